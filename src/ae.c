@@ -30,6 +30,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -46,16 +47,20 @@
 
 /* Include the best multiplexing layer supported by this system.
  * The following should be ordered by performances, descending. */
-#ifdef HAVE_EVPORT
-#include "ae_evport.c"
+#ifdef HAVE_IOURING
+#include "ae_iouring.c"
 #else
-    #ifdef HAVE_EPOLL
-    #include "ae_epoll.c"
+    #ifdef HAVE_EVPORT
+    #include "ae_evport.c"
     #else
-        #ifdef HAVE_KQUEUE
-        #include "ae_kqueue.c"
+        #ifdef HAVE_EPOLL
+        #include "ae_epoll.c"
         #else
-        #include "ae_select.c"
+            #ifdef HAVE_KQUEUE
+            #include "ae_kqueue.c"
+            #else
+            #include "ae_select.c"
+            #endif
         #endif
     #endif
 #endif
@@ -74,7 +79,13 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     }
     eventLoop->setsize = setsize;
     eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timeEventHeap = NULL;
+    eventLoop->timeEventHeapLen = 0;
+    eventLoop->timeEventHeapSize = 0;
+    eventLoop->timeEventTable = NULL;
+    eventLoop->timeEventTableSize = 0;
+    eventLoop->timeEventTableUsed = 0;
+    eventLoop->timeEventDeleted = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
@@ -133,6 +144,8 @@ void aeDeleteEventLoop(aeEventLoop *eventLoop) {
     aeApiFree(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
+    zfree(eventLoop->timeEventHeap);
+    zfree(eventLoop->timeEventTable);
     zfree(eventLoop);
 }
 
@@ -218,6 +231,121 @@ static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
     *ms = when_ms;
 }
 
+/* Time events are stored in a binary min-heap ordered by fire time, so
+ * that finding the nearest timer is O(1), while adding, removing and
+ * rescheduling a timer is O(log(N)). A small hash table maps ids to events
+ * in order to implement aeDeleteTimeEvent() without scanning the heap. */
+
+/* Return non-zero if the time event 'a' fires before 'b'. */
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    return a->when_sec < b->when_sec ||
+           (a->when_sec == b->when_sec && a->when_ms < b->when_ms);
+}
+
+static void aeTimeHeapSet(aeEventLoop *eventLoop, int idx, aeTimeEvent *te) {
+    eventLoop->timeEventHeap[idx] = te;
+    te->heapIndex = idx;
+}
+
+static void aeTimeHeapSiftUp(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[idx];
+
+    while (idx > 0) {
+        int parent = (idx-1)/2;
+        if (!aeTimeEventBefore(te,eventLoop->timeEventHeap[parent])) break;
+        aeTimeHeapSet(eventLoop,idx,eventLoop->timeEventHeap[parent]);
+        idx = parent;
+    }
+    aeTimeHeapSet(eventLoop,idx,te);
+}
+
+static void aeTimeHeapSiftDown(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[idx];
+    int len = eventLoop->timeEventHeapLen;
+
+    while (1) {
+        int child = idx*2+1;
+        if (child >= len) break;
+        if (child+1 < len &&
+            aeTimeEventBefore(eventLoop->timeEventHeap[child+1],
+                              eventLoop->timeEventHeap[child])) child++;
+        if (!aeTimeEventBefore(eventLoop->timeEventHeap[child],te)) break;
+        aeTimeHeapSet(eventLoop,idx,eventLoop->timeEventHeap[child]);
+        idx = child;
+    }
+    aeTimeHeapSet(eventLoop,idx,te);
+}
+
+static void aeTimeHeapInsert(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (eventLoop->timeEventHeapLen == eventLoop->timeEventHeapSize) {
+        eventLoop->timeEventHeapSize = eventLoop->timeEventHeapSize ?
+                                       eventLoop->timeEventHeapSize*2 : 16;
+        eventLoop->timeEventHeap = zrealloc(eventLoop->timeEventHeap,
+            sizeof(aeTimeEvent*)*eventLoop->timeEventHeapSize);
+    }
+    aeTimeHeapSet(eventLoop,eventLoop->timeEventHeapLen++,te);
+    aeTimeHeapSiftUp(eventLoop,te->heapIndex);
+}
+
+static void aeTimeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int idx = te->heapIndex;
+    aeTimeEvent *last = eventLoop->timeEventHeap[--eventLoop->timeEventHeapLen];
+
+    te->heapIndex = -1;
+    if (last == te) return;
+    aeTimeHeapSet(eventLoop,idx,last);
+    aeTimeHeapSiftDown(eventLoop,idx);
+    aeTimeHeapSiftUp(eventLoop,last->heapIndex);
+}
+
+static void aeTimeTableAdd(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    unsigned long idx;
+
+    if (eventLoop->timeEventTableUsed >= eventLoop->timeEventTableSize) {
+        unsigned long newsize = eventLoop->timeEventTableSize ?
+                                eventLoop->timeEventTableSize*2 : 16;
+        aeTimeEvent **table = zcalloc(sizeof(aeTimeEvent*)*newsize);
+        unsigned long j;
+
+        for (j = 0; j < eventLoop->timeEventTableSize; j++) {
+            aeTimeEvent *e = eventLoop->timeEventTable[j];
+            while (e) {
+                aeTimeEvent *next = e->next;
+                idx = (unsigned long)e->id & (newsize-1);
+                e->next = table[idx];
+                table[idx] = e;
+                e = next;
+            }
+        }
+        zfree(eventLoop->timeEventTable);
+        eventLoop->timeEventTable = table;
+        eventLoop->timeEventTableSize = newsize;
+    }
+    idx = (unsigned long)te->id & (eventLoop->timeEventTableSize-1);
+    te->next = eventLoop->timeEventTable[idx];
+    eventLoop->timeEventTable[idx] = te;
+    eventLoop->timeEventTableUsed++;
+}
+
+/* Unlink the event with the specified id from the id table and return it,
+ * or return NULL if there is no such event. */
+static aeTimeEvent *aeTimeTableUnlink(aeEventLoop *eventLoop, long long id) {
+    aeTimeEvent **link, *te;
+
+    if (eventLoop->timeEventTableSize == 0) return NULL;
+    link = &eventLoop->timeEventTable[
+        (unsigned long)id & (eventLoop->timeEventTableSize-1)];
+    while ((te = *link) != NULL) {
+        if (te->id == id) {
+            *link = te->next;
+            eventLoop->timeEventTableUsed--;
+            return te;
+        }
+        link = &te->next;
+    }
+    return NULL;
+}
+
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
@@ -234,62 +362,39 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->prev = NULL;
-    te->next = eventLoop->timeEventHead;
-    if (te->next) {
-        te->next->prev = te;
-    }
-    eventLoop->timeEventHead = te;
+    aeTimeTableAdd(eventLoop,te);
+    aeTimeHeapInsert(eventLoop,te);
     return id;
 }
 
+/* The event is removed from the heap and from the id table immediately,
+ * but freed (calling its finalizer) only by the next processTimeEvents()
+ * call, since it is legal to delete an event from its own timeProc. */
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            te->id = AE_DELETED_EVENT_ID;
-            return AE_OK;
-        }
-        te = te->next;
-    }
-    return AE_ERR; /* NO event with the specified ID found */
+    aeTimeEvent *te = aeTimeTableUnlink(eventLoop,id);
+
+    if (te == NULL) return AE_ERR; /* NO event with the specified ID found */
+    if (te->heapIndex != -1) aeTimeHeapRemove(eventLoop,te);
+    te->id = AE_DELETED_EVENT_ID;
+    te->next = eventLoop->timeEventDeleted;
+    eventLoop->timeEventDeleted = te;
+    return AE_OK;
 }
 
 /* Search the first timer to fire.
  * This operation is useful to know how many time the select can be
  * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- // 查找最近的定时任务
- */
+ * If there are no timers NULL is returned. */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-    int eCount = 0;
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms)) {
-            nearest = te;
-        }
-        te = te->next;
-        eCount++;
-    }
-    (void)eCount;
-    return nearest;
+    return eventLoop->timeEventHeapLen ? eventLoop->timeEventHeap[0] : NULL;
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop) {
-    int processed = 0;
-    aeTimeEvent *te;
+    int processed = 0, numdone = 0, maxdone = 16, j;
+    aeTimeEvent *te, *done_static[16], **done = done_static;
     long long maxId;
     time_t now = time(NULL);
 
@@ -300,70 +405,71 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
      * Here we try to detect system clock skews, and force all the time
      * events to be processed ASAP when this happens: the idea is that
      * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
+     * indefinitely, and practice suggests it is. Since all the events get
+     * the same fire time the heap property is preserved. */
     if (now < eventLoop->lastTime) {// 修改时间往后调了
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
+        for (j = 0; j < eventLoop->timeEventHeapLen; j++) {
+            eventLoop->timeEventHeap[j]->when_sec = 0;
+            eventLoop->timeEventHeap[j]->when_ms = 0;
         }
     }
     eventLoop->lastTime = now;
 
-    te = eventLoop->timeEventHead;
+    /* Free the events deleted since the last call. */
+    while ((te = eventLoop->timeEventDeleted) != NULL) {
+        eventLoop->timeEventDeleted = te->next;
+        if (te->finalizerProc) {
+            te->finalizerProc(eventLoop, te->clientData);
+        }
+        zfree(te);
+    }
+
+    /* Pop the timers that should fire from the heap. Every event is
+     * processed at most once per call: the ones that were just processed
+     * and the ones created by time events in this iteration are put back
+     * into the heap only at the end. */
     maxId = eventLoop->timeEventNextId-1;
-    while(te) {
+    while (eventLoop->timeEventHeapLen) {
         long now_sec, now_ms;
-        long long id;
+        int retval;
 
-        /* Remove events scheduled for deletion. */
-        if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (te->prev) {
-                te->prev->next = te->next;
-            }
-            else {
-                eventLoop->timeEventHead = te->next;
-            }
-            if (te->next) {
-                te->next->prev = te->prev;
-            }
-            if (te->finalizerProc) {
-                te->finalizerProc(eventLoop, te->clientData);
-            }
-            zfree(te);
-            te = next;
-            continue;
-        }
-
-        /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. 防御性编程*/
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
+        te = eventLoop->timeEventHeap[0];
         aeGetTime(&now_sec, &now_ms);
         // 触发时间到了
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            if (retval != AE_NOMORE) {
-                // 如果需要继续执行，设置下次触发时间
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
+        if (now_sec < te->when_sec ||
+            (now_sec == te->when_sec && now_ms < te->when_ms)) break;
+
+        aeTimeHeapRemove(eventLoop,te);
+        if (numdone == maxdone) {
+            maxdone *= 2;
+            if (done == done_static) {
+                done = zmalloc(sizeof(aeTimeEvent*)*maxdone);
+                memcpy(done,done_static,sizeof(done_static));
             } else {
-                te->id = AE_DELETED_EVENT_ID;
+                done = zrealloc(done,sizeof(aeTimeEvent*)*maxdone);
             }
         }
-        te = te->next;
+        done[numdone++] = te;
+        if (te->id > maxId) continue;
+
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        processed++;
+        /* The event may have been deleted by its own timeProc. */
+        if (te->id == AE_DELETED_EVENT_ID) continue;
+        if (retval != AE_NOMORE) {
+            // 如果需要继续执行，设置下次触发时间
+            aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
+        } else {
+            aeDeleteTimeEvent(eventLoop, te->id);
+        }
     }
+
+    /* Reinsert the events that are still alive. */
+    for (j = 0; j < numdone; j++) {
+        if (done[j]->id != AE_DELETED_EVENT_ID)
+            aeTimeHeapInsert(eventLoop,done[j]);
+    }
+    if (done != done_static) zfree(done);
     return processed;
 }
 
@@ -553,3 +659,140 @@ void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep
 void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep) {
     eventLoop->aftersleep = aftersleep;
 }
+
+#ifdef REDIS_TEST
+#include <assert.h>
+
+static long long aeTestUsec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static aeTimeEvent *aeTestFind(aeEventLoop *eventLoop, long long id) {
+    aeTimeEvent *te = eventLoop->timeEventTable[
+        (unsigned long)id & (eventLoop->timeEventTableSize-1)];
+    while (te && te->id != id) te = te->next;
+    return te;
+}
+
+static int aeTestFired, aeTestFinalized;
+static long aeTestLastSec, aeTestLastMs;
+
+static int aeTestNoop(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+    return AE_NOMORE;
+}
+
+/* Check that timers fire once each, in fire time order. */
+static int aeTestOrdered(aeEventLoop *eventLoop, long long id, void *clientData) {
+    aeTimeEvent *te = clientData;
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+
+    assert(te->when_sec > aeTestLastSec ||
+           (te->when_sec == aeTestLastSec && te->when_ms >= aeTestLastMs));
+    aeTestLastSec = te->when_sec;
+    aeTestLastMs = te->when_ms;
+    aeTestFired++;
+    return AE_NOMORE;
+}
+
+static int aeTestSelfDelete(aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(clientData);
+    aeTestFired++;
+    assert(aeDeleteTimeEvent(eventLoop,id) == AE_OK);
+    return 1; /* Ignored since the event was deleted. */
+}
+
+static int aeTestRepeat(aeEventLoop *eventLoop, long long id, void *clientData) {
+    int *count = clientData;
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    return ++(*count) == 3 ? AE_NOMORE : 0;
+}
+
+static void aeTestFinalizer(aeEventLoop *eventLoop, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(clientData);
+    aeTestFinalized++;
+}
+
+int aeTest(int argc, char *argv[]) {
+    aeEventLoop *el = aeCreateEventLoop(64);
+    long long start, *ids;
+    int j, numtimers = 100000, iterations = 10000;
+
+    AE_NOTUSED(argc);
+    AE_NOTUSED(argv);
+    assert(el != NULL);
+
+    printf("Timers fire in order: ");
+    for (j = 0; j < 1000; j++) {
+        long long id = aeCreateTimeEvent(el,rand()%30,aeTestOrdered,NULL,
+                                         aeTestFinalizer);
+        /* Let the timeProc see its own event to check the fire time. */
+        aeTimeEvent *te = aeTestFind(el,id);
+        te->clientData = te;
+    }
+    for (j = 0; j < 1000; j++) {
+        aeTimeEvent *te = el->timeEventHeap[j];
+        assert(te->heapIndex == j);
+        if (j) assert(!aeTimeEventBefore(te,el->timeEventHeap[(j-1)/2]));
+    }
+    while (aeTestFired < 1000) aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+    aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+    assert(aeTestFinalized == 1000);
+    assert(el->timeEventHeapLen == 0 && el->timeEventTableUsed == 0);
+    printf("OK\n");
+
+    printf("Delete from timeProc and reschedule: ");
+    {
+        int count = 0;
+        aeTestFired = aeTestFinalized = 0;
+        aeCreateTimeEvent(el,0,aeTestSelfDelete,NULL,aeTestFinalizer);
+        aeCreateTimeEvent(el,0,aeTestRepeat,&count,aeTestFinalizer);
+        aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+        /* Each event is processed at most once per call. */
+        assert(aeTestFired == 1 && count == 1);
+        aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+        aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+        aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+        assert(aeTestFired == 1 && count == 3 && aeTestFinalized == 2);
+        assert(aeDeleteTimeEvent(el,12345678) == AE_ERR);
+        printf("OK\n");
+    }
+
+    ids = zmalloc(sizeof(long long)*numtimers);
+    printf("Create %d timers: ",numtimers); {
+        start = aeTestUsec();
+        for (j = 0; j < numtimers; j++)
+            ids[j] = aeCreateTimeEvent(el,1000000+rand()%1000000,
+                                       aeTestNoop,NULL,NULL);
+        printf("%lld usec\n",aeTestUsec()-start);
+    }
+
+    printf("Event loop iteration with %d timers: ",numtimers); {
+        start = aeTestUsec();
+        for (j = 0; j < iterations; j++)
+            aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+        printf("%.3f usec per iteration\n",
+               (double)(aeTestUsec()-start)/iterations);
+    }
+
+    printf("Delete %d timers: ",numtimers); {
+        start = aeTestUsec();
+        for (j = 0; j < numtimers; j++)
+            assert(aeDeleteTimeEvent(el,ids[j]) == AE_OK);
+        aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+        printf("%lld usec\n",aeTestUsec()-start);
+        assert(el->timeEventHeapLen == 0 && el->timeEventTableUsed == 0);
+    }
+
+    zfree(ids);
+    aeDeleteEventLoop(el);
+    return 0;
+}
+#endif
@@ -83,8 +83,9 @@ typedef struct aeTimeEvent {
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *prev;
-    struct aeTimeEvent *next;
+    int heapIndex; /* Position in the timers heap, -1 if not in the heap. */
+    struct aeTimeEvent *next; /* Next event in the same bucket of the id
+                                 table, or in the list of deleted events. */
 } aeTimeEvent;
 
 /* A fired event */
@@ -101,7 +102,13 @@ typedef struct aeEventLoop {
     time_t lastTime;     /* Used to detect system clock skew */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timeEventHeap;  /* Min-heap of time events by fire time. */
+    int timeEventHeapLen;         /* Number of events in the heap. */
+    int timeEventHeapSize;        /* Allocated heap slots. */
+    aeTimeEvent **timeEventTable; /* Time events hashed by id. */
+    unsigned long timeEventTableSize;
+    unsigned long timeEventTableUsed;
+    aeTimeEvent *timeEventDeleted; /* Deleted events to finalize. */
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
@@ -129,4 +136,8 @@ void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 
+#ifdef REDIS_TEST
+int aeTest(int argc, char *argv[]);
+#endif
+
 #endif
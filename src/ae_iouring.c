@@ -0,0 +1,461 @@
+/* Linux io_uring(7) based ae.c module
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* This backend uses one-shot IORING_OP_POLL_ADD requests to monitor file
+ * descriptors. aeApiAddEvent() and aeApiDelEvent() usually don't enter the
+ * kernel: they just mark the descriptor as dirty (the only exception is
+ * when an fd is no longer monitored at all, see aeApiDelEvent()). Before
+ * waiting, aeApiPoll() turns
+ * every dirty descriptor into the poll add / poll remove requests needed to
+ * match its current mask, and submits all of them together with the wait
+ * using a single io_uring_enter(2) call.
+ *
+ * Since poll requests are one-shot, a descriptor that fired is re-armed
+ * in the next aeApiPoll() call, again as part of the same batch. The kernel
+ * checks readiness when the request is submitted, so this gives the same
+ * level triggered semantics of the other backends.
+ *
+ * liburing is not required: the rings are set up directly with the raw
+ * system calls. Linux 5.11 or greater is needed (IORING_FEAT_EXT_ARG).
+ *
+ * io_uring may still be unavailable at runtime: older kernels, seccomp
+ * filters and the kernel.io_uring_disabled sysctl make the setup fail. In
+ * that case the event loop falls back to epoll, whose backend is included
+ * here as well, with every aeApi name prefixed by aeEpoll. */
+
+#define aeApiState aeEpollApiState
+#define aeApiCreate aeEpollApiCreate
+#define aeApiResize aeEpollApiResize
+#define aeApiFree aeEpollApiFree
+#define aeApiAddEvent aeEpollApiAddEvent
+#define aeApiDelEvent aeEpollApiDelEvent
+#define aeApiPoll aeEpollApiPoll
+#define aeApiName aeEpollApiName
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <stdint.h>
+
+#define AE_URING_SQ_ENTRIES 1024   /* Max SQEs queued before a submit. */
+#define AE_URING_MAX_CQ_ENTRIES 65536
+#define AE_URING_UD_IGNORE UINT64_MAX /* user_data of poll remove requests. */
+
+typedef struct aeUringFd {
+    uint64_t armed_ud;  /* user_data of the armed poll request, if any. */
+    uint32_t seq;       /* Incremented for every new poll request. */
+    int armed;          /* AE_READABLE|AE_WRITABLE mask currently armed. */
+    int dirty;          /* True if the fd is in the dirty list. */
+} aeUringFd;
+
+typedef struct aeApiState {
+    /* The epoll backend state, used instead of the rings when io_uring
+     * could not be set up: it must be the first field, so that the epoll
+     * functions can use 'apidata' as it is. */
+    aeEpollApiState epoll;
+    int ringfd;             /* -1 when falling back to epoll. */
+    /* Submission queue ring. */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned to_submit;     /* SQEs queued and not yet consumed. */
+    /* Completion queue ring. */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Mappings, in order to unmap them on free. */
+    void *sq_ptr, *cq_ptr;
+    size_t sq_ptr_len, cq_ptr_len, sqes_len;
+    /* Per fd state and list of fds whose poll request must be updated. */
+    aeUringFd *fds;
+    int *dirty;
+    int numdirty;
+} aeApiState;
+
+static int aeUringSetup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeUringEnter(int ringfd, unsigned to_submit, unsigned min_complete,
+                        unsigned flags, void *arg, size_t argsz)
+{
+    return (int) syscall(__NR_io_uring_enter, ringfd, to_submit, min_complete,
+                         flags, arg, argsz);
+}
+
+static void aeUringUnmap(aeApiState *state) {
+    if (state->sqes) munmap(state->sqes,state->sqes_len);
+    if (state->cq_ptr && state->cq_ptr != state->sq_ptr)
+        munmap(state->cq_ptr,state->cq_ptr_len);
+    if (state->sq_ptr) munmap(state->sq_ptr,state->sq_ptr_len);
+}
+
+/* Set up the rings of 'state'. Returns -1 with errno set if io_uring is
+ * not available, releasing whatever was set up. */
+static int aeUringInit(aeEventLoop *eventLoop, aeApiState *state) {
+    struct io_uring_params p;
+    unsigned cq_entries = AE_URING_SQ_ENTRIES*2;
+
+    /* Every monitored fd has at most one poll request in flight, so
+     * size the completion queue after the set size. The kernel requires
+     * it to be at least as big as the submission queue. */
+    while (cq_entries < (unsigned)eventLoop->setsize &&
+           cq_entries < AE_URING_MAX_CQ_ENTRIES) cq_entries <<= 1;
+    memset(&p,0,sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    state->ringfd = aeUringSetup(AE_URING_SQ_ENTRIES,&p);
+    if (state->ringfd == -1) return -1;
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP))
+    {
+        errno = ENOSYS;
+        goto err;
+    }
+
+    state->sq_ptr_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cq_ptr_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_ptr_len > state->sq_ptr_len)
+            state->sq_ptr_len = state->cq_ptr_len;
+        state->cq_ptr_len = state->sq_ptr_len;
+    }
+    state->sq_ptr = mmap(NULL,state->sq_ptr_len,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQ_RING);
+    if (state->sq_ptr == MAP_FAILED) {
+        state->sq_ptr = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cq_ptr = state->sq_ptr;
+    } else {
+        state->cq_ptr = mmap(NULL,state->cq_ptr_len,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_CQ_RING);
+        if (state->cq_ptr == MAP_FAILED) {
+            state->cq_ptr = NULL;
+            goto err;
+        }
+    }
+    state->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL,state->sqes_len,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    state->sq_head = (unsigned*)((char*)state->sq_ptr+p.sq_off.head);
+    state->sq_tail = (unsigned*)((char*)state->sq_ptr+p.sq_off.tail);
+    state->sq_mask = (unsigned*)((char*)state->sq_ptr+p.sq_off.ring_mask);
+    state->sq_array = (unsigned*)((char*)state->sq_ptr+p.sq_off.array);
+    state->sq_entries = p.sq_entries;
+    state->cq_head = (unsigned*)((char*)state->cq_ptr+p.cq_off.head);
+    state->cq_tail = (unsigned*)((char*)state->cq_ptr+p.cq_off.tail);
+    state->cq_mask = (unsigned*)((char*)state->cq_ptr+p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)((char*)state->cq_ptr+p.cq_off.cqes);
+    return 0;
+
+err:
+    {
+        int saved_errno = errno;
+        aeUringUnmap(state);
+        state->sq_ptr = state->cq_ptr = state->sqes = NULL;
+        close(state->ringfd);
+        state->ringfd = -1;
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+/* Set if an event loop had to fall back to epoll, see aeApiName(). */
+static int aeUringFallback = 0;
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zcalloc(sizeof(aeApiState));
+
+    if (!state) return -1;
+    state->fds = zcalloc(sizeof(aeUringFd)*eventLoop->setsize);
+    state->dirty = zmalloc(sizeof(int)*eventLoop->setsize);
+    if (aeUringInit(eventLoop,state) == -1) {
+        aeEpollApiState *epoll;
+
+        if (aeEpollApiCreate(eventLoop) == -1) {
+            int saved_errno = errno;
+            zfree(state->fds);
+            zfree(state->dirty);
+            zfree(state);
+            errno = saved_errno;
+            return -1;
+        }
+        epoll = eventLoop->apidata;
+        state->epoll = *epoll;
+        zfree(epoll);
+        aeUringFallback = 1;
+    }
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->ringfd == -1) return aeEpollApiResize(eventLoop,setsize);
+    state->fds = zrealloc(state->fds, sizeof(aeUringFd)*setsize);
+    if (setsize > eventLoop->setsize)
+        memset(state->fds+eventLoop->setsize,0,
+               sizeof(aeUringFd)*(setsize-eventLoop->setsize));
+    state->dirty = zrealloc(state->dirty, sizeof(int)*setsize);
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    zfree(state->fds);
+    zfree(state->dirty);
+    if (state->ringfd == -1) {
+        aeEpollApiFree(eventLoop); /* Releases 'state' too. */
+        return;
+    }
+    aeUringUnmap(state);
+    close(state->ringfd);
+    zfree(state);
+}
+
+static void aeUringMarkDirty(aeApiState *state, int fd) {
+    if (state->fds[fd].dirty) return;
+    state->fds[fd].dirty = 1;
+    state->dirty[state->numdirty++] = fd;
+}
+
+static unsigned aeUringSqSpace(aeApiState *state) {
+    unsigned head = __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE);
+    return state->sq_entries - (*state->sq_tail - head);
+}
+
+/* Submit the queued SQEs without waiting for completions. Returns -1 if
+ * the kernel refused them. */
+static int aeUringFlush(aeApiState *state) {
+    int ret = aeUringEnter(state->ringfd,state->to_submit,0,0,NULL,0);
+    if (ret == -1) return -1;
+    state->to_submit -= ret;
+    return 0;
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeApiState *state) {
+    unsigned tail = *state->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if (aeUringSqSpace(state) == 0) return NULL;
+    sqe = &state->sqes[tail & *state->sq_mask];
+    memset(sqe,0,sizeof(*sqe));
+    state->sq_array[tail & *state->sq_mask] = tail & *state->sq_mask;
+    __atomic_store_n(state->sq_tail,tail+1,__ATOMIC_RELEASE);
+    state->to_submit++;
+    return sqe;
+}
+
+/* Queue the removal of the poll request armed for 'fd', if any. */
+static void aeUringRemovePoll(aeApiState *state, int fd) {
+    aeUringFd *uf = &state->fds[fd];
+    struct io_uring_sqe *sqe;
+
+    if (!uf->armed) return;
+    if (aeUringSqSpace(state) == 0) aeUringFlush(state);
+    /* If the kernel refuses the flush there is nothing better to do than
+     * leaving the request armed: its completion will be skipped anyway
+     * since 'armed' is cleared. */
+    if ((sqe = aeUringGetSqe(state)) != NULL) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = uf->armed_ud;
+        sqe->user_data = AE_URING_UD_IGNORE;
+    }
+    uf->armed = 0;
+}
+
+/* Queue the requests needed to make the poll request of 'fd' match
+ * 'mask'. Returns 0 if there was not enough room in the submission
+ * queue. */
+static int aeUringArm(aeApiState *state, int fd, int mask) {
+    aeUringFd *uf = &state->fds[fd];
+    struct io_uring_sqe *sqe;
+
+    if (uf->armed == mask) return 1;
+    if (aeUringSqSpace(state) < 2) return 0;
+    aeUringRemovePoll(state,fd);
+    if (mask) {
+        uint32_t events = 0;
+
+        if (mask & AE_READABLE) events |= POLLIN;
+        if (mask & AE_WRITABLE) events |= POLLOUT;
+        uf->seq++;
+        uf->armed_ud = ((uint64_t)uf->seq << 32) | (uint32_t)fd;
+        uf->armed = mask;
+        sqe = aeUringGetSqe(state);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        sqe->user_data = uf->armed_ud;
+    }
+    return 1;
+}
+
+/* aeUringArm() with the mask currently registered in the event loop. */
+static int aeUringUpdateFd(aeEventLoop *eventLoop, int fd) {
+    return aeUringArm(eventLoop->apidata,fd,
+                      eventLoop->events[fd].mask & (AE_READABLE|AE_WRITABLE));
+}
+
+/* The poll request of the fd is queued right away, so that a submission
+ * queue that can't be flushed is reported to the caller. It is submitted
+ * by aeApiPoll() together with the others. */
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->ringfd == -1)
+        return aeEpollApiAddEvent(eventLoop,fd,mask);
+    mask = (mask|eventLoop->events[fd].mask) & (AE_READABLE|AE_WRITABLE);
+    if (!aeUringArm(state,fd,mask) &&
+        (aeUringFlush(state) == -1 || !aeUringArm(state,fd,mask)))
+        return -1;
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->ringfd == -1) {
+        aeEpollApiDelEvent(eventLoop,fd,delmask);
+        return;
+    }
+
+    /* When the fd is no longer monitored the caller is likely going to
+     * close it. The armed poll request holds a reference to the file, so
+     * remove it right now: otherwise the socket would stay open, and for
+     * instance a client would not see the connection closed, until the
+     * next aeApiPoll() call. */
+    if ((eventLoop->events[fd].mask & ~delmask & (AE_READABLE|AE_WRITABLE))
+        == AE_NONE && state->fds[fd].armed)
+    {
+        aeUringRemovePoll(state,fd);
+        aeUringFlush(state);
+    }
+    aeUringMarkDirty(state,fd);
+}
+
+static void aeUringQueueDirty(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+    int j;
+
+    for (j = 0; j < state->numdirty; j++) {
+        int fd = state->dirty[j];
+
+        if (!aeUringUpdateFd(eventLoop,fd)) {
+            aeUringFlush(state);
+            if (!aeUringUpdateFd(eventLoop,fd)) break;
+        }
+        state->fds[fd].dirty = 0;
+    }
+    /* If the kernel could not keep up, leave the remaining fds for the
+     * next call. */
+    if (j != state->numdirty)
+        memmove(state->dirty,state->dirty+j,sizeof(int)*(state->numdirty-j));
+    state->numdirty -= j;
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail, min_complete = 1;
+    int ret, numevents = 0;
+
+    if (state->ringfd == -1) return aeEpollApiPoll(eventLoop,tvp);
+    aeUringQueueDirty(eventLoop);
+
+    memset(&arg,0,sizeof(arg));
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        if (tvp->tv_sec == 0 && tvp->tv_usec == 0) min_complete = 0;
+    }
+    ret = aeUringEnter(state->ringfd,state->to_submit,min_complete,
+        IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,&arg,sizeof(arg));
+    if (ret > 0) state->to_submit -= ret;
+
+    head = *state->cq_head;
+    tail = __atomic_load_n(state->cq_tail,__ATOMIC_ACQUIRE);
+    while (head != tail && numevents < eventLoop->setsize) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+        int fd = (int)(uint32_t)cqe->user_data;
+        aeUringFd *uf;
+        int mask = 0;
+
+        head++;
+        if (cqe->user_data == AE_URING_UD_IGNORE) continue;
+        uf = &state->fds[fd];
+        /* Skip completions of requests that were removed or replaced. */
+        if (!uf->armed || cqe->user_data != uf->armed_ud) continue;
+
+        if (cqe->res < 0) {
+            /* The poll request could not be armed: report every
+             * registered event so that the handler finds the error. */
+            mask = uf->armed;
+        } else {
+            if (cqe->res & POLLIN) mask |= AE_READABLE;
+            if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+            if (cqe->res & POLLERR) mask |= AE_WRITABLE;
+            if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+        }
+        /* The request is one-shot: re-arm it in the next call. */
+        uf->armed = 0;
+        aeUringMarkDirty(state,fd);
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cq_head,head,__ATOMIC_RELEASE);
+    return numevents;
+}
+
+static char *aeApiName(void) {
+    return aeUringFallback ? aeEpollApiName() : "io_uring";
+}
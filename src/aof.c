@@ -668,6 +668,7 @@ struct client *createFakeClient(void) {
     c->replstate = SLAVE_STATE_WAIT_BGSAVE_START;
     c->reply = listCreate();
     c->reply_bytes = 0;
+    c->reply_refs = 0;
     c->obuf_soft_limit_reached_time = 0;
     c->watched_keys = listCreate();
     c->peerid = NULL;
@@ -928,6 +929,44 @@ int rioWriteBulkObject(rio *r, robj *obj) {
     }
 }
 
+/* Emit the commands needed to rebuild a sparse bitmap: a SETBIT of the last
+ * bit, that sets the length of the string, then a SETBIT of every bit set.
+ * When so many bits are set that the commands would be larger than the
+ * string itself, a SET of the whole string is emitted instead.
+ * The function returns 0 on error, 1 on success. */
+int rewriteSparseBitmapObject(rio *r, robj *key, robj *o) {
+    sparseBitmap *sb = o->ptr;
+    long long last = (long long)sb->len*8-1;
+    roaringIterator ri;
+    int64_t bit;
+
+    if (roaringCard(sb->bits) > sb->len/32) {
+        robj *dec = getDecodedObject(o);
+        int retval = rioWriteBulkCount(r,'*',3) &&
+                     rioWriteBulkString(r,"SET",3) &&
+                     rioWriteBulkObject(r,key) &&
+                     rioWriteBulkObject(r,dec);
+        decrRefCount(dec);
+        return retval;
+    }
+
+    if (rioWriteBulkCount(r,'*',4) == 0) return 0;
+    if (rioWriteBulkString(r,"SETBIT",6) == 0) return 0;
+    if (rioWriteBulkObject(r,key) == 0) return 0;
+    if (rioWriteBulkLongLong(r,last) == 0) return 0;
+    if (rioWriteBulkLongLong(r,roaringContains(sb->bits,last)) == 0) return 0;
+
+    roaringInitIterator(sb->bits,&ri);
+    while(roaringNext(&ri,&bit) && bit != last) {
+        if (rioWriteBulkCount(r,'*',4) == 0) return 0;
+        if (rioWriteBulkString(r,"SETBIT",6) == 0) return 0;
+        if (rioWriteBulkObject(r,key) == 0) return 0;
+        if (rioWriteBulkLongLong(r,bit) == 0) return 0;
+        if (rioWriteBulkString(r,"1",1) == 0) return 0;
+    }
+    return 1;
+}
+
 /* Emit the commands needed to rebuild a list object.
  * The function returns 0 on error, 1 on success. */
 int rewriteListObject(rio *r, robj *key, robj *o) {
@@ -984,6 +1023,24 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        roaringIterator ri;
+        int64_t llval;
+
+        roaringInitIterator(o->ptr,&ri);
+        while(roaringNext(&ri,&llval)) {
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items) == 0) return 0;
+                if (rioWriteBulkString(r,"SADD",4) == 0) return 0;
+                if (rioWriteBulkObject(r,key) == 0) return 0;
+            }
+            if (rioWriteBulkLongLong(r,llval) == 0) return 0;
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
     } else if (o->encoding == OBJ_ENCODING_HT) {
         dictIterator *di = dictGetIterator(o->ptr);
         dictEntry *de;
@@ -1014,7 +1071,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1022,13 +1079,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            vstr = lpGetValue(eptr,&vlen,&vll);
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -1072,6 +1129,62 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
             items--;
         }
         dictReleaseIterator(di);
+    } else if (o->encoding == OBJ_ENCODING_PACKEDTREE) {
+        zptNode *leaf = ((zptree*)o->ptr)->head;
+        unsigned char *eptr, *sptr;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vll;
+        double score;
+
+        eptr = lpSeek(leaf->lp,0);
+        serverAssert(eptr != NULL);
+        sptr = lpNext(leaf->lp,eptr);
+        serverAssert(sptr != NULL);
+
+        while (eptr != NULL) {
+            vstr = lpGetValue(eptr,&vlen,&vll);
+            score = zzlGetScore(sptr);
+
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items*2) == 0) return 0;
+                if (rioWriteBulkString(r,"ZADD",4) == 0) return 0;
+                if (rioWriteBulkObject(r,key) == 0) return 0;
+            }
+            if (rioWriteBulkDouble(r,score) == 0) return 0;
+            if (vstr != NULL) {
+                if (rioWriteBulkString(r,(char*)vstr,vlen) == 0) return 0;
+            } else {
+                if (rioWriteBulkLongLong(r,vll) == 0) return 0;
+            }
+            zptNext(&leaf,&eptr,&sptr);
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
+    } else if (o->encoding == OBJ_ENCODING_BTREE) {
+        zbtNode *n = ((zset*)o->ptr)->zbt->head;
+
+        /* Emit the elements in order from the leaves. */
+        for (; n != NULL; n = n->next) {
+            for (int j = 0; j < n->num; j++) {
+                if (count == 0) {
+                    int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                        AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                    if (rioWriteBulkCount(r,'*',2+cmd_items*2) == 0) return 0;
+                    if (rioWriteBulkString(r,"ZADD",4) == 0) return 0;
+                    if (rioWriteBulkObject(r,key) == 0) return 0;
+                }
+                if (rioWriteBulkDouble(r,n->score[j]) == 0) return 0;
+                if (rioWriteBulkString(r,n->ele[j],sdslen(n->ele[j])) == 0)
+                    return 0;
+                if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+                items--;
+            }
+        }
     } else {
         serverPanic("Unknown sorted zset encoding");
     }
@@ -1085,12 +1198,22 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *vstr = NULL;
+        unsigned int vlen = UINT_MAX;
+        long long vll = LLONG_MAX;
+
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
+        if (vstr)
+            return rioWriteBulkString(r, (char*)vstr, vlen);
+        else
+            return rioWriteBulkLongLong(r, vll);
+    } else if (hi->encoding == OBJ_ENCODING_INTMAP) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromIntmap(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             return rioWriteBulkString(r, (char*)vstr, vlen);
         else
@@ -1325,7 +1448,11 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             expiretime = getExpire(db,&key);
 
             /* Save the key and associated value */
-            if (o->type == OBJ_STRING) {
+            if (o->type == OBJ_STRING &&
+                o->encoding == OBJ_ENCODING_ROARING)
+            {
+                if (rewriteSparseBitmapObject(aof,&key,o) == 0) goto werr;
+            } else if (o->type == OBJ_STRING) {
                 /* Emit a SET command */
                 char cmd[]="*3\r\n$3\r\nSET\r\n";
                 if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
@@ -87,6 +87,7 @@ void *bioProcessBackgroundJobs(void *arg);
 void lazyfreeFreeObjectFromBioThread(robj *o);
 void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
 void lazyfreeFreeSlotsMapFromBioThread(zskiplist *sl);
+void dictTableAllocFromBioThread(dictTableAlloc *req);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. */
@@ -197,7 +198,7 @@ void *bioProcessBackgroundJobs(void *arg) {
             /* What we free changes depending on what arguments are set:
              * arg1 -> free the object at pointer.
              * arg2 & arg3 -> free two dictionaries (a Redis DB).
-             * only arg3 -> free the skiplist. */
+             * only arg3 -> free a radix tree (slots map or expire index). */
             if (job->arg1) {
                 lazyfreeFreeObjectFromBioThread(job->arg1);
             }
@@ -207,6 +208,8 @@ void *bioProcessBackgroundJobs(void *arg) {
             else if (job->arg3) {
                 lazyfreeFreeSlotsMapFromBioThread(job->arg3);
             }
+        } else if (type == BIO_DICT_ALLOC) {
+            dictTableAllocFromBioThread(job->arg1);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
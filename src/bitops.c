@@ -34,14 +34,19 @@
  * Helpers and low level bit functions.
  * -------------------------------------------------------------------------- */
 
-/* Count number of bits set in the binary array pointed by 's' and long
- * 'count' bytes. The implementation of this function is required to
- * work with a input string length up to 512 MB. */
-size_t redisPopcount(void *s, long count) {
+#define BITOP_AND   0
+#define BITOP_OR    1
+#define BITOP_XOR   2
+#define BITOP_NOT   3
+
+static const unsigned char bitsinbyte[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
+
+/* Portable popcount kernel: a byte lookup table for the unaligned head and
+ * tail, and a 28 bytes unrolled SWAR loop for the rest. */
+static size_t popcountScalar(const void *s, long count) {
     size_t bits = 0;
-    unsigned char *p = s;
-    uint32_t *p4;
-    static const unsigned char bitsinbyte[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
+    const unsigned char *p = s;
+    const uint32_t *p4;
 
     /* Count initial bytes not aligned to 32 bit. */
     while((unsigned long)p & 3 && count) {
@@ -50,7 +55,7 @@ size_t redisPopcount(void *s, long count) {
     }
 
     /* Count bits 28 bytes at a time */
-    p4 = (uint32_t*)p;
+    p4 = (const uint32_t*)p;
     while(count>=28) {
         uint32_t aux1, aux2, aux3, aux4, aux5, aux6, aux7;
 
@@ -86,11 +91,380 @@ size_t redisPopcount(void *s, long count) {
                     ((aux7 + (aux7 >> 4)) & 0x0F0F0F0F))* 0x01010101) >> 24;
     }
     /* Count the remaining bytes. */
-    p = (unsigned char*)p4;
+    p = (const unsigned char*)p4;
     while(count--) bits += bitsinbyte[*p++];
     return bits;
 }
 
+/* Portable BITOP kernel: dst = dst <op> src for AND, OR and XOR, and
+ * dst = ~src for NOT, on 'len' bytes. */
+static void bitopApplyScalar(int op, unsigned char *dst,
+                             const unsigned char *src, unsigned long len)
+{
+    unsigned long j = 0;
+
+    /* On ARM we skip the word at a time loops since they would result in
+     * GCC compiling the code using multiple-words load/store operations
+     * that are not supported even in ARM >= v6. */
+#ifndef USE_ALIGNED_ACCESS
+    unsigned long *ld = (unsigned long*) dst;
+    const unsigned long *ls = (const unsigned long*) src;
+    unsigned long words = len / sizeof(unsigned long);
+
+    /* Different branches per different operations for speed (sorry). */
+    switch(op) {
+    case BITOP_AND: for (; j < words; j++) ld[j] &= ls[j]; break;
+    case BITOP_OR:  for (; j < words; j++) ld[j] |= ls[j]; break;
+    case BITOP_XOR: for (; j < words; j++) ld[j] ^= ls[j]; break;
+    case BITOP_NOT: for (; j < words; j++) ld[j] = ~ls[j]; break;
+    }
+    j = words * sizeof(unsigned long);
+#endif
+    for (; j < len; j++) {
+        switch(op) {
+        case BITOP_AND: dst[j] &= src[j]; break;
+        case BITOP_OR:  dst[j] |= src[j]; break;
+        case BITOP_XOR: dst[j] ^= src[j]; break;
+        case BITOP_NOT: dst[j] = ~src[j]; break;
+        }
+    }
+}
+
+/* Portable BITPOS kernel: return how many bytes at the start of 'p' can be
+ * skipped because they are all 0 (if 'bit' is 1) or all 1 (if 'bit' is 0).
+ * The vectorized versions skip whole vectors, the portable one nothing at
+ * all, since redisBitpos() already scans the string a word at a time. */
+static unsigned long bitposSkipScalar(const unsigned char *p,
+                                      unsigned long count, int bit)
+{
+    UNUSED(p);
+    UNUSED(count);
+    UNUSED(bit);
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * SIMD kernels.
+ *
+ * On x86-64 BITCOUNT, BITOP and BITPOS use POPCNT, AVX2 or AVX-512 kernels,
+ * selected at runtime according to what the CPU supports the first time one
+ * of them is called. The kernels are compiled with the GCC target attribute,
+ * so the rest of the server does not require these instruction sets.
+ * -------------------------------------------------------------------------- */
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 8)
+#define HAVE_BITOPS_SIMD 1
+#include <immintrin.h>
+
+__attribute__((target("popcnt")))
+static size_t popcountPopcnt(const void *s, long count) {
+    const unsigned char *p = s;
+    size_t bits = 0;
+    uint64_t w[4];
+
+    while (count >= 32) {
+        memcpy(w,p,sizeof(w));
+        bits += __builtin_popcountll(w[0]) + __builtin_popcountll(w[1]) +
+                __builtin_popcountll(w[2]) + __builtin_popcountll(w[3]);
+        p += 32;
+        count -= 32;
+    }
+    while (count >= 8) {
+        memcpy(w,p,sizeof(w[0]));
+        bits += __builtin_popcountll(w[0]);
+        p += 8;
+        count -= 8;
+    }
+    while (count--) bits += bitsinbyte[*p++];
+    return bits;
+}
+
+/* Count the bits of every nibble with a 16 entries table lookup (VPSHUFB),
+ * then sum the bytes with VPSADBW. */
+__attribute__((target("avx2,popcnt")))
+static size_t popcountAvx2(const void *s, long count) {
+    const unsigned char *p = s;
+    const __m256i lookup = _mm256_setr_epi8(
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i lowmask = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+
+#define POPCOUNT_AVX2_STEP(v) \
+    _mm256_add_epi8( \
+        _mm256_shuffle_epi8(lookup,_mm256_and_si256((v),lowmask)), \
+        _mm256_shuffle_epi8(lookup, \
+            _mm256_and_si256(_mm256_srli_epi16((v),4),lowmask)))
+
+    while (count >= 128) {
+        const __m256i *v = (const __m256i*)p;
+        /* Every byte of the sum is at most 4*8, no overflow possible. */
+        __m256i sum = _mm256_add_epi8(
+            _mm256_add_epi8(POPCOUNT_AVX2_STEP(_mm256_loadu_si256(v)),
+                            POPCOUNT_AVX2_STEP(_mm256_loadu_si256(v+1))),
+            _mm256_add_epi8(POPCOUNT_AVX2_STEP(_mm256_loadu_si256(v+2)),
+                            POPCOUNT_AVX2_STEP(_mm256_loadu_si256(v+3))));
+        acc = _mm256_add_epi64(acc,_mm256_sad_epu8(sum,_mm256_setzero_si256()));
+        p += 128;
+        count -= 128;
+    }
+#undef POPCOUNT_AVX2_STEP
+
+    size_t bits = _mm256_extract_epi64(acc,0) + _mm256_extract_epi64(acc,1) +
+                  _mm256_extract_epi64(acc,2) + _mm256_extract_epi64(acc,3);
+    return bits + popcountPopcnt(p,count);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static size_t popcountAvx512(const void *s, long count) {
+    const unsigned char *p = s;
+    __m512i acc1 = _mm512_setzero_si512(), acc2 = _mm512_setzero_si512();
+
+    /* Two accumulators to hide the latency of the additions. */
+    while (count >= 128) {
+        acc1 = _mm512_add_epi64(acc1,_mm512_popcnt_epi64(_mm512_loadu_si512(p)));
+        acc2 = _mm512_add_epi64(acc2,_mm512_popcnt_epi64(_mm512_loadu_si512(p+64)));
+        p += 128;
+        count -= 128;
+    }
+    size_t bits = _mm512_reduce_add_epi64(_mm512_add_epi64(acc1,acc2));
+    return bits + popcountPopcnt(p,count);
+}
+
+/* Vector loop for the BITOP kernels: 'a' is the destination vector and 'b'
+ * the source one. */
+#define BITOP_VECTOR_LOOP(vtype,width,load,store,expr) do { \
+    for (; j+(width) <= len; j += (width)) { \
+        vtype a = load((const vtype*)(dst+j)); \
+        vtype b = load((const vtype*)(src+j)); \
+        store((vtype*)(dst+j),(expr)); \
+    } \
+} while(0)
+
+__attribute__((target("avx2")))
+static void bitopApplyAvx2(int op, unsigned char *dst,
+                           const unsigned char *src, unsigned long len)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    unsigned long j = 0;
+
+    switch(op) {
+    case BITOP_AND:
+        BITOP_VECTOR_LOOP(__m256i,32,_mm256_loadu_si256,_mm256_storeu_si256,
+                          _mm256_and_si256(a,b));
+        break;
+    case BITOP_OR:
+        BITOP_VECTOR_LOOP(__m256i,32,_mm256_loadu_si256,_mm256_storeu_si256,
+                          _mm256_or_si256(a,b));
+        break;
+    case BITOP_XOR:
+        BITOP_VECTOR_LOOP(__m256i,32,_mm256_loadu_si256,_mm256_storeu_si256,
+                          _mm256_xor_si256(a,b));
+        break;
+    case BITOP_NOT:
+        for (; j+32 <= len; j += 32) {
+            __m256i b = _mm256_loadu_si256((const __m256i*)(src+j));
+            _mm256_storeu_si256((__m256i*)(dst+j),_mm256_xor_si256(b,ones));
+        }
+        break;
+    }
+    bitopApplyScalar(op,dst+j,src+j,len-j);
+}
+
+__attribute__((target("avx512f")))
+static void bitopApplyAvx512(int op, unsigned char *dst,
+                             const unsigned char *src, unsigned long len)
+{
+    const __m512i ones = _mm512_set1_epi32(-1);
+    unsigned long j = 0;
+
+    switch(op) {
+    case BITOP_AND:
+        BITOP_VECTOR_LOOP(__m512i,64,_mm512_loadu_si512,_mm512_storeu_si512,
+                          _mm512_and_si512(a,b));
+        break;
+    case BITOP_OR:
+        BITOP_VECTOR_LOOP(__m512i,64,_mm512_loadu_si512,_mm512_storeu_si512,
+                          _mm512_or_si512(a,b));
+        break;
+    case BITOP_XOR:
+        BITOP_VECTOR_LOOP(__m512i,64,_mm512_loadu_si512,_mm512_storeu_si512,
+                          _mm512_xor_si512(a,b));
+        break;
+    case BITOP_NOT:
+        for (; j+64 <= len; j += 64) {
+            __m512i b = _mm512_loadu_si512(src+j);
+            _mm512_storeu_si512(dst+j,_mm512_xor_si512(b,ones));
+        }
+        break;
+    }
+    bitopApplyScalar(op,dst+j,src+j,len-j);
+}
+#undef BITOP_VECTOR_LOOP
+
+/* Skip 128 bytes at a time, OR-ing (AND-ing when looking for a clear bit)
+ * four vectors together before testing them. */
+__attribute__((target("avx2")))
+static unsigned long bitposSkipAvx2(const unsigned char *p,
+                                    unsigned long count, int bit)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    unsigned long skipped = 0;
+
+    while (count-skipped >= 128) {
+        const __m256i *v = (const __m256i*)(p+skipped);
+        __m256i a = _mm256_loadu_si256(v), b = _mm256_loadu_si256(v+1);
+        __m256i c = _mm256_loadu_si256(v+2), d = _mm256_loadu_si256(v+3);
+
+        if (bit) {
+            __m256i x = _mm256_or_si256(_mm256_or_si256(a,b),
+                                        _mm256_or_si256(c,d));
+            if (!_mm256_testz_si256(x,x)) break;
+        } else {
+            __m256i x = _mm256_and_si256(_mm256_and_si256(a,b),
+                                         _mm256_and_si256(c,d));
+            if (!_mm256_testc_si256(x,ones)) break;
+        }
+        skipped += 128;
+    }
+    return skipped;
+}
+
+__attribute__((target("avx512f")))
+static unsigned long bitposSkipAvx512(const unsigned char *p,
+                                      unsigned long count, int bit)
+{
+    const __m512i ones = _mm512_set1_epi32(-1);
+    unsigned long skipped = 0;
+
+    while (count-skipped >= 256) {
+        const unsigned char *v = p+skipped;
+        __m512i a = _mm512_loadu_si512(v), b = _mm512_loadu_si512(v+64);
+        __m512i c = _mm512_loadu_si512(v+128), d = _mm512_loadu_si512(v+192);
+
+        if (bit) {
+            __m512i x = _mm512_or_si512(_mm512_or_si512(a,b),
+                                        _mm512_or_si512(c,d));
+            if (_mm512_test_epi64_mask(x,x)) break;
+        } else {
+            __m512i x = _mm512_and_si512(_mm512_and_si512(a,b),
+                                         _mm512_and_si512(c,d));
+            if (_mm512_cmpneq_epi64_mask(x,ones)) break;
+        }
+        skipped += 256;
+    }
+    return skipped;
+}
+#endif /* x86-64 SIMD kernels */
+
+/* -----------------------------------------------------------------------------
+ * Kernels dispatch.
+ * -------------------------------------------------------------------------- */
+
+static size_t popcountResolve(const void *s, long count);
+static void bitopApplyResolve(int op, unsigned char *dst,
+                              const unsigned char *src, unsigned long len);
+static unsigned long bitposSkipResolve(const unsigned char *p,
+                                       unsigned long count, int bit);
+
+/* The kernels in use. They initially point to functions selecting the best
+ * kernels for this CPU, and then calling them. */
+static size_t (*popcountKernel)(const void *s, long count) = popcountResolve;
+static void (*bitopApplyKernel)(int op, unsigned char *dst,
+    const unsigned char *src, unsigned long len) = bitopApplyResolve;
+static unsigned long (*bitposSkipKernel)(const unsigned char *p,
+    unsigned long count, int bit) = bitposSkipResolve;
+
+static void bitopsSelectKernels(void) {
+    popcountKernel = popcountScalar;
+    bitopApplyKernel = bitopApplyScalar;
+    bitposSkipKernel = bitposSkipScalar;
+#ifdef HAVE_BITOPS_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        bitopApplyKernel = bitopApplyAvx512;
+        bitposSkipKernel = bitposSkipAvx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        bitopApplyKernel = bitopApplyAvx2;
+        bitposSkipKernel = bitposSkipAvx2;
+    }
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vpopcntdq") &&
+        __builtin_cpu_supports("popcnt"))
+        popcountKernel = popcountAvx512;
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        popcountKernel = popcountAvx2;
+    else if (__builtin_cpu_supports("popcnt"))
+        popcountKernel = popcountPopcnt;
+#endif
+}
+
+static size_t popcountResolve(const void *s, long count) {
+    bitopsSelectKernels();
+    return popcountKernel(s,count);
+}
+
+static void bitopApplyResolve(int op, unsigned char *dst,
+                              const unsigned char *src, unsigned long len)
+{
+    bitopsSelectKernels();
+    bitopApplyKernel(op,dst,src,len);
+}
+
+static unsigned long bitposSkipResolve(const unsigned char *p,
+                                       unsigned long count, int bit)
+{
+    bitopsSelectKernels();
+    return bitposSkipKernel(p,count,bit);
+}
+
+/* Count number of bits set in the binary array pointed by 's' and long
+ * 'count' bytes. The implementation of this function is required to
+ * work with a input string length up to 512 MB. */
+size_t redisPopcount(void *s, long count) {
+    return popcountKernel(s,count);
+}
+
+/* Number of bytes of a source long 'len' available in the block of
+ * 'block' bytes starting at offset 'j'. */
+static inline unsigned long bitopAvail(unsigned long len, unsigned long j,
+                                       unsigned long block)
+{
+    if (len <= j) return 0;
+    return len-j < block ? len-j : block;
+}
+
+/* Compute dst = src[0] <op> src[1] <op> ... <op> src[numkeys-1], or
+ * dst = ~src[0] for NOT, for the bytes in the range [start,end) of the
+ * result. Sources shorter than the range are handled as zero padded, as
+ * 'len' holds the length of every source. The result is computed in blocks
+ * small enough to stay in the L1 cache while all the sources are combined
+ * into them. */
+#define BITOP_BLOCK_BYTES 4096
+void redisBitop(int op, unsigned char *dst, unsigned char **src,
+                unsigned long *len, unsigned long numkeys,
+                unsigned long start, unsigned long end)
+{
+    unsigned long j, i, block, avail;
+
+    for (j = start; j < end; j += block) {
+        block = end-j < BITOP_BLOCK_BYTES ? end-j : BITOP_BLOCK_BYTES;
+        avail = bitopAvail(len[0],j,block);
+        if (op == BITOP_NOT) {
+            if (avail) bitopApplyKernel(op,dst+j,src[0]+j,avail);
+            memset(dst+j+avail,0xff,block-avail);
+            continue;
+        }
+        if (avail) memcpy(dst+j,src[0]+j,avail);
+        memset(dst+j+avail,0,block-avail);
+        for (i = 1; i < numkeys; i++) {
+            avail = bitopAvail(len[i],j,block);
+            if (avail) bitopApplyKernel(op,dst+j,src[i]+j,avail);
+            if (op == BITOP_AND) memset(dst+j+avail,0,block-avail);
+        }
+    }
+}
+
 /* Return the position of the first bit set to one (if 'bit' is 1) or
  * zero (if 'bit' is 0) in the bitmap starting at 's' and long 'count' bytes.
  *
@@ -129,6 +503,14 @@ long redisBitpos(void *s, unsigned long count, int bit) {
         pos += 8;
     }
 
+    /* Skip whole vectors with the SIMD kernels, if available. */
+    if (!found) {
+        unsigned long skipped = bitposSkipKernel(c,count,bit);
+        c += skipped;
+        count -= skipped;
+        pos += skipped*8;
+    }
+
     /* Skip bits with full word step. */
     l = (unsigned long*) c;
     if (!found) {
@@ -389,13 +771,345 @@ void printBits(unsigned char *p, unsigned long count) {
 }
 
 /* -----------------------------------------------------------------------------
- * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
+ * Sparse bitmaps.
+ *
+ * SETBIT growing a string to bitmap-sparse-min-bytes or more converts it to a
+ * sparse bitmap, that only stores the offsets of the bits set in a roaring
+ * bitmap, so that setting a bit at a large offset doesn't allocate the whole
+ * string. GETBIT, SETBIT, BITCOUNT, BITPOS, BITOP (except NOT) and BITFIELD
+ * GET work on the offsets directly, every other command that needs the bytes
+ * of the string materializes it.
  * -------------------------------------------------------------------------- */
 
-#define BITOP_AND   0
-#define BITOP_OR    1
-#define BITOP_XOR   2
-#define BITOP_NOT   3
+/* Copy the bytes [start,start+count) of the sparse bitmap to 'buf', bytes
+ * past the end of the string are copied as zero. */
+void sparseBitmapRead(sparseBitmap *sb, unsigned char *buf, size_t start,
+                      size_t count)
+{
+    uint64_t end = (uint64_t)(start+count)*8;
+    roaringIterator ri;
+    int64_t bit;
+
+    memset(buf,0,count);
+    roaringInitIterator(sb->bits,&ri);
+    roaringSeek(&ri,(int64_t)start*8);
+    while (roaringNext(&ri,&bit) && (uint64_t)bit < end)
+        buf[(bit>>3)-start] |= 1 << (7-(bit&7));
+}
+
+/* Set the bit at 'bitoffset' to 'on', growing the string if needed, and
+ * return the old value of the bit. */
+static int sparseBitmapSetBit(sparseBitmap *sb, size_t bitoffset, int on) {
+    if ((bitoffset >> 3) >= sb->len) sb->len = (bitoffset >> 3)+1;
+    if (on)
+        return !roaringAdd(sb->bits,bitoffset);
+    else
+        return roaringRemove(sb->bits,bitoffset);
+}
+
+/* Return a sparse bitmap 'len' bytes long with the bits set in the string
+ * object 'o', that may be NULL. */
+static robj *sparseBitmapFromString(robj *o, size_t len) {
+    robj *sparse = createSparseBitmapObject(len);
+    sparseBitmap *sb = sparse->ptr;
+
+    if (o != NULL) {
+        robj *dec = getDecodedObject(o);
+        unsigned char *p = dec->ptr;
+        size_t j, plen = sdslen(dec->ptr);
+        int b;
+
+        for (j = 0; j < plen; j++) {
+            if (p[j] == 0) continue;
+            for (b = 0; b < 8; b++)
+                if (p[j] & (0x80 >> b)) roaringAdd(sb->bits,(int64_t)j*8+b);
+        }
+        decrRefCount(dec);
+    }
+    return sparse;
+}
+
+/* Return the number of bits set in the bytes [start,end] of the bitmap. */
+static long long sparseBitmapCount(sparseBitmap *sb, long start, long end) {
+    int64_t to = (int64_t)(end+1)*8, bit;
+    roaringIterator ri;
+    long long count = 0;
+
+    if (start == 0 && (size_t)end == sb->len-1) return roaringCard(sb->bits);
+    roaringInitIterator(sb->bits,&ri);
+    roaringSeek(&ri,(int64_t)start*8);
+    while (roaringNext(&ri,&bit) && bit < to) count++;
+    return count;
+}
+
+/* Return the position of the first bit set to 'bit' in the bytes
+ * [start,end] of the bitmap, like redisBitpos() does: if no bit set to one
+ * is found -1 is returned, if no bit set to zero is found the position of
+ * the first bit after the range is returned. */
+static long long sparseBitmapBitpos(sparseBitmap *sb, long start, long end,
+                                    int bit)
+{
+    int64_t from = (int64_t)start*8, to = (int64_t)(end+1)*8, v;
+    roaringIterator ri;
+
+    roaringInitIterator(sb->bits,&ri);
+    roaringSeek(&ri,from);
+    if (bit) return (roaringNext(&ri,&v) && v < to) ? v : -1;
+    while (from < to && roaringNext(&ri,&v) && v == from) from++;
+    return from;
+}
+
+/* BITOP AND, OR and XOR of sparse bitmaps 'objects', where NULL stands for
+ * a missing key, computed on the offsets of the bits set. The result is a
+ * sparse bitmap as well, 'maxlen' bytes long. */
+static robj *sparseBitmapBitop(int op, robj **objects, unsigned long numkeys,
+                               size_t maxlen)
+{
+    robj *res = createSparseBitmapObject(maxlen);
+    sparseBitmap *dst = res->ptr;
+    roaringIterator ri;
+    unsigned long j;
+    int64_t bit;
+
+    if (op == BITOP_AND && numkeys > 1) {
+        roaring *acc = NULL, *r;
+
+        for (j = 0; j < numkeys; j++)
+            if (objects[j] == NULL) return res;
+        for (j = 1; j < numkeys; j++) {
+            r = roaringIntersect(acc ? acc : ((sparseBitmap*)objects[0]->ptr)->bits,
+                                 ((sparseBitmap*)objects[j]->ptr)->bits);
+            if (acc) roaringFree(acc);
+            acc = r;
+        }
+        roaringFree(dst->bits);
+        dst->bits = acc;
+        return res;
+    }
+
+    for (j = 0; j < numkeys; j++) {
+        if (objects[j] == NULL) continue;
+        roaringInitIterator(((sparseBitmap*)objects[j]->ptr)->bits,&ri);
+        while (roaringNext(&ri,&bit)) {
+            if (!roaringAdd(dst->bits,bit) && op == BITOP_XOR)
+                roaringRemove(dst->bits,bit);
+        }
+    }
+    return res;
+}
+
+/* -----------------------------------------------------------------------------
+ * Incremental BITOP.
+ *
+ * When the result of BITOP is at least bitop-incremental-min-bytes long, the
+ * command does not compute it at once: the client is blocked and the result
+ * is computed a slice at a time by a timer, so that the other clients are
+ * served in the meantime. The job keeps a reference to the source values, so
+ * it computes the result from the values the keys had when BITOP was called
+ * even if the keys are modified while the job runs: write commands never
+ * modify a value in place while its reference count is greater than one.
+ * -------------------------------------------------------------------------- */
+
+#define BITOP_JOB_CHUNK_BYTES (64*1024) /* Bytes computed between time checks. */
+#define BITOP_JOB_SLICE_US 1000         /* Max time spent per timer call. */
+
+typedef struct bitopJob {
+    client *c;              /* Client blocked waiting for the result. */
+    redisDb *db;            /* DB of the target and source keys. */
+    int op;                 /* BITOP_AND, BITOP_OR, ... */
+    struct redisCommand *cmd; /* Command and arguments, to propagate them. */
+    robj **argv;
+    int argc;
+    unsigned long numkeys;  /* Number of source keys. */
+    robj **objects;         /* Decoded source values, or NULL if missing. */
+    unsigned char **src;    /* Source strings and their length. */
+    unsigned long *len;
+    unsigned long maxlen;   /* Length of the result. */
+    unsigned long pos;      /* Next byte of the result to compute. */
+    unsigned char *res;     /* The result, an sds string. */
+} bitopJob;
+
+static list *bitopJobs = NULL;  /* Jobs in progress. */
+static long long bitopTimer = -1; /* Timer computing the jobs, or -1. */
+
+static void freeBitopJob(bitopJob *job) {
+    unsigned long j;
+    int i;
+
+    for (j = 0; j < job->numkeys; j++)
+        if (job->objects[j]) decrRefCount(job->objects[j]);
+    for (i = 0; i < job->argc; i++) decrRefCount(job->argv[i]);
+    zfree(job->argv);
+    zfree(job->objects);
+    zfree(job->src);
+    zfree(job->len);
+    sdsfree((sds)job->res);
+    zfree(job);
+}
+
+/* Store the result of a completed job into the target key, propagate it, and
+ * reply to the blocked client. If all the source keys still hold the values
+ * the result was computed from, the BITOP command itself is propagated,
+ * otherwise the command was already followed by writes to the sources in the
+ * replication stream, so the result is propagated as a SET. Jobs are only
+ * started for non empty results. */
+static void bitopJobComplete(bitopJob *job) {
+    robj *targetkey = job->argv[2], *o;
+    redisDb *db = job->db;
+    int unchanged = 1;
+    unsigned long j;
+
+    for (j = 0; j < job->numkeys; j++) {
+        dictEntry *de = dictFind(db->dict,job->argv[j+3]->ptr);
+        if ((de ? dictGetVal(de) : NULL) != job->objects[j]) unchanged = 0;
+    }
+
+    o = createObject(OBJ_STRING,job->res);
+    job->res = NULL;
+    setKey(db,targetkey,o);
+    notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,db->id);
+    server.dirty++;
+
+    if (unchanged) {
+        propagate(job->cmd,db->id,job->argv,job->argc,
+                  PROPAGATE_AOF|PROPAGATE_REPL);
+    } else {
+        robj *argv[3];
+
+        argv[0] = createStringObject("SET",3);
+        argv[1] = targetkey;
+        argv[2] = o;
+        propagate(lookupCommandByCString("set"),db->id,argv,3,
+                  PROPAGATE_AOF|PROPAGATE_REPL);
+        decrRefCount(argv[0]);
+    }
+    decrRefCount(o);
+
+    addReplyLongLong(job->c,job->maxlen);
+    unblockClient(job->c); /* Frees the job. */
+}
+
+/* Compute the next slice of a job, completing it if this was the last. */
+static void bitopJobProcessChunk(bitopJob *job) {
+    unsigned long end = job->pos + BITOP_JOB_CHUNK_BYTES;
+
+    if (end > job->maxlen) end = job->maxlen;
+    redisBitop(job->op,job->res,job->src,job->len,job->numkeys,job->pos,end);
+    job->pos = end;
+    if (job->pos == job->maxlen) bitopJobComplete(job);
+}
+
+/* Timer handler computing the jobs in round robin, for at most
+ * BITOP_JOB_SLICE_US microseconds per call. */
+static int bitopJobsTimerHandler(struct aeEventLoop *el, long long id,
+                                 void *clientData)
+{
+    long long start = ustime();
+    UNUSED(el);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    while (listLength(bitopJobs) && ustime()-start < BITOP_JOB_SLICE_US) {
+        listNode *ln = listLast(bitopJobs);
+        bitopJob *job = listNodeValue(ln);
+
+        listRotate(bitopJobs);
+        bitopJobProcessChunk(job);
+    }
+    if (listLength(bitopJobs)) return 0; /* Call us again ASAP. */
+    bitopTimer = -1;
+    return AE_NOMORE;
+}
+
+/* Return true if BITOP called by 'c' can block the client to compute a
+ * result of 'maxlen' bytes incrementally. Clients that can't be blocked,
+ * like the master, Lua or MULTI/EXEC, always get the result synchronously. */
+static int bitopShouldBlock(client *c, unsigned long maxlen) {
+    return server.bitop_incremental_min_bytes > 0 &&
+           (long long)maxlen >= server.bitop_incremental_min_bytes &&
+           c->fd != -1 &&
+           !(c->flags & (CLIENT_MULTI|CLIENT_MASTER)) &&
+           !server.loading;
+}
+
+/* Block the client and start a job computing the BITOP result. The job
+ * takes ownership of the source arrays, the result is allocated here. */
+static void bitopStartJob(client *c, int op, unsigned long numkeys,
+                          robj **objects, unsigned char **src,
+                          unsigned long *len, unsigned long maxlen)
+{
+    bitopJob *job = zmalloc(sizeof(*job));
+    int j;
+
+    job->c = c;
+    job->db = c->db;
+    job->op = op;
+    job->cmd = c->cmd;
+    job->argc = c->argc;
+    job->argv = zmalloc(sizeof(robj*)*c->argc);
+    for (j = 0; j < c->argc; j++) {
+        job->argv[j] = c->argv[j];
+        incrRefCount(job->argv[j]);
+    }
+    job->numkeys = numkeys;
+    job->objects = objects;
+    job->src = src;
+    job->len = len;
+    job->maxlen = maxlen;
+    job->pos = 0;
+    job->res = (unsigned char*) sdsnewlen(NULL,maxlen);
+
+    if (bitopJobs == NULL) bitopJobs = listCreate();
+    listAddNodeHead(bitopJobs,job);
+    if (bitopTimer == -1)
+        bitopTimer = aeCreateTimeEvent(server.el,0,bitopJobsTimerHandler,
+                                       NULL,NULL);
+
+    c->bpop.timeout = 0;
+    c->bpop.bitop_job = job;
+    blockClient(c,BLOCKED_BITOP);
+}
+
+/* Called by unblockClient() to release the job of a client blocked in
+ * BITOP, either because the job completed or because it was cancelled. */
+void unblockClientFromBitop(client *c) {
+    bitopJob *job = c->bpop.bitop_job;
+
+    listDelNode(bitopJobs,listSearchKey(bitopJobs,job));
+    freeBitopJob(job);
+    c->bpop.bitop_job = NULL;
+}
+
+/* Reply to a client whose job is cancelled by CLIENT UNBLOCK. */
+void replyToBlockedClientFromBitop(client *c) {
+    addReplySds(c,sdsnew(
+        "-UNBLOCKED BITOP cancelled before completion\r\n"));
+}
+
+/* Complete synchronously the jobs reading from the DB 'dbnum', or from
+ * every DB if 'dbnum' is -1. Called before the DB is emptied in a background
+ * thread, that would otherwise release the source values concurrently with
+ * the jobs referencing them. */
+void bitopCompleteJobs(int dbnum) {
+    listNode *ln;
+    listIter li;
+
+    if (bitopJobs == NULL) return;
+    listRewind(bitopJobs,&li);
+    while((ln = listNext(&li))) {
+        bitopJob *job = listNodeValue(ln);
+
+        if (dbnum != -1 && job->db->id != dbnum) continue;
+        redisBitop(job->op,job->res,job->src,job->len,job->numkeys,
+                   job->pos,job->maxlen);
+        job->pos = job->maxlen;
+        bitopJobComplete(job);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
+ * -------------------------------------------------------------------------- */
 
 #define BITFIELDOP_GET 0
 #define BITFIELDOP_SET 1
@@ -521,6 +1235,33 @@ unsigned char *getObjectReadOnlyString(robj *o, long *len, char *llbuf) {
     return p;
 }
 
+/* Lookup the bitmap SETBIT writes the bit 'bitoffset' to, like
+ * lookupStringForBitCommand() does. A missing key or a short string grown to
+ * bitmap-sparse-min-bytes or more is converted into a sparse bitmap, that
+ * grows when the bit is set instead of here. */
+static robj *lookupBitmapForSetbit(client *c, size_t bitoffset) {
+    long long minlen = server.bitmap_sparse_min_bytes;
+    size_t byte = bitoffset >> 3;
+    robj *o = lookupKeyWrite(c->db,c->argv[1]);
+
+    if (o != NULL) {
+        if (checkType(c,o,OBJ_STRING)) return NULL;
+        if (o->encoding == OBJ_ENCODING_ROARING) return o;
+    }
+    if (minlen && (long long)byte+1 >= minlen &&
+        (o == NULL || (long long)stringObjectLen(o) < minlen))
+    {
+        robj *sparse = sparseBitmapFromString(o,byte+1);
+
+        if (o == NULL)
+            dbAdd(c->db,c->argv[1],sparse);
+        else
+            dbOverwrite(c->db,c->argv[1],sparse);
+        return sparse;
+    }
+    return lookupStringForBitCommand(c,bitoffset);
+}
+
 /* SETBIT key offset bitvalue */
 void setbitCommand(client *c) {
     robj *o;
@@ -542,7 +1283,16 @@ void setbitCommand(client *c) {
         return;
     }
 
-    if ((o = lookupStringForBitCommand(c,bitoffset)) == NULL) return;
+    if ((o = lookupBitmapForSetbit(c,bitoffset)) == NULL) return;
+
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        bitval = sparseBitmapSetBit(o->ptr,bitoffset,on);
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
+        server.dirty++;
+        addReply(c, bitval ? shared.cone : shared.czero);
+        return;
+    }
 
     /* Get current values */
     byte = bitoffset >> 3;
@@ -579,6 +1329,8 @@ void getbitCommand(client *c) {
     if (sdsEncodedObject(o)) {
         if (byte < sdslen(o->ptr))
             bitval = ((uint8_t*)o->ptr)[byte] & (1 << bit);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        bitval = roaringContains(((sparseBitmap*)o->ptr)->bits,bitoffset);
     } else {
         if (byte < (size_t)ll2string(llbuf,sizeof(llbuf),(long)o->ptr))
             bitval = llbuf[byte] & (1 << bit);
@@ -596,8 +1348,10 @@ void bitopCommand(client *c) {
     unsigned char **src; /* Array of source strings pointers. */
     unsigned long *len, maxlen = 0; /* Array of length of src strings,
                                        and max len. */
-    unsigned long minlen = 0;    /* Min len among the input keys. */
     unsigned char *res = NULL; /* Resulting string. */
+    robj *sparseres = NULL;    /* Resulting sparse bitmap. */
+    unsigned long sparse = 0, dense = 0; /* Number of sparse and other
+                                            source strings. */
 
     /* Parse the operation name. */
     if ((opname[0] == 'a' || opname[0] == 'A') && !strcasecmp(opname,"and"))
@@ -631,7 +1385,6 @@ void bitopCommand(client *c) {
             objects[j] = NULL;
             src[j] = NULL;
             len[j] = 0;
-            minlen = 0;
             continue;
         }
         /* Return an error if one of the keys is not a string. */
@@ -646,101 +1399,46 @@ void bitopCommand(client *c) {
             zfree(objects);
             return;
         }
-        objects[j] = getDecodedObject(o);
-        src[j] = objects[j]->ptr;
-        len[j] = sdslen(objects[j]->ptr);
+        if (o->encoding == OBJ_ENCODING_ROARING) {
+            /* Materialized below only if needed. */
+            incrRefCount(o);
+            objects[j] = o;
+            src[j] = NULL;
+            len[j] = ((sparseBitmap*)o->ptr)->len;
+            sparse++;
+        } else {
+            objects[j] = getDecodedObject(o);
+            src[j] = objects[j]->ptr;
+            len[j] = sdslen(objects[j]->ptr);
+            dense++;
+        }
         if (len[j] > maxlen) maxlen = len[j];
-        if (j == 0 || len[j] < minlen) minlen = len[j];
     }
 
-    /* Compute the bit operation, if at least one string is not empty. */
-    if (maxlen) {
-        res = (unsigned char*) sdsnewlen(NULL,maxlen);
-        unsigned char output, byte;
-        unsigned long i;
-
-        /* Fast path: as far as we have data for all the input bitmaps we
-         * can take a fast path that performs much better than the
-         * vanilla algorithm. On ARM we skip the fast path since it will
-         * result in GCC compiling the code using multiple-words load/store
-         * operations that are not supported even in ARM >= v6. */
-        j = 0;
-        #ifndef USE_ALIGNED_ACCESS
-        if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
-            unsigned long *lp[16];
-            unsigned long *lres = (unsigned long*) res;
-
-            /* Note: sds pointer is always aligned to 8 byte boundary. */
-            memcpy(lp,src,sizeof(unsigned long*)*numkeys);
-            memcpy(res,src[0],minlen);
-
-            /* Different branches per different operations for speed (sorry). */
-            if (op == BITOP_AND) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] &= lp[i][0];
-                        lres[1] &= lp[i][1];
-                        lres[2] &= lp[i][2];
-                        lres[3] &= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_OR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] |= lp[i][0];
-                        lres[1] |= lp[i][1];
-                        lres[2] |= lp[i][2];
-                        lres[3] |= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_XOR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] ^= lp[i][0];
-                        lres[1] ^= lp[i][1];
-                        lres[2] ^= lp[i][2];
-                        lres[3] ^= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_NOT) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    lres[0] = ~lres[0];
-                    lres[1] = ~lres[1];
-                    lres[2] = ~lres[2];
-                    lres[3] = ~lres[3];
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
+    if (sparse && !dense && op != BITOP_NOT) {
+        /* AND, OR and XOR of sparse bitmaps are computed on the offsets of
+         * the bits set, producing a sparse bitmap. */
+        sparseres = sparseBitmapBitop(op,objects,numkeys,maxlen);
+    } else {
+        for (j = 0; sparse && j < numkeys; j++) {
+            if (objects[j] && objects[j]->encoding == OBJ_ENCODING_ROARING) {
+                robj *dec = getDecodedObject(objects[j]);
+                decrRefCount(objects[j]);
+                objects[j] = dec;
+                src[j] = dec->ptr;
             }
         }
-        #endif
-
-        /* j is set to the next byte to process by the previous loop. */
-        for (; j < maxlen; j++) {
-            output = (len[0] <= j) ? 0 : src[0][j];
-            if (op == BITOP_NOT) output = ~output;
-            for (i = 1; i < numkeys; i++) {
-                byte = (len[i] <= j) ? 0 : src[i][j];
-                switch(op) {
-                case BITOP_AND: output &= byte; break;
-                case BITOP_OR:  output |= byte; break;
-                case BITOP_XOR: output ^= byte; break;
-                }
-            }
-            res[j] = output;
+
+        /* Large results are computed incrementally, replying when done. */
+        if (bitopShouldBlock(c,maxlen)) {
+            bitopStartJob(c,op,numkeys,objects,src,len,maxlen);
+            return;
+        }
+
+        /* Compute the bit operation, if at least one string is not empty. */
+        if (maxlen) {
+            res = (unsigned char*) sdsnewlen(NULL,maxlen);
+            redisBitop(op,res,src,len,numkeys,0,maxlen);
         }
     }
     for (j = 0; j < numkeys; j++) {
@@ -753,7 +1451,7 @@ void bitopCommand(client *c) {
 
     /* Store the computed value into the target key */
     if (maxlen) {
-        o = createObject(OBJ_STRING,res);
+        o = sparseres ? sparseres : createObject(OBJ_STRING,res);
         setKey(c->db,targetkey,o);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,c->db->id);
         decrRefCount(o);
@@ -775,7 +1473,12 @@ void bitcountCommand(client *c) {
     /* Lookup, check for type, and return 0 for non existing keys. */
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        p = NULL;
+        strlen = ((sparseBitmap*)o->ptr)->len;
+    } else {
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->argc == 4) {
@@ -810,7 +1513,10 @@ void bitcountCommand(client *c) {
     } else {
         long bytes = end-start+1;
 
-        addReplyLongLong(c,redisPopcount(p+start,bytes));
+        if (p == NULL)
+            addReplyLongLong(c,sparseBitmapCount(o->ptr,start,end));
+        else
+            addReplyLongLong(c,redisPopcount(p+start,bytes));
     }
 }
 
@@ -839,7 +1545,12 @@ void bitposCommand(client *c) {
         return;
     }
     if (checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        p = NULL;
+        strlen = ((sparseBitmap*)o->ptr)->len;
+    } else {
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->argc == 4 || c->argc == 5) {
@@ -874,7 +1585,14 @@ void bitposCommand(client *c) {
         addReplyLongLong(c, -1);
     } else {
         long bytes = end-start+1;
-        long pos = redisBitpos(p+start,bytes,bit);
+        long pos;
+
+        if (p == NULL) {
+            pos = sparseBitmapBitpos(o->ptr,start,end,bit);
+            if (pos != -1) pos -= start*8;
+        } else {
+            pos = redisBitpos(p+start,bytes,bit);
+        }
 
         /* If we are looking for clear bits, and the user specified an exact
          * range with start-end, we can't consider the right of the range as
@@ -1093,7 +1811,7 @@ void bitfieldCommand(client *c) {
             unsigned char *src = NULL;
             char llbuf[LONG_STR_SIZE];
 
-            if (o != NULL)
+            if (o != NULL && o->encoding != OBJ_ENCODING_ROARING)
                 src = getObjectReadOnlyString(o,&strlen,llbuf);
 
             /* For GET we use a trick: before executing the operation
@@ -1103,9 +1821,13 @@ void bitfieldCommand(client *c) {
             memset(buf,0,9);
             int i;
             size_t byte = thisop->offset >> 3;
-            for (i = 0; i < 9; i++) {
-                if (src == NULL || i+byte >= (size_t)strlen) break;
-                buf[i] = src[i+byte];
+            if (o != NULL && o->encoding == OBJ_ENCODING_ROARING) {
+                sparseBitmapRead(o->ptr,buf,byte,9);
+            } else {
+                for (i = 0; i < 9; i++) {
+                    if (src == NULL || i+byte >= (size_t)strlen) break;
+                    buf[i] = src[i+byte];
+                }
             }
 
             /* Now operate on the copied buffer which is guaranteed
@@ -1129,3 +1851,240 @@ void bitfieldCommand(client *c) {
     }
     zfree(ops);
 }
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+
+static void ok(void) {
+    printf("OK\n");
+}
+
+#define assert(_e) ((_e)?(void)0:(_assert(#_e,__FILE__,__LINE__),exit(1)))
+static void _assert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static void randomFill(unsigned char *p, size_t len, uint64_t seed) {
+    uint64_t x = seed | 1;
+    for (size_t j = 0; j < len; j++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        p[j] = x >> 32;
+    }
+}
+
+/* The kernels available on this CPU, to check them against each other. */
+typedef struct {
+    const char *name;
+    size_t (*popcount)(const void *s, long count);
+} popcountKernelInfo;
+
+typedef struct {
+    const char *name;
+    void (*apply)(int op, unsigned char *dst, const unsigned char *src,
+                  unsigned long len);
+    unsigned long (*skip)(const unsigned char *p, unsigned long count,
+                          int bit);
+} bitopKernelInfo;
+
+static int getKernels(popcountKernelInfo *pk, bitopKernelInfo *bk, int *nbk) {
+    int npk = 0;
+
+    pk[npk].name = "scalar"; pk[npk++].popcount = popcountScalar;
+    bk[0].name = "scalar"; bk[0].apply = bitopApplyScalar;
+    bk[0].skip = bitposSkipScalar;
+    *nbk = 1;
+#ifdef HAVE_BITOPS_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        pk[npk].name = "popcnt"; pk[npk++].popcount = popcountPopcnt;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        pk[npk].name = "avx2"; pk[npk++].popcount = popcountAvx2;
+    }
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vpopcntdq") &&
+        __builtin_cpu_supports("popcnt"))
+    {
+        pk[npk].name = "avx512"; pk[npk++].popcount = popcountAvx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        bk[*nbk].name = "avx2"; bk[*nbk].apply = bitopApplyAvx2;
+        bk[(*nbk)++].skip = bitposSkipAvx2;
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        bk[*nbk].name = "avx512"; bk[*nbk].apply = bitopApplyAvx512;
+        bk[(*nbk)++].skip = bitposSkipAvx512;
+    }
+#endif
+    return npk;
+}
+
+int bitopsTest(int argc, char **argv) {
+    popcountKernelInfo pk[4];
+    bitopKernelInfo bk[3];
+    int npk, nbk;
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    npk = getKernels(pk,bk,&nbk);
+    printf("Kernels:");
+    for (int k = 0; k < npk; k++) printf(" %s",pk[k].name);
+    printf(" (popcount),");
+    for (int k = 0; k < nbk; k++) printf(" %s",bk[k].name);
+    printf(" (bitop, bitpos)\n");
+
+    printf("Popcount kernels: "); {
+        unsigned char buf[2048+64];
+
+        randomFill(buf,sizeof(buf),1);
+        for (int i = 0; i < 2000; i++) {
+            long offset = rand() % 64, count = rand() % 2048;
+            size_t expected = 0;
+
+            for (long j = 0; j < count; j++)
+                expected += __builtin_popcount(buf[offset+j]);
+            for (int k = 0; k < npk; k++)
+                assert(pk[k].popcount(buf+offset,count) == expected);
+        }
+        ok();
+    }
+
+    printf("Bitop kernels: "); {
+        unsigned char a[1024+64], b[1024+64], dst[1024+64], ref[1024+64];
+
+        for (int i = 0; i < 2000; i++) {
+            int op = rand() % 4;
+            long offset = rand() % 64, len = rand() % 1024;
+
+            randomFill(a,sizeof(a),i*2+1);
+            randomFill(b,sizeof(b),i*2+2);
+            for (long j = 0; j < len; j++) {
+                switch(op) {
+                case BITOP_AND: ref[j] = a[offset+j] & b[offset+j]; break;
+                case BITOP_OR:  ref[j] = a[offset+j] | b[offset+j]; break;
+                case BITOP_XOR: ref[j] = a[offset+j] ^ b[offset+j]; break;
+                case BITOP_NOT: ref[j] = ~b[offset+j]; break;
+                }
+            }
+            for (int k = 0; k < nbk; k++) {
+                memcpy(dst,a+offset,len);
+                bk[k].apply(op,dst,b+offset,len);
+                assert(memcmp(dst,ref,len) == 0);
+            }
+        }
+        ok();
+    }
+
+    printf("Bitop ranges of zero padded sources: "); {
+        unsigned char a[10000], b[10000], c[10000], dst[10000];
+        unsigned char *src[3] = {a,b,c};
+
+        randomFill(a,sizeof(a),11);
+        randomFill(b,sizeof(b),12);
+        randomFill(c,sizeof(c),13);
+        for (int i = 0; i < 200; i++) {
+            int op = rand() % 4;
+            unsigned long numkeys = op == BITOP_NOT ? 1 : 3;
+            unsigned long lens[3], maxlen = 0, start, end;
+
+            for (unsigned long k = 0; k < numkeys; k++) {
+                lens[k] = rand() % 10000;
+                if (lens[k] > maxlen) maxlen = lens[k];
+            }
+            start = maxlen ? rand() % maxlen : 0;
+            end = start + rand() % (maxlen-start+1);
+            memset(dst,0xaa,sizeof(dst));
+            redisBitop(op,dst,src,lens,numkeys,start,end);
+            for (unsigned long j = start; j < end; j++) {
+                unsigned char output = lens[0] > j ? a[j] : 0;
+                if (op == BITOP_NOT) output = ~output;
+                for (unsigned long k = 1; k < numkeys; k++) {
+                    unsigned char byte = lens[k] > j ? src[k][j] : 0;
+                    switch(op) {
+                    case BITOP_AND: output &= byte; break;
+                    case BITOP_OR:  output |= byte; break;
+                    case BITOP_XOR: output ^= byte; break;
+                    }
+                }
+                assert(dst[j] == output);
+            }
+            if (start) assert(dst[start-1] == 0xaa);
+            if (end < sizeof(dst)) assert(dst[end] == 0xaa);
+        }
+        ok();
+    }
+
+    printf("Bitpos kernels: "); {
+        unsigned char buf[4096+64];
+
+        for (int i = 0; i < 2000; i++) {
+            int bit = rand() % 2;
+            long offset = rand() % 64, count = rand() % 4096;
+            long target = rand() % (count+1), expected;
+
+            /* A run of skippable bytes, then a random byte. */
+            memset(buf,bit ? 0 : 0xff,sizeof(buf));
+            if (target < count) buf[offset+target] = rand() % 255 + (bit ? 1 : 0);
+            for (expected = 0; expected < count*8; expected++) {
+                unsigned char byte = buf[offset+expected/8];
+                if (((byte >> (7-expected%8)) & 1) == bit) break;
+            }
+            if (expected == count*8 && bit) expected = -1;
+
+            for (int k = 0; k < nbk; k++) {
+                bitposSkipKernel = bk[k].skip;
+                assert(redisBitpos(buf+offset,count,bit) == expected);
+            }
+        }
+        bitopsSelectKernels();
+        ok();
+    }
+
+    printf("Benchmark on 512MB bitmaps:\n"); {
+        size_t len = 512*1024*1024;
+        unsigned char *a = zmalloc(len), *b = zmalloc(len), *dst = zmalloc(len);
+        unsigned char *src[2] = {a,b};
+        unsigned long lens[2] = {len,len};
+        long long start;
+        size_t bits = 0;
+
+        randomFill(a,len,1);
+        randomFill(b,len,2);
+        for (int k = 0; k < npk; k++) {
+            size_t count;
+            start = usec();
+            count = pk[k].popcount(a,len);
+            printf("  BITCOUNT %-7s %lldusec\n",pk[k].name,usec()-start);
+            if (k) assert(count == bits);
+            bits = count;
+        }
+        for (int k = 0; k < nbk; k++) {
+            bitopApplyKernel = bk[k].apply;
+            start = usec();
+            redisBitop(BITOP_AND,dst,src,lens,2,0,len);
+            printf("  BITOP AND %-6s %lldusec\n",bk[k].name,usec()-start);
+        }
+        memset(dst,0,len);
+        dst[len-1] = 1;
+        for (int k = 0; k < nbk; k++) {
+            bitposSkipKernel = bk[k].skip;
+            start = usec();
+            assert(redisBitpos(dst,len,1) == (long)(len*8-1));
+            printf("  BITPOS %-9s %lldusec\n",bk[k].name,usec()-start);
+        }
+        bitopsSelectKernels();
+        zfree(a);
+        zfree(b);
+        zfree(dst);
+    }
+    return 0;
+}
+#endif
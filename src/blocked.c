@@ -125,7 +125,9 @@ void processUnblockedClients(void) {
          * client is not blocked before to proceed, but things may change and
          * the code is conceptually more correct this way. */
         if (!(c->flags & CLIENT_BLOCKED)) {
-            if (c->querybuf && sdslen(c->querybuf) > 0) {
+            if (c->querybuf && (sdslen(c->querybuf) > 0 ||
+                                c->flags & CLIENT_PENDING_COMMAND))
+            {
                 processInputBufferAndReplicate(c);
             }
         }
@@ -168,6 +170,8 @@ void unblockClient(client *c) {
         unblockClientWaitingReplicas(c);
     } else if (c->btype == BLOCKED_MODULE) {
         unblockClientFromModule(c);
+    } else if (c->btype == BLOCKED_BITOP) {
+        unblockClientFromBitop(c);
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
@@ -192,6 +196,8 @@ void replyToBlockedClientTimedOut(client *c) {
         addReplyLongLong(c,replicationCountAcksByOffset(c->bpop.reploffset));
     } else if (c->btype == BLOCKED_MODULE) {
         moduleBlockedClientTimedOut(c);
+    } else if (c->btype == BLOCKED_BITOP) {
+        replyToBlockedClientFromBitop(c);
     } else {
         serverPanic("Unknown btype in replyToBlockedClientTimedOut().");
     }
@@ -91,6 +91,20 @@ configEnum aof_fsync_enum[] = {
     {NULL, 0}
 };
 
+configEnum hashtable_huge_pages_enum[] = {
+    {"no", HASHTABLE_HUGE_PAGES_NO},
+    {"thp", HASHTABLE_HUGE_PAGES_THP},
+    {"hugetlb", HASHTABLE_HUGE_PAGES_HUGETLB},
+    {NULL, 0}
+};
+
+configEnum list_compress_algorithm_enum[] = {
+    {"lzf", QUICKLIST_NODE_ENCODING_LZF},
+    {"lz4", QUICKLIST_NODE_ENCODING_LZ4},
+    {"zstd", QUICKLIST_NODE_ENCODING_ZSTD},
+    {NULL, 0}
+};
+
 /* Output buffer limits presets. */
 clientBufferLimitsConfig clientBufferLimitsDefaults[CLIENT_TYPE_OBUF_COUNT] = {
     {0, 0, 0}, /* normal */
@@ -212,6 +226,13 @@ void loadServerConfigFromString(char *config) {
             if (server.tcpkeepalive < 0) {
                 err = "Invalid tcp-keepalive value"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"io-threads") && argc == 2) {
+            server.io_threads_num = atoi(argv[1]);
+            if (server.io_threads_num < 1 ||
+                server.io_threads_num > IO_THREADS_MAX_NUM)
+            {
+                err = "Invalid number of I/O threads"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"protected-mode") && argc == 2) {
             if ((server.protected_mode = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -330,6 +351,10 @@ void loadServerConfigFromString(char *config) {
             }
         } else if ((!strcasecmp(argv[0],"proto-max-bulk-len")) && argc == 2) {
             server.proto_max_bulk_len = memtoll(argv[1],NULL);
+        } else if ((!strcasecmp(argv[0],"bitop-incremental-min-bytes")) && argc == 2) {
+            server.bitop_incremental_min_bytes = memtoll(argv[1],NULL);
+        } else if ((!strcasecmp(argv[0],"bitmap-sparse-min-bytes")) && argc == 2) {
+            server.bitmap_sparse_min_bytes = memtoll(argv[1],NULL);
         } else if ((!strcasecmp(argv[0],"client-query-buffer-limit")) && argc == 2) {
             server.client_max_querybuf_len = memtoll(argv[1],NULL);
         } else if (!strcasecmp(argv[0],"lfu-log-factor") && argc == 2) {
@@ -440,6 +465,14 @@ void loadServerConfigFromString(char *config) {
             if ((server.lazyfree_lazy_server_del = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"expire-in-keyspace") && argc == 2) {
+            if ((server.expire_in_keyspace = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-expire-index") && argc == 2) {
+            if ((server.active_expire_index = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if ((!strcasecmp(argv[0],"slave-lazy-flush") ||
                     !strcasecmp(argv[0],"replica-lazy-flush")) && argc == 2)
         {
@@ -574,6 +607,15 @@ void loadServerConfigFromString(char *config) {
                 err = "active-defrag-cycle-max must be between 1 and 99";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"hashtable-huge-pages") && argc == 2) {
+            server.hashtable_huge_pages =
+                configEnumGetValue(hashtable_huge_pages_enum,argv[1]);
+            if (server.hashtable_huge_pages == INT_MIN) {
+                err = "argument must be 'no', 'thp' or 'hugetlb'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rehash-bg-alloc-min-slots") && argc == 2) {
+            server.rehash_bg_alloc_min_slots = memtoll(argv[1],NULL);
         } else if (!strcasecmp(argv[0],"active-defrag-max-scan-fields") && argc == 2) {
             server.active_defrag_max_scan_fields = strtoll(argv[1],NULL,10);
             if (server.active_defrag_max_scan_fields < 1) {
@@ -584,6 +626,10 @@ void loadServerConfigFromString(char *config) {
             server.hash_max_ziplist_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"hash-max-ziplist-value") && argc == 2) {
             server.hash_max_ziplist_value = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"hash-intmap-encoding") && argc == 2) {
+            if ((server.hash_intmap_encoding = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"stream-node-max-bytes") && argc == 2) {
             server.stream_node_max_bytes = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"stream-node-max-entries") && argc == 2) {
@@ -596,12 +642,35 @@ void loadServerConfigFromString(char *config) {
             server.list_max_ziplist_size = atoi(argv[1]);
         } else if (!strcasecmp(argv[0],"list-compress-depth") && argc == 2) {
             server.list_compress_depth = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"list-compress-algorithm") && argc == 2) {
+            server.list_compress_algorithm =
+                configEnumGetValue(list_compress_algorithm_enum,argv[1]);
+            if (server.list_compress_algorithm == INT_MIN) {
+                err = "argument must be 'lzf', 'lz4' or 'zstd'";
+                goto loaderr;
+            }
+            if (!quicklistSetCodec(server.list_compress_algorithm)) {
+                err = "this server was built without support for the "
+                      "requested codec: rebuild with USE_LZ4=yes or "
+                      "USE_ZSTD=yes";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"set-max-intset-entries") && argc == 2) {
             server.set_max_intset_entries = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"set-roaring-encoding") && argc == 2) {
+            if ((server.set_roaring_encoding = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"zset-max-ziplist-entries") && argc == 2) {
             server.zset_max_ziplist_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"zset-max-ziplist-value") && argc == 2) {
             server.zset_max_ziplist_value = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"zset-max-packedtree-entries") && argc == 2) {
+            server.zset_max_packedtree_entries = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"zset-btree-encoding") && argc == 2) {
+            if ((server.zset_btree_encoding = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"hll-sparse-max-bytes") && argc == 2) {
             server.hll_sparse_max_bytes = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"rename-command") && argc == 3) {
@@ -1061,11 +1130,29 @@ void configSetCommand(client *c) {
     {
         zfree(server.slave_announce_ip);
         server.slave_announce_ip = ((char*)o->ptr)[0] ? zstrdup(o->ptr) : NULL;
+    } config_set_special_field("list-compress-algorithm") {
+        int enc = configEnumGetValue(list_compress_algorithm_enum,o->ptr);
+
+        if (enc == INT_MIN) goto badfmt;
+        if (!quicklistSetCodec(enc)) {
+            addReplyErrorFormat(c,
+                "-DISABLED The '%s' codec is not available: it requires a "
+                "Redis server built with USE_%s=yes",
+                (char*)o->ptr,enc == QUICKLIST_NODE_ENCODING_LZ4 ? "LZ4" : "ZSTD");
+            return;
+        }
+        server.list_compress_algorithm = enc;
 
     /* Boolean fields.
      * config_set_bool_field(name,var). */
     } config_set_bool_field(
       "rdbcompression", server.rdb_compression) {
+    } config_set_bool_field(
+      "hash-intmap-encoding",server.hash_intmap_encoding) {
+    } config_set_bool_field(
+      "zset-btree-encoding",server.zset_btree_encoding) {
+    } config_set_bool_field(
+      "set-roaring-encoding",server.set_roaring_encoding) {
     } config_set_bool_field(
       "repl-disable-tcp-nodelay",server.repl_disable_tcp_nodelay) {
     } config_set_bool_field(
@@ -1154,6 +1241,8 @@ void configSetCommand(client *c) {
       "active-defrag-cycle-max",server.active_defrag_cycle_max,1,99) {
     } config_set_numerical_field(
       "active-defrag-max-scan-fields",server.active_defrag_max_scan_fields,1,LONG_MAX) {
+    } config_set_numerical_field(
+      "rehash-bg-alloc-min-slots",server.rehash_bg_alloc_min_slots,0,LONG_MAX) {
     } config_set_numerical_field(
       "auto-aof-rewrite-percentage",server.aof_rewrite_perc,0,INT_MAX){
     } config_set_numerical_field(
@@ -1174,6 +1263,8 @@ void configSetCommand(client *c) {
       "zset-max-ziplist-entries",server.zset_max_ziplist_entries,0,LONG_MAX) {
     } config_set_numerical_field(
       "zset-max-ziplist-value",server.zset_max_ziplist_value,0,LONG_MAX) {
+    } config_set_numerical_field(
+      "zset-max-packedtree-entries",server.zset_max_packedtree_entries,0,LONG_MAX) {
     } config_set_numerical_field(
       "hll-sparse-max-bytes",server.hll_sparse_max_bytes,0,LONG_MAX) {
     } config_set_numerical_field(
@@ -1252,6 +1343,10 @@ void configSetCommand(client *c) {
         }
     } config_set_memory_field(
       "proto-max-bulk-len",server.proto_max_bulk_len) {
+    } config_set_memory_field(
+      "bitop-incremental-min-bytes",server.bitop_incremental_min_bytes) {
+    } config_set_memory_field(
+      "bitmap-sparse-min-bytes",server.bitmap_sparse_min_bytes) {
     } config_set_memory_field(
       "client-query-buffer-limit",server.client_max_querybuf_len) {
     } config_set_memory_field("repl-backlog-size",ll) {
@@ -1267,6 +1362,9 @@ void configSetCommand(client *c) {
       "maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum) {
     } config_set_enum_field(
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
+    } config_set_enum_field(
+      "hashtable-huge-pages",server.hashtable_huge_pages,hashtable_huge_pages_enum) {
+        updateDictHugePages();
 
     /* Everyhing else is an error... */
     } config_set_else {
@@ -1344,6 +1442,8 @@ void configGetCommand(client *c) {
     /* Numerical values */
     config_get_numerical_field("maxmemory",server.maxmemory);
     config_get_numerical_field("proto-max-bulk-len",server.proto_max_bulk_len);
+    config_get_numerical_field("bitop-incremental-min-bytes",server.bitop_incremental_min_bytes);
+    config_get_numerical_field("bitmap-sparse-min-bytes",server.bitmap_sparse_min_bytes);
     config_get_numerical_field("client-query-buffer-limit",server.client_max_querybuf_len);
     config_get_numerical_field("maxmemory-samples",server.maxmemory_samples);
     config_get_numerical_field("lfu-log-factor",server.lfu_log_factor);
@@ -1355,6 +1455,7 @@ void configGetCommand(client *c) {
     config_get_numerical_field("active-defrag-cycle-min",server.active_defrag_cycle_min);
     config_get_numerical_field("active-defrag-cycle-max",server.active_defrag_cycle_max);
     config_get_numerical_field("active-defrag-max-scan-fields",server.active_defrag_max_scan_fields);
+    config_get_numerical_field("rehash-bg-alloc-min-slots",server.rehash_bg_alloc_min_slots);
     config_get_numerical_field("auto-aof-rewrite-percentage",
             server.aof_rewrite_perc);
     config_get_numerical_field("auto-aof-rewrite-min-size",
@@ -1377,6 +1478,8 @@ void configGetCommand(client *c) {
             server.zset_max_ziplist_entries);
     config_get_numerical_field("zset-max-ziplist-value",
             server.zset_max_ziplist_value);
+    config_get_numerical_field("zset-max-packedtree-entries",
+            server.zset_max_packedtree_entries);
     config_get_numerical_field("hll-sparse-max-bytes",
             server.hll_sparse_max_bytes);
     config_get_numerical_field("lua-time-limit",server.lua_time_limit);
@@ -1391,6 +1494,7 @@ void configGetCommand(client *c) {
     config_get_numerical_field("cluster-announce-bus-port",server.cluster_announce_bus_port);
     config_get_numerical_field("tcp-backlog",server.tcp_backlog);
     config_get_numerical_field("databases",server.dbnum);
+    config_get_numerical_field("io-threads",server.io_threads_num);
     config_get_numerical_field("repl-ping-slave-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-ping-replica-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-timeout",server.repl_timeout);
@@ -1441,6 +1545,12 @@ void configGetCommand(client *c) {
     config_get_bool_field("rdbcompression", server.rdb_compression);
     config_get_bool_field("rdbchecksum", server.rdb_checksum);
     config_get_bool_field("activerehashing", server.activerehashing);
+    config_get_bool_field("hash-intmap-encoding",
+            server.hash_intmap_encoding);
+    config_get_bool_field("zset-btree-encoding",
+            server.zset_btree_encoding);
+    config_get_bool_field("set-roaring-encoding",
+            server.set_roaring_encoding);
     config_get_bool_field("activedefrag", server.active_defrag_enabled);
     config_get_bool_field("protected-mode", server.protected_mode);
     config_get_bool_field("repl-disable-tcp-nodelay",
@@ -1461,6 +1571,10 @@ void configGetCommand(client *c) {
             server.lazyfree_lazy_expire);
     config_get_bool_field("lazyfree-lazy-server-del",
             server.lazyfree_lazy_server_del);
+    config_get_bool_field("expire-in-keyspace",
+            server.expire_in_keyspace);
+    config_get_bool_field("active-expire-index",
+            server.active_expire_index);
     config_get_bool_field("slave-lazy-flush",
             server.repl_slave_lazy_flush);
     config_get_bool_field("replica-lazy-flush",
@@ -1477,6 +1591,10 @@ void configGetCommand(client *c) {
             server.supervised_mode,supervised_mode_enum);
     config_get_enum_field("appendfsync",
             server.aof_fsync,aof_fsync_enum);
+    config_get_enum_field("list-compress-algorithm",
+            server.list_compress_algorithm,list_compress_algorithm_enum);
+    config_get_enum_field("hashtable-huge-pages",
+            server.hashtable_huge_pages,hashtable_huge_pages_enum);
     config_get_enum_field("syslog-facility",
             server.syslog_facility,syslog_facility_enum);
 
@@ -2138,6 +2256,7 @@ int rewriteConfig(char *path) {
     rewriteConfigSyslogfacilityOption(state);
     rewriteConfigSaveOption(state);
     rewriteConfigNumericalOption(state,"databases",server.dbnum,CONFIG_DEFAULT_DBNUM);
+    rewriteConfigNumericalOption(state,"io-threads",server.io_threads_num,CONFIG_DEFAULT_IO_THREADS_NUM);
     rewriteConfigYesNoOption(state,"stop-writes-on-bgsave-error",server.stop_writes_on_bgsave_err,CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR);
     rewriteConfigYesNoOption(state,"rdbcompression",server.rdb_compression,CONFIG_DEFAULT_RDB_COMPRESSION);
     rewriteConfigYesNoOption(state,"rdbchecksum",server.rdb_checksum,CONFIG_DEFAULT_RDB_CHECKSUM);
@@ -2164,6 +2283,8 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"maxclients",server.maxclients,CONFIG_DEFAULT_MAX_CLIENTS);
     rewriteConfigBytesOption(state,"maxmemory",server.maxmemory,CONFIG_DEFAULT_MAXMEMORY);
     rewriteConfigBytesOption(state,"proto-max-bulk-len",server.proto_max_bulk_len,CONFIG_DEFAULT_PROTO_MAX_BULK_LEN);
+    rewriteConfigBytesOption(state,"bitop-incremental-min-bytes",server.bitop_incremental_min_bytes,CONFIG_DEFAULT_BITOP_INCREMENTAL_MIN_BYTES);
+    rewriteConfigBytesOption(state,"bitmap-sparse-min-bytes",server.bitmap_sparse_min_bytes,CONFIG_DEFAULT_BITMAP_SPARSE_MIN_BYTES);
     rewriteConfigBytesOption(state,"client-query-buffer-limit",server.client_max_querybuf_len,PROTO_MAX_QUERYBUF_LEN);
     rewriteConfigEnumOption(state,"maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum,CONFIG_DEFAULT_MAXMEMORY_POLICY);
     rewriteConfigNumericalOption(state,"maxmemory-samples",server.maxmemory_samples,CONFIG_DEFAULT_MAXMEMORY_SAMPLES);
@@ -2175,9 +2296,11 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"active-defrag-cycle-min",server.active_defrag_cycle_min,CONFIG_DEFAULT_DEFRAG_CYCLE_MIN);
     rewriteConfigNumericalOption(state,"active-defrag-cycle-max",server.active_defrag_cycle_max,CONFIG_DEFAULT_DEFRAG_CYCLE_MAX);
     rewriteConfigNumericalOption(state,"active-defrag-max-scan-fields",server.active_defrag_max_scan_fields,CONFIG_DEFAULT_DEFRAG_MAX_SCAN_FIELDS);
+    rewriteConfigNumericalOption(state,"rehash-bg-alloc-min-slots",server.rehash_bg_alloc_min_slots,CONFIG_DEFAULT_REHASH_BG_ALLOC_MIN_SLOTS);
     rewriteConfigYesNoOption(state,"appendonly",server.aof_state != AOF_OFF,0);
     rewriteConfigStringOption(state,"appendfilename",server.aof_filename,CONFIG_DEFAULT_AOF_FILENAME);
     rewriteConfigEnumOption(state,"appendfsync",server.aof_fsync,aof_fsync_enum,CONFIG_DEFAULT_AOF_FSYNC);
+    rewriteConfigEnumOption(state,"hashtable-huge-pages",server.hashtable_huge_pages,hashtable_huge_pages_enum,CONFIG_DEFAULT_HASHTABLE_HUGE_PAGES);
     rewriteConfigYesNoOption(state,"no-appendfsync-on-rewrite",server.aof_no_fsync_on_rewrite,CONFIG_DEFAULT_AOF_NO_FSYNC_ON_REWRITE);
     rewriteConfigNumericalOption(state,"auto-aof-rewrite-percentage",server.aof_rewrite_perc,AOF_REWRITE_PERC);
     rewriteConfigBytesOption(state,"auto-aof-rewrite-min-size",server.aof_rewrite_min_size,AOF_REWRITE_MIN_SIZE);
@@ -2195,13 +2318,18 @@ int rewriteConfig(char *path) {
     rewriteConfigNotifykeyspaceeventsOption(state);
     rewriteConfigNumericalOption(state,"hash-max-ziplist-entries",server.hash_max_ziplist_entries,OBJ_HASH_MAX_ZIPLIST_ENTRIES);
     rewriteConfigNumericalOption(state,"hash-max-ziplist-value",server.hash_max_ziplist_value,OBJ_HASH_MAX_ZIPLIST_VALUE);
+    rewriteConfigYesNoOption(state,"hash-intmap-encoding",server.hash_intmap_encoding,OBJ_HASH_INTMAP_ENCODING);
     rewriteConfigNumericalOption(state,"stream-node-max-bytes",server.stream_node_max_bytes,OBJ_STREAM_NODE_MAX_BYTES);
     rewriteConfigNumericalOption(state,"stream-node-max-entries",server.stream_node_max_entries,OBJ_STREAM_NODE_MAX_ENTRIES);
     rewriteConfigNumericalOption(state,"list-max-ziplist-size",server.list_max_ziplist_size,OBJ_LIST_MAX_ZIPLIST_SIZE);
     rewriteConfigNumericalOption(state,"list-compress-depth",server.list_compress_depth,OBJ_LIST_COMPRESS_DEPTH);
+    rewriteConfigEnumOption(state,"list-compress-algorithm",server.list_compress_algorithm,list_compress_algorithm_enum,OBJ_LIST_COMPRESS_ALGORITHM);
     rewriteConfigNumericalOption(state,"set-max-intset-entries",server.set_max_intset_entries,OBJ_SET_MAX_INTSET_ENTRIES);
+    rewriteConfigYesNoOption(state,"set-roaring-encoding",server.set_roaring_encoding,OBJ_SET_ROARING_ENCODING);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-entries",server.zset_max_ziplist_entries,OBJ_ZSET_MAX_ZIPLIST_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-value",server.zset_max_ziplist_value,OBJ_ZSET_MAX_ZIPLIST_VALUE);
+    rewriteConfigNumericalOption(state,"zset-max-packedtree-entries",server.zset_max_packedtree_entries,OBJ_ZSET_MAX_PACKEDTREE_ENTRIES);
+    rewriteConfigYesNoOption(state,"zset-btree-encoding",server.zset_btree_encoding,OBJ_ZSET_BTREE_ENCODING);
     rewriteConfigNumericalOption(state,"hll-sparse-max-bytes",server.hll_sparse_max_bytes,CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES);
     rewriteConfigYesNoOption(state,"activerehashing",server.activerehashing,CONFIG_DEFAULT_ACTIVE_REHASHING);
     rewriteConfigYesNoOption(state,"activedefrag",server.active_defrag_enabled,CONFIG_DEFAULT_ACTIVE_DEFRAG);
@@ -2216,6 +2344,8 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"lazyfree-lazy-eviction",server.lazyfree_lazy_eviction,CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-expire",server.lazyfree_lazy_expire,CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-server-del",server.lazyfree_lazy_server_del,CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL);
+    rewriteConfigYesNoOption(state,"expire-in-keyspace",server.expire_in_keyspace,CONFIG_DEFAULT_EXPIRE_IN_KEYSPACE);
+    rewriteConfigYesNoOption(state,"active-expire-index",server.active_expire_index,CONFIG_DEFAULT_ACTIVE_EXPIRE_INDEX);
     rewriteConfigYesNoOption(state,"replica-lazy-flush",server.repl_slave_lazy_flush,CONFIG_DEFAULT_SLAVE_LAZY_FLUSH);
     rewriteConfigYesNoOption(state,"dynamic-hz",server.dynamic_hz,CONFIG_DEFAULT_DYNAMIC_HZ);
 
@@ -39,6 +39,7 @@
  *----------------------------------------------------------------------------*/
 
 int keyIsExpired(redisDb *db, robj *key);
+static int expireTimeIsReached(mstime_t when);
 
 /* Update LFU when an object is accessed.
  * Firstly, decrement the counter if the decrement time is reached.
@@ -52,31 +53,33 @@ void updateLFU(robj *val) {
     val->lru = (LFUGetTimeInMinutes()<<8) | counter;
 }
 
+/* Return the value stored at the keyspace entry 'de', updating its access
+ * time according to 'flags'. */
+static robj *lookupKeyFromEntry(dictEntry *de, int flags) {
+    robj *val = dictGetVal(de);
+
+    /* Update the access time for the ageing algorithm.
+     * Don't do it if we have a saving child, as this will trigger
+     * a copy on write madness. */
+    if (server.rdb_child_pid == -1 &&
+        server.aof_child_pid == -1 &&
+        !(flags & LOOKUP_NOTOUCH))
+    {
+        if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+            updateLFU(val);
+        } else {
+            val->lru = LRU_CLOCK();
+        }
+    }
+    return val;
+}
+
 /* Low level key lookup API, not actually called directly from commands
  * implementations that should instead rely on lookupKeyRead(),
  * lookupKeyWrite() and lookupKeyReadWithFlags(). */
 robj *lookupKey(redisDb *db, robj *key, int flags) {
     dictEntry *de = dictFind(db->dict,key->ptr);
-    if (de) {
-        robj *val = dictGetVal(de);
-
-        /* Update the access time for the ageing algorithm.
-         * Don't do it if we have a saving child, as this will trigger
-         * a copy on write madness. */
-        if (server.rdb_child_pid == -1 &&
-            server.aof_child_pid == -1 &&
-            !(flags & LOOKUP_NOTOUCH))
-        {
-            if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
-                updateLFU(val);
-            } else {
-                val->lru = LRU_CLOCK();
-            }
-        }
-        return val;
-    } else {
-        return NULL;
-    }
+    return de ? lookupKeyFromEntry(de,flags) : NULL;
 }
 
 /* Lookup a key for read operations, or return NULL if the key is not found
@@ -103,6 +106,22 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
     robj *val;
 
+    /* When the expire is stored in the keyspace entry a single lookup is
+     * enough, unless the key turns out to be expired: in that case we
+     * take the slow path below. */
+    if (server.expire_in_keyspace) {
+        dictEntry *de = dictFind(db->dict,key->ptr);
+
+        if (de == NULL) {
+            server.stat_keyspace_misses++;
+            return NULL;
+        }
+        if (!expireTimeIsReached(dictEntryKeyMeta(de)->expire)) {
+            server.stat_keyspace_hits++;
+            return lookupKeyFromEntry(de,flags);
+        }
+    }
+
     if (expireIfNeeded(db,key) == 1) {
         /* Key expired. If we are in the context of a master, expireIfNeeded()
          * returns 0 only when the key does not exist at all, so it's safe
@@ -155,6 +174,13 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * Returns the linked value object if the key exists or NULL if the key
  * does not exist in the specified DB. */
 robj *lookupKeyWrite(redisDb *db, robj *key) {
+    if (server.expire_in_keyspace) {
+        dictEntry *de = dictFind(db->dict,key->ptr);
+
+        if (de == NULL) return NULL;
+        if (!expireTimeIsReached(dictEntryKeyMeta(de)->expire))
+            return lookupKeyFromEntry(de,LOOKUP_NONE);
+    }
     expireIfNeeded(db,key);
     return lookupKey(db,key,LOOKUP_NONE);
 }
@@ -178,8 +204,16 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    unsigned long slots = dictSlots(db->dict);
+    mstime_t latency;
+
+    /* The key name is copied inside the dict entry, see dbDictType. */
+    latencyStartMonitor(latency);
+    int retval = dictAdd(db->dict, key->ptr, val);
+    latencyEndMonitor(latency);
+    /* Adding the key may have grown the table. */
+    if (dictSlots(db->dict) > slots)
+        latencyAddSampleIfNeeded("dict-expand",latency);
 
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
     if (val->type == OBJ_LIST || val->type == OBJ_ZSET) {
@@ -244,7 +278,7 @@ int dbExists(redisDb *db, robj *key) {
 robj *dbRandomKey(redisDb *db) {
     dictEntry *de;
     int maxtries = 100;
-    int allvolatile = dictSize(db->dict) == dictSize(db->expires);
+    int allvolatile = dictSize(db->dict) == dbVolatileKeysCount(db);
 
     while(1) {
         sds key;
@@ -255,7 +289,9 @@ robj *dbRandomKey(redisDb *db) {
 
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
-        if (dictFind(db->expires,key)) {
+        if (server.expire_in_keyspace ? dictEntryKeyMeta(de)->expire != -1 :
+                                        dictFind(db->expires,key) != NULL)
+        {
             if (allvolatile && server.masterhost && --maxtries == 0) {
                 /* If the DB is composed only of keys with an expire set,
                  * it could happen that all the keys are already logically
@@ -278,6 +314,16 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
+    if (db->expires_index) expireIndexRemove(db,key);
+    if (server.expire_in_keyspace) {
+        dictEntry *de = dictUnlink(db->dict,key->ptr);
+        if (de == NULL) return 0;
+        if (dictEntryKeyMeta(de)->expire != -1) volatileKeysDelete(db,de);
+        dictFreeUnlinkedEntry(db->dict,de);
+        if (server.cluster_enabled) slotToKeyDel(key);
+        return 1;
+    }
+
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
@@ -365,6 +411,13 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         startdb = enddb = dbnum;
     }
 
+    /* BITOP jobs and client replies reference values that a background
+     * thread can't release while they are in use. */
+    if (async) {
+        bitopCompleteJobs(dbnum);
+        copyClientsReplyRefs();
+    }
+
     for (int j = startdb; j <= enddb; j++) {
         removed += dictSize(server.db[j].dict);
         if (async) {
@@ -372,6 +425,8 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         } else {
             dictEmpty(server.db[j].dict,callback);
             dictEmpty(server.db[j].expires,callback);
+            volatileKeysEmpty(&server.db[j]);
+            expireIndexEmpty(&server.db[j]);
         }
     }
     if (server.cluster_enabled) {
@@ -591,7 +646,9 @@ void scanCallback(void *privdata, const dictEntry *de) {
     } else if (o->type == OBJ_ZSET) {
         sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObjectFromLongDouble(*(double*)dictGetVal(de),0);
+        double score = o->encoding == OBJ_ENCODING_BTREE ?
+                       dictGetDoubleVal(de) : *(double*)dictGetVal(de);
+        val = createStringObjectFromLongDouble(score,0);
     } else {
         serverPanic("Type not handled in SCAN callback.");
     }
@@ -619,6 +676,25 @@ int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor) {
     return C_OK;
 }
 
+/* Cursors of roaring encoded sets are element values rather than bucket
+ * indexes, so they are tagged with the top bit of the cursor, which a dict
+ * cursor never has set since it is smaller than the table size. The rest of
+ * the cursor holds the high bits of the element with its sign bit flipped, so
+ * that the scan resumes at most a few elements before the next one to return:
+ * this can only cause duplicates, which SCAN allows. */
+#define SCAN_ROARING_CURSOR (~0UL ^ (~0UL >> 1))
+#define SCAN_ROARING_SHIFT (65 - (int)sizeof(unsigned long)*8)
+
+static unsigned long scanRoaringCursor(int64_t value) {
+    uint64_t u = (uint64_t)value ^ (1ULL<<63);
+    return SCAN_ROARING_CURSOR | (unsigned long)(u >> SCAN_ROARING_SHIFT);
+}
+
+static int64_t scanRoaringCursorValue(unsigned long cursor) {
+    uint64_t u = (uint64_t)(cursor & ~SCAN_ROARING_CURSOR) << SCAN_ROARING_SHIFT;
+    return (int64_t)(u ^ (1ULL<<63));
+}
+
 /* This command implements SCAN, HSCAN and SSCAN commands.
  * If object 'o' is passed, then it must be a Hash or Set object, otherwise
  * if 'o' is NULL the command will operate on the dictionary associated with
@@ -636,7 +712,8 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     listNode *node, *nextnode;
     long count = 10;
     sds pat = NULL;
-    int patlen = 0, use_pattern = 0;
+    int patlen = 0, use_pattern = 0, cursorlen;
+    char cursorbuf[32];
     dict *ht;
 
     /* Object must be NULL (to iterate keys names), or the type of the object
@@ -680,11 +757,13 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     /* Step 2: Iterate the collection.
      *
-     * Note that if the object is encoded with a ziplist, intset, or any other
+     * Note that if the object is encoded with a listpack, intset, or any other
      * representation that is not a hash table, we are sure that it is also
      * composed of a small number of elements. So to avoid taking state we
      * just return everything inside the object in a single call, setting the
-     * cursor to zero to signal the end of the iteration. */
+     * cursor to zero to signal the end of the iteration. Roaring bitmaps are
+     * the exception: they are sorted, so the cursor is an element value, see
+     * scanRoaringCursor(). */
 
     /* Handle the case of a hash table. */
     ht = NULL;
@@ -695,7 +774,8 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
         count *= 2; /* We return key / value for this type. */
-    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->type == OBJ_ZSET && (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                                       o->encoding == OBJ_ENCODING_BTREE)) {
         zset *zs = o->ptr;
         ht = zs->dict;
         count *= 2; /* We return key / value for this type. */
@@ -703,6 +783,11 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     if (ht) {
         void *privdata[2];
+        /* A roaring cursor means that the set was converted to a hash table
+         * while it was being scanned: the cursor is meaningless as a bucket
+         * index, so start over. SCAN allows duplicates, but not misses. */
+        if (cursor & SCAN_ROARING_CURSOR) cursor = 0;
+
         /* We set the max number of iterations to ten times the specified
          * COUNT, so if the hash table is in a pathological state (very
          * sparsely populated) we avoid to block too much time at the cost
@@ -719,6 +804,23 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count);
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_ROARING) {
+        /* Roaring bitmaps can be big, so they are scanned incrementally in
+         * ascending order: the cursor is the next element to return. */
+        roaringIterator ri;
+        int64_t ll;
+
+        roaringInitIterator(o->ptr,&ri);
+        if (cursor & SCAN_ROARING_CURSOR)
+            roaringSeek(&ri,scanRoaringCursorValue(cursor));
+        cursor = 0;
+        while (roaringNext(&ri,&ll)) {
+            if (listLength(keys) == (unsigned long)count) {
+                cursor = scanRoaringCursor(ll);
+                break;
+            }
+            listAddNodeTail(keys,createStringObjectFromLongLong(ll));
+        }
     } else if (o->type == OBJ_SET) {
         int pos = 0;
         int64_t ll;
@@ -726,18 +828,49 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         while(intsetGet(o->ptr,pos++,&ll))
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
         cursor = 0;
+    } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_INTMAP) {
+        uint32_t pos, len = intmapLen(o->ptr);
+        unsigned char *field;
+        uint32_t flen;
+
+        for (pos = 0; pos < len; pos++) {
+            intmapGetField(o->ptr,pos,&field,&flen);
+            listAddNodeTail(keys,createStringObject((char*)field,flen));
+            listAddNodeTail(keys,
+                createStringObjectFromLongLong(intmapGetValue(o->ptr,pos)));
+        }
+        cursor = 0;
+    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_PACKEDTREE) {
+        zptNode *leaf = ((zptree*)o->ptr)->head;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vll;
+
+        /* Like for listpacks, return the whole set in a single call. */
+        for (; leaf != NULL; leaf = leaf->next) {
+            unsigned char *p = lpFirst(leaf->lp);
+
+            while(p) {
+                vstr = lpGetValue(p,&vlen,&vll);
+                listAddNodeTail(keys,
+                    (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
+                                     createStringObjectFromLongLong(vll));
+                p = lpNext(leaf->lp,p);
+            }
+        }
+        cursor = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpFirst(o->ptr);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             listAddNodeTail(keys,
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -792,7 +925,8 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     /* Step 4: Reply to the client. */
     addReplyMultiBulkLen(c, 2);
-    addReplyBulkLongLong(c,cursor);
+    cursorlen = snprintf(cursorbuf,sizeof(cursorbuf),"%lu",cursor);
+    addReplyBulkCBuffer(c,cursorbuf,cursorlen);
 
     addReplyMultiBulkLen(c, listLength(keys));
     while ((node = listFirst(keys)) != NULL) {
@@ -1018,10 +1152,14 @@ int dbSwapDatabases(int id1, int id2) {
      * remain in the same DB they were. */
     db1->dict = db2->dict;
     db1->expires = db2->expires;
+    db1->volatile_keys = db2->volatile_keys;
+    db1->expires_index = db2->expires_index;
     db1->avg_ttl = db2->avg_ttl;
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
+    db2->volatile_keys = aux.volatile_keys;
+    db2->expires_index = aux.expires_index;
     db2->avg_ttl = aux.avg_ttl;
 
     /* Now we need to handle clients blocked on lists: as an effect
@@ -1072,8 +1210,18 @@ void swapdbCommand(client *c) {
  *----------------------------------------------------------------------------*/
 
 int removeExpire(redisDb *db, robj *key) {
+    if (db->expires_index) expireIndexRemove(db,key);
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
+    if (server.expire_in_keyspace) {
+        dictEntry *de = dictFind(db->dict,key->ptr);
+        serverAssertWithInfo(NULL,key,de != NULL);
+        keyMeta *meta = dictEntryKeyMeta(de);
+        if (meta->expire == -1) return 0;
+        volatileKeysDelete(db,de);
+        meta->expire = -1;
+        return 1;
+    }
     serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
     return dictDelete(db->expires,key->ptr) == DICT_OK;
 }
@@ -1086,10 +1234,28 @@ void setExpire(client *c, redisDb *db, robj *key, long long when) {
     dictEntry *kde, *de;
 
     /* Reuse the sds from the main dict in the expire dict */
+    if (db->expires_index) {
+        expireIndexRemove(db,key);
+        expireIndexAdd(db,key,when);
+    }
+
     kde = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
-    de = dictAddOrFind(db->expires,dictGetKey(kde));
-    dictSetSignedIntegerVal(de,when);
+    if (server.expire_in_keyspace) {
+        keyMeta *meta = dictEntryKeyMeta(kde);
+        if (meta->expire == -1) volatileKeysAdd(db,kde);
+        meta->expire = when;
+    } else {
+        unsigned long slots = dictSlots(db->expires);
+        mstime_t latency;
+
+        latencyStartMonitor(latency);
+        de = dictAddOrFind(db->expires,dictGetKey(kde));
+        latencyEndMonitor(latency);
+        if (dictSlots(db->expires) > slots)
+            latencyAddSampleIfNeeded("dict-expand",latency);
+        dictSetSignedIntegerVal(de,when);
+    }
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->flags & CLIENT_MASTER))
@@ -1101,6 +1267,11 @@ void setExpire(client *c, redisDb *db, robj *key, long long when) {
 long long getExpire(redisDb *db, robj *key) {
     dictEntry *de;
 
+    if (server.expire_in_keyspace) {
+        de = dictFind(db->dict,key->ptr);
+        return de ? dictEntryKeyMeta(de)->expire : -1;
+    }
+
     /* No expire? return ASAP */
     if (dictSize(db->expires) == 0 ||
        (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
@@ -1111,6 +1282,19 @@ long long getExpire(redisDb *db, robj *key) {
     return dictGetSignedIntegerVal(de);
 }
 
+/* Return the entry holding the expire time of 'key', that is the entry of
+ * db->expires, or the keyspace entry itself when expire-in-keyspace is
+ * enabled. NULL is returned if the key does not exist or is not volatile.
+ * Use expireEntryGetTime() to read the time from the returned entry. */
+dictEntry *dbFindExpireEntry(redisDb *db, sds key) {
+    dictEntry *de;
+
+    if (!server.expire_in_keyspace)
+        return dictSize(db->expires) ? dictFind(db->expires,key) : NULL;
+    de = dictFind(db->dict,key);
+    return (de && dictEntryKeyMeta(de)->expire != -1) ? de : NULL;
+}
+
 /* Propagate expires into slaves and the AOF file.
  * When a key expires in the master, a DEL operation for this key is sent
  * to all the slaves and the AOF file if enabled.
@@ -1136,9 +1320,9 @@ void propagateExpire(redisDb *db, robj *key, int lazy) {
     decrRefCount(argv[1]);
 }
 
-/* Check if the key is expired. */
-int keyIsExpired(redisDb *db, robj *key) {
-    mstime_t when = getExpire(db,key);
+/* Check if the absolute unix time 'when' in milliseconds is reached, so
+ * that a key with such expire time should be considered expired. */
+static int expireTimeIsReached(mstime_t when) {
     mstime_t now;
 
     if (when < 0) {
@@ -1178,6 +1362,11 @@ int keyIsExpired(redisDb *db, robj *key) {
     return now > when;
 }
 
+/* Check if the key is expired. */
+int keyIsExpired(redisDb *db, robj *key) {
+    return expireTimeIsReached(getExpire(db,key));
+}
+
 /* This function is called when we are going to perform some operation
  * in a given key, but such key may be already logically expired even if
  * it still exists in the database. The main way this function is called
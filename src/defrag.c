@@ -48,6 +48,7 @@ int je_get_defrag_hint(void* ptr, int *bin_util, int *run_util);
 /* forward declarations*/
 void defragDictBucketCallback(void *privdata, dictEntry **bucketref);
 dictEntry* replaceSateliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sds newkey, uint64_t hash, long *defragged);
+long defragRoaring(roaring **rp);
 
 /* Defrag helper for generic allocations.
  *
@@ -129,6 +130,13 @@ robj *activeDefragStringOb(robj* ob, long *defragged) {
                 ret->ptr = (void*)((intptr_t)ret + ofs);
                 (*defragged)++;
             }
+        } else if (ob->encoding==OBJ_ENCODING_ROARING) {
+            sparseBitmap *sb = ob->ptr, *newsb;
+            if ((newsb = activeDefragAlloc(sb))) {
+                ob->ptr = sb = newsb;
+                (*defragged)++;
+            }
+            *defragged += defragRoaring(&sb->bits);
         } else if (ob->encoding!=OBJ_ENCODING_INT) {
             serverPanic("Unknown string encoding");
         }
@@ -173,12 +181,15 @@ long dictIterDefragEntry(dictIterator *iter) {
 long dictDefragTables(dict* d) {
     dictEntry **newtable;
     long defragged = 0;
-    /* handle the first hash table */
-    newtable = activeDefragAlloc(d->ht[0].table);
-    if (newtable)
-        defragged++, d->ht[0].table = newtable;
+    /* handle the first hash table. Tables allocated with mmap() are not
+     * handled by the allocator, so there is nothing to defrag. */
+    if (d->ht[0].table && !dictTableIsMapped(d->ht[0].size)) {
+        newtable = activeDefragAlloc(d->ht[0].table);
+        if (newtable)
+            defragged++, d->ht[0].table = newtable;
+    }
     /* handle the second hash table */
-    if (d->ht[1].table) {
+    if (d->ht[1].table && !dictTableIsMapped(d->ht[1].size)) {
         newtable = activeDefragAlloc(d->ht[1].table);
         if (newtable)
             defragged++, d->ht[1].table = newtable;
@@ -556,6 +567,67 @@ long defragZsetSkiplist(redisDb *db, dictEntry *kde) {
     return defragged;
 }
 
+/* Defrag a roaring bitmap of a set or a sparse bitmap string: the struct,
+ * the containers array and the array or bitmap of every container, that are
+ * only referenced once. */
+long defragRoaring(roaring **rp) {
+    roaring *r = *rp, *newr;
+    roaringContainer *newc;
+    void *newdata;
+    long defragged = 0;
+
+    if ((newr = activeDefragAlloc(r)))
+        defragged++, *rp = r = newr;
+    if (r->containers && (newc = activeDefragAlloc(r->containers)))
+        defragged++, r->containers = newc;
+    for (uint32_t j = 0; j < r->len; j++) {
+        if ((newdata = activeDefragAlloc(r->containers[j].data)))
+            defragged++, r->containers[j].data = newdata;
+    }
+    return defragged;
+}
+
+/* Defrag the leaves and the index of a packed tree sorted set. The tree nodes
+ * are referenced from their parent and siblings, and are left alone. */
+long defragZsetPackedTree(robj *ob) {
+    zptree *zpt = ob->ptr, *newzpt;
+    zptNode *leaf;
+    unsigned char *newlp;
+    void *newptr;
+    long defragged = 0;
+
+    if ((newzpt = activeDefragAlloc(zpt)))
+        defragged++, ob->ptr = zpt = newzpt;
+    for (leaf = zpt->head; leaf != NULL; leaf = leaf->next) {
+        if ((newlp = activeDefragAlloc(leaf->lp)))
+            defragged++, leaf->lp = newlp;
+    }
+    if (zpt->hashes && (newptr = activeDefragAlloc(zpt->hashes)))
+        defragged++, zpt->hashes = newptr;
+    if (zpt->scores && (newptr = activeDefragAlloc(zpt->scores)))
+        defragged++, zpt->scores = newptr;
+    return defragged;
+}
+
+/* Defrag the containers of a B-tree sorted set. The elements are referenced
+ * by the hash table, the leaves and possibly by inner nodes, and the nodes
+ * by their parent and siblings, so they are left alone. */
+long defragZsetBtree(robj *ob) {
+    zset *zs = ob->ptr, *newzs;
+    zbtree *newzbt;
+    dict *newdict;
+    long defragged = 0;
+
+    if ((newzs = activeDefragAlloc(zs)))
+        defragged++, ob->ptr = zs = newzs;
+    if ((newzbt = activeDefragAlloc(zs->zbt)))
+        defragged++, zs->zbt = newzbt;
+    if ((newdict = activeDefragAlloc(zs->dict)))
+        defragged++, zs->dict = newdict;
+    defragged += dictDefragTables(zs->dict);
+    return defragged;
+}
+
 long defragHash(redisDb *db, dictEntry *kde) {
     long defragged = 0;
     robj *ob = dictGetVal(kde);
@@ -765,18 +837,13 @@ long defragKey(redisDb *db, dictEntry *de) {
     robj *newob, *ob;
     unsigned char *newzl;
     long defragged = 0;
-    sds newsds;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
-    if (newsds)
-        defragged++, de->key = newsds;
+    /* The key name is embedded in the dictEntry, that was already handled
+     * by defragKeyspaceBucketCallback(), try to defrag the entry of the
+     * key in db->expires. */
     if (dictSize(db->expires)) {
-         /* Dirty code:
-          * I can't search in db->expires for that key after i already released
-          * the pointer it holds it won't be able to do the string compare */
-        uint64_t hash = dictGetHash(db->dict, de->key);
-        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
+        uint64_t hash = dictGetHash(db->dict, keysds);
+        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, NULL, hash, &defragged);
     }
 
     /* Try to defrag robj and / or string value. */
@@ -804,22 +871,32 @@ long defragKey(redisDb *db, dictEntry *de) {
             intset *newis, *is = ob->ptr;
             if ((newis = activeDefragAlloc(is)))
                 defragged++, ob->ptr = newis;
+        } else if (ob->encoding == OBJ_ENCODING_ROARING) {
+            defragged += defragRoaring((roaring**)&ob->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
             defragged += defragZsetSkiplist(db, de);
+        } else if (ob->encoding == OBJ_ENCODING_PACKEDTREE) {
+            defragged += defragZsetPackedTree(ob);
+        } else if (ob->encoding == OBJ_ENCODING_BTREE) {
+            defragged += defragZsetBtree(ob);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
+        } else if (ob->encoding == OBJ_ENCODING_INTMAP) {
+            intmap *newim, *im = ob->ptr;
+            if ((newim = activeDefragAlloc(im)))
+                defragged++, ob->ptr = newim;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
             defragged += defragHash(db, de);
         } else {
@@ -860,6 +937,36 @@ void defragDictBucketCallback(void *privdata, dictEntry **bucketref) {
     }
 }
 
+/* Defrag scan callback for the slots of the main dict of a db, that uses
+ * open addressing, so every slot holds a single entry. The key
+ * name is embedded in the dictEntry, so moving the entry moves the key as
+ * well, and the key pointer held by db->expires (or the volatile keys
+ * index when expire-in-keyspace is enabled) must be updated. */
+void defragKeyspaceBucketCallback(void *privdata, dictEntry **bucketref) {
+    redisDb *db = privdata;
+    dictEntry *de = *bucketref, *newde;
+    sds oldkey = dictGetKey(de);
+    size_t keyoff = (char*)oldkey - (char*)de;
+    long defragged = 0;
+
+    if ((newde = activeDefragAlloc(de)) == NULL) return;
+    newde->key = (char*)newde + keyoff;
+    *bucketref = newde;
+    if (server.expire_in_keyspace) {
+        /* The expire lives in the entry: just fix the volatile index. */
+        keyMeta *meta = dictEntryKeyMeta(newde);
+        if (meta->expire != -1) db->volatile_keys.entries[meta->vpos] = newde;
+        return;
+    }
+    if (dictSize(db->expires)) {
+        /* Dirty code:
+         * I can't search in db->expires for that key after i already released
+         * the pointer it holds it won't be able to do the string compare */
+        uint64_t hash = dictGetHash(db->dict, newde->key);
+        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, oldkey, newde->key, hash, &defragged);
+    }
+}
+
 /* Utility function to get the fragmentation ratio from jemalloc.
  * It is critical to do that by comparing only heap maps that belong to
  * jemalloc, and skip ones the jemalloc keeps as spare. Since we use this
@@ -1106,7 +1213,7 @@ void activeDefragCycle(void) {
                 break; /* this will exit the function and we'll continue on the next cycle */
             }
 
-            cursor = dictScan(db->dict, cursor, defragScanCallback, defragDictBucketCallback, db);
+            cursor = dictScan(db->dict, cursor, defragScanCallback, defragKeyspaceBucketCallback, db);
 
             /* Once in 16 scan iterations, 512 pointer reallocations. or 64 keys
              * (if we have a lot of pointers in one hash bucket or rehasing),
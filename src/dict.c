@@ -3,7 +3,9 @@
  * This file implements in memory hash tables with insert/del/replace/find/
  * get-random-element operations. Hash tables will auto resize if needed
  * tables of power of two in size are used, collisions are handled by
- * chaining. See the source code for more information... :)
+ * chaining, or, for the dict types asking for it, with open addressing
+ * (linear probing of groups of slots, with one byte of metadata per slot).
+ * See the source code for more information... :)
  *
  * Copyright (c) 2006-2012, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -58,16 +60,127 @@
  *
  * Note that even when dict_can_resize is set to 0, not all resizes are
  * prevented: a hash table is still allowed to grow if the ratio between
- * the number of elements and the buckets > dict_force_resize_ratio. */
+ * the number of elements and the buckets > dict_force_resize_ratio. Open
+ * addressing tables can't hold more elements than slots, so they are still
+ * allowed to grow once almost full (see _dictOaExpandIfNeeded()). */
 static int dict_can_resize = 1;
 static unsigned int dict_force_resize_ratio = 5;
 
+/* Flags passed to zmmap() for the tables allocated with mmap(), in order
+ * to use huge pages. See dictSetTableHugePages(). */
+static int dict_table_mmap_flags = 0;
+
+/* -------------------------- open addressing -------------------------------
+ *
+ * The dict types setting 'openAddressing' use a different table layout.
+ * Every hash table is an array of slots holding dictEntry pointers, plus
+ * an array of control bytes, one per slot, stored in the same allocation
+ * right after the slots. A control byte is either DICT_CTRL_EMPTY, or
+ * DICT_CTRL_DELETED (a tombstone left by a deletion), or, when the slot is
+ * in use, the 7 most significant bits of the hash of the key stored there
+ * with the high bit set.
+ *
+ * Collisions are resolved with linear probing: an element whose hash
+ * selects the "home" slot H = hash & sizemask is stored in the first free
+ * slot at or after H (wrapping around the end of the table). This is the
+ * invariant that every other function relies on:
+ *
+ *     all the slots between the home slot of an element and the slot
+ *     where it is stored are not EMPTY.
+ *
+ * So a lookup can stop as soon as it meets an EMPTY slot. Probing is done
+ * DICT_GROUP_WIDTH control bytes at a time: the bytes of a group are compared
+ * with the 7 bits of the hash we are looking for (with SSE2 where available,
+ * a single compare and movemask), and only the slots that match are
+ * dereferenced, so most failed comparisons never touch the dictEntry.
+ *
+ * To load a full group even near the end of the table without special
+ * cases, the first DICT_GROUP_WIDTH-1 control bytes are cloned after the
+ * last one.
+ *
+ * Deleting an element can't just make its slot EMPTY, as it may be part
+ * of the probe sequence of other elements: the slot is marked DELETED
+ * instead, unless the next slot is EMPTY (in that case no probe sequence
+ * can cross the slot). Deleted slots are reused by insertions and purged
+ * when the table is rehashed.
+ *
+ * Entries are not chained, so their 'next' field holds the hash of their
+ * key instead, and rehashing or scanning never hash a key again. The hash
+ * is truncated to the size of a pointer, that is still more bits than the
+ * size of any table needs, and the control byte of an entry is copied
+ * around rather than computed again.
+ *
+ * EMPTY is the zero byte, so a table obtained from zeroed memory is ready
+ * to use. */
+
+#define DICT_CTRL_EMPTY   ((uint8_t)0x00)
+#define DICT_CTRL_DELETED ((uint8_t)0x7F)
+#define DICT_CTRL_ISFULL(c) (((c) & 0x80) != 0)
+#define DICT_CTRL_HASH(hash) ((uint8_t)(((hash) >> 57) | 0x80))
+
+#define dictHtCtrl(ht) ((uint8_t*)((ht)->table+(ht)->size))
+#define dictHtAllocSize(size) \
+    ((size)*sizeof(dictEntry*)+(size)+DICT_GROUP_WIDTH-1)
+
+#define dictOaEntryHash(de) ((uintptr_t)(de)->next)
+#define dictOaSetEntryHash(de,h) ((de)->next = (dictEntry*)(uintptr_t)(h))
+
+/* Return a bitmap of the slots of the group starting at 'ctrl' whose
+ * control byte is 'c'. */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+static inline unsigned int dictGroupMatch(const uint8_t *ctrl, uint8_t c) {
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group,_mm_set1_epi8((char)c)));
+}
+
+/* Return a bitmap of the slots of the group that are EMPTY or DELETED. */
+static inline unsigned int dictGroupMatchFree(const uint8_t *ctrl) {
+    return ~_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl)) & 0xffff;
+}
+#else
+static inline unsigned int dictGroupMatch(const uint8_t *ctrl, uint8_t c) {
+    unsigned int mask = 0, j;
+    for (j = 0; j < DICT_GROUP_WIDTH; j++)
+        if (ctrl[j] == c) mask |= 1U << j;
+    return mask;
+}
+
+static inline unsigned int dictGroupMatchFree(const uint8_t *ctrl) {
+    unsigned int mask = 0, j;
+    for (j = 0; j < DICT_GROUP_WIDTH; j++)
+        if (!DICT_CTRL_ISFULL(ctrl[j])) mask |= 1U << j;
+    return mask;
+}
+#endif
+
+#define dictGroupFirst(mask) ((unsigned long)__builtin_ctz(mask))
+
+/* Set the control byte of slot 'idx', updating its clones if any. */
+static inline void _dictSetCtrl(dictht *ht, unsigned long idx, uint8_t c) {
+    uint8_t *ctrl = dictHtCtrl(ht);
+
+    ctrl[idx] = c;
+    if (idx < DICT_GROUP_WIDTH-1) {
+        unsigned long j;
+        for (j = idx+ht->size; j < ht->size+DICT_GROUP_WIDTH-1; j += ht->size)
+            ctrl[j] = c;
+    }
+}
+
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
 static long _dictKeyIndex(dict *ht, const void *key, uint64_t hash, dictEntry **existing);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static int _dictOaExpandIfNeeded(dict *d);
+static int _dictOaIsFull(dictht *ht);
+static void _dictOaGrowTable(dict *d, int table, unsigned long size);
+static long _dictOaLookup(dict *d, dictht *ht, const void *key, uint64_t hash);
+static unsigned long _dictOaFreeSlot(dictht *ht, uint64_t hash);
+static void _dictOaInsertAt(dictht *ht, unsigned long idx, uint8_t c, dictEntry *de);
+static void _dictOaRemoveAt(dictht *ht, unsigned long idx);
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -105,6 +218,7 @@ static void _dictReset(dictht *ht)
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
+    ht->deleted = 0;
 }
 
 /* Create a new hash table */
@@ -127,11 +241,13 @@ int _dictInit(dict *d, dictType *type,
     d->privdata = privDataPtr;
     d->rehashidx = -1;
     d->iterators = 0;
+    d->iterators_ht1 = 0;
     return DICT_OK;
 }
 
 /* Resize the table to the minimal size that contains all the elements,
- * but with the invariant of a USED/BUCKETS ratio near to <= 1 */
+ * but with the invariant of a USED/BUCKETS ratio near to <= 1 (<= 7/8 with
+ * open addressing, see dictExpand()). */
 int dictResize(dict *d)
 {
     int minimal;
@@ -143,39 +259,196 @@ int dictResize(dict *d)
     return dictExpand(d, minimal);
 }
 
-/* Expand or create the hash table */
-int dictExpand(dict *d, unsigned long size)
-{
-    /* the size is invalid if it is smaller than the number of
-     * elements already inside the hash table */
-    if (dictIsRehashing(d) || d->ht[0].used > size)
-        return DICT_ERR;
+/* Allocate a table of 'size' buckets, or of 'size' slots with all the
+ * control bytes marked as empty if 'openaddr' is true. The slots of an
+ * open addressing table are never read unless their control byte says they
+ * are in use, so they are not initialized.
+ *
+ * Tables of at least DICT_TABLE_MMAP_MIN_SIZE buckets or slots are
+ * allocated with zmmap(): the kernel zeroes their pages lazily, when first
+ * touched, so growing a huge dict doesn't stop the world while gigabytes of
+ * memory are written. */
+static dictEntry **_dictAllocTable(int openaddr, unsigned long size) {
+    size_t bytes = openaddr ? dictHtAllocSize(size) : size*sizeof(dictEntry*);
+    dictEntry **table;
+
+    if (dictTableIsMapped(size)) return zmmap(bytes,dict_table_mmap_flags);
+    if (!openaddr) return zcalloc(bytes);
+    table = zmalloc(bytes);
+    memset((uint8_t*)(table+size),DICT_CTRL_EMPTY,size+DICT_GROUP_WIDTH-1);
+    return table;
+}
 
-    dictht n; /* the new hash table */
-    unsigned long realsize = _dictNextPower(size);
+/* Release a table obtained with _dictAllocTable(). */
+static void _dictFreeTable(int openaddr, dictEntry **table, unsigned long size) {
+    if (dictTableIsMapped(size))
+        zmunmap(table,openaddr ? dictHtAllocSize(size) :
+                                 size*sizeof(dictEntry*));
+    else
+        zfree(table);
+}
 
-    /* Rehashing to the same table size is not useful. */
-    if (realsize == d->ht[0].size) return DICT_ERR;
+/* Allocate an open addressing table of 'size' slots, that must be a power
+ * of two. This function does not touch any dictionary, so it is safe to
+ * call it from a different thread in order to prepare the table of a huge
+ * dictionary, see dictExpandWithTable(). Tables allocated with mmap() are
+ * faulted in here, otherwise the rehashing would still pay for it. */
+dictEntry **dictAllocTable(unsigned long size) {
+    if (dictTableIsMapped(size))
+        return zmmap(dictHtAllocSize(size),
+                     dict_table_mmap_flags|ZMMAP_POPULATE);
+    return _dictAllocTable(1,size);
+}
 
-    /* Allocate the new hash table and initialize all pointers to NULL */
-    n.size = realsize;
-    n.sizemask = realsize-1;
-    n.table = zcalloc(realsize*sizeof(dictEntry*));
+/* Release a table of 'size' slots obtained with dictAllocTable(). */
+void dictFreeTable(dictEntry **table, unsigned long size) {
+    _dictFreeTable(1,table,size);
+}
+
+/* Set the zmmap() flags used for the tables allocated with mmap(), that is
+ * ZMMAP_THP, ZMMAP_HUGETLB, or zero to use normal pages. */
+void dictSetTableHugePages(int flags) {
+    dict_table_mmap_flags = flags;
+}
+
+/* Start using 'table' of 'size' buckets or slots as the new table of the
+ * dictionary, rehashing the existing elements incrementally if any. */
+static void _dictInstallTable(dict *d, unsigned long size, dictEntry **table) {
+    dictht n; /* the new hash table */
+
+    n.size = size;
+    n.sizemask = size-1;
+    n.table = table;
     n.used = 0;
+    n.deleted = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
      * we just set the first hash table so that it can accept keys. */
     if (d->ht[0].table == NULL) {
         d->ht[0] = n;
-        return DICT_OK;
+        return;
     }
 
     /* Prepare a second hash table for incremental rehashing */
     d->ht[1] = n;
     d->rehashidx = 0;
+}
+
+/* Expand or create the hash table. With chaining the new table has at
+ * least 'size' buckets, with open addressing it has room for 'size'
+ * elements without growing. */
+int dictExpand(dict *d, unsigned long size)
+{
+    unsigned long realsize;
+
+    /* the size is invalid if it is smaller than the number of
+     * elements already inside the hash table */
+    if (dictIsRehashing(d) || d->ht[0].used > size)
+        return DICT_ERR;
+
+    if (dictIsOpenAddressing(d)) {
+        realsize = _dictNextPower(size+size/7+1);
+
+        /* The old table is rehashed incrementally while the new one
+         * receives the insertions, so the new table must not be much
+         * smaller than the old one, see _dictOaExpandIfNeeded(). Shrink
+         * at most 4 times at once. */
+        if (realsize < d->ht[0].size/4) realsize = d->ht[0].size/4;
+
+        /* Rehashing to the same table size is only useful in order to get
+         * rid of the deleted slots. */
+        if (realsize == d->ht[0].size && d->ht[0].deleted == 0)
+            return DICT_ERR;
+    } else {
+        realsize = _dictNextPower(size);
+
+        /* Rehashing to the same table size is not useful. */
+        if (realsize == d->ht[0].size) return DICT_ERR;
+    }
+
+    _dictInstallTable(d,realsize,
+        _dictAllocTable(dictIsOpenAddressing(d),realsize));
+    return DICT_OK;
+}
+
+/* Like dictExpand() but use 'table', of 'size' slots, obtained with
+ * dictAllocTable(). Only growing open addressing dicts is allowed: DICT_ERR
+ * is returned if the dictionary uses chaining, is rehashing or is already at
+ * least that big, and in that case the caller is still the owner of the
+ * table. */
+int dictExpandWithTable(dict *d, unsigned long size, dictEntry **table) {
+    if (!dictIsOpenAddressing(d) || dictIsRehashing(d) ||
+        size <= d->ht[0].size) return DICT_ERR;
+    _dictInstallTable(d,size,table);
     return DICT_OK;
 }
 
+/* If an open addressing dictionary is going to grow soon, that is when 3/4
+ * of the slots are in use while growing happens at 7/8 (see
+ * _dictOaExpandIfNeeded()), return the number of slots of the table it will
+ * need, otherwise return zero. Used in order to prepare the table of huge
+ * dictionaries in advance. */
+unsigned long dictGrowSizeHint(dict *d) {
+    dictht *ht = &d->ht[0];
+
+    if (!dictIsOpenAddressing(d) || dictIsRehashing(d) || ht->size == 0)
+        return 0;
+    if (ht->used+ht->deleted < ht->size-(ht->size>>2)) return 0;
+    return ht->size*2;
+}
+
+/* Release the old table once it was rehashed completely. Returns 1 if there
+ * are still keys to move from the old to the new hash table, otherwise 0. */
+static int _dictRehashCompleted(dict *d) {
+    if (d->ht[0].used != 0) return 1;
+
+    _dictFreeTable(dictIsOpenAddressing(d),d->ht[0].table,d->ht[0].size);
+    d->ht[0] = d->ht[1];
+    _dictReset(&d->ht[1]);
+    d->rehashidx = -1;
+    return 0;
+}
+
+/* dictRehash() for open addressing tables, where a rehashing step consists
+ * in moving a run of adjacent non empty slots (that may contain more than
+ * one key, as colliding keys are stored one after the other).
+ *
+ * Runs are never split: the slots before rehashidx are empty, so lookups in
+ * the old table would stop there and miss a key stored after rehashidx whose
+ * probe sequence started in the part already migrated. */
+static int _dictOaRehash(dict *d, int n) {
+    int empty_visits = n*10; /* Max number of empty slots to visit. */
+    dictht *t0 = &d->ht[0], *t1 = &d->ht[1];
+    uint8_t *ctrl = dictHtCtrl(t0);
+
+    while(n-- && t0->used != 0) {
+        /* Note that rehashidx can't overflow as we are sure there are more
+         * elements because ht[0].used != 0 */
+        assert(t0->size > (unsigned long)d->rehashidx);
+        while(ctrl[d->rehashidx] == DICT_CTRL_EMPTY) {
+            d->rehashidx++;
+            if (--empty_visits == 0) return 1;
+        }
+        /* Move all the keys in this run from the old to the new HT */
+        while((unsigned long)d->rehashidx < t0->size &&
+              ctrl[d->rehashidx] != DICT_CTRL_EMPTY)
+        {
+            if (DICT_CTRL_ISFULL(ctrl[d->rehashidx])) {
+                dictEntry *de = t0->table[d->rehashidx];
+
+                _dictOaInsertAt(t1,_dictOaFreeSlot(t1,dictOaEntryHash(de)),
+                                ctrl[d->rehashidx],de);
+                t0->used--;
+            } else {
+                t0->deleted--;
+            }
+            _dictSetCtrl(t0,d->rehashidx,DICT_CTRL_EMPTY);
+            d->rehashidx++;
+        }
+    }
+    return _dictRehashCompleted(d);
+}
+
 /* Performs N steps of incremental rehashing. Returns 1 if there are still
  * keys to move from the old to the new hash table, otherwise 0 is returned.
  *
@@ -188,6 +461,7 @@ int dictExpand(dict *d, unsigned long size)
 int dictRehash(dict *d, int n) {
     int empty_visits = n*10; /* Max number of empty buckets to visit. */
     if (!dictIsRehashing(d)) return 0;
+    if (dictIsOpenAddressing(d)) return _dictOaRehash(d,n);
 
     while(n-- && d->ht[0].used != 0) {
         dictEntry *de, *nextde;
@@ -216,18 +490,7 @@ int dictRehash(dict *d, int n) {
         d->ht[0].table[d->rehashidx] = NULL;
         d->rehashidx++;
     }
-
-    /* Check if we already rehashed the whole table... */
-    if (d->ht[0].used == 0) {
-        zfree(d->ht[0].table);
-        d->ht[0] = d->ht[1];
-        _dictReset(&d->ht[1]);
-        d->rehashidx = -1;
-        return 0;
-    }
-
-    /* More to rehash... */
-    return 1;
+    return _dictRehashCompleted(d);
 }
 
 long long timeInMilliseconds(void) {
@@ -261,6 +524,20 @@ static void _dictRehashStep(dict *d) {
     if (d->iterators == 0) dictRehash(d,1);
 }
 
+/* Allocate a new entry for 'key'. */
+static dictEntry *_dictNewEntry(dict *d, void *key) {
+    dictEntry *entry;
+
+    if (d->type->keyEmbed) {
+        entry = zmalloc(sizeof(*entry)+d->type->keyEmbedSize(key));
+        entry->key = d->type->keyEmbed(entry+1, key);
+    } else {
+        entry = zmalloc(sizeof(*entry));
+        dictSetKey(d, entry, key);
+    }
+    return entry;
+}
+
 /* Add an element to the target hash table */
 int dictAdd(dict *d, void *key, void *val)
 {
@@ -273,6 +550,43 @@ int dictAdd(dict *d, void *key, void *val)
     return DICT_OK;
 }
 
+/* dictAddRaw() for open addressing tables. */
+static dictEntry *_dictOaAddRaw(dict *d, void *key, dictEntry **existing)
+{
+    uint64_t h = dictHashKey(d,key);
+    dictEntry *entry;
+    dictht *ht;
+    long idx;
+    int table;
+
+    if (existing) *existing = NULL;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+
+    /* Search if the key is already in the dictionary. */
+    for (table = 0; table <= 1; table++) {
+        idx = _dictOaLookup(d, &d->ht[table], key, h);
+        if (idx != -1) {
+            if (existing) *existing = d->ht[table].table[idx];
+            return NULL;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+
+    /* Expand the hash table if needed */
+    if (_dictOaExpandIfNeeded(d) == DICT_ERR)
+        return NULL;
+
+    /* Store the new entry in the first free slot of its probe sequence.
+     * Note that if we are in the process of rehashing the hash table, the
+     * entry goes in the second (new) hash table, unless safe iterators
+     * made the old one receive the insertions, see _dictOaExpandIfNeeded(). */
+    ht = dictIsRehashing(d) && !_dictOaIsFull(&d->ht[1]) ? &d->ht[1] : &d->ht[0];
+    entry = _dictNewEntry(d, key);
+    dictOaSetEntryHash(entry, h);
+    _dictOaInsertAt(ht, _dictOaFreeSlot(ht,h), DICT_CTRL_HASH(h), entry);
+    return entry;
+}
+
 /* Low level add or find:
  * This function adds the entry but instead of setting a value returns the
  * dictEntry structure to the user, that will make sure to fill the value
@@ -297,6 +611,7 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
     dictEntry *entry;
     dictht *ht;
 
+    if (dictIsOpenAddressing(d)) return _dictOaAddRaw(d,key,existing);
     if (dictIsRehashing(d)) _dictRehashStep(d);
 
     /* Get the index of the new element, or -1 if
@@ -309,13 +624,10 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
+    entry = _dictNewEntry(d, key);
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
-
-    /* Set the hash entry fields. */
-    dictSetKey(d, entry, key);
     return entry;
 }
 
@@ -374,26 +686,39 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
     h = dictHashKey(d, key);
 
     for (table = 0; table <= 1; table++) {
-        idx = h & d->ht[table].sizemask;
-        he = d->ht[table].table[idx];
-        prevHe = NULL;
-        while(he) {
-            if (key==he->key || dictCompareKeys(d, key, he->key)) {
-                /* Unlink the element from the list */
-                if (prevHe)
-                    prevHe->next = he->next;
-                else
-                    d->ht[table].table[idx] = he->next;
-                if (!nofree) {
-                    dictFreeKey(d, he);
-                    dictFreeVal(d, he);
-                    zfree(he);
+        if (dictIsOpenAddressing(d)) {
+            long slot = _dictOaLookup(d, &d->ht[table], key, h);
+
+            he = NULL;
+            if (slot != -1) {
+                he = d->ht[table].table[slot];
+                _dictOaRemoveAt(&d->ht[table], slot);
+            }
+        } else {
+            idx = h & d->ht[table].sizemask;
+            he = d->ht[table].table[idx];
+            prevHe = NULL;
+            while(he) {
+                if (key==he->key || dictCompareKeys(d, key, he->key)) {
+                    /* Unlink the element from the list */
+                    if (prevHe)
+                        prevHe->next = he->next;
+                    else
+                        d->ht[table].table[idx] = he->next;
+                    d->ht[table].used--;
+                    break;
                 }
-                d->ht[table].used--;
-                return he;
+                prevHe = he;
+                he = he->next;
             }
-            prevHe = he;
-            he = he->next;
+        }
+        if (he) {
+            if (!nofree) {
+                dictFreeKey(d, he);
+                dictFreeVal(d, he);
+                zfree(he);
+            }
+            return he;
         }
         if (!dictIsRehashing(d)) break;
     }
@@ -443,6 +768,7 @@ void dictFreeUnlinkedEntry(dict *d, dictEntry *he) {
 /* Destroy an entire dictionary */
 int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
     unsigned long i;
+    int openaddr = dictIsOpenAddressing(d);
 
     /* Free all the elements */
     for (i = 0; i < ht->size && ht->used > 0; i++) {
@@ -450,9 +776,10 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
 
         if (callback && (i & 65535) == 0) callback(d->privdata);
 
+        if (openaddr && !DICT_CTRL_ISFULL(dictHtCtrl(ht)[i])) continue;
         if ((he = ht->table[i]) == NULL) continue;
         while(he) {
-            nextHe = he->next;
+            nextHe = openaddr ? NULL : he->next;
             dictFreeKey(d, he);
             dictFreeVal(d, he);
             zfree(he);
@@ -461,7 +788,7 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
         }
     }
     /* Free the table and the allocated cache structure */
-    zfree(ht->table);
+    _dictFreeTable(openaddr,ht->table,ht->size);
     /* Re-initialize the table */
     _dictReset(ht);
     return DICT_OK; /* never fails */
@@ -484,12 +811,17 @@ dictEntry *dictFind(dict *d, const void *key)
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
-        idx = h & d->ht[table].sizemask;
-        he = d->ht[table].table[idx];
-        while(he) {
-            if (key==he->key || dictCompareKeys(d, key, he->key))
-                return he;
-            he = he->next;
+        if (dictIsOpenAddressing(d)) {
+            long slot = _dictOaLookup(d, &d->ht[table], key, h);
+            if (slot != -1) return d->ht[table].table[slot];
+        } else {
+            idx = h & d->ht[table].sizemask;
+            he = d->ht[table].table[idx];
+            while(he) {
+                if (key==he->key || dictCompareKeys(d, key, he->key))
+                    return he;
+                he = he->next;
+            }
         }
         if (!dictIsRehashing(d)) return NULL;
     }
@@ -576,20 +908,25 @@ dictEntry *dictNext(dictIterator *iter)
             if (iter->index >= (long) ht->size) {
                 if (dictIsRehashing(iter->d) && iter->table == 0) {
                     iter->table++;
-                    iter->index = 0;
-                    ht = &iter->d->ht[1];
+                    iter->index = -1;
+                    if (iter->safe) iter->d->iterators_ht1++;
+                    continue;
                 } else {
                     break;
                 }
             }
+            if (dictIsOpenAddressing(iter->d) &&
+                !DICT_CTRL_ISFULL(dictHtCtrl(ht)[iter->index])) continue;
             iter->entry = ht->table[iter->index];
         } else {
             iter->entry = iter->nextEntry;
         }
         if (iter->entry) {
             /* We need to save the 'next' here, the iterator user
-             * may delete the entry we are returning. */
-            iter->nextEntry = iter->entry->next;
+             * may delete the entry we are returning. With open addressing
+             * every slot holds at most one entry. */
+            iter->nextEntry = dictIsOpenAddressing(iter->d) ?
+                              NULL : iter->entry->next;
             return iter->entry;
         }
     }
@@ -599,9 +936,10 @@ dictEntry *dictNext(dictIterator *iter)
 void dictReleaseIterator(dictIterator *iter)
 {
     if (!(iter->index == -1 && iter->table == 0)) {
-        if (iter->safe)
+        if (iter->safe) {
             iter->d->iterators--;
-        else
+            if (iter->table == 1) iter->d->iterators_ht1--;
+        } else
             assert(iter->fingerprint == dictFingerprint(iter->d));
     }
     zfree(iter);
@@ -617,6 +955,34 @@ dictEntry *dictGetRandomKey(dict *d)
 
     if (dictSize(d) == 0) return NULL;
     if (dictIsRehashing(d)) _dictRehashStep(d);
+
+    /* With open addressing every element has a slot on its own, so picking
+     * random slots until we find one in use returns every element with the
+     * same probability. */
+    if (dictIsOpenAddressing(d)) {
+        dictht *ht;
+
+        if (dictIsRehashing(d)) {
+            do {
+                h = d->rehashidx + (random() % (d->ht[0].size +
+                                                d->ht[1].size -
+                                                d->rehashidx));
+                if (h >= d->ht[0].size) {
+                    ht = &d->ht[1];
+                    h -= d->ht[0].size;
+                } else {
+                    ht = &d->ht[0];
+                }
+            } while(!DICT_CTRL_ISFULL(dictHtCtrl(ht)[h]));
+        } else {
+            ht = &d->ht[0];
+            do {
+                h = random() & ht->sizemask;
+            } while(!DICT_CTRL_ISFULL(dictHtCtrl(ht)[h]));
+        }
+        return ht->table[h];
+    }
+
     if (dictIsRehashing(d)) {
         do {
             /* We are sure there are no elements in indexes from 0
@@ -722,8 +1088,11 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
             if (i >= d->ht[j].size) {
                 continue; /* Out of range for this table. */
             }
-            
-            dictEntry *he = d->ht[j].table[i];
+
+            dictEntry *he = NULL;
+            if (!dictIsOpenAddressing(d) ||
+                DICT_CTRL_ISFULL(dictHtCtrl(&d->ht[j])[i]))
+                he = d->ht[j].table[i];
 
             /* Count contiguous empty buckets, and jump to other
              * locations if they reach 'count' (with a minimum of 5). */
@@ -740,7 +1109,7 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
                      * empty while iterating. */
                     *des = he;
                     des++;
-                    he = he->next;
+                    he = dictIsOpenAddressing(d) ? NULL : he->next;
                     stored++;
                     if (stored == count) {
                         return stored;
@@ -765,6 +1134,44 @@ static unsigned long rev(unsigned long v) {
     return v;
 }
 
+/* Emit the elements of the bucket 'idx' of 'ht'. With open addressing the
+ * bucket is made of the elements whose home slot (the first slot of their
+ * probe sequence) is 'idx': because of linear probing they can only be
+ * found in the run of non empty slots starting at 'idx', where however they
+ * may be mixed with elements having other home slots, so the stored hash of
+ * every element found there must be checked. */
+static void dictScanBucket(dict *d, dictht *ht, unsigned long idx,
+                           dictScanFunction *fn,
+                           dictScanBucketFunction *bucketfn,
+                           void *privdata)
+{
+    const dictEntry *de, *next;
+
+    if (dictIsOpenAddressing(d)) {
+        uint8_t *ctrl = dictHtCtrl(ht);
+        unsigned long j = idx, n;
+
+        for (n = 0; n < ht->size && ctrl[j] != DICT_CTRL_EMPTY; n++) {
+            if (DICT_CTRL_ISFULL(ctrl[j]) &&
+                (dictOaEntryHash(ht->table[j]) & ht->sizemask) == idx)
+            {
+                if (bucketfn) bucketfn(privdata, &ht->table[j]);
+                fn(privdata, ht->table[j]);
+            }
+            j = (j+1) & ht->sizemask;
+        }
+        return;
+    }
+
+    if (bucketfn) bucketfn(privdata, &ht->table[idx]);
+    de = ht->table[idx];
+    while (de) {
+        next = de->next;
+        fn(privdata, de);
+        de = next;
+    }
+}
+
 /* dictScan() is used to iterate over the elements of a dictionary.
  *
  * Iterating works the following way:
@@ -797,7 +1204,10 @@ static unsigned long rev(unsigned long v) {
  * use chaining, so the position of an element in a given table is given
  * by computing the bitwise AND between Hash(key) and SIZE-1
  * (where SIZE-1 is always the mask that is equivalent to taking the rest
- *  of the division between the Hash of the key and SIZE).
+ *  of the division between the Hash of the key and SIZE). With open
+ * addressing this is the home slot of the element, where its probe sequence
+ * starts, and the cursor selects home slots rather than physical slots, so
+ * that the guarantees below are the same (see dictScanBucket()).
  *
  * For example if the current hash table size is 16, the mask is
  * (in binary) 1111. The position of a key in the hash table will always be
@@ -856,7 +1266,6 @@ unsigned long dictScan(dict *d,
                        void *privdata)
 {
     dictht *t0, *t1;
-    const dictEntry *de, *next;
     unsigned long m0, m1;
 
     if (dictSize(d) == 0) return 0;
@@ -866,13 +1275,7 @@ unsigned long dictScan(dict *d,
         m0 = t0->sizemask;
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
-        }
+        dictScanBucket(d, t0, v & m0, fn, bucketfn, privdata);
 
         /* Set unmasked bits so incrementing the reversed cursor
          * operates on the masked bits */
@@ -897,25 +1300,13 @@ unsigned long dictScan(dict *d,
         m1 = t1->sizemask;
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
-        }
+        dictScanBucket(d, t0, v & m0, fn, bucketfn, privdata);
 
         /* Iterate over indices in larger table that are the expansion
          * of the index pointed to by the cursor in the smaller table */
         do {
             /* Emit entries at cursor */
-            if (bucketfn) bucketfn(privdata, &t1->table[v & m1]);
-            de = t1->table[v & m1];
-            while (de) {
-                next = de->next;
-                fn(privdata, de);
-                de = next;
-            }
+            dictScanBucket(d, t1, v & m1, fn, bucketfn, privdata);
 
             /* Increment the reverse cursor not covered by the smaller mask.*/
             v |= ~m1;
@@ -954,6 +1345,116 @@ static int _dictExpandIfNeeded(dict *d)
     return DICT_OK;
 }
 
+/* _dictExpandIfNeeded() for open addressing tables. */
+static int _dictOaExpandIfNeeded(dict *d)
+{
+    dictht *ht;
+    unsigned long filled, minsize;
+
+    /* Incremental rehashing already in progress. The new table must be
+     * able to hold the elements still in the old one as well, without
+     * going past 15/16 of its slots. dictExpand() sizes it with room to
+     * spare, but the insertions can outpace the rehashing, that may visit
+     * just one slot of the old table per step: when the slots left to
+     * visit are more than the room left, rehash proportionally more on
+     * every insertion, so that the rehashing completes first. The new
+     * table is at least 1/4 of the old one, so this is a few slots per
+     * insertion.
+     *
+     * Safe iterators pause the rehashing, and a table can't be replaced
+     * while one of them is visiting it. Meanwhile the insertions use up the
+     * room of the new table regardless of the elements still to rehash,
+     * and once it is full it is replaced by a bigger one, if no iterator
+     * got to it yet. Otherwise the iterators are done with the old table:
+     * it is replaced by a bigger one to receive the insertions, to be
+     * rehashed from the start. The growth the rehashing needs is deferred
+     * until the iterators are released. */
+    if (dictIsRehashing(d)) {
+        unsigned long limit, room, left;
+
+        ht = &d->ht[1];
+        if (d->iterators) {
+            if (!_dictOaIsFull(ht)) return DICT_OK;
+            if (d->iterators_ht1 == 0) {
+                _dictOaGrowTable(d,1,dictSize(d)*2);
+                return DICT_OK;
+            }
+            assert(d->iterators_ht1 == d->iterators &&
+                   "dict full: keys added while safe iterators visit both "
+                   "tables");
+            ht = &d->ht[0];
+            if (d->rehashidx != 0 || _dictOaIsFull(ht))
+                _dictOaGrowTable(d,0,(ht->used+1)*2);
+            return DICT_OK;
+        }
+        limit = ht->size-(ht->size>>4);
+        filled = d->ht[0].used+ht->used+ht->deleted+1;
+        if (filled < limit) {
+            room = limit-filled;
+            left = d->ht[0].size-d->rehashidx;
+            if (left > room) dictRehash(d,left/room < 100 ? left/room : 100);
+            return DICT_OK;
+        }
+
+        /* The room was used up while safe iterators paused the rehashing:
+         * move the new table to a bigger one, able to hold all the
+         * elements, and go on rehashing into it. */
+        _dictOaGrowTable(d,1,dictSize(d)*2);
+        return DICT_OK;
+    }
+    ht = &d->ht[0];
+
+    /* If the hash table is empty expand it to the initial size. */
+    if (ht->size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
+
+    /* If the slots in use, counting the deleted ones, reached 7/8 of the
+     * table and we are allowed to resize the hash table (global setting),
+     * or we should avoid it but the table is almost full (15/16), we resize
+     * doubling the number of slots. If most of the slots in use are
+     * actually deleted, the table is rehashed to the same size instead. */
+    filled = ht->used+ht->deleted+1;
+    if ((dict_can_resize && filled > ht->size-(ht->size>>3)) ||
+        filled >= ht->size-(ht->size>>4))
+    {
+        minsize = ht->used+1;
+        if (minsize < ht->size/2) minsize = ht->size/2;
+        return dictExpand(d, minsize);
+    }
+    return DICT_OK;
+}
+
+/* Return true if the open addressing table 'ht' can't receive another
+ * element without going past 15/16 of its slots. */
+static int _dictOaIsFull(dictht *ht) {
+    return ht->used+ht->deleted+1 >= ht->size-(ht->size>>4);
+}
+
+/* Replace the table 'table' of the open addressing dict 'd' with a new one
+ * with room for 'size' elements, moving its elements there. This is only
+ * used while rehashing, when the table receiving the insertions is full,
+ * see _dictOaExpandIfNeeded(). The rehashing of a replaced old table starts
+ * again from its first slot. */
+static void _dictOaGrowTable(dict *d, int table, unsigned long size) {
+    dictht *old = &d->ht[table], n;
+    uint8_t *ctrl = dictHtCtrl(old);
+    unsigned long idx;
+
+    n.size = _dictNextPower(size+size/7+1);
+    n.sizemask = n.size-1;
+    n.table = _dictAllocTable(1,n.size);
+    n.used = 0;
+    n.deleted = 0;
+    for (idx = 0; idx < old->size; idx++) {
+        if (!DICT_CTRL_ISFULL(ctrl[idx])) continue;
+        dictEntry *de = old->table[idx];
+        _dictOaInsertAt(&n,_dictOaFreeSlot(&n,dictOaEntryHash(de)),ctrl[idx],
+                        de);
+    }
+    _dictFreeTable(1,old->table,old->size);
+    *old = n;
+    if (table == 0) d->rehashidx = 0;
+}
+
 /* Our hash table capability is a power of two */
 static unsigned long _dictNextPower(unsigned long size)
 {
@@ -999,11 +1500,86 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
     return idx;
 }
 
+/* Returns the index of the slot of the open addressing table 'ht' holding
+ * the given 'key', or -1 if the key is not there. */
+static long _dictOaLookup(dict *d, dictht *ht, const void *key, uint64_t hash)
+{
+    unsigned long pos, probed;
+    uint8_t *ctrl, h2 = DICT_CTRL_HASH(hash);
+
+    if (ht->used == 0) return -1;
+    ctrl = dictHtCtrl(ht);
+    pos = hash & ht->sizemask;
+    for (probed = 0; probed < ht->size; probed += DICT_GROUP_WIDTH) {
+        unsigned int match = dictGroupMatch(ctrl+pos,h2);
+
+        while(match) {
+            unsigned long idx = (pos+dictGroupFirst(match)) & ht->sizemask;
+            dictEntry *he = ht->table[idx];
+
+            if (key==he->key || dictCompareKeys(d, key, he->key))
+                return idx;
+            match &= match-1;
+        }
+        /* An empty slot ends the probe sequence. */
+        if (dictGroupMatch(ctrl+pos,DICT_CTRL_EMPTY)) return -1;
+        pos = (pos+DICT_GROUP_WIDTH) & ht->sizemask;
+    }
+    return -1;
+}
+
+/* Returns the index of the first free (empty or deleted) slot of the probe
+ * sequence of 'hash'. The caller must make sure the table is not full. */
+static unsigned long _dictOaFreeSlot(dictht *ht, uint64_t hash)
+{
+    uint8_t *ctrl = dictHtCtrl(ht);
+    unsigned long pos = hash & ht->sizemask;
+
+    while(1) {
+        unsigned int match = dictGroupMatchFree(ctrl+pos);
+
+        if (match) return (pos+dictGroupFirst(match)) & ht->sizemask;
+        pos = (pos+DICT_GROUP_WIDTH) & ht->sizemask;
+    }
+}
+
+/* Store 'de' into the free slot 'idx', with control byte 'c'. */
+static void _dictOaInsertAt(dictht *ht, unsigned long idx, uint8_t c, dictEntry *de)
+{
+    if (dictHtCtrl(ht)[idx] == DICT_CTRL_DELETED) ht->deleted--;
+    _dictSetCtrl(ht,idx,c);
+    ht->table[idx] = de;
+    ht->used++;
+}
+
+/* Release the slot 'idx'. It can be marked as empty only if no probe
+ * sequence goes through it, that is, when the next slot is empty. In that
+ * case the deleted slots just before it become useless as well. */
+static void _dictOaRemoveAt(dictht *ht, unsigned long idx)
+{
+    uint8_t *ctrl = dictHtCtrl(ht);
+
+    ht->used--;
+    if (ctrl[(idx+1) & ht->sizemask] != DICT_CTRL_EMPTY) {
+        _dictSetCtrl(ht,idx,DICT_CTRL_DELETED);
+        ht->deleted++;
+        return;
+    }
+    _dictSetCtrl(ht,idx,DICT_CTRL_EMPTY);
+    idx = (idx-1) & ht->sizemask;
+    while(ctrl[idx] == DICT_CTRL_DELETED) {
+        _dictSetCtrl(ht,idx,DICT_CTRL_EMPTY);
+        ht->deleted--;
+        idx = (idx-1) & ht->sizemask;
+    }
+}
+
 void dictEmpty(dict *d, void(callback)(void*)) {
     _dictClear(d,&d->ht[0],callback);
     _dictClear(d,&d->ht[1],callback);
     d->rehashidx = -1;
     d->iterators = 0;
+    d->iterators_ht1 = 0;
 }
 
 void dictEnableResize(void) {
@@ -1018,6 +1594,33 @@ uint64_t dictGetHash(dict *d, const void *key) {
     return dictHashKey(d, key);
 }
 
+/* dictFindEntryRefByPtrAndHash() for open addressing tables. */
+static dictEntry **_dictOaFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash) {
+    unsigned long pos, probed, table;
+    uint8_t h2 = DICT_CTRL_HASH(hash);
+
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+        uint8_t *ctrl = dictHtCtrl(ht);
+
+        pos = hash & ht->sizemask;
+        for (probed = 0; ht->used && probed < ht->size; probed += DICT_GROUP_WIDTH) {
+            unsigned int match = dictGroupMatch(ctrl+pos,h2);
+
+            while(match) {
+                unsigned long idx = (pos+dictGroupFirst(match)) & ht->sizemask;
+                if (oldptr==ht->table[idx]->key)
+                    return &ht->table[idx];
+                match &= match-1;
+            }
+            if (dictGroupMatch(ctrl+pos,DICT_CTRL_EMPTY)) break;
+            pos = (pos+DICT_GROUP_WIDTH) & ht->sizemask;
+        }
+        if (!dictIsRehashing(d)) return NULL;
+    }
+    return NULL;
+}
+
 /* Finds the dictEntry reference by using pointer and pre-calculated hash.
  * oldkey is a dead pointer and should not be accessed.
  * the hash value should be provided using dictGetHash.
@@ -1028,6 +1631,8 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t h
     unsigned long idx, table;
 
     if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
+    if (dictIsOpenAddressing(d))
+        return _dictOaFindEntryRefByPtrAndHash(d,oldptr,hash);
     for (table = 0; table <= 1; table++) {
         idx = hash & d->ht[table].sizemask;
         heref = &d->ht[table].table[idx];
@@ -1046,7 +1651,53 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t h
 /* ------------------------------- Debugging ---------------------------------*/
 
 #define DICT_STATS_VECTLEN 50
-size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
+
+/* _dictGetStatsHt() for open addressing tables. The probe length of an
+ * element is the number of slots a lookup has to visit to find it. */
+static size_t _dictOaGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
+    unsigned long i, probelen, maxprobelen = 0;
+    unsigned long totprobelen = 0;
+    unsigned long plvector[DICT_STATS_VECTLEN];
+    size_t l = 0;
+
+    /* Compute stats. */
+    for (i = 0; i < DICT_STATS_VECTLEN; i++) plvector[i] = 0;
+    for (i = 0; i < ht->size; i++) {
+        if (!DICT_CTRL_ISFULL(dictHtCtrl(ht)[i])) continue;
+        probelen = ((i - dictOaEntryHash(ht->table[i])) & ht->sizemask) + 1;
+        plvector[(probelen < DICT_STATS_VECTLEN) ? probelen : (DICT_STATS_VECTLEN-1)]++;
+        if (probelen > maxprobelen) maxprobelen = probelen;
+        totprobelen += probelen;
+    }
+
+    /* Generate human readable stats. */
+    l += snprintf(buf+l,bufsize-l,
+        "Hash table %d stats (%s):\n"
+        " table size: %ld\n"
+        " number of elements: %ld\n"
+        " deleted slots: %ld\n"
+        " max probe length: %ld\n"
+        " avg probe length: %.02f\n"
+        " Probe length distribution:\n",
+        tableid, (tableid == 0) ? "main hash table" : "rehashing target",
+        ht->size, ht->used, ht->deleted, maxprobelen,
+        (float)totprobelen/ht->used);
+
+    for (i = 1; i < DICT_STATS_VECTLEN; i++) {
+        if (plvector[i] == 0) continue;
+        if (l >= bufsize) break;
+        l += snprintf(buf+l,bufsize-l,
+            "   %s%ld: %ld (%.02f%%)\n",
+            (i == DICT_STATS_VECTLEN-1)?">= ":"",
+            i, plvector[i], ((float)plvector[i]/ht->used)*100);
+    }
+
+    /* Unlike snprintf(), teturn the number of characters actually written. */
+    if (bufsize) buf[bufsize-1] = '\0';
+    return strlen(buf);
+}
+
+size_t _dictGetStatsHt(char *buf, size_t bufsize, dict *d, dictht *ht, int tableid) {
     unsigned long i, slots = 0, chainlen, maxchainlen = 0;
     unsigned long totchainlen = 0;
     unsigned long clvector[DICT_STATS_VECTLEN];
@@ -1056,6 +1707,8 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
         return snprintf(buf,bufsize,
             "No stats available for empty dictionaries\n");
     }
+    if (dictIsOpenAddressing(d))
+        return _dictOaGetStatsHt(buf,bufsize,ht,tableid);
 
     /* Compute stats. */
     for (i = 0; i < DICT_STATS_VECTLEN; i++) clvector[i] = 0;
@@ -1112,16 +1765,201 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
     char *orig_buf = buf;
     size_t orig_bufsize = bufsize;
 
-    l = _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
+    l = _dictGetStatsHt(buf,bufsize,d,&d->ht[0],0);
     buf += l;
     bufsize -= l;
     if (dictIsRehashing(d) && bufsize > 0) {
-        _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
+        _dictGetStatsHt(buf,bufsize,d,&d->ht[1],1);
     }
     /* Make sure there is a NULL term at the end. */
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
 }
 
+#ifdef REDIS_TEST
+#define UNUSED(x) (void)(x)
+
+static uint64_t dictTestHash(const void *key) {
+    return dictGenHashFunction((unsigned char*)&key,sizeof(key));
+}
+
+static dictType dictTestType = {
+    dictTestHash, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 1
+};
+
+#define dictTestKey(j) ((void*)(uintptr_t)((j)+1))
+
+/* The keys that are rehashing must all fit the new table, with room left. */
+static void dictTestCheckRoom(dict *d) {
+    dictht *t1 = &d->ht[1];
+
+    if (!dictIsRehashing(d)) return;
+    assert(d->ht[0].used+t1->used+t1->deleted < t1->size-(t1->size>>4));
+}
+
+static void dictTestScanCallback(void *privdata, const dictEntry *de) {
+    UNUSED(de);
+    (*(long*)privdata)++;
+}
+
+int dictTest(int argc, char **argv) {
+    dictIterator *iter;
+    dict *d;
+    long j, count;
+    unsigned long cursor;
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    printf("Adding keys with a safe iterator while rehashing: "); {
+        dictEntry **slot;
+
+        d = dictCreate(&dictTestType,NULL);
+        for (j = 0; j < 1000; j++)
+            assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+        while(dictRehash(d,100));
+        for (; !dictIsRehashing(d); j++)
+            assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+
+        /* The new table can't change while the iterator is in use. */
+        iter = dictGetSafeIterator(d);
+        assert(dictNext(iter) != NULL);
+        slot = d->ht[1].table;
+        for (count = j+j/2; j < count; j++)
+            assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+        assert(d->ht[1].table == slot && dictIsRehashing(d));
+        for (j = 0; j < count; j++) assert(dictFind(d,dictTestKey(j)));
+        dictReleaseIterator(iter);
+
+        /* Once released, the rehashing completes before growing again. */
+        for (count = j+j*20; j < count; j++) {
+            assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+            dictTestCheckRoom(d);
+        }
+        assert((long)dictSize(d) == count);
+        for (j = 0; j < count; j++) assert(dictFind(d,dictTestKey(j)));
+
+        iter = dictGetSafeIterator(d);
+        for (j = 0; dictNext(iter); j++);
+        dictReleaseIterator(iter);
+        assert(j == count);
+        dictRelease(d);
+        printf("OK\n");
+    }
+
+    printf("Adding many keys with a safe iterator: "); {
+        int phase;
+
+        /* The iterator is either still visiting the old table, or already
+         * visiting the new one, when the keys added fill it up. */
+        for (phase = 0; phase < 2; phase++) {
+            long initial;
+            char *seen;
+
+            d = dictCreate(&dictTestType,NULL);
+            for (j = 0; j < 1000; j++)
+                assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+            while(dictRehash(d,100));
+            for (; !dictIsRehashing(d); j++)
+                assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+            initial = j;
+            seen = zcalloc(initial);
+
+            iter = dictGetSafeIterator(d);
+            do {
+                dictEntry *de = dictNext(iter);
+                long k = (long)(uintptr_t)dictGetKey(de)-1;
+
+                assert(!seen[k]);
+                seen[k] = 1;
+            } while(iter->table != phase);
+            for (count = initial*10; j < count; j++)
+                assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+            assert(dictIsRehashing(d));
+
+            /* Every element that was there from the start is returned
+             * exactly once. */
+            dictEntry *de;
+            while((de = dictNext(iter)) != NULL) {
+                long k = (long)(uintptr_t)dictGetKey(de)-1;
+
+                if (k >= initial) continue;
+                assert(!seen[k]);
+                seen[k] = 1;
+            }
+            dictReleaseIterator(iter);
+            for (long k = 0; k < initial; k++) assert(seen[k]);
+            zfree(seen);
+
+            /* Growing resumes once the iterator is released. */
+            for (count = j+initial*10; j < count; j++) {
+                assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+                dictTestCheckRoom(d);
+            }
+            for (j = 0; j < count; j++) assert(dictFind(d,dictTestKey(j)));
+            assert((long)dictSize(d) == count);
+
+            long scanned = 0;
+            cursor = 0;
+            do {
+                cursor = dictScan(d,cursor,dictTestScanCallback,NULL,&scanned);
+            } while(cursor);
+            assert(scanned >= count);
+            dictRelease(d);
+        }
+        printf("OK\n");
+    }
+
+    printf("Adding keys while shrinking: "); {
+        d = dictCreate(&dictTestType,NULL);
+        for (j = 0; j < 100000; j++)
+            assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+        while(dictRehash(d,100));
+        for (j = 100; j < 100000; j++)
+            assert(dictDelete(d,dictTestKey(j)) == DICT_OK);
+        assert(dictResize(d) == DICT_OK);
+        assert(d->ht[1].size == d->ht[0].size/4);
+
+        /* The rehashing of the sparse old table goes on incrementally,
+         * but completes before the new table is full. */
+        assert(dictAdd(d,dictTestKey(100),NULL) == DICT_OK);
+        assert(dictIsRehashing(d));
+        for (j = 101; j < 100000; j++) {
+            assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+            dictTestCheckRoom(d);
+        }
+        for (j = 0; j < 100000; j++) assert(dictFind(d,dictTestKey(j)));
+        dictRelease(d);
+        printf("OK\n");
+    }
+
+    printf("Scanning while rehashing: "); {
+        d = dictCreate(&dictTestType,NULL);
+        for (j = 0; j < 1000; j++)
+            assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+        while(dictRehash(d,100));
+        for (j = 1000; j < 100000; j += 2)
+            assert(dictAdd(d,dictTestKey(j),NULL) == DICT_OK);
+        for (j = 1000; j < 100000; j += 4)
+            assert(dictDelete(d,dictTestKey(j)) == DICT_OK);
+        while(dictRehash(d,100));
+        assert(dictExpand(d,dictSize(d)*2) == DICT_OK);
+
+        /* The tables don't change while scanning, so every element is
+         * reported exactly once, even if stored after a slot of another
+         * home slot. */
+        count = 0;
+        cursor = 0;
+        do {
+            cursor = dictScan(d,cursor,dictTestScanCallback,NULL,&count);
+        } while(cursor);
+        assert(count == (long)dictSize(d));
+        dictRelease(d);
+        printf("OK\n");
+    }
+    return 0;
+}
+#endif
+
 /* ------------------------------- Benchmark ---------------------------------*/
 
 #ifdef DICT_BENCHMARK_MAIN
@@ -3,7 +3,9 @@
  * This file implements in-memory hash tables with insert/del/replace/find/
  * get-random-element operations. Hash tables will auto-resize if needed
  * tables of power of two in size are used, collisions are handled by
- * chaining. See the source code for more information... :)
+ * chaining, or, for the dict types asking for it, with open addressing
+ * (linear probing of groups of slots, with one byte of metadata per slot).
+ * See the source code for more information... :)
  *
  * Copyright (c) 2006-2012, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -34,6 +36,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef __DICT_H
 #define __DICT_H
@@ -52,6 +55,9 @@ typedef struct dictEntry {
         int64_t s64;
         double d;
     } v;
+    /* Next entry of the same bucket. Entries of open addressing tables are
+     * not chained, and use this field to remember the hash of their key,
+     * see dict.c. */
     struct dictEntry *next;
 } dictEntry;
 
@@ -62,15 +68,32 @@ typedef struct dictType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    /* Optional: when set, the key is copied inside the dictEntry allocation
+     * on insertion, saving an allocation and a pointer chase per entry.
+     * keyEmbedSize() returns the bytes needed to store a copy of 'key' and
+     * keyEmbed() writes it in 'buf', returning the key to store in the
+     * entry. The key passed to dictAdd() is not retained by the dict, and
+     * keyDup/keyDestructor are not used. */
+    size_t (*keyEmbedSize)(const void *key);
+    void *(*keyEmbed)(void *buf, const void *key);
+    /* Optional: when non zero, collisions are handled with open addressing
+     * instead of chaining. This is faster for big dicts, but dictExpand()
+     * then means "room for size elements", see dict.c. */
+    int openAddressing;
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
- * implement incremental rehashing, for the old to the new table. */
+ * implement incremental rehashing, for the old to the new table.
+ *
+ * With open addressing 'table' is an array of 'size' slots, immediately
+ * followed (in the same allocation) by one control byte per slot, see
+ * dict.c for the details. */
 typedef struct dictht {
     dictEntry **table;
     unsigned long size;
     unsigned long sizemask;
     unsigned long used;
+    unsigned long deleted; /* Slots marked as deleted (open addressing). */
 } dictht;
 
 typedef struct dict {
@@ -79,6 +102,7 @@ typedef struct dict {
     dictht ht[2];
     long rehashidx; /* rehashing not in progress if rehashidx == -1 */
     unsigned long iterators; /* number of iterators currently running */
+    unsigned long iterators_ht1; /* safe iterators that reached ht[1] */
 } dict;
 
 /* If safe is set to 1 this is a safe iterator, that means, you can call
@@ -95,11 +119,21 @@ typedef struct dictIterator {
 } dictIterator;
 
 typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
+/* 'bucketref' is the head of a chain of entries, or, with open addressing,
+ * a slot holding a single entry. */
 typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* Number of slots whose control bytes are probed at once (open addressing). */
+#define DICT_GROUP_WIDTH         16
+
+/* Tables with at least this number of slots are allocated with mmap(),
+ * see dict.c. */
+#define DICT_TABLE_MMAP_MIN_SIZE (1<<18)
+#define dictTableIsMapped(size) ((size) >= DICT_TABLE_MMAP_MIN_SIZE)
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeVal(d, entry) \
     if ((d)->type->valDestructor) \
@@ -139,6 +173,7 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 
 #define dictHashKey(d, key) (d)->type->hashFunction(key)
 #define dictGetKey(he) ((he)->key)
+#define dictGetEmbedBuf(he) ((void*)((he)+1)) /* For types with keyEmbed. */
 #define dictGetVal(he) ((he)->v.val)
 #define dictGetSignedIntegerVal(he) ((he)->v.s64)
 #define dictGetUnsignedIntegerVal(he) ((he)->v.u64)
@@ -146,10 +181,16 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
+#define dictIsOpenAddressing(d) ((d)->type->openAddressing)
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
 int dictExpand(dict *d, unsigned long size);
+dictEntry **dictAllocTable(unsigned long size);
+void dictFreeTable(dictEntry **table, unsigned long size);
+void dictSetTableHugePages(int flags);
+int dictExpandWithTable(dict *d, unsigned long size, dictEntry **table);
+unsigned long dictGrowSizeHint(dict *d);
 int dictAdd(dict *d, void *key, void *val);
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing);
 dictEntry *dictAddOrFind(dict *d, void *key);
@@ -181,6 +222,10 @@ unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanB
 uint64_t dictGetHash(dict *d, const void *key);
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
 
+#ifdef REDIS_TEST
+int dictTest(int argc, char *argv[]);
+#endif
+
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
 extern dictType dictTypeHeapStrings;
@@ -157,14 +157,22 @@ void evictionPoolAlloc(void) {
  *
  * We insert keys on place in ascending order, so keys with the smaller
  * idle time are on the left, and keys with the higher idle time on the
- * right. */
+ * right.
+ *
+ * When expire-in-keyspace is enabled, volatile policies pass a NULL
+ * 'sampledict': keys are sampled from the volatile keys index of the DB,
+ * which already references the keyspace entries. */
 
 void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, 
                                             struct evictionPoolEntry *pool) {
     int j, k, count;
     dictEntry *samples[server.maxmemory_samples];//maxmemory_samples default=5
 
-    count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    if (sampledict)
+        count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    else
+        count = volatileKeysGetSome(server.db+dbid,samples,
+                                    server.maxmemory_samples);
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
@@ -178,7 +186,8 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict,
          * dictionary (but the expires one) we need to lookup the key
          * again in the key dictionary to obtain the value object. */
         if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = dictFind(keydict, key);
+            if (sampledict && sampledict != keydict)
+                de = dictFind(keydict, key);
             o = dictGetVal(de);
         }
 
@@ -198,7 +207,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict,
             idle = 255-LFUDecrAndReturn(o);
         } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
             /* In this case the sooner the expire the better. */
-            idle = ULLONG_MAX - (long)dictGetVal(de);
+            idle = ULLONG_MAX - expireEntryGetTime(de);
         } else {
             serverPanic("Unknown eviction policy in evictionPoolPopulate()");
         }
@@ -518,9 +527,14 @@ int freeMemoryIfNeeded(void) {
                  * every DB. */
                 for (i = 0; i < server.dbnum; i++) {
                     db = server.db+i;//指向第i个db
-                    dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
-                            db->dict : db->expires;//所有的key还是有生命限制的key
-                    if ((keys = dictSize(dict)) != 0) {
+                    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
+                        dict = db->dict;
+                        keys = dictSize(dict);
+                    } else {
+                        dict = server.expire_in_keyspace ? NULL : db->expires;
+                        keys = dbVolatileKeysCount(db);
+                    }//所有的key还是有生命限制的key
+                    if (keys != 0) {
                         //lfu和lru在这里区分
                         evictionPoolPopulate(i, dict, db->dict, pool);
                         total_keys += keys;
@@ -541,7 +555,7 @@ int freeMemoryIfNeeded(void) {
                         de = dictFind(server.db[pool[k].dbid].dict,
                             pool[k].key);
                     } else {
-                        de = dictFind(server.db[pool[k].dbid].expires,
+                        de = dbFindExpireEntry(server.db+pool[k].dbid,
                             pool[k].key);
                     }
 
@@ -573,10 +587,16 @@ int freeMemoryIfNeeded(void) {
             for (i = 0; i < server.dbnum; i++) {
                 j = (++next_db) % server.dbnum;
                 db = server.db+j;
-                dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
-                        db->dict : db->expires;
-                if (dictSize(dict) != 0) {
-                    de = dictGetRandomKey(dict);
+                if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) {
+                    dict = db->dict;
+                    de = dictSize(dict) ? dictGetRandomKey(dict) : NULL;
+                } else if (server.expire_in_keyspace) {
+                    de = volatileKeysRandom(db);
+                } else {
+                    dict = db->expires;
+                    de = dictSize(dict) ? dictGetRandomKey(dict) : NULL;
+                }
+                if (de) {
                     bestkey = dictGetKey(de);
                     bestdbid = j;
                     break;
@@ -40,9 +40,174 @@
  * if no access is performed on them.
  *----------------------------------------------------------------------------*/
 
+/*-----------------------------------------------------------------------------
+ * Index of volatile keys when expires are stored in the keyspace.
+ *
+ * With expire-in-keyspace enabled the expire time of every key lives in a
+ * keyMeta header embedded in its db->dict entry, and db->expires stays empty.
+ * Active expiry and the volatile eviction policies still need to sample only
+ * among keys having an expire set, so we keep a compact array of pointers to
+ * such entries. Every volatile entry remembers its position in the array
+ * (keyMeta.vpos) so that removal is O(1): the last element is moved in the
+ * hole left by the deleted one.
+ *----------------------------------------------------------------------------*/
+
+#define VOLATILE_KEYS_MIN_SIZE 16
+
+static void volatileKeysResize(volatileKeys *vk, unsigned long size) {
+    vk->entries = zrealloc(vk->entries,sizeof(dictEntry*)*size);
+    vk->size = size;
+}
+
+/* Add the keyspace entry 'de' to the volatile keys index of 'db'. The caller
+ * should make sure the entry is not already indexed. */
+void volatileKeysAdd(redisDb *db, dictEntry *de) {
+    volatileKeys *vk = &db->volatile_keys;
+
+    if (vk->len == vk->size)
+        volatileKeysResize(vk,vk->size ? vk->size*2 : VOLATILE_KEYS_MIN_SIZE);
+    dictEntryKeyMeta(de)->vpos = vk->len;
+    vk->entries[vk->len++] = de;
+}
+
+/* Remove the keyspace entry 'de' from the volatile keys index of 'db'. */
+void volatileKeysDelete(redisDb *db, dictEntry *de) {
+    volatileKeys *vk = &db->volatile_keys;
+    unsigned long pos = dictEntryKeyMeta(de)->vpos;
+
+    serverAssert(pos < vk->len && vk->entries[pos] == de);
+    vk->len--;
+    if (pos != vk->len) {
+        vk->entries[pos] = vk->entries[vk->len];
+        dictEntryKeyMeta(vk->entries[pos])->vpos = pos;
+    }
+    if (vk->size > VOLATILE_KEYS_MIN_SIZE && vk->len < vk->size/4)
+        volatileKeysResize(vk,vk->size/2);
+}
+
+/* Release the whole index. Used when the keyspace is flushed. */
+void volatileKeysEmpty(redisDb *db) {
+    zfree(db->volatile_keys.entries);
+    db->volatile_keys.entries = NULL;
+    db->volatile_keys.len = 0;
+    db->volatile_keys.size = 0;
+}
+
+/* Return a random keyspace entry having an expire set, or NULL if there
+ * are no volatile keys in 'db'. */
+dictEntry *volatileKeysRandom(redisDb *db) {
+    volatileKeys *vk = &db->volatile_keys;
+
+    if (vk->len == 0) return NULL;
+    return vk->entries[random() % vk->len];
+}
+
+/* Like dictGetSomeKeys(): store up to 'count' volatile entries starting
+ * from a random position of the index into 'des', and return the number of
+ * entries stored. */
+unsigned int volatileKeysGetSome(redisDb *db, dictEntry **des,
+                                 unsigned int count)
+{
+    volatileKeys *vk = &db->volatile_keys;
+    unsigned long j, pos;
+
+    if (count > vk->len) count = vk->len;
+    if (count == 0) return 0;
+    pos = random() % vk->len;
+    for (j = 0; j < count; j++) {
+        des[j] = vk->entries[pos];
+        if (++pos == vk->len) pos = 0;
+    }
+    return count;
+}
+
+/*-----------------------------------------------------------------------------
+ * Index of volatile keys ordered by expire time.
+ *
+ * With active-expire-index enabled every DB keeps a radix tree of its
+ * volatile keys, where each element is the expire time, as a 64 bit big
+ * endian integer, followed by the key name. Walking the tree from the first
+ * element visits keys in expire order, so the active expire cycle is able
+ * to delete exactly the keys already expired instead of sampling random
+ * keys hoping to find some.
+ *----------------------------------------------------------------------------*/
+
+#define EXPIRE_INDEX_TIME_LEN 8
+
+static void expireIndexUpdateKey(redisDb *db, sds key, size_t keylen,
+                                 long long when, int add)
+{
+    unsigned char buf[64];
+    unsigned char *indexed = buf;
+    /* Flip the sign bit so that the unsigned big endian order of the
+     * encoded time matches the signed order of 'when'. */
+    uint64_t t = (uint64_t)when ^ (1ULL<<63);
+    int j;
+
+    if (keylen+EXPIRE_INDEX_TIME_LEN > sizeof(buf))
+        indexed = zmalloc(keylen+EXPIRE_INDEX_TIME_LEN);
+    for (j = 0; j < EXPIRE_INDEX_TIME_LEN; j++)
+        indexed[j] = (t >> (56-j*8)) & 0xff;
+    memcpy(indexed+EXPIRE_INDEX_TIME_LEN,key,keylen);
+    if (add) {
+        raxInsert(db->expires_index,indexed,keylen+EXPIRE_INDEX_TIME_LEN,
+                  NULL,NULL);
+    } else {
+        raxRemove(db->expires_index,indexed,keylen+EXPIRE_INDEX_TIME_LEN,
+                  NULL);
+    }
+    if (indexed != buf) zfree(indexed);
+}
+
+static long long expireIndexGetTime(unsigned char *indexed) {
+    uint64_t t = 0;
+    int j;
+
+    for (j = 0; j < EXPIRE_INDEX_TIME_LEN; j++) t = (t << 8) | indexed[j];
+    return (long long)(t ^ (1ULL<<63));
+}
+
+/* Index 'key' as expiring at 'when'. The caller should remove the previous
+ * expire time of the key from the index, if any, before calling this
+ * function. */
+void expireIndexAdd(redisDb *db, robj *key, long long when) {
+    expireIndexUpdateKey(db,key->ptr,sdslen(key->ptr),when,1);
+}
+
+/* Remove 'key' from the index if it has an expire set. Should be called
+ * before the expire of the key is changed or removed, and before the key
+ * is deleted. */
+void expireIndexRemove(redisDb *db, robj *key) {
+    long long when = getExpire(db,key);
+
+    if (when != -1)
+        expireIndexUpdateKey(db,key->ptr,sdslen(key->ptr),when,0);
+}
+
+/* Remove all the elements from the index. */
+void expireIndexEmpty(redisDb *db) {
+    if (db->expires_index == NULL) return;
+    raxFree(db->expires_index);
+    db->expires_index = raxNew();
+}
+
+/* Delete the expired key 'keyobj' from 'db', propagating the deletion to
+ * AOF and replicas and firing the "expired" event. */
+static void activeExpireDeleteKey(redisDb *db, robj *keyobj) {
+    propagateExpire(db,keyobj,server.lazyfree_lazy_expire);
+    if (server.lazyfree_lazy_expire)
+        dbAsyncDelete(db,keyobj);
+    else
+        dbSyncDelete(db,keyobj);
+    notifyKeyspaceEvent(NOTIFY_EXPIRED,
+        "expired",keyobj,db->id);
+    server.stat_expiredkeys++;
+}
+
 /* Helper function for the activeExpireCycle() function.
  * This function will try to expire the key that is stored in the hash table
- * entry 'de' of the 'expires' hash table of a Redis database.
+ * entry 'de' of the 'expires' hash table of a Redis database (or the
+ * keyspace entry itself when expire-in-keyspace is enabled).
  *
  * If the key is found to be expired, it is removed from the database and
  * 1 is returned. Otherwise no operation is performed and 0 is returned.
@@ -52,26 +217,91 @@
  * The parameter 'now' is the current time in milliseconds as is passed
  * to the function to avoid too many gettimeofday() syscalls. */
 int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
-    long long t = dictGetSignedIntegerVal(de);
+    long long t = expireEntryGetTime(de);
     if (now > t) {
         sds key = dictGetKey(de);
         robj *keyobj = createStringObject(key,sdslen(key));
 
-        propagateExpire(db,keyobj,server.lazyfree_lazy_expire);
-        if (server.lazyfree_lazy_expire)
-            dbAsyncDelete(db,keyobj);
-        else
-            dbSyncDelete(db,keyobj);
-        notifyKeyspaceEvent(NOTIFY_EXPIRED,
-            "expired",keyobj,db->id);
+        activeExpireDeleteKey(db,keyobj);
         decrRefCount(keyobj);
-        server.stat_expiredkeys++;
         return 1;
     } else {
         return 0;
     }
 }
 
+/* Update the average TTL stats of 'db' with the average of the TTLs
+ * sampled in the current cycle. */
+static void updateAvgTTL(redisDb *db, long long avg_ttl) {
+    /* Do a simple running average with a few samples.
+     * We just use the current estimate with a weight of 2%
+     * and the previous estimate with a weight of 98%. */
+    if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
+    db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);
+}
+
+/* When the expire index is used we no longer sample random keys, so just
+ * pick one to keep the average TTL stats of 'db' updated. */
+static void activeExpireSampleAvgTTL(redisDb *db) {
+    dictEntry *de;
+
+    if (dbVolatileKeysCount(db) == 0) {
+        db->avg_ttl = 0;
+        return;
+    }
+    if (server.expire_in_keyspace)
+        de = volatileKeysRandom(db);
+    else
+        de = dictGetRandomKey(db->expires);
+    long long ttl = expireEntryGetTime(de)-mstime();
+    if (ttl > 0) updateAvgTTL(db,ttl);
+}
+
+/* Helper function for the activeExpireCycle() function, used when the
+ * expire index is enabled. Delete the keys of 'db' that are already expired
+ * in expire time order, until there are no more expired keys or the time
+ * limit is reached. The number of expired keys is returned, and
+ * '*timedout' is set to 1 if we stopped because of the time limit.
+ *
+ * Since the deleted keys are removed from the index, at every iteration the
+ * first element of the index is the next candidate. */
+static long activeExpireIndexCycle(redisDb *db, long long start,
+                                   long long timelimit, int *timedout)
+{
+    long long now = mstime();
+    long expired = 0, visited = 0;
+    raxIterator ri;
+
+    raxStart(&ri,db->expires_index);
+    while(1) {
+        raxSeek(&ri,"^",NULL,0);
+        if (!raxNext(&ri)) break;
+
+        long long when = expireIndexGetTime(ri.key);
+        if (now <= when) break; /* Next keys expire later. */
+
+        size_t keylen = ri.key_len-EXPIRE_INDEX_TIME_LEN;
+        robj *keyobj = createStringObject((char*)ri.key+EXPIRE_INDEX_TIME_LEN,
+                                          keylen);
+        if (getExpire(db,keyobj) == when) {
+            activeExpireDeleteKey(db,keyobj);
+            expired++;
+        } else {
+            /* Should never happen, but make sure we don't delete a key
+             * because of a stale element, nor loop forever on it. */
+            expireIndexUpdateKey(db,keyobj->ptr,keylen,when,0);
+        }
+        decrRefCount(keyobj);
+
+        if ((++visited & 0xf) == 0 && ustime()-start > timelimit) {
+            *timedout = 1;
+            break;
+        }
+    }
+    raxStop(&ri);
+    return expired;
+}
+
 /* Try to expire a few timed out keys. The algorithm used is adaptive and
  * will use few CPU cycles if there are few expiring keys, otherwise
  * it will get more aggressive to avoid that too much memory is used by
@@ -155,6 +385,15 @@ void activeExpireCycle(int type) {
          * distribute the time evenly across DBs. */
         current_db++;
 
+        /* With the expire index we don't need to sample: the expired keys
+         * are exactly the first elements of the index. */
+        if (db->expires_index) {
+            activeExpireIndexCycle(db,start,timelimit,&timelimit_exit);
+            if (timelimit_exit) server.stat_expired_time_cap_reached_count++;
+            activeExpireSampleAvgTTL(db);
+            continue;
+        }
+
         /* Continue to expire if at the end of the cycle more than 25%
          * of the keys were expired. */
         do {
@@ -164,18 +403,21 @@ void activeExpireCycle(int type) {
             iteration++;
 
             /* If there is nothing to expire try next DB ASAP. */
-            if ((num = dictSize(db->expires)) == 0) {
+            if ((num = dbVolatileKeysCount(db)) == 0) {
                 db->avg_ttl = 0;
                 break;
             }
-            slots = dictSlots(db->expires);
             now = mstime();
 
             /* When there are less than 1% filled slots getting random
              * keys is expensive, so stop here waiting for better times...
-             * The dictionary will be resized asap. */
-            if (num && slots > DICT_HT_INITIAL_SIZE &&
-                (num*100/slots < 1)) break;
+             * The dictionary will be resized asap. Sampling the volatile
+             * keys index is always O(1) so there is no such issue there. */
+            if (!server.expire_in_keyspace) {
+                slots = dictSlots(db->expires);
+                if (num && slots > DICT_HT_INITIAL_SIZE &&
+                    (num*100/slots < 1)) break;
+            }
 
             /* The main collection cycle. Sample random keys among keys
              * with an expire set, checking for expired ones. */
@@ -190,8 +432,12 @@ void activeExpireCycle(int type) {
                 dictEntry *de;
                 long long ttl;
 
-                if ((de = dictGetRandomKey(db->expires)) == NULL) break;
-                ttl = dictGetSignedIntegerVal(de)-now;
+                if (server.expire_in_keyspace)
+                    de = volatileKeysRandom(db);
+                else
+                    de = dictGetRandomKey(db->expires);
+                if (de == NULL) break;
+                ttl = expireEntryGetTime(de)-now;
                 if (activeExpireCycleTryExpire(db,de,now)) expired++;
                 if (ttl > 0) {
                     /* We want the average TTL of keys yet not expired. */
@@ -203,15 +449,7 @@ void activeExpireCycle(int type) {
             total_expired += expired;
 
             /* Update the average TTL stats for this database. */
-            if (ttl_samples) {
-                long long avg_ttl = ttl_sum/ttl_samples;
-
-                /* Do a simple running average with a few samples.
-                 * We just use the current estimate with a weight of 2%
-                 * and the previous estimate with a weight of 98%. */
-                if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
-                db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);
-            }
+            if (ttl_samples) updateAvgTTL(db,ttl_sum/ttl_samples);
 
             /* We can't block forever here even if there are many keys to
              * expire. So after a given amount of milliseconds return to the
@@ -300,7 +538,7 @@ void expireSlaveKeys(void) {
         while(dbids && dbid < server.dbnum) {
             if ((dbids & 1) != 0) {
                 redisDb *db = server.db+dbid;
-                dictEntry *expire = dictFind(db->expires,keyname);
+                dictEntry *expire = dbFindExpireEntry(db,keyname);
                 int expired = 0;
 
                 if (expire &&
@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* An intmap is a map from binary safe fields to integers, used to encode
+ * small hashes whose values are all integers. Everything lives in a single
+ * allocation, like an intset:
+ *
+ * <header> <values> <offsets> <fields>
+ *
+ * Fields are kept in lexicographical order (the same order as sdscmp()), so
+ * lookups are binary searches. <values> is an array of 'length' integers,
+ * all using the same size, selected like intset does: the array is upgraded
+ * to a larger type when a value needing it is stored. The value of the
+ * field at position N is values[N], so integer updates such as HINCRBY
+ * happen in place. <offsets> is an array of 'length' uint32_t with the
+ * position of every field inside <fields>, where the names are stored
+ * back to back: the length of a field is the distance to the next offset
+ * (or to 'fieldbytes' for the last field).
+ *
+ * Intmaps are never serialized as they are, so everything is stored in
+ * host byte order. Values and offsets are not guaranteed to be aligned and
+ * are always accessed with memcpy(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intmap.h"
+#include "zmalloc.h"
+
+/* Note that these encodings are ordered, so:
+ * INTMAP_ENC_INT16 < INTMAP_ENC_INT32 < INTMAP_ENC_INT64. */
+#define INTMAP_ENC_INT16 (sizeof(int16_t))
+#define INTMAP_ENC_INT32 (sizeof(int32_t))
+#define INTMAP_ENC_INT64 (sizeof(int64_t))
+
+#define INTMAP_OFFSET_SIZE (sizeof(uint32_t))
+
+/* Return the required encoding for the provided value. */
+static uint8_t _intmapValueEncoding(int64_t v) {
+    if (v < INT32_MIN || v > INT32_MAX)
+        return INTMAP_ENC_INT64;
+    else if (v < INT16_MIN || v > INT16_MAX)
+        return INTMAP_ENC_INT32;
+    else
+        return INTMAP_ENC_INT16;
+}
+
+/* Return the value at pos, given an encoding. */
+static int64_t _intmapGetEncoded(intmap *im, uint32_t pos, uint8_t enc) {
+    int64_t v64;
+    int32_t v32;
+    int16_t v16;
+
+    if (enc == INTMAP_ENC_INT64) {
+        memcpy(&v64,((int64_t*)im->contents)+pos,sizeof(v64));
+        return v64;
+    } else if (enc == INTMAP_ENC_INT32) {
+        memcpy(&v32,((int32_t*)im->contents)+pos,sizeof(v32));
+        return v32;
+    } else {
+        memcpy(&v16,((int16_t*)im->contents)+pos,sizeof(v16));
+        return v16;
+    }
+}
+
+/* Set the value at pos, given an encoding. */
+static void _intmapSetEncoded(intmap *im, uint32_t pos, int64_t value,
+                              uint8_t enc)
+{
+    int64_t v64 = value;
+    int32_t v32 = value;
+    int16_t v16 = value;
+
+    if (enc == INTMAP_ENC_INT64)
+        memcpy(((int64_t*)im->contents)+pos,&v64,sizeof(v64));
+    else if (enc == INTMAP_ENC_INT32)
+        memcpy(((int32_t*)im->contents)+pos,&v32,sizeof(v32));
+    else
+        memcpy(((int16_t*)im->contents)+pos,&v16,sizeof(v16));
+}
+
+/* Read and write the entry 'i' of an offsets array. */
+static uint32_t _intmapOffsetAt(unsigned char *offsets, uint32_t i) {
+    uint32_t off;
+    memcpy(&off,offsets+i*INTMAP_OFFSET_SIZE,sizeof(off));
+    return off;
+}
+
+static void _intmapSetOffsetAt(unsigned char *offsets, uint32_t i,
+                               uint32_t off)
+{
+    memcpy(offsets+i*INTMAP_OFFSET_SIZE,&off,sizeof(off));
+}
+
+/* Return the start of the offsets and of the fields sections. */
+static unsigned char *_intmapOffsets(intmap *im) {
+    return (unsigned char*)im->contents + im->length*im->encoding;
+}
+
+static unsigned char *_intmapFields(intmap *im) {
+    return _intmapOffsets(im) + im->length*INTMAP_OFFSET_SIZE;
+}
+
+/* Compare two fields with the same semantic of sdscmp(). */
+static int _intmapCompare(unsigned char *a, uint32_t alen,
+                          unsigned char *b, uint32_t blen)
+{
+    uint32_t minlen = (alen < blen) ? alen : blen;
+    int cmp = memcmp(a,b,minlen);
+    if (cmp == 0) return (alen < blen) ? -1 : (alen > blen);
+    return cmp;
+}
+
+/* Create an empty intmap. */
+intmap *intmapNew(void) {
+    intmap *im = zmalloc(sizeof(intmap));
+    im->encoding = INTMAP_ENC_INT16;
+    im->length = 0;
+    im->fieldbytes = 0;
+    return im;
+}
+
+/* Return by reference the field stored at pos. */
+void intmapGetField(intmap *im, uint32_t pos, unsigned char **field,
+                    uint32_t *flen)
+{
+    unsigned char *offsets = _intmapOffsets(im);
+    uint32_t off = _intmapOffsetAt(offsets,pos);
+    uint32_t end = (pos+1 < im->length) ? _intmapOffsetAt(offsets,pos+1) :
+                                          im->fieldbytes;
+
+    *field = _intmapFields(im)+off;
+    *flen = end-off;
+}
+
+/* Search for "field". Return 1 when the field was found and sets "pos" to
+ * its position within the intmap. Return 0 when the field is not present
+ * and sets "pos" to the position where it can be inserted. */
+int intmapFind(intmap *im, unsigned char *field, uint32_t flen,
+               uint32_t *pos)
+{
+    int min = 0, max = (int)im->length-1, mid, cmp;
+    unsigned char *cur;
+    uint32_t curlen;
+
+    while(max >= min) {
+        mid = ((unsigned int)min + (unsigned int)max) >> 1;
+        intmapGetField(im,mid,&cur,&curlen);
+        cmp = _intmapCompare(field,flen,cur,curlen);
+        if (cmp > 0) {
+            min = mid+1;
+        } else if (cmp < 0) {
+            max = mid-1;
+        } else {
+            if (pos) *pos = mid;
+            return 1;
+        }
+    }
+    if (pos) *pos = min;
+    return 0;
+}
+
+/* Upgrades the values of the intmap to a larger encoding. */
+static intmap *intmapUpgrade(intmap *im, uint8_t newenc) {
+    uint8_t curenc = im->encoding;
+    uint32_t length = im->length;
+    size_t tail = length*INTMAP_OFFSET_SIZE+im->fieldbytes;
+
+    im = zrealloc(im,sizeof(intmap)+length*newenc+tail);
+    memmove(im->contents+length*newenc,im->contents+length*curenc,tail);
+    im->encoding = newenc;
+
+    /* Upgrade back-to-front so we don't overwrite values. */
+    while(length--)
+        _intmapSetEncoded(im,length,_intmapGetEncoded(im,length,curenc),
+                          newenc);
+    return im;
+}
+
+/* Insert a new field at pos, that must be the position returned by
+ * intmapFind() for the same field. */
+static intmap *intmapInsert(intmap *im, uint32_t pos, unsigned char *field,
+                            uint32_t flen, int64_t value)
+{
+    uint8_t valenc = _intmapValueEncoding(value);
+    uint32_t enc, len, fb, off, j;
+    unsigned char *base, *oldoffsets, *oldfields, *offsets, *fields;
+
+    if (valenc > im->encoding) im = intmapUpgrade(im,valenc);
+    enc = im->encoding;
+    len = im->length;
+    fb = im->fieldbytes;
+
+    im = zrealloc(im,sizeof(intmap)+(len+1)*(enc+INTMAP_OFFSET_SIZE)+
+                     fb+flen);
+    base = (unsigned char*)im->contents;
+    oldoffsets = base+len*enc;
+    oldfields = oldoffsets+len*INTMAP_OFFSET_SIZE;
+    offsets = base+(len+1)*enc;
+    fields = offsets+(len+1)*INTMAP_OFFSET_SIZE;
+    off = (pos < len) ? _intmapOffsetAt(oldoffsets,pos) : fb;
+
+    /* Every section moves to the right, so handle them back-to-front:
+     * fields, then offsets, then values. */
+    memmove(fields+off+flen,oldfields+off,fb-off);
+    memmove(fields,oldfields,off);
+    memcpy(fields+off,field,flen);
+
+    memmove(offsets+(pos+1)*INTMAP_OFFSET_SIZE,
+            oldoffsets+pos*INTMAP_OFFSET_SIZE,(len-pos)*INTMAP_OFFSET_SIZE);
+    memmove(offsets,oldoffsets,pos*INTMAP_OFFSET_SIZE);
+    _intmapSetOffsetAt(offsets,pos,off);
+    for (j = pos+1; j <= len; j++)
+        _intmapSetOffsetAt(offsets,j,_intmapOffsetAt(offsets,j)+flen);
+
+    memmove(base+(pos+1)*enc,base+pos*enc,(len-pos)*enc);
+    im->length = len+1;
+    im->fieldbytes = fb+flen;
+    _intmapSetEncoded(im,pos,value,enc);
+    return im;
+}
+
+/* Set the value of the field at pos. The intmap is upgraded to a larger
+ * encoding if needed, otherwise the value is updated in place. */
+intmap *intmapSetValue(intmap *im, uint32_t pos, int64_t value) {
+    uint8_t valenc = _intmapValueEncoding(value);
+
+    if (valenc > im->encoding) im = intmapUpgrade(im,valenc);
+    _intmapSetEncoded(im,pos,value,im->encoding);
+    return im;
+}
+
+/* Return the value of the field at pos. */
+int64_t intmapGetValue(intmap *im, uint32_t pos) {
+    return _intmapGetEncoded(im,pos,im->encoding);
+}
+
+/* Add a field, or overwrite the value of an existing one. If 'update' is
+ * not NULL it is set to 1 when the field already existed, 0 otherwise. */
+intmap *intmapSet(intmap *im, unsigned char *field, uint32_t flen,
+                  int64_t value, int *update)
+{
+    uint32_t pos;
+
+    if (intmapFind(im,field,flen,&pos)) {
+        if (update) *update = 1;
+        return intmapSetValue(im,pos,value);
+    }
+    if (update) *update = 0;
+    return intmapInsert(im,pos,field,flen,value);
+}
+
+/* Delete a field. If 'deleted' is not NULL it is set to 1 when the field
+ * was found, 0 otherwise. */
+intmap *intmapDelete(intmap *im, unsigned char *field, uint32_t flen,
+                     int *deleted)
+{
+    uint32_t pos, enc, len, fb, off, end, dlen, j;
+    unsigned char *base, *oldoffsets, *oldfields, *offsets, *fields;
+
+    if (!intmapFind(im,field,flen,&pos)) {
+        if (deleted) *deleted = 0;
+        return im;
+    }
+    if (deleted) *deleted = 1;
+
+    enc = im->encoding;
+    len = im->length;
+    fb = im->fieldbytes;
+    base = (unsigned char*)im->contents;
+    oldoffsets = base+len*enc;
+    oldfields = oldoffsets+len*INTMAP_OFFSET_SIZE;
+    offsets = base+(len-1)*enc;
+    fields = offsets+(len-1)*INTMAP_OFFSET_SIZE;
+    off = _intmapOffsetAt(oldoffsets,pos);
+    end = (pos+1 < len) ? _intmapOffsetAt(oldoffsets,pos+1) : fb;
+    dlen = end-off;
+
+    /* Every section moves to the left, so handle them front-to-back:
+     * values, then offsets, then fields. */
+    memmove(base+pos*enc,base+(pos+1)*enc,(len-pos-1)*enc);
+
+    memmove(offsets,oldoffsets,pos*INTMAP_OFFSET_SIZE);
+    memmove(offsets+pos*INTMAP_OFFSET_SIZE,
+            oldoffsets+(pos+1)*INTMAP_OFFSET_SIZE,
+            (len-pos-1)*INTMAP_OFFSET_SIZE);
+    for (j = pos; j < len-1; j++)
+        _intmapSetOffsetAt(offsets,j,_intmapOffsetAt(offsets,j)-dlen);
+
+    memmove(fields,oldfields,off);
+    memmove(fields+off,oldfields+end,fb-end);
+
+    im->length = len-1;
+    im->fieldbytes = fb-dlen;
+    return zrealloc(im,intmapBlobLen(im));
+}
+
+/* Return intmap length */
+uint32_t intmapLen(const intmap *im) {
+    return im->length;
+}
+
+/* Return intmap blob size in bytes. */
+size_t intmapBlobLen(intmap *im) {
+    return sizeof(intmap)+im->length*(im->encoding+INTMAP_OFFSET_SIZE)+
+           im->fieldbytes;
+}
+
+#ifdef REDIS_TEST
+#include <time.h>
+
+static void ok(void) {
+    printf("OK\n");
+}
+
+#define assert(_e) ((_e)?(void)0:(_assert(#_e,__FILE__,__LINE__),exit(1)))
+static void _assert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+static void checkConsistency(intmap *im) {
+    unsigned char *f1, *f2;
+    uint32_t l1, l2, total = 0;
+
+    for (uint32_t i = 0; i < im->length; i++) {
+        intmapGetField(im,i,&f1,&l1);
+        total += l1;
+        if (i+1 == im->length) break;
+        intmapGetField(im,i+1,&f2,&l2);
+        assert(_intmapCompare(f1,l1,f2,l2) < 0);
+    }
+    assert(total == im->fieldbytes);
+}
+
+static int64_t lookup(intmap *im, char *field, int *found) {
+    uint32_t pos;
+    *found = intmapFind(im,(unsigned char*)field,strlen(field),&pos);
+    return *found ? intmapGetValue(im,pos) : 0;
+}
+
+#define UNUSED(x) (void)(x)
+int intmapTest(int argc, char **argv) {
+    int update, deleted, found;
+    intmap *im;
+    srand(time(NULL));
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    printf("Basic set and get: "); {
+        im = intmapNew();
+        im = intmapSet(im,(unsigned char*)"b",1,2,&update); assert(!update);
+        im = intmapSet(im,(unsigned char*)"a",1,1,&update); assert(!update);
+        im = intmapSet(im,(unsigned char*)"ab",2,3,&update); assert(!update);
+        im = intmapSet(im,(unsigned char*)"",0,4,&update); assert(!update);
+        im = intmapSet(im,(unsigned char*)"b",1,5,&update); assert(update);
+        assert(intmapLen(im) == 4);
+        assert(lookup(im,"a",&found) == 1 && found);
+        assert(lookup(im,"ab",&found) == 3 && found);
+        assert(lookup(im,"b",&found) == 5 && found);
+        assert(lookup(im,"",&found) == 4 && found);
+        lookup(im,"c",&found); assert(!found);
+        checkConsistency(im);
+        zfree(im);
+        ok();
+    }
+
+    printf("Upgrade to int32 and int64: "); {
+        im = intmapNew();
+        im = intmapSet(im,(unsigned char*)"x",1,-32768,NULL);
+        im = intmapSet(im,(unsigned char*)"y",1,32767,NULL);
+        assert(im->encoding == INTMAP_ENC_INT16);
+        im = intmapSet(im,(unsigned char*)"z",1,65535,NULL);
+        assert(im->encoding == INTMAP_ENC_INT32);
+        im = intmapSetValue(im,0,-4294967295);
+        assert(im->encoding == INTMAP_ENC_INT64);
+        assert(lookup(im,"x",&found) == -4294967295);
+        assert(lookup(im,"y",&found) == 32767);
+        assert(lookup(im,"z",&found) == 65535);
+        checkConsistency(im);
+        zfree(im);
+        ok();
+    }
+
+    printf("Stress set+delete: "); {
+        int64_t values[1000];
+        int present[1000] = {0};
+        char buf[32];
+
+        im = intmapNew();
+        for (int i = 0; i < 100000; i++) {
+            int j = rand() % 1000;
+            int len = snprintf(buf,sizeof(buf),"field:%d",j);
+
+            if (rand() % 3) {
+                int64_t v = ((int64_t)rand() << 16) - rand();
+                im = intmapSet(im,(unsigned char*)buf,len,v,&update);
+                assert(update == present[j]);
+                values[j] = v;
+                present[j] = 1;
+            } else {
+                im = intmapDelete(im,(unsigned char*)buf,len,&deleted);
+                assert(deleted == present[j]);
+                present[j] = 0;
+            }
+        }
+        checkConsistency(im);
+        for (int j = 0; j < 1000; j++) {
+            int64_t v;
+            snprintf(buf,sizeof(buf),"field:%d",j);
+            v = lookup(im,buf,&found);
+            assert(found == present[j]);
+            if (found) assert(v == values[j]);
+        }
+        zfree(im);
+        ok();
+    }
+
+    return 0;
+}
+#endif
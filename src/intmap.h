@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __INTMAP_H
+#define __INTMAP_H
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct intmap {
+    uint32_t encoding;      /* Size in bytes of every value: 2, 4 or 8. */
+    uint32_t length;        /* Number of fields. */
+    uint32_t fieldbytes;    /* Total length of the field names. */
+    int8_t contents[];
+} intmap;
+
+intmap *intmapNew(void);
+intmap *intmapSet(intmap *im, unsigned char *field, uint32_t flen, int64_t value, int *update);
+intmap *intmapDelete(intmap *im, unsigned char *field, uint32_t flen, int *deleted);
+int intmapFind(intmap *im, unsigned char *field, uint32_t flen, uint32_t *pos);
+int64_t intmapGetValue(intmap *im, uint32_t pos);
+intmap *intmapSetValue(intmap *im, uint32_t pos, int64_t value);
+void intmapGetField(intmap *im, uint32_t pos, unsigned char **field, uint32_t *flen);
+uint32_t intmapLen(const intmap *im);
+size_t intmapBlobLen(intmap *im);
+
+#ifdef REDIS_TEST
+int intmapTest(int argc, char *argv[]);
+#endif
+
+#endif // __INTMAP_H
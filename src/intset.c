@@ -281,6 +281,240 @@ size_t intsetBlobLen(intset *is) {
     return sizeof(intset)+intrev32ifbe(is->length)*intrev32ifbe(is->encoding);
 }
 
+/* ----------------------------- Set operations ----------------------------- */
+
+/* When a set is this many times bigger than the other one, intersections and
+ * differences don't walk it: the elements of the small set are searched in
+ * it with an exponential search, starting from the previous match. */
+#define INTSET_GALLOP_RATIO 32
+
+/* Create an intset with the given encoding and room for 'len' elements. The
+ * caller fills it and sets the final length with intsetTruncate(). */
+static intset *intsetNewLen(uint8_t encoding, uint32_t len) {
+    intset *is = zmalloc(sizeof(intset)+len*encoding);
+    is->encoding = intrev32ifbe(encoding);
+    is->length = 0;
+    return is;
+}
+
+/* Set the length of an intset created by intsetNewLen() to 'len', releasing
+ * the unused memory. */
+static intset *intsetTruncate(intset *is, uint32_t len) {
+    is->length = intrev32ifbe(len);
+    return intsetResize(is,len);
+}
+
+/* Return the position of the first element of 'is' not smaller than 'value',
+ * starting the search at 'from': an exponential search finds the range
+ * where the element is, then a binary search is performed inside it. */
+static uint32_t intsetGallop(intset *is, uint32_t from, int64_t value) {
+    uint32_t len = intrev32ifbe(is->length), step = 1, lo, hi;
+
+    if (from >= len || _intsetGet(is,from) >= value) return from;
+    lo = from; /* is[lo] < value */
+    hi = from+1;
+    while (hi < len && _intsetGet(is,hi) < value) {
+        lo = hi;
+        step <<= 1;
+        hi = (len-lo > step) ? lo+step : len;
+    }
+    /* Now is[lo] < value <= is[hi], or hi == len. */
+    while (hi-lo > 1) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (_intsetGet(is,mid) < value) lo = mid; else hi = mid;
+    }
+    return hi;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+/* Intersection of two sorted arrays of int32 or int16 elements, with the
+ * same layout of the intset contents on little endian hosts. The arrays are
+ * walked one block of 16 bytes at a time: every element of the block of 'a'
+ * is compared with every element of the block of 'b' with a few vector
+ * compares of 'a' against rotations of 'b', then the block with the smaller
+ * last element (or both) is skipped. The tails are merged one element at a
+ * time. The common elements are stored in 'dst', the count is returned. */
+static uint32_t intsetIntersect32(const int32_t *a, uint32_t la,
+                                  const int32_t *b, uint32_t lb, int32_t *dst)
+{
+    uint32_t i = 0, j = 0, n = 0;
+
+    while (i+4 <= la && j+4 <= lb) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a+i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b+j));
+        __m128i eq = _mm_cmpeq_epi32(va,vb);
+        eq = _mm_or_si128(eq,_mm_cmpeq_epi32(va,
+                _mm_shuffle_epi32(vb,_MM_SHUFFLE(0,3,2,1))));
+        eq = _mm_or_si128(eq,_mm_cmpeq_epi32(va,
+                _mm_shuffle_epi32(vb,_MM_SHUFFLE(1,0,3,2))));
+        eq = _mm_or_si128(eq,_mm_cmpeq_epi32(va,
+                _mm_shuffle_epi32(vb,_MM_SHUFFLE(2,1,0,3))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        while (mask) {
+            int k = __builtin_ctz(mask);
+            dst[n++] = a[i+k];
+            mask &= mask-1;
+        }
+        int32_t amax = a[i+3], bmax = b[j+3];
+        if (amax <= bmax) i += 4;
+        if (bmax <= amax) j += 4;
+    }
+    while (i < la && j < lb) {
+        if (a[i] < b[j]) i++;
+        else if (a[i] > b[j]) j++;
+        else { dst[n++] = a[i]; i++; j++; }
+    }
+    return n;
+}
+
+/* Rotate the 8 int16 lanes of 'v' by 'k' positions. */
+#define INTSET_ROTATE16(v,k) \
+    _mm_or_si128(_mm_srli_si128(v,(k)*2),_mm_slli_si128(v,16-(k)*2))
+
+static uint32_t intsetIntersect16(const int16_t *a, uint32_t la,
+                                  const int16_t *b, uint32_t lb, int16_t *dst)
+{
+    uint32_t i = 0, j = 0, n = 0;
+
+    while (i+8 <= la && j+8 <= lb) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a+i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b+j));
+        __m128i eq = _mm_cmpeq_epi16(va,vb);
+        eq = _mm_or_si128(eq,_mm_cmpeq_epi16(va,INTSET_ROTATE16(vb,1)));
+        eq = _mm_or_si128(eq,_mm_cmpeq_epi16(va,INTSET_ROTATE16(vb,2)));
+        eq = _mm_or_si128(eq,_mm_cmpeq_epi16(va,INTSET_ROTATE16(vb,3)));
+        eq = _mm_or_si128(eq,_mm_cmpeq_epi16(va,INTSET_ROTATE16(vb,4)));
+        eq = _mm_or_si128(eq,_mm_cmpeq_epi16(va,INTSET_ROTATE16(vb,5)));
+        eq = _mm_or_si128(eq,_mm_cmpeq_epi16(va,INTSET_ROTATE16(vb,6)));
+        eq = _mm_or_si128(eq,_mm_cmpeq_epi16(va,INTSET_ROTATE16(vb,7)));
+        /* Two bits per lane: keep the low one. */
+        int mask = _mm_movemask_epi8(eq) & 0x5555;
+        while (mask) {
+            int k = __builtin_ctz(mask)/2;
+            dst[n++] = a[i+k];
+            mask &= mask-1;
+        }
+        int16_t amax = a[i+7], bmax = b[j+7];
+        if (amax <= bmax) i += 8;
+        if (bmax <= amax) j += 8;
+    }
+    while (i < la && j < lb) {
+        if (a[i] < b[j]) i++;
+        else if (a[i] > b[j]) j++;
+        else { dst[n++] = a[i]; i++; j++; }
+    }
+    return n;
+}
+#endif
+
+/* Return a new intset with the elements that are both in 'a' and 'b'. */
+intset *intsetIntersect(intset *a, intset *b) {
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+    uint32_t i, j, n = 0;
+    uint8_t enca = intrev32ifbe(a->encoding), encb = intrev32ifbe(b->encoding);
+    intset *dst;
+
+    /* Make 'a' the smaller set. */
+    if (la > lb) {
+        intset *tmp = a; a = b; b = tmp;
+        uint32_t ltmp = la; la = lb; lb = ltmp;
+        uint8_t etmp = enca; enca = encb; encb = etmp;
+    }
+
+    /* The common elements fit the smaller of the two encodings. */
+    dst = intsetNewLen(enca < encb ? enca : encb,la);
+    if (la == 0) return intsetTruncate(dst,0);
+
+    if (lb/la >= INTSET_GALLOP_RATIO) {
+        for (i = 0, j = 0; i < la && j < lb; i++) {
+            int64_t v = _intsetGet(a,i);
+            j = intsetGallop(b,j,v);
+            if (j < lb && _intsetGet(b,j) == v) _intsetSet(dst,n++,v);
+        }
+        return intsetTruncate(dst,n);
+    }
+
+#if defined(__SSE2__)
+    if (enca == encb && enca == INTSET_ENC_INT32) {
+        n = intsetIntersect32((int32_t*)a->contents,la,
+                              (int32_t*)b->contents,lb,(int32_t*)dst->contents);
+        return intsetTruncate(dst,n);
+    } else if (enca == encb && enca == INTSET_ENC_INT16) {
+        n = intsetIntersect16((int16_t*)a->contents,la,
+                              (int16_t*)b->contents,lb,(int16_t*)dst->contents);
+        return intsetTruncate(dst,n);
+    }
+#endif
+
+    i = j = 0;
+    while (i < la && j < lb) {
+        int64_t va = _intsetGetEncoded(a,i,enca);
+        int64_t vb = _intsetGetEncoded(b,j,encb);
+        if (va < vb) {
+            i++;
+        } else if (va > vb) {
+            j++;
+        } else {
+            _intsetSet(dst,n++,va);
+            i++;
+            j++;
+        }
+    }
+    return intsetTruncate(dst,n);
+}
+
+/* Return a new intset with the elements that are in 'a' or 'b'. */
+intset *intsetUnion(intset *a, intset *b) {
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+    uint32_t i = 0, j = 0, n = 0;
+    uint8_t enca = intrev32ifbe(a->encoding), encb = intrev32ifbe(b->encoding);
+    intset *dst = intsetNewLen(enca > encb ? enca : encb,la+lb);
+
+    while (i < la && j < lb) {
+        int64_t va = _intsetGetEncoded(a,i,enca);
+        int64_t vb = _intsetGetEncoded(b,j,encb);
+        if (va <= vb) i++;
+        if (vb <= va) j++;
+        _intsetSet(dst,n++,va < vb ? va : vb);
+    }
+    while (i < la) _intsetSet(dst,n++,_intsetGetEncoded(a,i++,enca));
+    while (j < lb) _intsetSet(dst,n++,_intsetGetEncoded(b,j++,encb));
+    return intsetTruncate(dst,n);
+}
+
+/* Return a new intset with the elements of 'a' that are not in 'b'. */
+intset *intsetDifference(intset *a, intset *b) {
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+    uint32_t i = 0, j = 0, n = 0;
+    uint8_t enca = intrev32ifbe(a->encoding), encb = intrev32ifbe(b->encoding);
+    intset *dst = intsetNewLen(enca,la);
+
+    if (la && lb/la >= INTSET_GALLOP_RATIO) {
+        for (i = 0; i < la; i++) {
+            int64_t v = _intsetGetEncoded(a,i,enca);
+            j = intsetGallop(b,j,v);
+            if (j == lb || _intsetGet(b,j) != v) _intsetSet(dst,n++,v);
+        }
+        return intsetTruncate(dst,n);
+    }
+
+    while (i < la && j < lb) {
+        int64_t va = _intsetGetEncoded(a,i,enca);
+        int64_t vb = _intsetGetEncoded(b,j,encb);
+        if (va < vb) {
+            _intsetSet(dst,n++,va);
+            i++;
+        } else {
+            if (va == vb) i++;
+            j++;
+        }
+    }
+    while (i < la) _intsetSet(dst,n++,_intsetGetEncoded(a,i++,enca));
+    return intsetTruncate(dst,n);
+}
+
 #ifdef REDIS_TEST
 #include <sys/time.h>
 #include <time.h>
@@ -471,6 +705,76 @@ int intsetTest(int argc, char **argv) {
                num,size,usec()-start);
     }
 
+    printf("Intersection, union and difference: "); {
+        /* Ranges picking the int16 and int32 encodings, plus a flag to
+         * upgrade the set to int64. */
+        int64_t ranges[] = {200, 30000, 200000, 4000000};
+
+        for (i = 0; i < 2000; i++) {
+            intset *a = intsetNew(), *b = intsetNew(), *sets[3];
+            int64_t ra = ranges[rand()%4], rb = ranges[rand()%4];
+            int la = rand()%(rand()%4 ? 100 : 3000), lb = rand()%100;
+            int64_t v;
+
+            for (int j = 0; j < la; j++) a = intsetAdd(a,rand()%ra-ra/2,NULL);
+            for (int j = 0; j < lb; j++) b = intsetAdd(b,rand()%rb-rb/2,NULL);
+            if (rand()%8 == 0) a = intsetAdd(a,1LL<<40,NULL);
+            if (rand()%8 == 0) b = intsetAdd(b,1LL<<40,NULL);
+            if (rand()%2) { intset *tmp = a; a = b; b = tmp; }
+
+            sets[0] = intsetIntersect(a,b);
+            sets[1] = intsetUnion(a,b);
+            sets[2] = intsetDifference(a,b);
+            for (int k = 0; k < 3; k++)
+                if (intsetLen(sets[k])) checkConsistency(sets[k]);
+            for (uint32_t j = 0; intsetGet(a,j,&v); j++) {
+                assert(intsetFind(sets[0],v) == intsetFind(b,v));
+                assert(intsetFind(sets[1],v));
+                assert(intsetFind(sets[2],v) == !intsetFind(b,v));
+            }
+            for (uint32_t j = 0; intsetGet(b,j,&v); j++) {
+                assert(intsetFind(sets[0],v) == intsetFind(a,v));
+                assert(intsetFind(sets[1],v));
+                assert(!intsetFind(sets[2],v));
+            }
+            assert(intsetLen(sets[1]) ==
+                   intsetLen(a)+intsetLen(b)-intsetLen(sets[0]));
+            assert(intsetLen(sets[2]) == intsetLen(a)-intsetLen(sets[0]));
+            for (int k = 0; k < 3; k++) zfree(sets[k]);
+            zfree(a);
+            zfree(b);
+        }
+        ok();
+    }
+
+    printf("Stress intersection: "); {
+        intset *a, *b, *dst;
+        long long start;
+
+        for (int bits = 15; bits <= 20; bits += 5) {
+            a = createSet(bits,20000);
+            b = createSet(bits,20000);
+            start = usec();
+            for (i = 0; i < 100; i++) zfree(intsetIntersect(a,b));
+            printf("\n  100 intersections of %u and %u elements, %s: %lldusec",
+                intsetLen(a),intsetLen(b),
+                bits == 15 ? "int16" : "int32",usec()-start);
+            zfree(a);
+            zfree(b);
+        }
+        a = createSet(20,100);
+        b = createSet(20,20000);
+        start = usec();
+        for (i = 0; i < 10000; i++) {
+            dst = intsetIntersect(a,b);
+            zfree(dst);
+        }
+        printf("\n  10000 intersections of %u and %u elements (galloping): "
+               "%lldusec\n",intsetLen(a),intsetLen(b),usec()-start);
+        zfree(a);
+        zfree(b);
+    }
+
     printf("Stress add+delete: "); {
         int i, v1, v2;
         is = intsetNew();
@@ -35,9 +35,22 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
     } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
+    } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_ROARING){
+        /* One allocation per container. */
+        roaring *r = obj->ptr;
+        return r->len;
+    } else if (obj->type == OBJ_STRING && obj->encoding == OBJ_ENCODING_ROARING){
+        sparseBitmap *sb = obj->ptr;
+        return sb->bits->len;
     } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_SKIPLIST){
         zset *zs = obj->ptr;
         return zs->zsl->length;
+    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_PACKEDTREE){
+        /* Roughly the number of leaves. */
+        return zptLength(obj->ptr)/(ZPT_LEAF_MAX_ENTRIES/2)+1;
+    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_BTREE){
+        zset *zs = obj->ptr;
+        return zs->zbt->length;
     } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
@@ -52,6 +65,8 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
  * will be reclaimed in a different bio.c thread. */
 #define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
+    if (db->expires_index) expireIndexRemove(db,key);
+
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) {
@@ -62,6 +77,11 @@ int dbAsyncDelete(redisDb *db, robj *key) {
      * is actually just slower... So under a certain limit we just free
      * the object synchronously. */
     dictEntry *de = dictUnlink(db->dict,key->ptr);
+    if (de && server.expire_in_keyspace &&
+        dictEntryKeyMeta(de)->expire != -1)
+    {
+        volatileKeysDelete(db,de);
+    }
     if (de) {
         robj *val = dictGetVal(de);
         size_t free_effort = lazyfreeGetFreeEffort(val);
@@ -110,10 +130,18 @@ void freeObjAsync(robj *o) {
  * lazy freeing. */
 void emptyDbAsync(redisDb *db) {
     dict *oldht1 = db->dict, *oldht2 = db->expires;
-    db->dict = dictCreate(&dbDictType,NULL);
+    db->dict = dictCreate(server.expire_in_keyspace ?
+                          &dbDictWithExpireType : &dbDictType,NULL);
     db->expires = dictCreate(&keyptrDictType,NULL);
+    volatileKeysEmpty(db);
     atomicIncr(lazyfree_objects,dictSize(oldht1));
     bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
+    if (db->expires_index) {
+        rax *oldindex = db->expires_index;
+        db->expires_index = raxNew();
+        atomicIncr(lazyfree_objects,oldindex->numele);
+        bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,oldindex);
+    }
 }
 
 /* Empty the slots-keys map of Redis CLuster by creating a new empty one
@@ -41,6 +41,7 @@
 
 #include "listpack.h"
 #include "listpack_malloc.h"
+#include "util.h"
 
 #define LP_HDR_SIZE 6       /* 32 bit total len + 16 bit number of elements. */
 #define LP_HDR_NUMELE_UNKNOWN UINT16_MAX
@@ -88,6 +89,9 @@
 
 #define LP_EOF 0xFF
 
+/* Max size of the encoded string searched by lpFind() with memfind(). */
+#define LP_FIND_NEEDLE_SIZE 128
+
 #define LP_ENCODING_6BIT_STR_LEN(p) ((p)[0] & 0x3F)
 #define LP_ENCODING_12BIT_STR_LEN(p) ((((p)[0] & 0xF) << 8) | (p)[1])
 #define LP_ENCODING_32BIT_STR_LEN(p) (((uint32_t)(p)[1]<<0) | \
@@ -739,6 +743,14 @@ unsigned char *lpAppend(unsigned char *lp, unsigned char *ele, uint32_t size) {
     return lpInsert(lp,ele,size,eofptr,LP_BEFORE,NULL);
 }
 
+/* Prepend the specified element 'ele' of length 'len' at the start of the
+ * listpack. It is implemented in terms of lpInsert(), so the return value is
+ * the same as lpInsert(). */
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    unsigned char *p = lp + LP_HDR_SIZE; /* First element or EOF. */
+    return lpInsert(lp,ele,size,p,LP_BEFORE,NULL);
+}
+
 /* Remove the element pointed by 'p', and return the resulting listpack.
  * If 'newp' is not NULL, the next element pointer (to the right of the
  * deleted one) is returned by reference. If the deleted element was the
@@ -801,3 +813,215 @@ unsigned char *lpSeek(unsigned char *lp, long index) {
     }
 }
 
+
+/* This is just a wrapper to lpGet() that is able to get an integer from an
+ * entry without converting it to a string, with the same semantics of
+ * ziplistGet(): if the entry is a string its pointer is returned and
+ * the length is stored in 'slen', otherwise NULL is returned and the
+ * integer value is stored in 'lval'. */
+unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval) {
+    unsigned char *vstr;
+    int64_t ele_len;
+
+    vstr = lpGet(p,&ele_len,NULL);
+    if (vstr) {
+        *slen = ele_len;
+    } else {
+        *lval = ele_len;
+    }
+    return vstr;
+}
+
+/* Return 1 if the entry pointed by 'p' is equal to the string 's' of
+ * length 'slen', 0 otherwise. Integer entries are compared converting 's'
+ * to an integer, which is faster than the other way around. */
+unsigned int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    unsigned char *value;
+    int64_t sz, sval;
+
+    if (p[0] == LP_EOF) return 0;
+    value = lpGet(p,&sz,NULL);
+    if (value) return slen == sz && memcmp(value,s,slen) == 0;
+    return lpStringToInt64((const char*)s,slen,&sval) && sz == sval;
+}
+
+/* Find pointer to the entry equal to the specified entry, starting from the
+ * entry 'p' of the listpack 'lp'. Skip 'skip' entries between every
+ * comparison. Returns NULL when the field could not be found.
+ *
+ * A string that is not a valid integer is always stored verbatim after its
+ * encoding header, so the header followed by the string is first searched
+ * as raw bytes: when they are not in the listpack no entry needs to be
+ * decoded, otherwise entries are just skipped until the one starting where
+ * the bytes were found, searching again only if that turns out to be in the
+ * middle of another entry or in an entry that is skipped. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip) {
+    unsigned char *end = lp+lpGetTotalBytes(lp)-1;
+    unsigned int skipcnt = 0;
+    int64_t sval, vlen;
+    int isint;
+
+    if (p == NULL) return NULL;
+    isint = lpStringToInt64((const char*)s,slen,&sval);
+
+    if (!isint && 2+slen <= LP_FIND_NEEDLE_SIZE) {
+        unsigned char needle[LP_FIND_NEEDLE_SIZE], *match;
+        unsigned long needlelen = (slen < 64 ? 1 : 2) + slen;
+
+        lpEncodeString(needle,s,slen);
+        match = memfind(p,end-p,needle,needlelen);
+        while (match != NULL && p < end) {
+            if (p > match) {
+                match = memfind(p,end-p,needle,needlelen);
+                if (match == NULL) break;
+            }
+            if (p == match && skipcnt == 0) return p;
+            skipcnt = skipcnt ? skipcnt-1 : skip;
+            p = lpSkip(p);
+        }
+        return NULL;
+    }
+
+    while (p) {
+        if (skipcnt == 0) {
+            unsigned char *value = lpGet(p,&vlen,NULL);
+
+            /* Strings that are valid integers are always stored as
+             * integers, so only entries of the same kind can match. */
+            if (value) {
+                if (!isint && vlen == slen && memcmp(value,s,slen) == 0)
+                    return p;
+            } else if (isint && vlen == sval) {
+                return p;
+            }
+
+            /* Reset skip count */
+            skipcnt = skip;
+        } else {
+            /* Skip entry */
+            skipcnt--;
+        }
+        p = lpNext(lp,p);
+    }
+    return NULL;
+}
+
+/* Delete 'num' entries starting at the entry at 'index' (that can be
+ * negative as in lpSeek()), or less if the listpack ends before. Returns
+ * the new listpack. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *first, *last;
+    uint32_t bytes = lpGetTotalBytes(lp);
+    uint32_t numele = lpGetNumElements(lp);
+    unsigned long deleted = 0;
+
+    if (num == 0 || (first = lpSeek(lp,index)) == NULL) return lp;
+    last = first;
+    while (deleted < num && last[0] != LP_EOF) {
+        last = lpSkip(last);
+        deleted++;
+    }
+
+    /* Move the tail, EOF included, over the deleted entries. */
+    memmove(first,last,lp+bytes-last);
+    bytes -= last-first;
+    lpSetTotalBytes(lp,bytes);
+    if (numele != LP_HDR_NUMELE_UNKNOWN) lpSetNumElements(lp,numele-deleted);
+    return lp_realloc(lp,bytes);
+}
+
+/* Merge listpacks 'first' and 'second' by appending 'second' to 'first'.
+ *
+ * NOTE: The larger listpack is reallocated to contain the new merged listpack.
+ * Either 'first' or 'second' can be used for the result. The parameter not
+ * used will be free'd and set to NULL.
+ *
+ * After calling this function, the input parameters are no longer valid since
+ * they are changed and free'd in-place.
+ *
+ * Returns NULL on failure, that is if one of the arguments is NULL, if they
+ * are the same listpack or if the result would not fit in a listpack. */
+unsigned char *lpMerge(unsigned char **first, unsigned char **second) {
+    unsigned char *target;
+    uint32_t fbytes, sbytes, fnum, snum;
+    uint64_t bytes;
+    int append;
+
+    if (first == NULL || *first == NULL || second == NULL || *second == NULL)
+        return NULL;
+    if (*first == *second) return NULL;
+
+    fbytes = lpGetTotalBytes(*first);
+    sbytes = lpGetTotalBytes(*second);
+    fnum = lpLength(*first);
+    snum = lpLength(*second);
+
+    /* A single header and EOF are needed in the result. */
+    bytes = (uint64_t)fbytes+sbytes-LP_HDR_SIZE-1;
+    if (bytes > UINT32_MAX) return NULL;
+
+    /* Reallocate the larger listpack, so that less bytes are copied. */
+    append = fbytes >= sbytes;
+    if (append) {
+        target = lp_realloc(*first,bytes);
+        memcpy(target+fbytes-1,*second+LP_HDR_SIZE,sbytes-LP_HDR_SIZE);
+        lp_free(*second);
+    } else {
+        target = lp_realloc(*second,bytes);
+        memmove(target+fbytes-1,target+LP_HDR_SIZE,sbytes-LP_HDR_SIZE);
+        memcpy(target+LP_HDR_SIZE,*first+LP_HDR_SIZE,fbytes-LP_HDR_SIZE-1);
+        lp_free(*first);
+    }
+    lpSetTotalBytes(target,bytes);
+    lpSetNumElements(target,(uint64_t)fnum+snum < LP_HDR_NUMELE_UNKNOWN ?
+                            fnum+snum : LP_HDR_NUMELE_UNKNOWN);
+
+    if (append) {
+        *first = target;
+        *second = NULL;
+    } else {
+        *first = NULL;
+        *second = target;
+    }
+    return target;
+}
+
+/* Print info about the listpack and its entries to standard output, for
+ * debugging purposes. */
+void lpRepr(unsigned char *lp) {
+    unsigned char *p, *vstr;
+    unsigned char intbuf[LP_INTBUF_SIZE];
+    int64_t vlen;
+    int index = 0;
+
+    printf("{total bytes %u} {num entries %u}\n",
+        (unsigned) lpBytes(lp), (unsigned) lpLength(lp));
+
+    p = lpFirst(lp);
+    while (p) {
+        uint32_t encoded = lpCurrentEncodedSize(p);
+        unsigned long backlen = lpEncodeBacklen(NULL,encoded);
+
+        printf(
+            "{\n"
+                "\taddr: 0x%08lx,\n"
+                "\tindex: %2d,\n"
+                "\toffset: %5lu,\n"
+                "\thdr+entrylen+backlen: %2lu,\n"
+                "\tbacklen size: %lu,\n",
+            (long unsigned)p, index, (unsigned long)(p-lp),
+            (unsigned long)encoded+backlen, backlen);
+        vstr = lpGet(p,&vlen,intbuf);
+        printf("\t[str]");
+        if (vlen > 40) {
+            if (fwrite(vstr,40,1,stdout) == 0) perror("fwrite");
+            printf("...");
+        } else {
+            if (vlen && fwrite(vstr,vlen,1,stdout) == 0) perror("fwrite");
+        }
+        printf("\n}\n");
+        index++;
+        p = lpNext(lp,p);
+    }
+    printf("{end}\n\n");
+}
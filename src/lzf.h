@@ -96,5 +96,15 @@ unsigned int
 lzf_decompress (const void *const in_data,  unsigned int in_len,
                 void             *out_data, unsigned int out_len);
 
+/*
+ * Like lzf_decompress, but only produce the first out_len bytes of the
+ * decompressed data, stopping there, and return out_len. If the data is
+ * shorter than that, or if an error in the compressed data is detected
+ * before, a zero is returned and errno is set to EINVAL.
+ */
+unsigned int
+lzf_decompress_prefix (const void *const in_data,  unsigned int in_len,
+                       void             *out_data, unsigned int out_len);
+
 #endif
 
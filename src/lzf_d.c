@@ -189,3 +189,77 @@ lzf_decompress (const void *const in_data,  unsigned int in_len,
 #if defined(__GNUC__) && __GNUC__ >= 5
 #pragma GCC diagnostic pop
 #endif
+
+unsigned int
+lzf_decompress_prefix (const void *const in_data,  unsigned int in_len,
+                       void             *out_data, unsigned int out_len)
+{
+  u8 const *ip = (const u8 *)in_data;
+  u8       *op = (u8 *)out_data;
+  u8 const *const in_end  = ip + in_len;
+  u8       *const out_end = op + out_len;
+
+  while (op < out_end && ip < in_end)
+    {
+      unsigned int ctrl = *ip++;
+
+      if (ctrl < (1 << 5)) /* literal run */
+        {
+          ctrl++;
+
+          if (ip + ctrl > in_end)
+            {
+              SET_ERRNO (EINVAL);
+              return 0;
+            }
+
+          while (ctrl-- && op < out_end)
+            *op++ = *ip++;
+        }
+      else /* back reference */
+        {
+          unsigned int len = ctrl >> 5;
+
+          u8 *ref = op - ((ctrl & 0x1f) << 8) - 1;
+
+          if (ip >= in_end)
+            {
+              SET_ERRNO (EINVAL);
+              return 0;
+            }
+
+          if (len == 7)
+            {
+              len += *ip++;
+
+              if (ip >= in_end)
+                {
+                  SET_ERRNO (EINVAL);
+                  return 0;
+                }
+            }
+
+          ref -= *ip++;
+
+          if (ref < (u8 *)out_data)
+            {
+              SET_ERRNO (EINVAL);
+              return 0;
+            }
+
+          len += 2;
+
+          do
+            *op++ = *ref++;
+          while (--len && op < out_end);
+        }
+    }
+
+  if (op < out_end)
+    {
+      SET_ERRNO (EINVAL);
+      return 0;
+    }
+
+  return out_len;
+}
@@ -166,6 +166,9 @@ struct RedisModuleKey {
     uint32_t zstart;        /* Start pos for positional ranges. */
     uint32_t zend;          /* End pos for positional ranges. */
     void *zcurrent;         /* Zset iterator current node. */
+    zptNode *zleaf;         /* Zset iterator current leaf (packed tree). */
+    int zpos;               /* Zset iterator position inside the current
+                               node (B-tree). */
     int zer;                /* Zset iterator end reached flag
                                (true if end was reached). */
 };
@@ -440,7 +443,7 @@ int moduleCreateEmptyKey(RedisModuleKey *key, int type) {
                             server.list_compress_depth);
         break;
     case REDISMODULE_KEYTYPE_ZSET:
-        obj = createZsetZiplistObject();
+        obj = createZsetListpackObject();
         break;
     case REDISMODULE_KEYTYPE_HASH:
         obj = createHashObject();
@@ -2098,7 +2101,7 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
     zrs->minex = minex;
     zrs->maxex = maxex;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInRange(key->value->ptr,zrs) :
                                 zzlLastInRange(key->value->ptr,zrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -2106,6 +2109,14 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
         zskiplist *zsl = zs->zsl;
         key->zcurrent = first ? zslFirstInRange(zsl,zrs) :
                                 zslLastInRange(zsl,zrs);
+    } else if (key->value->encoding == OBJ_ENCODING_PACKEDTREE) {
+        key->zcurrent = first ?
+            zptFirstInRange(key->value->ptr,zrs,&key->zleaf) :
+            zptLastInRange(key->value->ptr,zrs,&key->zleaf);
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = key->value->ptr;
+        key->zcurrent = first ? zbtFirstInRange(zs->zbt,zrs,&key->zpos) :
+                                zbtLastInRange(zs->zbt,zrs,&key->zpos);
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2162,7 +2173,7 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
      * otherwise we don't want the zlexrangespec to be freed. */
     key->ztype = REDISMODULE_ZSET_RANGE_LEX;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInLexRange(key->value->ptr,zlrs) :
                                 zzlLastInLexRange(key->value->ptr,zlrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -2170,6 +2181,14 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
         zskiplist *zsl = zs->zsl;
         key->zcurrent = first ? zslFirstInLexRange(zsl,zlrs) :
                                 zslLastInLexRange(zsl,zlrs);
+    } else if (key->value->encoding == OBJ_ENCODING_PACKEDTREE) {
+        key->zcurrent = first ?
+            zptFirstInLexRange(key->value->ptr,zlrs,&key->zleaf) :
+            zptLastInLexRange(key->value->ptr,zlrs,&key->zleaf);
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = key->value->ptr;
+        key->zcurrent = first ? zbtFirstInLexRange(zs->zbt,zlrs,&key->zpos) :
+                                zbtLastInLexRange(zs->zbt,zlrs,&key->zpos);
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2207,12 +2226,12 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
     RedisModuleString *str;
 
     if (key->zcurrent == NULL) return NULL;
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr, *sptr;
         eptr = key->zcurrent;
-        sds ele = ziplistGetObject(eptr);
+        sds ele = lpGetObject(eptr);
         if (score) {
-            sptr = ziplistNext(key->value->ptr,eptr);
+            sptr = lpNext(key->value->ptr,eptr);
             *score = zzlGetScore(sptr);
         }
         str = createObject(OBJ_STRING,ele);
@@ -2220,6 +2239,16 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
         zskiplistNode *ln = key->zcurrent;
         if (score) *score = ln->score;
         str = createStringObject(ln->ele,sdslen(ln->ele));
+    } else if (key->value->encoding == OBJ_ENCODING_PACKEDTREE) {
+        unsigned char *eptr = key->zcurrent;
+        sds ele = lpGetObject(eptr);
+        if (score) *score = zzlGetScore(lpNext(key->zleaf->lp,eptr));
+        str = createObject(OBJ_STRING,ele);
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtNode *n = key->zcurrent;
+        sds ele = n->ele[key->zpos];
+        if (score) *score = n->score[key->zpos];
+        str = createStringObject(ele,sdslen(ele));
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2233,12 +2262,12 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
 int RM_ZsetRangeNext(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->zcurrent;
         unsigned char *next;
-        next = ziplistNext(zl,eptr); /* Skip element. */
-        if (next) next = ziplistNext(zl,next); /* Skip score. */
+        next = lpNext(zl,eptr); /* Skip element. */
+        if (next) next = lpNext(zl,next); /* Skip score. */
         if (next == NULL) {
             key->zer = 1;
             return 0;
@@ -2248,7 +2277,7 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
                 /* Fetch the next element score for the
                  * range check. */
                 unsigned char *saved_next = next;
-                next = ziplistNext(zl,next); /* Skip next element. */
+                next = lpNext(zl,next); /* Skip next element. */
                 double score = zzlGetScore(next); /* Obtain the next score. */
                 if (!zslValueLteMax(score,&key->zrs)) {
                     key->zer = 1;
@@ -2285,6 +2314,57 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
             key->zcurrent = next;
             return 1;
         }
+    } else if (key->value->encoding == OBJ_ENCODING_PACKEDTREE) {
+        zptNode *leaf = key->zleaf;
+        unsigned char *eptr = key->zcurrent;
+        unsigned char *sptr = lpNext(leaf->lp,eptr);
+
+        zptNext(&leaf,&eptr,&sptr);
+        if (eptr == NULL) {
+            key->zer = 1;
+            return 0;
+        } else {
+            /* Are we still within the range? */
+            if (key->ztype == REDISMODULE_ZSET_RANGE_SCORE &&
+                !zslValueLteMax(zzlGetScore(sptr),&key->zrs))
+            {
+                key->zer = 1;
+                return 0;
+            } else if (key->ztype == REDISMODULE_ZSET_RANGE_LEX) {
+                if (!zzlLexValueLteMax(eptr,&key->zlrs)) {
+                    key->zer = 1;
+                    return 0;
+                }
+            }
+            key->zleaf = leaf;
+            key->zcurrent = eptr;
+            return 1;
+        }
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtNode *n = key->zcurrent;
+        int pos = key->zpos;
+
+        zbtNext(&n,&pos);
+        if (n == NULL) {
+            key->zer = 1;
+            return 0;
+        } else {
+            /* Are we still within the range? */
+            if (key->ztype == REDISMODULE_ZSET_RANGE_SCORE &&
+                !zslValueLteMax(n->score[pos],&key->zrs))
+            {
+                key->zer = 1;
+                return 0;
+            } else if (key->ztype == REDISMODULE_ZSET_RANGE_LEX) {
+                if (!zslLexValueLteMax(n->ele[pos],&key->zlrs)) {
+                    key->zer = 1;
+                    return 0;
+                }
+            }
+            key->zcurrent = n;
+            key->zpos = pos;
+            return 1;
+        }
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2296,12 +2376,12 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
 int RM_ZsetRangePrev(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->zcurrent;
         unsigned char *prev;
-        prev = ziplistPrev(zl,eptr); /* Go back to previous score. */
-        if (prev) prev = ziplistPrev(zl,prev); /* Back to previous ele. */
+        prev = lpPrev(zl,eptr); /* Go back to previous score. */
+        if (prev) prev = lpPrev(zl,prev); /* Back to previous ele. */
         if (prev == NULL) {
             key->zer = 1;
             return 0;
@@ -2311,7 +2391,7 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
                 /* Fetch the previous element score for the
                  * range check. */
                 unsigned char *saved_prev = prev;
-                prev = ziplistNext(zl,prev); /* Skip element to get the score.*/
+                prev = lpNext(zl,prev); /* Skip element to get the score.*/
                 double score = zzlGetScore(prev); /* Obtain the prev score. */
                 if (!zslValueGteMin(score,&key->zrs)) {
                     key->zer = 1;
@@ -2348,6 +2428,57 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
             key->zcurrent = prev;
             return 1;
         }
+    } else if (key->value->encoding == OBJ_ENCODING_PACKEDTREE) {
+        zptNode *leaf = key->zleaf;
+        unsigned char *eptr = key->zcurrent;
+        unsigned char *sptr = lpNext(leaf->lp,eptr);
+
+        zptPrev(&leaf,&eptr,&sptr);
+        if (eptr == NULL) {
+            key->zer = 1;
+            return 0;
+        } else {
+            /* Are we still within the range? */
+            if (key->ztype == REDISMODULE_ZSET_RANGE_SCORE &&
+                !zslValueGteMin(zzlGetScore(sptr),&key->zrs))
+            {
+                key->zer = 1;
+                return 0;
+            } else if (key->ztype == REDISMODULE_ZSET_RANGE_LEX) {
+                if (!zzlLexValueGteMin(eptr,&key->zlrs)) {
+                    key->zer = 1;
+                    return 0;
+                }
+            }
+            key->zleaf = leaf;
+            key->zcurrent = eptr;
+            return 1;
+        }
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtNode *n = key->zcurrent;
+        int pos = key->zpos;
+
+        zbtPrev(&n,&pos);
+        if (n == NULL) {
+            key->zer = 1;
+            return 0;
+        } else {
+            /* Are we still within the range? */
+            if (key->ztype == REDISMODULE_ZSET_RANGE_SCORE &&
+                !zslValueGteMin(n->score[pos],&key->zrs))
+            {
+                key->zer = 1;
+                return 0;
+            } else if (key->ztype == REDISMODULE_ZSET_RANGE_LEX) {
+                if (!zslLexValueGteMin(n->ele[pos],&key->zlrs)) {
+                    key->zer = 1;
+                    return 0;
+                }
+            }
+            key->zcurrent = n;
+            key->zpos = pos;
+            return 1;
+        }
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -35,6 +35,16 @@
 #include <ctype.h>
 
 static void setProtocolError(const char *errstr, client *c);
+static int postponeClientRead(client *c);
+int ProcessingEventsWhileBlocked = 0; /* See processEventsWhileBlocked(). */
+
+/* Operation the clients are being served for by the threaded I/O code, see
+ * handleClientsWithPendingReadsUsingThreads() and
+ * handleClientsWithPendingWritesUsingThreads(). */
+#define IO_THREADS_OP_IDLE 0
+#define IO_THREADS_OP_READ 1
+#define IO_THREADS_OP_WRITE 2
+static int io_threads_op = IO_THREADS_OP_IDLE;
 
 /* Return the size consumed from the allocator, for the specified SDS string,
  * including internal fragmentation. This function is used in order to compute
@@ -55,18 +65,76 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     }
 }
 
+/* Free a client we failed to read from or write to. While the threaded I/O
+ * code is serving clients we may be in an I/O thread, or the client may be
+ * referenced by the lists of clients to serve, so in such a context we just
+ * schedule it for asynchronous freeing. */
+static void freeClientFromIOHandler(client *c) {
+    if (io_threads_op != IO_THREADS_OP_IDLE)
+        freeClientAsync(c);
+    else
+        freeClient(c);
+}
+
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
-    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
+    clientReplyBlock *buf;
+
+    /* Blocks referencing an object just need a new reference. */
+    if (old->obj) {
+        buf = zmalloc(sizeof(clientReplyBlock));
+        memcpy(buf, o, sizeof(clientReplyBlock));
+        incrRefCount(buf->obj);
+        return buf;
+    }
+    buf = zmalloc(sizeof(clientReplyBlock) + old->size);
     memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
+    clientReplyBlock *buf = o;
+    /* Note that 'buf' is NULL for the placeholder nodes created by
+     * addDeferredMultiBulkLength(). */
+    if (buf && buf->obj) decrRefCount(buf->obj);
     zfree(o);
 }
 
+/* Replace the blocks of the reply list referencing an object with copies
+ * of the object content. This is needed before handing objects to a
+ * background thread to be released, since releasing a reference is not
+ * thread safe: see emptyDb(). */
+static void copyClientReplyRefs(client *c) {
+    listIter li;
+    listNode *ln;
+
+    if (c->reply_refs == 0) return;
+    listRewind(c->reply,&li);
+    while((ln = listNext(&li))) {
+        clientReplyBlock *ref = listNodeValue(ln), *copy;
+
+        if (ref == NULL || ref->obj == NULL) continue;
+        copy = zmalloc(sizeof(clientReplyBlock) + ref->used);
+        copy->size = copy->used = ref->used;
+        copy->obj = NULL;
+        memcpy(copy->buf, ref->obj->ptr, ref->used);
+        decrRefCount(ref->obj);
+        zfree(ref);
+        listNodeValue(ln) = copy;
+    }
+    c->reply_refs = 0;
+}
+
+/* Call copyClientReplyRefs() for all the clients. */
+void copyClientsReplyRefs(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients,&li);
+    while((ln = listNext(&li))) copyClientReplyRefs(listNodeValue(ln));
+}
+
 int listMatchObjects(void *a, void *b) {
     return equalStringObjects(a,b);
 }
@@ -137,6 +205,7 @@ client *createClient(int fd) {
     c->slave_capa = SLAVE_CAPA_NONE;
     c->reply = listCreate();
     c->reply_bytes = 0;
+    c->reply_refs = 0;
     c->obuf_soft_limit_reached_time = 0;
     listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
@@ -149,6 +218,7 @@ client *createClient(int fd) {
     c->bpop.xread_group_noack = 0;
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
+    c->bpop.bitop_job = NULL;
     c->woff = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
@@ -234,8 +304,12 @@ int prepareClientToWrite(client *c) {
         return C_ERR; /* Fake client for AOF loading. */
     }
     /* Schedule the client to write the output buffers to the socket, unless
-     * it should already be setup to do so (it has already pending data). */
-    if (!clientHasPendingReplies(c)) {
+     * it should already be setup to do so (it has already pending data).
+     *
+     * If CLIENT_PENDING_READ is set, we may be in an I/O thread and must not
+     * touch the global list of clients pending write: the write handler will
+     * be installed by handleClientsWithPendingReadsUsingThreads() instead. */
+    if (!clientHasPendingReplies(c) && !(c->flags & CLIENT_PENDING_READ)) {
         clientInstallWriteHandler(c);
     }
 
@@ -293,6 +367,7 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
         /* take over the allocation's internal fragmentation */
         tail->size = zmalloc_usable(tail) - sizeof(clientReplyBlock);
         tail->used = len;
+        tail->obj = NULL;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);
         c->reply_bytes += tail->size;
@@ -300,6 +375,25 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
+/* Append a block referencing the string object 'obj' to the reply list,
+ * instead of copying its content: the object sds is sent directly from
+ * writeToClient(). This is used for big objects, to avoid copying them
+ * (and having them twice in memory) just to send them to the client.
+ * A reference is always safe to take, since the commands modifying a string
+ * in place unshare it first when its reference count is greater than one. */
+void _addReplyObjectToList(client *c, robj *obj) {
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    clientReplyBlock *ref = zmalloc(sizeof(clientReplyBlock));
+    ref->size = ref->used = sdslen(obj->ptr);
+    ref->obj = obj;
+    incrRefCount(obj);
+    listAddNodeTail(c->reply, ref);
+    c->reply_bytes += ref->size;
+    c->reply_refs++;
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -312,7 +406,15 @@ void addReply(client *c, robj *obj) {
     }
 
     if (sdsEncodedObject(obj)) {
-        if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != C_OK) {
+        /* Big objects are referenced instead of copied. Lua and module
+         * clients access the reply blocks directly, so we always copy
+         * for them. */
+        if (obj->encoding == OBJ_ENCODING_RAW &&
+            sdslen(obj->ptr) >= PROTO_REPLY_REF_MIN_BYTES &&
+            !(c->flags & (CLIENT_LUA|CLIENT_MODULE)))
+        {
+            _addReplyObjectToList(c,obj);
+        } else if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != C_OK) {
             _addReplyStringToList(c,obj->ptr,sdslen(obj->ptr));
         }
     } else if (obj->encoding == OBJ_ENCODING_INT) {
@@ -324,6 +426,11 @@ void addReply(client *c, robj *obj) {
         if (_addReplyToBuffer(c,buf,len) != C_OK) {
             _addReplyStringToList(c,buf,len);
         }
+    } else if (obj->encoding == OBJ_ENCODING_ROARING) {
+        /* Sparse bitmaps are materialized only to be sent. */
+        robj *dec = getDecodedObject(obj);
+        addReply(c,dec);
+        decrRefCount(dec);
     } else {
         serverPanic("Wrong obj->encoding in addReply()");
     }
@@ -476,6 +583,7 @@ void setDeferredMultiBulkLength(client *c, void *node, long length) {
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable(buf) - sizeof(clientReplyBlock);
         buf->used = lenstr_len;
+        buf->obj = NULL;
         memcpy(buf->buf, lenstr, lenstr_len);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
@@ -553,6 +661,8 @@ void addReplyBulkLen(client *c, robj *obj) {
 
     if (sdsEncodedObject(obj)) {
         len = sdslen(obj->ptr);
+    } else if (obj->encoding == OBJ_ENCODING_ROARING) {
+        len = stringObjectLen(obj);
     } else {
         long n = (long)obj->ptr;
 
@@ -655,7 +765,9 @@ void AddReplyFromClient(client *dst, client *src) {
     if (listLength(src->reply))
         listJoin(dst->reply,src->reply);
     dst->reply_bytes += src->reply_bytes;
+    dst->reply_refs += src->reply_refs;
     src->reply_bytes = 0;
+    src->reply_refs = 0;
     src->bufpos = 0;
 }
 
@@ -669,6 +781,7 @@ void copyClientOutputBuffer(client *dst, client *src) {
     memcpy(dst->buf,src->buf,src->bufpos);
     dst->bufpos = src->bufpos;
     dst->reply_bytes = src->reply_bytes;
+    dst->reply_refs = src->reply_refs;
 }
 
 /* Return true if the specified client has pending reply buffers to write to
@@ -851,6 +964,14 @@ void unlinkClient(client *c) {
         c->flags &= ~CLIENT_PENDING_WRITE;
     }
 
+    /* Remove from the list of pending reads if needed. */
+    if (c->flags & CLIENT_PENDING_READ) {
+        ln = listSearchKey(server.clients_pending_read,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.clients_pending_read,ln);
+        c->flags &= ~CLIENT_PENDING_READ;
+    }
+
     /* When client was just unblocked because of a blocking operation,
      * remove it from the list of unblocked clients. */
     if (c->flags & CLIENT_UNBLOCKED) {
@@ -966,9 +1087,20 @@ void freeClient(client *c) {
  * a context where calling freeClient() is not possible, because the client
  * should be valid for the continuation of the flow of the program. */
 void freeClientAsync(client *c) {
+    /* This function may be called by the I/O threads, so the access to the
+     * server.clients_to_close list must be serialized. All the other accesses
+     * to the list happen in the main thread while the I/O threads are idle. */
+    static pthread_mutex_t async_free_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
     if (c->flags & CLIENT_CLOSE_ASAP || c->flags & CLIENT_LUA) return;
     c->flags |= CLIENT_CLOSE_ASAP;
+    if (server.io_threads_num == 1) {
+        listAddNodeTail(server.clients_to_close,c);
+        return;
+    }
+    pthread_mutex_lock(&async_free_queue_mutex);
     listAddNodeTail(server.clients_to_close,c);
+    pthread_mutex_unlock(&async_free_queue_mutex);
 }
 
 void freeClientsInAsyncFreeQueue(void) {
@@ -991,52 +1123,100 @@ client *lookupClientByID(uint64_t id) {
     return (c == raxNotFound) ? NULL : c;
 }
 
+/* Write the static buffer and the first blocks of the reply list of the
+ * client with a single writev(2) call, up to NET_MAX_WRITEV_IOVCNT buffers
+ * and about NET_MAX_WRITES_PER_EVENT bytes, then consume what was written
+ * from the output buffers. This way the header of a bulk reply and the
+ * payload of a referenced object are sent without copying and without
+ * paying a syscall for each of them. Returns what writev(2) returned. */
+static ssize_t _writevToClient(int fd, client *c) {
+    struct iovec iov[NET_MAX_WRITEV_IOVCNT];
+    int iovcnt = 0;
+    size_t iov_bytes = 0, offset = c->sentlen;
+    ssize_t nwritten = 0;
+    listIter li;
+    listNode *ln;
+    clientReplyBlock *o;
+
+    /* Note that 'sentlen' refers to the static buffer if not empty,
+     * otherwise to the block on the head of the reply list. */
+    if (c->bufpos > 0) {
+        iov[iovcnt].iov_base = c->buf + offset;
+        iov[iovcnt].iov_len = c->bufpos - offset;
+        iov_bytes += iov[iovcnt++].iov_len;
+        offset = 0;
+    }
+    listRewind(c->reply,&li);
+    while((ln = listNext(&li)) && iovcnt < NET_MAX_WRITEV_IOVCNT &&
+          iov_bytes < NET_MAX_WRITES_PER_EVENT)
+    {
+        o = listNodeValue(ln);
+        size_t len = o->used - offset;
+        char *data = o->obj ? (char*)o->obj->ptr : o->buf;
+
+        /* Referenced objects may be huge: don't send more than about
+         * NET_MAX_WRITES_PER_EVENT bytes at once anyway. */
+        if (len > NET_MAX_WRITES_PER_EVENT - iov_bytes)
+            len = NET_MAX_WRITES_PER_EVENT - iov_bytes;
+        if (len != 0) {
+            iov[iovcnt].iov_base = data + offset;
+            iov[iovcnt].iov_len = len;
+            iov_bytes += iov[iovcnt++].iov_len;
+        }
+        offset = 0;
+    }
+    if (iovcnt) {
+        nwritten = writev(fd,iov,iovcnt);
+        if (nwritten <= 0) return nwritten;
+    }
+
+    /* Consume the written bytes from the static buffer first... */
+    size_t remaining = nwritten;
+    if (c->bufpos > 0) {
+        size_t buflen = c->bufpos - c->sentlen;
+        if (remaining < buflen) {
+            c->sentlen += remaining;
+            return nwritten;
+        }
+        /* The buffer was sent, set bufpos to zero to continue with the
+         * remainder of the reply. */
+        c->bufpos = 0;
+        c->sentlen = 0;
+        remaining -= buflen;
+    }
+
+    /* ...then from the reply list, releasing the blocks fully sent, as
+     * well as the empty ones. */
+    while(listLength(c->reply)) {
+        ln = listFirst(c->reply);
+        o = listNodeValue(ln);
+        size_t len = o->used - c->sentlen;
+        if (remaining < len) {
+            c->sentlen += remaining;
+            break;
+        }
+        remaining -= len;
+        c->reply_bytes -= o->size;
+        if (o->obj) c->reply_refs--;
+        listDelNode(c->reply,ln);
+        c->sentlen = 0;
+    }
+    /* If there are no longer objects in the list, we expect
+     * the count of reply bytes to be exactly zero. */
+    if (listLength(c->reply) == 0) serverAssert(c->reply_bytes == 0);
+    return nwritten;
+}
+
 /* Write data in output buffers to client. Return C_OK if the client
  * is still valid after the call, C_ERR if it was freed. */
 int writeToClient(int fd, client *c, int handler_installed) {
     ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
-    clientReplyBlock *o;
 
     while(clientHasPendingReplies(c)) {
-        if (c->bufpos > 0) {
-            nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->sentlen == c->bufpos) {
-                c->bufpos = 0;
-                c->sentlen = 0;
-            }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = o->used;
+        nwritten = _writevToClient(fd,c);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
 
-            if (objlen == 0) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
-            }
-
-            nwritten = write(fd, o->buf + c->sentlen, objlen - c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                /* If there are no longer objects in the list, we expect
-                 * the count of reply bytes to be exactly zero. */
-                if (listLength(c->reply) == 0)
-                    serverAssert(c->reply_bytes == 0);
-            }
-        }
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -1054,14 +1234,14 @@ int writeToClient(int fd, client *c, int handler_installed) {
              zmalloc_used_memory() < server.maxmemory) &&
             !(c->flags & CLIENT_SLAVE)) break;
     }
-    server.stat_net_output_bytes += totwritten;
+    atomicIncr(server.stat_net_output_bytes,totwritten);
     if (nwritten == -1) {
         if (errno == EAGAIN) {
             nwritten = 0;
         } else {
             serverLog(LL_VERBOSE,
                 "Error writing to client: %s", strerror(errno));
-            freeClient(c);
+            freeClientFromIOHandler(c);
             return C_ERR;
         }
     }
@@ -1078,7 +1258,7 @@ int writeToClient(int fd, client *c, int handler_installed) {
 
         /* Close connection after entire reply has been sent. */
         if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
-            freeClient(c);
+            freeClientFromIOHandler(c);
             return C_ERR;
         }
     }
@@ -1092,6 +1272,27 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     writeToClient(fd,privdata,1);
 }
 
+/* Install the writable event handler for a client that still has data to
+ * output after an attempt to write it synchronously. */
+static void installClientWriteHandler(client *c) {
+    int ae_flags = AE_WRITABLE;
+    /* For the fsync=always policy, we want that a given FD is never
+     * served for reading and writing in the same event loop iteration,
+     * so that in the middle of receiving the query, and serving it
+     * to the client, we'll call beforeSleep() that will do the
+     * actual fsync of AOF to disk. AE_BARRIER ensures that. */
+    if (server.aof_state == AOF_ON &&
+        server.aof_fsync == AOF_FSYNC_ALWAYS)
+    {
+        ae_flags |= AE_BARRIER;
+    }
+    if (aeCreateFileEvent(server.el, c->fd, ae_flags,
+        sendReplyToClient, c) == AE_ERR)
+    {
+            freeClientAsync(c);
+    }
+}
+
 /* This function is called just before entering the event loop, in the hope
  * we can just write the replies to the client output buffer without any
  * need to use a syscall in order to install the writable event handler,
@@ -1116,24 +1317,7 @@ int handleClientsWithPendingWrites(void) {
 
         /* If after the synchronous writes above we still have data to
          * output to the client, we need to install the writable handler. */
-        if (clientHasPendingReplies(c)) {
-            int ae_flags = AE_WRITABLE;
-            /* For the fsync=always policy, we want that a given FD is never
-             * served for reading and writing in the same event loop iteration,
-             * so that in the middle of receiving the query, and serving it
-             * to the client, we'll call beforeSleep() that will do the
-             * actual fsync of AOF to disk. AE_BARRIER ensures that. */
-            if (server.aof_state == AOF_ON &&
-                server.aof_fsync == AOF_FSYNC_ALWAYS)
-            {
-                ae_flags |= AE_BARRIER;
-            }
-            if (aeCreateFileEvent(server.el, c->fd, ae_flags,
-                sendReplyToClient, c) == AE_ERR)
-            {
-                    freeClientAsync(c);
-            }
-        }
+        if (clientHasPendingReplies(c)) installClientWriteHandler(c);
     }
     return processed;
 }
@@ -1434,17 +1618,55 @@ int processMultibulkBuffer(client *c) {
     return C_ERR;
 }
 
+/* Execute the command parsed in the client argument vector, then reset the
+ * client to get ready for the next one. Returns C_ERR if the client is no
+ * longer valid after the command was executed, otherwise C_OK. */
+static int processCommandAndResetClient(client *c) {
+    int deadclient = 0;
+    server.current_client = c;
+    // 执行命令
+    if (processCommand(c) == C_OK) {
+        if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI)) {
+            /* Update the applied replication offset of our master. */
+            c->reploff = c->read_reploff - sdslen(c->querybuf) + c->qb_pos;
+        }
+
+        /* Don't reset the client structure for clients blocked in a
+         * module blocking command, so that the reply callback will
+         * still be able to access the client argv and argc field.
+         * The client will be reset in unblockClientFromModule(). */
+        if (!(c->flags & CLIENT_BLOCKED) || c->btype != BLOCKED_MODULE) {
+            resetClient(c);
+        }
+    }
+    /* freeMemoryIfNeeded may flush slave output buffers. This may
+     * result into a slave, that may be the active client, to be
+     * freed. */
+    if (server.current_client == NULL) deadclient = 1;
+    server.current_client = NULL;
+    return deadclient ? C_ERR : C_OK;
+}
+
 /* This function is called every time, in the client structure 'c', there is
  * more query buffer to process, because we read more data from the socket
  * or because a client was blocked and later reactivated, so there could be
- * pending query buffer, already representing a full command, to process. */
+ * pending query buffer, already representing a full command, to process.
+ *
+ * When called in the context of an I/O thread (the client is flagged with
+ * CLIENT_PENDING_READ) the function only parses the next command: the client
+ * is flagged with CLIENT_PENDING_COMMAND and the command is executed later
+ * by the main thread, calling this function again. */
 void processInputBuffer(client *c) {
-    server.current_client = c;
-
     /* Keep processing while there is something in the input buffer */
-    while(c->qb_pos < sdslen(c->querybuf)) {
-        /* Return if clients are paused. */
-        if (!(c->flags & CLIENT_SLAVE) && clientsArePaused()) {
+    while(c->flags & CLIENT_PENDING_COMMAND ||
+          c->qb_pos < sdslen(c->querybuf))
+    {
+        /* Return if clients are paused. The I/O threads skip the check since
+         * it is not thread safe: the main thread will check again before
+         * executing the command. */
+        if (!(c->flags & (CLIENT_SLAVE|CLIENT_PENDING_READ)) &&
+            clientsArePaused())
+        {
             break;
         }
 
@@ -1470,64 +1692,59 @@ void processInputBuffer(client *c) {
             break;
         }
 
-        /* Determine request type when unknown. */
-        if (!c->reqtype) {
-            if (c->querybuf[c->qb_pos] == '*') {
-                c->reqtype = PROTO_REQ_MULTIBULK;
-            } else {
-                c->reqtype = PROTO_REQ_INLINE;
+        if (c->flags & CLIENT_PENDING_COMMAND) {
+            /* The command was already parsed by an I/O thread. */
+            c->flags &= ~CLIENT_PENDING_COMMAND;
+        } else {
+            /* Determine request type when unknown. */
+            if (!c->reqtype) {
+                if (c->querybuf[c->qb_pos] == '*') {
+                    c->reqtype = PROTO_REQ_MULTIBULK;
+                } else {
+                    c->reqtype = PROTO_REQ_INLINE;
+                }
             }
-        }
 
-        if (c->reqtype == PROTO_REQ_INLINE) {
-            // 构造参数
-            if (processInlineBuffer(c) != C_OK) {
-                break;
-            }
-        } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
-            if (processMultibulkBuffer(c) != C_OK) {
-                break;
+            if (c->reqtype == PROTO_REQ_INLINE) {
+                // 构造参数
+                if (processInlineBuffer(c) != C_OK) {
+                    break;
+                }
+            } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
+                if (processMultibulkBuffer(c) != C_OK) {
+                    break;
+                }
+            } else {
+                serverPanic("Unknown request type");
             }
-        } else {
-            serverPanic("Unknown request type");
         }
 
         /* Multibulk processing could see a <= 0 length. */
         if (c->argc == 0) {
             resetClient(c);
         } else {
-            /* Only reset the client when the command was executed. */
-            // 执行命令
-            if (processCommand(c) == C_OK) {
-                if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI)) {
-                    /* Update the applied replication offset of our master. */
-                    c->reploff = c->read_reploff - sdslen(c->querybuf) + c->qb_pos;
-                }
-
-                /* Don't reset the client structure for clients blocked in a
-                 * module blocking command, so that the reply callback will
-                 * still be able to access the client argv and argc field.
-                 * The client will be reset in unblockClientFromModule(). */
-                if (!(c->flags & CLIENT_BLOCKED) || c->btype != BLOCKED_MODULE) {
-                    resetClient(c);
-                }
-            }
-            /* freeMemoryIfNeeded may flush slave output buffers. This may
-             * result into a slave, that may be the active client, to be
-             * freed. */
-            if (server.current_client == NULL) {
+            /* If we are in the context of an I/O thread, we can't really
+             * execute the command here. All we can do is to flag the client
+             * as one that needs to process the command. */
+            if (c->flags & CLIENT_PENDING_READ) {
+                c->flags |= CLIENT_PENDING_COMMAND;
                 break;
             }
+
+            /* Only reset the client when the command was executed. If the
+             * client is no longer valid, return ASAP without trimming the
+             * query buffer. */
+            if (processCommandAndResetClient(c) == C_ERR) {
+                return;
+            }
         }
     }
 
     /* Trim to pos */
-    if (server.current_client != NULL && c->qb_pos) {
+    if (c->qb_pos) {
         sdsrange(c->querybuf,c->qb_pos,-1);
         c->qb_pos = 0;
     }
-
-    server.current_client = NULL;
 }
 
 /* This is a wrapper for processInputBuffer that also cares about handling
@@ -1557,6 +1774,10 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     UNUSED(el);
     UNUSED(mask);
 
+    /* Check if we want to read from the client later when exiting from
+     * the event loop. This is the case if threaded I/O is enabled. */
+    if (postponeClientRead(c)) return;
+
     readlen = PROTO_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
      * that is large enough, try to maximize the probability that the query
@@ -1588,12 +1809,12 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
             return;
         } else {
             serverLog(LL_VERBOSE, "Reading from client: %s",strerror(errno));
-            freeClient(c);
+            freeClientFromIOHandler(c);
             return;
         }
     } else if (nread == 0) {//客户端关闭
         serverLog(LL_VERBOSE, "Client closed connection");
-        freeClient(c);
+        freeClientFromIOHandler(c);
         return;
     } else if (c->flags & CLIENT_MASTER) {// master节点
         /* Append the query buffer to the pending (not applied) buffer
@@ -1608,7 +1829,7 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     if (c->flags & CLIENT_MASTER) {
         c->read_reploff += nread;
     }
-    server.stat_net_input_bytes += nread;
+    atomicIncr(server.stat_net_input_bytes,nread);
     if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
         sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
 
@@ -1616,7 +1837,7 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         serverLog(LL_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
         sdsfree(ci);
         sdsfree(bytes);
-        freeClient(c);
+        freeClientFromIOHandler(c);
         return;
     }
 
@@ -2281,6 +2502,12 @@ int clientsArePaused(void) {
 int processEventsWhileBlocked(void) {
     int iterations = 4; /* See the function top-comment. */
     int count = 0;
+
+    /* Note: when we are processing events while blocked (for instance during
+     * busy Lua scripts), we set a global flag. When such flag is set, we
+     * avoid handling the read part of clients using threaded I/O, since
+     * beforeSleep() is not called here to process the postponed reads. */
+    ProcessingEventsWhileBlocked = 1;
     while (iterations--) {
         int events = 0;
         events += aeProcessEvents(server.el, AE_FILE_EVENTS|AE_DONT_WAIT);
@@ -2288,5 +2515,310 @@ int processEventsWhileBlocked(void) {
         if (!events) break;
         count += events;
     }
+    ProcessingEventsWhileBlocked = 0;
+    return count;
+}
+
+/* ==========================================================================
+ * Threaded I/O
+ * ========================================================================== */
+
+pthread_t io_threads[IO_THREADS_MAX_NUM];
+pthread_mutex_t io_threads_mutex[IO_THREADS_MAX_NUM];
+unsigned long io_threads_pending[IO_THREADS_MAX_NUM];
+
+/* This is the list of clients each thread will serve when threaded I/O is
+ * used. We spawn io_threads_num-1 threads, since one is the main thread
+ * itself. */
+list *io_threads_list[IO_THREADS_MAX_NUM];
+
+static inline unsigned long getIOPendingCount(int i) {
+    unsigned long count = 0;
+    atomicGetWithSync(io_threads_pending[i],count);
     return count;
 }
+
+static inline void setIOPendingCount(int i, unsigned long count) {
+    atomicSetWithSync(io_threads_pending[i],count);
+}
+
+void *IOThreadMain(void *myid) {
+    /* The ID is the thread number (from 0 to server.iothreads_num-1), and is
+     * used by the thread to just manipulate a single sub-array of clients. */
+    long id = (unsigned long)myid;
+
+    while(1) {
+        /* Wait for start */
+        for (int j = 0; j < 1000000; j++) {
+            if (getIOPendingCount(id) != 0) break;
+        }
+
+        /* Give the main thread a chance to stop this thread. */
+        if (getIOPendingCount(id) == 0) {
+            pthread_mutex_lock(&io_threads_mutex[id]);
+            pthread_mutex_unlock(&io_threads_mutex[id]);
+            continue;
+        }
+
+        /* Process: note that the main thread will never touch our list
+         * before we drop the pending count to 0. */
+        listIter li;
+        listNode *ln;
+        listRewind(io_threads_list[id],&li);
+        while((ln = listNext(&li))) {
+            client *c = listNodeValue(ln);
+            if (io_threads_op == IO_THREADS_OP_WRITE) {
+                writeToClient(c->fd,c,0);
+            } else if (io_threads_op == IO_THREADS_OP_READ) {
+                readQueryFromClient(server.el,c->fd,c,0);
+            } else {
+                serverPanic("io_threads_op value is unknown");
+            }
+        }
+        listEmpty(io_threads_list[id]);
+        setIOPendingCount(id,0);
+    }
+}
+
+/* Initialize the data structures needed for threaded I/O. */
+void initThreadedIO(void) {
+    server.io_threads_active = 0; /* We start with threads not active. */
+
+    /* Don't spawn any thread if the user selected a single thread:
+     * we'll handle I/O directly from the main thread. */
+    if (server.io_threads_num == 1) return;
+
+    /* Spawn and initialize the I/O threads. */
+    for (int i = 0; i < server.io_threads_num; i++) {
+        /* Things we do for all the threads including the main thread. */
+        io_threads_list[i] = listCreate();
+        if (i == 0) continue; /* Thread 0 is the main thread. */
+
+        /* Things we do only for the additional threads. */
+        pthread_t tid;
+        pthread_mutex_init(&io_threads_mutex[i],NULL);
+        setIOPendingCount(i,0);
+        /* Thread will be stopped. */
+        pthread_mutex_lock(&io_threads_mutex[i]);
+        if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)i) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize I/O threads.");
+            exit(1);
+        }
+        io_threads[i] = tid;
+    }
+}
+
+static void startThreadedIO(void) {
+    serverAssert(server.io_threads_active == 0);
+    for (int j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_unlock(&io_threads_mutex[j]);
+    server.io_threads_active = 1;
+}
+
+static void stopThreadedIO(void) {
+    serverAssert(server.io_threads_active == 1);
+    for (int j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_lock(&io_threads_mutex[j]);
+    server.io_threads_active = 0;
+}
+
+/* The threads spin waiting for work while active, which is a waste of CPU
+ * when the server is mostly idle. This function stops the threads when
+ * there are too few clients to serve ('pending'), and returns 1 if the
+ * caller should handle the clients without threads, 0 otherwise (in which
+ * case the caller should start the threads if they are not active). */
+static int stopThreadedIOIfNeeded(int pending) {
+    /* Return ASAP if I/O threads are disabled (single threaded mode). */
+    if (server.io_threads_num == 1) return 1;
+
+    if (pending < (server.io_threads_num*2)) {
+        if (server.io_threads_active) stopThreadedIO();
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* Return 1 if we want to handle the client read later using threaded I/O.
+ * This is called by the readable handler of the event loop.
+ * As a side effect of calling this function the client is put in the
+ * pending read clients and flagged as such. Masters and slaves are always
+ * served synchronously since they need the replication stream to be
+ * handled in order, and so are clients while the server is paused. */
+static int postponeClientRead(client *c) {
+    if (server.io_threads_num > 1 &&
+        !ProcessingEventsWhileBlocked &&
+        !(c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PENDING_READ)) &&
+        !clientsArePaused())
+    {
+        c->flags |= CLIENT_PENDING_READ;
+        listAddNodeHead(server.clients_pending_read,c);
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* When threaded I/O is also enabled for the reading + parsing side, the
+ * readable handler will just put normal clients into a queue of clients to
+ * process (instead of serving them synchronously). This function runs
+ * the queue using the I/O threads, and process them in order to accumulate
+ * the reads in the buffers, and also parse the first command available
+ * rendering it in the client structures. Then the commands are executed
+ * by the main thread, so command execution is still single threaded. */
+int handleClientsWithPendingReadsUsingThreads(void) {
+    int processed = listLength(server.clients_pending_read);
+    int threads = server.io_threads_num;
+
+    /* With just a few clients to serve, waking up the threads costs more
+     * than serving the clients from the main thread. */
+    if (stopThreadedIOIfNeeded(processed)) {
+        threads = 1;
+    } else if (!server.io_threads_active) {
+        startThreadedIO();
+    }
+    if (processed == 0) return 0;
+
+    /* Distribute the clients across N different lists. */
+    listIter li;
+    listNode *ln;
+    listRewind(server.clients_pending_read,&li);
+    int item_id = 0;
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        int target_id = item_id % threads;
+        listAddNodeTail(io_threads_list[target_id],c);
+        item_id++;
+    }
+
+    /* Give the start condition to the waiting threads, by setting the
+     * start condition atomic var. */
+    io_threads_op = IO_THREADS_OP_READ;
+    for (int j = 1; j < threads; j++) {
+        int count = listLength(io_threads_list[j]);
+        setIOPendingCount(j,count);
+    }
+
+    /* Also use the main thread to process a slice of clients. */
+    listRewind(io_threads_list[0],&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        readQueryFromClient(server.el,c->fd,c,0);
+    }
+    listEmpty(io_threads_list[0]);
+
+    /* Wait for all the other threads to end their work. */
+    while(1) {
+        unsigned long pending = 0;
+        for (int j = 1; j < threads; j++)
+            pending += getIOPendingCount(j);
+        if (pending == 0) break;
+    }
+    io_threads_op = IO_THREADS_OP_IDLE;
+    if (threads > 1) server.stat_io_reads_processed += processed;
+
+    /* Run the list of clients again to install the write handler where
+     * needed, and execute the commands the threads parsed. */
+    while(listLength(server.clients_pending_read)) {
+        ln = listFirst(server.clients_pending_read);
+        client *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_READ;
+        listDelNode(server.clients_pending_read,ln);
+
+        /* Replies (protocol errors) emitted by the threads did not install
+         * the write handler, see prepareClientToWrite(). */
+        if (!(c->flags & CLIENT_PENDING_WRITE) && clientHasPendingReplies(c))
+            clientInstallWriteHandler(c);
+
+        processInputBuffer(c);
+    }
+    return processed;
+}
+
+/* Like handleClientsWithPendingWrites(), but the clients with pending output
+ * are distributed across the I/O threads, each one writing its own batch of
+ * clients, so that the write(2) calls scale across cores. The main thread
+ * waits for all the threads to finish before the next event loop iteration,
+ * and installs the write handler where needed. */
+int handleClientsWithPendingWritesUsingThreads(void) {
+    int processed = listLength(server.clients_pending_write);
+    if (processed == 0) return 0; /* Return ASAP if there are no clients. */
+
+    /* If I/O threads are disabled or we have few clients to serve, don't
+     * use I/O threads, but the boring synchronous code. */
+    if (stopThreadedIOIfNeeded(processed)) {
+        return handleClientsWithPendingWrites();
+    }
+
+    /* Start threads if needed. */
+    if (!server.io_threads_active) startThreadedIO();
+
+    /* Distribute the clients across N different lists. The clients are
+     * left in the pending write list, which is scanned again once the
+     * threads are done: while serving the clients with threaded I/O no
+     * client is freed synchronously, so the list can't be modified. */
+    listIter li;
+    listNode *ln;
+    listRewind(server.clients_pending_write,&li);
+    int item_id = 0;
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_WRITE;
+
+        /* If a client is protected, don't do anything, that may trigger
+         * write error or recreate handler. Clients that are going to be
+         * closed ASAP are skipped as well. */
+        if (c->flags & (CLIENT_PROTECTED|CLIENT_CLOSE_ASAP)) {
+            listDelNode(server.clients_pending_write,ln);
+            continue;
+        }
+
+        /* Releasing the reference to an object is not thread safe, since
+         * the same object may be referenced by clients served by different
+         * threads: clients referencing objects are served by the main
+         * thread. */
+        int target_id = c->reply_refs ? 0 : item_id % server.io_threads_num;
+        listAddNodeTail(io_threads_list[target_id],c);
+        item_id++;
+    }
+
+    /* Give the start condition to the waiting threads, by setting the
+     * start condition atomic var. */
+    io_threads_op = IO_THREADS_OP_WRITE;
+    for (int j = 1; j < server.io_threads_num; j++) {
+        int count = listLength(io_threads_list[j]);
+        setIOPendingCount(j,count);
+    }
+
+    /* Also use the main thread to process a slice of clients. */
+    listRewind(io_threads_list[0],&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        writeToClient(c->fd,c,0);
+    }
+    listEmpty(io_threads_list[0]);
+
+    /* Wait for all the other threads to end their work. */
+    while(1) {
+        unsigned long pending = 0;
+        for (int j = 1; j < server.io_threads_num; j++)
+            pending += getIOPendingCount(j);
+        if (pending == 0) break;
+    }
+    io_threads_op = IO_THREADS_OP_IDLE;
+
+    /* Run the list of clients again to install the write handler where
+     * needed. */
+    listRewind(server.clients_pending_write,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        /* If after the threaded writes above we still have data to output
+         * to the client, we need to install the writable handler. */
+        if (!(c->flags & CLIENT_CLOSE_ASAP) && clientHasPendingReplies(c))
+            installClientWriteHandler(c);
+    }
+    listEmpty(server.clients_pending_write);
+    server.stat_io_writes_processed += item_id;
+    return processed;
+}
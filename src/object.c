@@ -239,10 +239,26 @@ robj *createIntsetObject(void) {
     return o;
 }
 
+robj *createSparseBitmapObject(size_t len) {
+    sparseBitmap *sb = zmalloc(sizeof(*sb));
+    sb->len = len;
+    sb->bits = roaringNew();
+    robj *o = createObject(OBJ_STRING,sb);
+    o->encoding = OBJ_ENCODING_ROARING;
+    return o;
+}
+
 robj *createHashObject(void) {
-    unsigned char *zl = ziplistNew();
+    unsigned char *zl = lpNew();
     robj *o = createObject(OBJ_HASH, zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    o->encoding = OBJ_ENCODING_LISTPACK;
+    return o;
+}
+
+robj *createIntmapHashObject(void) {
+    intmap *im = intmapNew();
+    robj *o = createObject(OBJ_HASH, im);
+    o->encoding = OBJ_ENCODING_INTMAP;
     return o;
 }
 
@@ -252,15 +268,35 @@ robj *createZsetObject(void) {
 
     zs->dict = dictCreate(&zsetDictType,NULL);
     zs->zsl = zslCreate();
+    zs->zbt = NULL;
     o = createObject(OBJ_ZSET,zs);
     o->encoding = OBJ_ENCODING_SKIPLIST;
     return o;
 }
 
-robj *createZsetZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
+robj *createZsetBtreeObject(void) {
+    zset *zs = zmalloc(sizeof(*zs));
+    robj *o;
+
+    zs->dict = dictCreate(&zsetDictType,NULL);
+    zs->zsl = NULL;
+    zs->zbt = zbtCreate();
+    o = createObject(OBJ_ZSET,zs);
+    o->encoding = OBJ_ENCODING_BTREE;
+    return o;
+}
+
+robj *createZsetListpackObject(void) {
+    unsigned char *zl = lpNew();
     robj *o = createObject(OBJ_ZSET,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    o->encoding = OBJ_ENCODING_LISTPACK;
+    return o;
+}
+
+robj *createZsetPackedTreeObject(void) {
+    zptree *zpt = zptCreate();
+    robj *o = createObject(OBJ_ZSET,zpt);
+    o->encoding = OBJ_ENCODING_PACKEDTREE;
     return o;
 }
 
@@ -281,6 +317,10 @@ robj *createModuleObject(moduleType *mt, void *value) {
 void freeStringObject(robj *o) {
     if (o->encoding == OBJ_ENCODING_RAW) {
         sdsfree(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        sparseBitmap *sb = o->ptr;
+        roaringFree(sb->bits);
+        zfree(sb);
     }
 }
 
@@ -300,6 +340,9 @@ void freeSetObject(robj *o) {
     case OBJ_ENCODING_INTSET:
         zfree(o->ptr);
         break;
+    case OBJ_ENCODING_ROARING:
+        roaringFree(o->ptr);
+        break;
     default:
         serverPanic("Unknown set encoding type");
     }
@@ -314,8 +357,17 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
+        break;
+    case OBJ_ENCODING_PACKEDTREE:
+        zptFree(o->ptr);
+        break;
+    case OBJ_ENCODING_BTREE:
+        zs = o->ptr;
+        dictRelease(zs->dict);
+        zbtFree(zs->zbt);
+        zfree(zs);
         break;
     default:
         serverPanic("Unknown sorted set encoding");
@@ -327,7 +379,10 @@ void freeHashObject(robj *o) {
     case OBJ_ENCODING_HT:
         dictRelease((dict*) o->ptr);
         break;
-    case OBJ_ENCODING_ZIPLIST:
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
+        break;
+    case OBJ_ENCODING_INTMAP:
         zfree(o->ptr);
         break;
     default:
@@ -526,6 +581,12 @@ robj *getDecodedObject(robj *o) {
         ll2string(buf,32,(long)o->ptr);
         dec = createStringObject(buf,strlen(buf));
         return dec;
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_ROARING) {
+        sparseBitmap *sb = o->ptr;
+
+        dec = createObject(OBJ_STRING,sdsnewlen(NULL,sb->len));
+        sparseBitmapRead(sb,dec->ptr,0,sb->len);
+        return dec;
     } else {
         serverPanic("Unknown encoding type");
     }
@@ -603,11 +664,23 @@ size_t stringObjectLen(robj *o) {
     serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
     if (sdsEncodedObject(o)) {
         return sdslen(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        return ((sparseBitmap*)o->ptr)->len;
     } else {
         return sdigits10((long)o->ptr);
     }
 }
 
+/* Return a decoded copy of a sparse bitmap to parse it as a number, or NULL
+ * if it can't be one: a bitmap with fewer bits set than bytes has a zero
+ * byte, that a number never contains. */
+static robj *getDecodedNumericBitmap(robj *o) {
+    sparseBitmap *sb = o->ptr;
+
+    if (roaringCard(sb->bits) < sb->len) return NULL;
+    return getDecodedObject(o);
+}
+
 int getDoubleFromObject(const robj *o, double *target) {
     double value;
     char *eptr;
@@ -628,6 +701,14 @@ int getDoubleFromObject(const robj *o, double *target) {
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            robj *dec = getDecodedNumericBitmap((robj*)o);
+            int retval;
+
+            if (dec == NULL) return C_ERR;
+            retval = getDoubleFromObject(dec,target);
+            decrRefCount(dec);
+            return retval;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -670,6 +751,14 @@ int getLongDoubleFromObject(robj *o, long double *target) {
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            robj *dec = getDecodedNumericBitmap(o);
+            int retval;
+
+            if (dec == NULL) return C_ERR;
+            retval = getLongDoubleFromObject(dec,target);
+            decrRefCount(dec);
+            return retval;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -703,6 +792,14 @@ int getLongLongFromObject(robj *o, long long *target) {
             if (string2ll(o->ptr,sdslen(o->ptr),&value) == 0) return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            robj *dec = getDecodedNumericBitmap(o);
+            int retval;
+
+            if (dec == NULL) return C_ERR;
+            retval = getLongLongFromObject(dec,target);
+            decrRefCount(dec);
+            return retval;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -748,8 +845,13 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_HT: return "hashtable";
     case OBJ_ENCODING_QUICKLIST: return "quicklist";
     case OBJ_ENCODING_ZIPLIST: return "ziplist";
+    case OBJ_ENCODING_LISTPACK: return "listpack";
     case OBJ_ENCODING_INTSET: return "intset";
+    case OBJ_ENCODING_INTMAP: return "intmap";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
+    case OBJ_ENCODING_PACKEDTREE: return "packedtree";
+    case OBJ_ENCODING_BTREE: return "btree";
+    case OBJ_ENCODING_ROARING: return "roaring";
     case OBJ_ENCODING_EMBSTR: return "embstr";
     default: return "unknown";
     }
@@ -800,6 +902,9 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             asize = sdsAllocSize(o->ptr)+sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_EMBSTR) {
             asize = sdslen(o->ptr)+2+sizeof(*o);
+        } else if(o->encoding == OBJ_ENCODING_ROARING) {
+            sparseBitmap *sb = o->ptr;
+            asize = sizeof(*o)+sizeof(*sb)+roaringAllocSize(sb->bits);
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -809,7 +914,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             quicklistNode *node = ql->head;
             asize = sizeof(*o)+sizeof(quicklist);
             do {
-                elesize += sizeof(quicklistNode)+ziplistBlobLen(node->zl);
+                elesize += sizeof(quicklistNode)+lpBytes(node->zl);
                 samples++;
             } while ((node = node->next) && samples < sample_size);
             asize += (double)elesize/samples*ql->len;
@@ -833,12 +938,14 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             intset *is = o->ptr;
             asize = sizeof(*o)+sizeof(*is)+is->encoding*is->length;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            asize = sizeof(*o)+roaringAllocSize(o->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
             d = ((zset*)o->ptr)->dict;
             zskiplist *zsl = ((zset*)o->ptr)->zsl;
@@ -853,12 +960,30 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                 znode = znode->level[0].forward;
             }
             if (samples) asize += (double)elesize/samples*dictSize(d);
+        } else if (o->encoding == OBJ_ENCODING_PACKEDTREE) {
+            asize = sizeof(*o)+zptAllocSize(o->ptr);
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            d = ((zset*)o->ptr)->dict;
+            zbtNode *n = ((zset*)o->ptr)->zbt->head;
+            asize = sizeof(*o)+sizeof(zset)+sizeof(zbtree)+sizeof(dict)+
+                    (sizeof(struct dictEntry*)*dictSlots(d));
+            /* Sample whole leaves, the inner nodes are comparatively few. */
+            while(n != NULL && samples < sample_size) {
+                for (int j = 0; j < n->num; j++)
+                    elesize += sdsAllocSize(n->ele[j]) + sizeof(struct dictEntry);
+                elesize += zmalloc_size(n);
+                samples += n->num;
+                n = n->next;
+            }
+            if (samples) asize += (double)elesize/samples*dictSize(d);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
+        } else if (o->encoding == OBJ_ENCODING_INTMAP) {
+            asize = sizeof(*o)+intmapBlobLen(o->ptr);
         } else if (o->encoding == OBJ_ENCODING_HT) {
             d = o->ptr;
             di = dictGetIterator(d);
@@ -1058,13 +1183,18 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mh->db[mh->num_dbs].dbid = j;
 
         mem = dictSize(db->dict) * sizeof(dictEntry) +
-              dictSlots(db->dict) * sizeof(dictEntry*) +
+              dictSlots(db->dict) * (sizeof(dictEntry*)+1) +
               dictSize(db->dict) * sizeof(robj);
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
-        mem = dictSize(db->expires) * sizeof(dictEntry) +
-              dictSlots(db->expires) * sizeof(dictEntry*);
+        if (server.expire_in_keyspace) {
+            mem = dictSize(db->dict) * sizeof(keyMeta) +
+                  db->volatile_keys.size * sizeof(dictEntry*);
+        } else {
+            mem = dictSize(db->expires) * sizeof(dictEntry) +
+                  dictSlots(db->expires) * (sizeof(dictEntry*)+1);
+        }
         mh->db[mh->num_dbs].overhead_ht_expires = mem;
         mem_total+=mem;
 
@@ -1345,6 +1475,7 @@ NULL
         size_t usage = objectComputeSize(dictGetVal(de),samples);
         usage += sdsAllocSize(dictGetKey(de));
         usage += sizeof(dictEntry);
+        if (server.expire_in_keyspace) usage += sizeof(keyMeta);
         addReplyLongLong(c,usage);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
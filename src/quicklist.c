@@ -1,4 +1,4 @@
-/* quicklist.c - A doubly linked list of ziplists
+/* quicklist.c - A doubly linked list of listpacks
  *
  * Copyright (c) 2014, Matt Stancliff <matt@genges.com>
  * All rights reserved.
@@ -32,8 +32,18 @@
 #include "quicklist.h"
 #include "zmalloc.h"
 #include "ziplist.h"
+#include "listpack.h"
 #include "util.h" /* for ll2string */
 #include "lzf.h"
+#include "redisassert.h"
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
 
 #if defined(REDIS_TEST) || defined(REDIS_TEST_VERBOSE)
 #include <stdio.h> /* for printf (debug printing), snprintf (genstr) */
@@ -46,11 +56,11 @@
 /* Optimization levels for size-based filling */
 static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
 
-/* Maximum size in bytes of any multi-element ziplist.
- * Larger values will live in their own isolated ziplists. */
+/* Maximum size in bytes of any multi-element listpack.
+ * Larger values will live in their own isolated listpacks. */
 #define SIZE_SAFETY_LIMIT 8192
 
-/* Minimum ziplist size in bytes for attempting compression. */
+/* Minimum listpack size in bytes for attempting compression. */
 #define MIN_COMPRESS_BYTES 48
 
 /* Minimum size reduction in bytes to store compressed quicklistNode data.
@@ -58,6 +68,82 @@ static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
  * resulted in a larger size than the original data. */
 #define MIN_COMPRESS_IMPROVE 8
 
+/* Compression level used for ZSTD nodes. */
+#define ZSTD_COMPRESS_LEVEL 3
+
+/* Codecs usable to compress quicklist nodes, indexed by node encoding.
+ * compress() returns the compressed length, or 0 if the result did not fit
+ * in 'out_len' bytes. decompress() returns 1 only if exactly 'out_len' bytes
+ * were produced. LZF is always available, LZ4 and ZSTD only when the server
+ * is built with USE_LZ4=yes / USE_ZSTD=yes. */
+typedef struct quicklistCodec {
+    size_t (*compress)(const void *in, size_t in_len, void *out,
+                       size_t out_len);
+    int (*decompress)(const void *in, size_t in_len, void *out,
+                      size_t out_len);
+} quicklistCodec;
+
+static size_t lzfCodecCompress(const void *in, size_t in_len, void *out,
+                               size_t out_len) {
+    return lzf_compress(in, in_len, out, out_len);
+}
+
+static int lzfCodecDecompress(const void *in, size_t in_len, void *out,
+                              size_t out_len) {
+    return lzf_decompress(in, in_len, out, out_len) == out_len;
+}
+
+#ifdef USE_LZ4
+static size_t lz4CodecCompress(const void *in, size_t in_len, void *out,
+                               size_t out_len) {
+    int n = LZ4_compress_default(in, out, in_len, out_len);
+    return n > 0 ? (size_t)n : 0;
+}
+
+static int lz4CodecDecompress(const void *in, size_t in_len, void *out,
+                              size_t out_len) {
+    return LZ4_decompress_safe(in, out, in_len, out_len) == (int)out_len;
+}
+#endif
+
+#ifdef USE_ZSTD
+/* Contexts are reused across calls: creating one per node would cost more
+ * than compressing a few KB of listpack. */
+static ZSTD_CCtx *zstd_cctx = NULL;
+static ZSTD_DCtx *zstd_dctx = NULL;
+
+static size_t zstdCodecCompress(const void *in, size_t in_len, void *out,
+                                size_t out_len) {
+    if (zstd_cctx == NULL) zstd_cctx = ZSTD_createCCtx();
+    size_t n = ZSTD_compressCCtx(zstd_cctx, out, out_len, in, in_len,
+                                 ZSTD_COMPRESS_LEVEL);
+    return ZSTD_isError(n) ? 0 : n;
+}
+
+static int zstdCodecDecompress(const void *in, size_t in_len, void *out,
+                               size_t out_len) {
+    if (zstd_dctx == NULL) zstd_dctx = ZSTD_createDCtx();
+    return ZSTD_decompressDCtx(zstd_dctx, out, out_len, in, in_len) == out_len;
+}
+#endif
+
+static const quicklistCodec codecs[] = {
+    [QUICKLIST_NODE_ENCODING_LZF] = {lzfCodecCompress, lzfCodecDecompress},
+#ifdef USE_LZ4
+    [QUICKLIST_NODE_ENCODING_LZ4] = {lz4CodecCompress, lz4CodecDecompress},
+#endif
+#ifdef USE_ZSTD
+    [QUICKLIST_NODE_ENCODING_ZSTD] = {zstdCodecCompress,
+                                      zstdCodecDecompress},
+#endif
+};
+
+#define CODECS_COUNT (sizeof(codecs) / sizeof(*codecs))
+
+/* Codec used for nodes compressed from now on. Nodes already compressed
+ * keep the codec recorded in their encoding, so a list may mix codecs. */
+static int compress_codec = QUICKLIST_NODE_ENCODING_LZF;
+
 /* If not verbose testing, remove all debug printing. */
 #ifndef REDIS_TEST_VERBOSE
 #define D(...)
@@ -128,6 +214,21 @@ void quicklistSetOptions(quicklist *quicklist, int fill, int depth) {
     quicklistSetCompressDepth(quicklist, depth);
 }
 
+/* Return 1 if nodes can be compressed and decompressed with the codec
+ * of the given node 'encoding' in this build, otherwise 0. */
+int quicklistCodecIsAvailable(int encoding) {
+    return encoding > QUICKLIST_NODE_ENCODING_RAW &&
+           (size_t)encoding < CODECS_COUNT && codecs[encoding].compress;
+}
+
+/* Select the codec used to compress nodes from now on, for every quicklist.
+ * Returns 0 if the codec isn't available in this build, 1 otherwise. */
+int quicklistSetCodec(int encoding) {
+    if (!quicklistCodecIsAvailable(encoding)) return 0;
+    compress_codec = encoding;
+    return 1;
+}
+
 /* Create a new quicklist with some default parameters. */
 quicklist *quicklistNew(int fill, int compress) {
     quicklist *quicklist = quicklistCreate();
@@ -143,7 +244,7 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     node->sz = 0;
     node->next = node->prev = NULL;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
-    node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
+    node->container = QUICKLIST_NODE_CONTAINER_PACKED;
     node->recompress = 0;
     return node;
 }
@@ -172,9 +273,9 @@ void quicklistRelease(quicklist *quicklist) {
     zfree(quicklist);
 }
 
-/* Compress the ziplist in 'node' and update encoding details.
- * Returns 1 if ziplist compressed successfully.
- * Returns 0 if compression failed or if ziplist too small to compress. */
+/* Compress the listpack in 'node' and update encoding details.
+ * Returns 1 if listpack compressed successfully.
+ * Returns 0 if compression failed or if listpack too small to compress. */
 REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
 #ifdef REDIS_TEST
     node->attempted_compress = 1;
@@ -184,20 +285,21 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
     if (node->sz < MIN_COMPRESS_BYTES)
         return 0;
 
+    const quicklistCodec *codec = &codecs[compress_codec];
     quicklistLZF *lzf = zmalloc(sizeof(*lzf) + node->sz);
 
     /* Cancel if compression fails or doesn't compress small enough */
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
-                                 node->sz)) == 0) ||
+    if (((lzf->sz = codec->compress(node->zl, node->sz, lzf->compressed,
+                                    node->sz)) == 0) ||
         lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressable. */
+        /* The codec aborts/rejects compression if value not compressable. */
         zfree(lzf);
         return 0;
     }
     lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
     zfree(node->zl);
     node->zl = (unsigned char *)lzf;
-    node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    node->encoding = compress_codec;
     node->recompress = 0;
     return 1;
 }
@@ -210,8 +312,12 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
         }                                                                      \
     } while (0)
 
-/* Uncompress the ziplist in 'node' and update encoding details.
- * Returns 1 on successful decode, 0 on failure to decode. */
+/* Uncompress the listpack in 'node' and update encoding details.
+ * Returns 1 on successful decode, 0 on failure.
+ *
+ * On failure the node is left compressed: compressed nodes loaded from an
+ * RDB file are adopted without decoding them, see
+ * quicklistValidateCompression() for input that can't be trusted. */
 REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 #ifdef REDIS_TEST
     node->attempted_compress = 0;
@@ -219,7 +325,8 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 
     void *decompressed = zmalloc(node->sz);
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+    if (!codecs[node->encoding].decompress(lzf->compressed, lzf->sz,
+                                           decompressed, node->sz)) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
         zfree(decompressed);
         return 0;
@@ -233,7 +340,7 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 /* Decompress only compressed nodes. */
 #define quicklistDecompressNode(_node)                                         \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
         }                                                                      \
     } while (0)
@@ -241,21 +348,33 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 /* Force node to not be immediately re-compresable */
 #define quicklistDecompressNodeForUse(_node)                                   \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
             (_node)->recompress = 1;                                           \
         }                                                                      \
     } while (0)
 
-/* Extract the raw LZF data from this quicklistNode.
- * Pointer to LZF data is assigned to '*data'.
- * Return value is the length of compressed LZF data. */
+/* Extract the raw compressed data from this quicklistNode, in the format of
+ * the codec named by node->encoding.
+ * Pointer to compressed data is assigned to '*data'.
+ * Return value is the length of compressed data. */
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
     *data = lzf->compressed;
     return lzf->sz;
 }
 
+/* Return 1 if some node of 'quicklist' is compressed with a codec other
+ * than LZF, so that it can't be serialized as a plain LZF string. */
+int quicklistHasNonLzfNodes(const quicklist *quicklist) {
+    for (quicklistNode *node = quicklist->head; node; node = node->next) {
+        if (quicklistNodeIsCompressed(node) &&
+            node->encoding != QUICKLIST_NODE_ENCODING_LZF)
+            return 1;
+    }
+    return 0;
+}
+
 #define quicklistAllowsCompression(_ql) ((_ql)->compress != 0)
 
 /* Force 'quicklist' to meet compression guidelines set by compress depth.
@@ -313,7 +432,9 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
         if (forward == node || reverse == node)
             in_depth = 1;
 
-        if (forward == reverse)
+        /* We passed into compress depth of opposite side of the quicklist
+         * so there's no need to compress anything and we can exit. */
+        if (forward == reverse || forward->next == reverse)
             return;
 
         forward = forward->next;
@@ -422,23 +543,25 @@ REDIS_STATIC int _quicklistNodeAllowInsert(const quicklistNode *node,
     if (unlikely(!node))
         return 0;
 
-    int ziplist_overhead;
-    /* size of previous offset */
-    if (sz < 254)
-        ziplist_overhead = 1;
+    int listpack_overhead;
+    /* size of encoding header */
+    if (sz < 64)
+        listpack_overhead = 1;
+    else if (likely(sz < 4096))
+        listpack_overhead = 2;
     else
-        ziplist_overhead = 5;
+        listpack_overhead = 5;
 
-    /* size of forward offset */
-    if (sz < 64)
-        ziplist_overhead += 1;
-    else if (likely(sz < 16384))
-        ziplist_overhead += 2;
+    /* size of backward length */
+    if (sz + listpack_overhead < 128)
+        listpack_overhead += 1;
+    else if (likely(sz + listpack_overhead < 16384))
+        listpack_overhead += 2;
     else
-        ziplist_overhead += 5;
+        listpack_overhead += 5;
 
     /* new_sz overestimates if 'sz' encodes to an integer type */
-    unsigned int new_sz = node->sz + sz + ziplist_overhead;
+    unsigned int new_sz = node->sz + sz + listpack_overhead;
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(new_sz, fill)))
         return 1;
     else if (!sizeMeetsSafetyLimit(new_sz))
@@ -455,9 +578,9 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
     if (!a || !b)
         return 0;
 
-    /* approximate merged ziplist size (- 11 to remove one ziplist
+    /* approximate merged listpack size (- 7 to remove one listpack
      * header/trailer) */
-    unsigned int merge_sz = a->sz + b->sz - 11;
+    unsigned int merge_sz = a->sz + b->sz - 7;
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(merge_sz, fill)))
         return 1;
     else if (!sizeMeetsSafetyLimit(merge_sz))
@@ -470,7 +593,7 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
 
 #define quicklistNodeUpdateSz(node)                                            \
     do {                                                                       \
-        (node)->sz = ziplistBlobLen((node)->zl);                               \
+        (node)->sz = lpBytes((node)->zl);                                      \
     } while (0)
 
 /* Add new entry to head node of quicklist.
@@ -482,11 +605,11 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
     if (likely(
             _quicklistNodeAllowInsert(quicklist->head, quicklist->fill, sz))) {
         quicklist->head->zl =
-            ziplistPush(quicklist->head->zl, value, sz, ZIPLIST_HEAD);
+            lpPrepend(quicklist->head->zl, value, sz);
         quicklistNodeUpdateSz(quicklist->head);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        node->zl = lpPrepend(lpNew(), value, sz);
 
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeBefore(quicklist, quicklist->head, node);
@@ -505,11 +628,11 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     if (likely(
             _quicklistNodeAllowInsert(quicklist->tail, quicklist->fill, sz))) {
         quicklist->tail->zl =
-            ziplistPush(quicklist->tail->zl, value, sz, ZIPLIST_TAIL);
+            lpAppend(quicklist->tail->zl, value, sz);
         quicklistNodeUpdateSz(quicklist->tail);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_TAIL);
+        node->zl = lpAppend(lpNew(), value, sz);
 
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
@@ -519,20 +642,131 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     return (orig_tail != quicklist->tail);
 }
 
-/* Create new node consisting of a pre-formed ziplist.
- * Used for loading RDBs where entire ziplists have been stored
+/* Create new node consisting of a pre-formed listpack.
+ * Used for loading RDBs where entire listpacks have been stored
  * to be retrieved later. */
-void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
+void quicklistAppendListpack(quicklist *quicklist, unsigned char *zl) {
     quicklistNode *node = quicklistCreateNode();
 
     node->zl = zl;
-    node->count = ziplistLen(node->zl);
-    node->sz = ziplistBlobLen(zl);
+    node->count = lpLength(node->zl);
+    node->sz = lpBytes(zl);
 
     _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
     quicklist->count += node->count;
 }
 
+/* Append a node holding 'data' to the tail of 'quicklist', taking ownership
+ * of 'data'. With a RAW 'encoding' 'data' is a listpack, otherwise it is a
+ * quicklistLZF compressed with the codec of 'encoding'. 'sz' and 'count' are
+ * the size and number of entries of the listpack.
+ *
+ * No compression pass is run, so that nodes loaded in bulk are not
+ * decompressed and compressed again while they pass through the tail depth:
+ * once done appending, the caller must call quicklistFixCompression(). */
+void quicklistAppendEncoded(quicklist *quicklist, unsigned char *data,
+                            int encoding, unsigned int sz,
+                            unsigned int count) {
+    quicklistNode *node = quicklistCreateNode();
+
+    node->zl = data;
+    node->sz = sz;
+    node->count = count;
+    node->encoding = encoding;
+
+    node->prev = quicklist->tail;
+    if (quicklist->tail)
+        quicklist->tail->next = node;
+    else
+        quicklist->head = node;
+    quicklist->tail = node;
+    quicklist->len++;
+    quicklist->count += count;
+}
+
+/* Listpack header: 32 bit total bytes + 16 bit number of elements, the
+ * latter set to UINT16_MAX when there are too many elements to count. */
+#define LISTPACK_HDR_SIZE 6
+#define LISTPACK_HDR_NUMELE_UNKNOWN UINT16_MAX
+
+/* Append a node holding 'lzf', an LZF compressed listpack of 'sz' bytes as
+ * saved in RDB files, without decompressing it: the entries count is read
+ * from the listpack header, decoding just the first bytes of the stream.
+ * The node then gets decompressed on first access, or by
+ * quicklistFixCompression(), which the caller must call once done
+ * appending, like for quicklistAppendEncoded().
+ *
+ * Takes ownership of 'lzf' on success. Returns 0 without appending
+ * anything if the data isn't a listpack of 'sz' bytes. */
+int quicklistAppendLzf(quicklist *quicklist, quicklistLZF *lzf,
+                       unsigned int sz) {
+    unsigned char hdr[LISTPACK_HDR_SIZE];
+
+    if (!lzf_decompress_prefix(lzf->compressed, lzf->sz, hdr, sizeof(hdr)))
+        return 0;
+
+    uint32_t bytes = (uint32_t)hdr[0] | (uint32_t)hdr[1] << 8 |
+                     (uint32_t)hdr[2] << 16 | (uint32_t)hdr[3] << 24;
+    uint32_t count = (uint32_t)hdr[4] | (uint32_t)hdr[5] << 8;
+    if (bytes != sz || count == 0)
+        return 0;
+
+    if (count == LISTPACK_HDR_NUMELE_UNKNOWN) {
+        /* Counting the entries requires the whole listpack anyway. */
+        unsigned char *zl = zmalloc(sz);
+        if (lzf_decompress(lzf->compressed, lzf->sz, zl, sz) != sz) {
+            zfree(zl);
+            return 0;
+        }
+        zfree(lzf);
+        quicklistAppendEncoded(quicklist, zl, QUICKLIST_NODE_ENCODING_RAW, sz,
+                               lpLength(zl));
+        return 1;
+    }
+
+    quicklistAppendEncoded(quicklist, (unsigned char *)lzf,
+                           QUICKLIST_NODE_ENCODING_LZF, sz, count);
+    return 1;
+}
+
+/* Make every node of 'quicklist' meet the compress depth: nodes within the
+ * depth at both ends are decompressed and the ones in between compressed.
+ * Nodes already holding compressed data keep it as it is.
+ *
+ * Returns 0 if a node within the depth can't be decompressed. */
+int quicklistFixCompression(quicklist *quicklist) {
+    unsigned long depth = quicklist->compress, at = 0;
+
+    for (quicklistNode *node = quicklist->head; node;
+         node = node->next, at++) {
+        if (!quicklistAllowsCompression(quicklist) || at < depth ||
+            quicklist->len - at <= depth) {
+            if (quicklistNodeIsCompressed(node) &&
+                !__quicklistDecompressNode(node))
+                return 0;
+        } else {
+            quicklistCompressNode(node);
+        }
+    }
+    return 1;
+}
+
+/* Like quicklistFixCompression(), but every compressed node is decompressed
+ * first, and its listpack checked against the size and count it was
+ * appended with: nodes in between are then compressed again. This is what
+ * input that can't be trusted, like RESTORE payloads, needs.
+ *
+ * Returns 0 if a node can't be decompressed or doesn't match. */
+int quicklistValidateCompression(quicklist *quicklist) {
+    for (quicklistNode *node = quicklist->head; node; node = node->next) {
+        if (!quicklistNodeIsCompressed(node)) continue;
+        if (!__quicklistDecompressNode(node) ||
+            lpBytes(node->zl) != node->sz || lpLength(node->zl) != node->count)
+            return 0;
+    }
+    return quicklistFixCompression(quicklist);
+}
+
 /* Append all values of ziplist 'zl' individually into 'quicklist'.
  *
  * This allows us to restore old RDB ziplists into new quicklists
@@ -609,12 +843,12 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
  *       already had to get *p from an uncompressed node somewhere.
  *
  * Returns 1 if the entire node was deleted, 0 if node still exists.
- * Also updates in/out param 'p' with the next offset in the ziplist. */
+ * Also updates in/out param 'p' with the next offset in the listpack. */
 REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
                                    unsigned char **p) {
     int gone = 0;
 
-    node->zl = ziplistDelete(node->zl, p);
+    node->zl = lpDelete(node->zl, *p, p);
     node->count--;
     if (node->count == 0) {
         gone = 1;
@@ -630,7 +864,7 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
 /* Delete one element represented by 'entry'
  *
  * 'entry' stores enough metadata to delete the proper position in
- * the correct ziplist in the correct quicklist node. */
+ * the correct listpack in the correct quicklist node. */
 void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
     quicklistNode *prev = entry->node->prev;
     quicklistNode *next = entry->node->next;
@@ -656,7 +890,7 @@ void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
      *   - [1, 2, 3] => delete offset 1 => [1, 3]: next element still offset 1
      *   - [1, 2, 3] => delete offset 0 => [2, 3]: next element still offset 0
      *  if we deleted the last element at offet N and now
-     *  length of this ziplist is N-1, the next call into
+     *  length of this listpack is N-1, the next call into
      *  quicklistNext() will jump to the next node. */
 }
 
@@ -669,8 +903,8 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
     quicklistEntry entry;
     if (likely(quicklistIndex(quicklist, index, &entry))) {
         /* quicklistIndex provides an uncompressed node */
-        entry.node->zl = ziplistDelete(entry.node->zl, &entry.zi);
-        entry.node->zl = ziplistInsert(entry.node->zl, entry.zi, data, sz);
+        entry.node->zl = lpInsert(entry.node->zl, data, sz, entry.zi,
+                                  LP_REPLACE, NULL);
         quicklistNodeUpdateSz(entry.node);
         quicklistCompress(quicklist, entry.node);
         return 1;
@@ -679,9 +913,9 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
     }
 }
 
-/* Given two nodes, try to merge their ziplists.
+/* Given two nodes, try to merge their listpacks.
  *
- * This helps us not have a quicklist with 3 element ziplists if
+ * This helps us not have a quicklist with 3 element listpacks if
  * our fill factor can handle much higher levels.
  *
  * Note: 'a' must be to the LEFT of 'b'.
@@ -692,15 +926,15 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
  *
  * Returns the input node picked to merge against or NULL if
  * merging was not possible. */
-REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
+REDIS_STATIC quicklistNode *_quicklistListpackMerge(quicklist *quicklist,
                                                    quicklistNode *a,
                                                    quicklistNode *b) {
     D("Requested merge (a,b) (%u, %u)", a->count, b->count);
 
     quicklistDecompressNode(a);
     quicklistDecompressNode(b);
-    if ((ziplistMerge(&a->zl, &b->zl))) {
-        /* We merged ziplists! Now remove the unused quicklistNode. */
+    if ((lpMerge(&a->zl, &b->zl))) {
+        /* We merged listpacks! Now remove the unused quicklistNode. */
         quicklistNode *keep = NULL, *nokeep = NULL;
         if (!a->zl) {
             nokeep = a;
@@ -709,7 +943,7 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
             nokeep = b;
             keep = a;
         }
-        keep->count = ziplistLen(keep->zl);
+        keep->count = lpLength(keep->zl);
         quicklistNodeUpdateSz(keep);
 
         nokeep->count = 0;
@@ -722,7 +956,7 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
     }
 }
 
-/* Attempt to merge ziplists within two nodes on either side of 'center'.
+/* Attempt to merge listpacks within two nodes on either side of 'center'.
  *
  * We attempt to merge:
  *   - (center->prev->prev, center->prev)
@@ -750,19 +984,19 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
 
     /* Try to merge prev_prev and prev */
     if (_quicklistNodeAllowMerge(prev, prev_prev, fill)) {
-        _quicklistZiplistMerge(quicklist, prev_prev, prev);
+        _quicklistListpackMerge(quicklist, prev_prev, prev);
         prev_prev = prev = NULL; /* they could have moved, invalidate them. */
     }
 
     /* Try to merge next and next_next */
     if (_quicklistNodeAllowMerge(next, next_next, fill)) {
-        _quicklistZiplistMerge(quicklist, next, next_next);
+        _quicklistListpackMerge(quicklist, next, next_next);
         next = next_next = NULL; /* they could have moved, invalidate them. */
     }
 
     /* Try to merge center node and previous node */
     if (_quicklistNodeAllowMerge(center, center->prev, fill)) {
-        target = _quicklistZiplistMerge(quicklist, center->prev, center);
+        target = _quicklistListpackMerge(quicklist, center->prev, center);
         center = NULL; /* center could have been deleted, invalidate it. */
     } else {
         /* else, we didn't merge here, but target needs to be valid below. */
@@ -771,7 +1005,7 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
 
     /* Use result of center merge (or original) to merge with next node. */
     if (_quicklistNodeAllowMerge(target, target->next, fill)) {
-        _quicklistZiplistMerge(quicklist, target, target->next);
+        _quicklistListpackMerge(quicklist, target, target->next);
     }
 }
 
@@ -801,7 +1035,7 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
     quicklistNode *new_node = quicklistCreateNode();
     new_node->zl = zmalloc(zl_sz);
 
-    /* Copy original ziplist so we can split it */
+    /* Copy original listpack so we can split it */
     memcpy(new_node->zl, node->zl, zl_sz);
 
     /* -1 here means "continue deleting until the list ends" */
@@ -813,12 +1047,12 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
     D("After %d (%d); ranges: [%d, %d], [%d, %d]", after, offset, orig_start,
       orig_extent, new_start, new_extent);
 
-    node->zl = ziplistDeleteRange(node->zl, orig_start, orig_extent);
-    node->count = ziplistLen(node->zl);
+    node->zl = lpDeleteRange(node->zl, orig_start, orig_extent);
+    node->count = lpLength(node->zl);
     quicklistNodeUpdateSz(node);
 
-    new_node->zl = ziplistDeleteRange(new_node->zl, new_start, new_extent);
-    new_node->count = ziplistLen(new_node->zl);
+    new_node->zl = lpDeleteRange(new_node->zl, new_start, new_extent);
+    new_node->count = lpLength(new_node->zl);
     quicklistNodeUpdateSz(new_node);
 
     D("After split lengths: orig (%d), new (%d)", node->count, new_node->count);
@@ -840,7 +1074,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         /* we have no reference node, so let's create only node in the list */
         D("No node given!");
         new_node = quicklistCreateNode();
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->zl = lpPrepend(lpNew(), value, sz);
         __quicklistInsertNode(quicklist, NULL, new_node, after);
         new_node->count++;
         quicklist->count++;
@@ -855,7 +1089,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     }
 
     if (after && (entry->offset == node->count)) {
-        D("At Tail of current ziplist");
+        D("At Tail of current listpack");
         at_tail = 1;
         if (!_quicklistNodeAllowInsert(node->next, fill, sz)) {
             D("Next node is full too.");
@@ -876,19 +1110,14 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     if (!full && after) {
         D("Not full, inserting after current position.");
         quicklistDecompressNodeForUse(node);
-        unsigned char *next = ziplistNext(node->zl, entry->zi);
-        if (next == NULL) {
-            node->zl = ziplistPush(node->zl, value, sz, ZIPLIST_TAIL);
-        } else {
-            node->zl = ziplistInsert(node->zl, next, value, sz);
-        }
+        node->zl = lpInsert(node->zl, value, sz, entry->zi, LP_AFTER, NULL);
         node->count++;
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(quicklist, node);
     } else if (!full && !after) {
         D("Not full, inserting before current position.");
         quicklistDecompressNodeForUse(node);
-        node->zl = ziplistInsert(node->zl, entry->zi, value, sz);
+        node->zl = lpInsert(node->zl, value, sz, entry->zi, LP_BEFORE, NULL);
         node->count++;
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(quicklist, node);
@@ -898,7 +1127,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and tail, but next isn't full; inserting next node head");
         new_node = node->next;
         quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_HEAD);
+        new_node->zl = lpPrepend(new_node->zl, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(quicklist, new_node);
@@ -908,7 +1137,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and head, but prev isn't full, inserting prev node tail");
         new_node = node->prev;
         quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_TAIL);
+        new_node->zl = lpAppend(new_node->zl, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(quicklist, new_node);
@@ -918,7 +1147,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
          *   - create new node and attach to quicklist */
         D("\tprovisioning new node...");
         new_node = quicklistCreateNode();
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->zl = lpPrepend(lpNew(), value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(quicklist, node, new_node, after);
@@ -928,8 +1157,8 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("\tsplitting node...");
         quicklistDecompressNodeForUse(node);
         new_node = _quicklistSplitNode(node, entry->offset, after);
-        new_node->zl = ziplistPush(new_node->zl, value, sz,
-                                   after ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+        new_node->zl = after ? lpPrepend(new_node->zl, value, sz)
+                             : lpAppend(new_node->zl, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(quicklist, node, new_node, after);
@@ -986,7 +1215,7 @@ int quicklistDelRange(quicklist *quicklist, const long start,
         int delete_entire_node = 0;
         if (entry.offset == 0 && extent >= node->count) {
             /* If we are deleting more than the count of this node, we
-             * can just delete the entire node without ziplist math. */
+             * can just delete the entire node without listpack math. */
             delete_entire_node = 1;
             del = node->count;
         } else if (entry.offset >= 0 && extent >= node->count) {
@@ -1020,7 +1249,7 @@ int quicklistDelRange(quicklist *quicklist, const long start,
             __quicklistDelNode(quicklist, node);
         } else {
             quicklistDecompressNodeForUse(node);
-            node->zl = ziplistDeleteRange(node->zl, entry.offset, del);
+            node->zl = lpDeleteRange(node->zl, entry.offset, del);
             quicklistNodeUpdateSz(node);
             node->count -= del;
             quicklist->count -= del;
@@ -1038,9 +1267,9 @@ int quicklistDelRange(quicklist *quicklist, const long start,
     return 1;
 }
 
-/* Passthrough to ziplistCompare() */
+/* Passthrough to lpCompare() */
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
-    return ziplistCompare(p1, p2, p2_len);
+    return lpCompare(p1, p2, p2_len);
 }
 
 /* Returns a quicklist iterator 'iter'. After the initialization every
@@ -1136,14 +1365,14 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     if (!iter->zi) {
         /* If !zi, use current index. */
         quicklistDecompressNodeForUse(iter->current);
-        iter->zi = ziplistIndex(iter->current->zl, iter->offset);
+        iter->zi = lpSeek(iter->current->zl, iter->offset);
     } else {
         /* else, use existing iterator offset and get prev/next as necessary. */
         if (iter->direction == AL_START_HEAD) {
-            nextFn = ziplistNext;
+            nextFn = lpNext;
             offset_update = 1;
         } else if (iter->direction == AL_START_TAIL) {
-            nextFn = ziplistPrev;
+            nextFn = lpPrev;
             offset_update = -1;
         }
         iter->zi = nextFn(iter->current->zl, iter->zi);
@@ -1154,11 +1383,11 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     entry->offset = iter->offset;
 
     if (iter->zi) {
-        /* Populate value from existing ziplist position */
-        ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+        /* Populate value from existing listpack position */
+        entry->value = lpGetValue(entry->zi, &entry->sz, &entry->longval);
         return 1;
     } else {
-        /* We ran out of ziplist entries.
+        /* We ran out of listpack entries.
          * Pick next node, update offset, then re-run retrieval. */
         quicklistCompress(iter->quicklist, iter->current);
         if (iter->direction == AL_START_HEAD) {
@@ -1192,7 +1421,7 @@ quicklist *quicklistDup(quicklist *orig) {
          current = current->next) {
         quicklistNode *node = quicklistCreateNode();
 
-        if (current->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+        if (quicklistNodeIsCompressed(current)) {
             quicklistLZF *lzf = (quicklistLZF *)current->zl;
             size_t lzf_sz = sizeof(*lzf) + lzf->sz;
             node->zl = zmalloc(lzf_sz);
@@ -1271,8 +1500,8 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
     }
 
     quicklistDecompressNodeForUse(entry->node);
-    entry->zi = ziplistIndex(entry->node->zl, entry->offset);
-    ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+    entry->zi = lpSeek(entry->node->zl, entry->offset);
+    entry->value = lpGetValue(entry->zi, &entry->sz, &entry->longval);
     /* The caller will use our result, so we don't re-compress here.
      * The caller can recompress or delete the node as needed. */
     return 1;
@@ -1284,14 +1513,14 @@ void quicklistRotate(quicklist *quicklist) {
         return;
 
     /* First, get the tail entry */
-    unsigned char *p = ziplistIndex(quicklist->tail->zl, -1);
+    unsigned char *p = lpSeek(quicklist->tail->zl, -1);
     unsigned char *value;
     long long longval;
     unsigned int sz;
     char longstr[32] = {0};
-    ziplistGet(p, &value, &sz, &longval);
+    value = lpGetValue(p, &sz, &longval);
 
-    /* If value found is NULL, then ziplistGet populated longval instead */
+    /* If value found is NULL, then lpGetValue populated longval instead */
     if (!value) {
         /* Write the longval as a string so we can re-add it */
         sz = ll2string(longstr, sizeof(longstr), longval);
@@ -1301,11 +1530,11 @@ void quicklistRotate(quicklist *quicklist) {
     /* Add tail entry to head (must happen before tail is deleted). */
     quicklistPushHead(quicklist, value, sz);
 
-    /* If quicklist has only one node, the head ziplist is also the
-     * tail ziplist and PushHead() could have reallocated our single ziplist,
+    /* If quicklist has only one node, the head listpack is also the
+     * tail listpack and PushHead() could have reallocated our single listpack,
      * which would make our pre-existing 'p' unusable. */
     if (quicklist->len == 1) {
-        p = ziplistIndex(quicklist->tail->zl, -1);
+        p = lpSeek(quicklist->tail->zl, -1);
     }
 
     /* Remove tail entry. */
@@ -1349,8 +1578,9 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
         return 0;
     }
 
-    p = ziplistIndex(node->zl, pos);
-    if (ziplistGet(p, &vstr, &vlen, &vlong)) {
+    p = lpSeek(node->zl, pos);
+    if (p) {
+        vstr = lpGetValue(p, &vlen, &vlong);
         if (vstr) {
             if (data)
                 *data = saver(vstr, vlen);
@@ -1415,6 +1645,7 @@ void quicklistPush(quicklist *quicklist, void *value, const size_t sz,
 #include <stdint.h>
 #include <sys/time.h>
 
+#undef assert
 #define assert(_e)                                                             \
     do {                                                                       \
         if (!(_e)) {                                                           \
@@ -1452,9 +1683,9 @@ static void ql_info(quicklist *ql) {
     printf("Container length: %lu\n", ql->len);
     printf("Container size: %lu\n", ql->count);
     if (ql->head)
-        printf("\t(zsize head: %d)\n", ziplistLen(ql->head->zl));
+        printf("\t(zsize head: %d)\n", lpLength(ql->head->zl));
     if (ql->tail)
-        printf("\t(zsize tail: %d)\n", ziplistLen(ql->tail->zl));
+        printf("\t(zsize tail: %d)\n", lpLength(ql->tail->zl));
     printf("\n");
 #else
     UNUSED(ql);
@@ -1552,18 +1783,18 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
     }
 
     if (ql->head && head_count != ql->head->count &&
-        head_count != ziplistLen(ql->head->zl)) {
+        head_count != lpLength(ql->head->zl)) {
         yell("quicklist head count wrong: expected %d, "
              "got cached %d vs. actual %d",
-             head_count, ql->head->count, ziplistLen(ql->head->zl));
+             head_count, ql->head->count, lpLength(ql->head->zl));
         errors++;
     }
 
     if (ql->tail && tail_count != ql->tail->count &&
-        tail_count != ziplistLen(ql->tail->zl)) {
+        tail_count != lpLength(ql->tail->zl)) {
         yell("quicklist tail count wrong: expected %d, "
              "got cached %u vs. actual %d",
-             tail_count, ql->tail->count, ziplistLen(ql->tail->zl));
+             tail_count, ql->tail->count, lpLength(ql->tail->zl));
         errors++;
     }
 
@@ -1583,7 +1814,7 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
                     errors++;
                 }
             } else {
-                if (node->encoding != QUICKLIST_NODE_ENCODING_LZF &&
+                if (!quicklistNodeIsCompressed(node) &&
                     !node->attempted_compress) {
                     yell("Incorrect non-compression: node %d is NOT "
                          "compressed at depth %d ((%u, %u); total "
@@ -1717,7 +1948,7 @@ int quicklistTest(int argc, char *argv[]) {
                 quicklist *ql = quicklistNew(f, options[_i]);
                 quicklistPushHead(ql, "hello", 6);
                 quicklistRotate(ql);
-                /* Ignore compression verify because ziplist is
+                /* Ignore compression verify because listpack is
                  * too small to compress. */
                 ql_verify(ql, 1, 1, 1, 1);
                 quicklistRelease(ql);
@@ -2618,7 +2849,7 @@ int quicklistTest(int argc, char *argv[]) {
                                     node->sz);
                             }
                         } else {
-                            if (node->encoding != QUICKLIST_NODE_ENCODING_LZF) {
+                            if (!quicklistNodeIsCompressed(node)) {
                                 ERR("Incorrect non-compression: node %d is NOT "
                                     "compressed at depth %d ((%u, %u); total "
                                     "nodes: %u; size: %u; attempted: %d)",
@@ -2634,6 +2865,162 @@ int quicklistTest(int argc, char *argv[]) {
     }
     long long stop = mstime();
 
+    /* Nodes keep the codec they were compressed with, so lists may mix
+     * codecs, and compressed nodes can be appended as they are. */
+    for (int enc = QUICKLIST_NODE_ENCODING_LZF;
+         enc <= QUICKLIST_NODE_ENCODING_ZSTD; enc++) {
+        if (!quicklistCodecIsAvailable(enc))
+            continue;
+
+        TEST_DESC("mixed codecs in one list switching to codec %d", enc) {
+            quicklist *ql = quicklistNew(32, 1);
+            for (int i = 0; i < 1000; i++) {
+                if (i == 500)
+                    quicklistSetCodec(enc);
+                char *v = genstr("hello mixed", i);
+                quicklistPushTail(ql, v, strlen(v));
+            }
+
+            int lzf_nodes = 0, enc_nodes = 0;
+            for (quicklistNode *node = ql->head; node; node = node->next) {
+                lzf_nodes += node->encoding == QUICKLIST_NODE_ENCODING_LZF;
+                enc_nodes += node->encoding == enc;
+            }
+            if (!lzf_nodes || !enc_nodes)
+                ERR("Expected nodes of both codecs, got %d LZF and %d of %d",
+                    lzf_nodes, enc_nodes, enc);
+            quicklistSetCodec(QUICKLIST_NODE_ENCODING_LZF);
+            ql_verify(ql, 32, 1000, 32, 8);
+
+            quicklist *copy = quicklistDup(ql);
+            quicklistRelease(ql);
+            ql_verify(copy, 32, 1000, 32, 8);
+            for (int i = 0; i < 1000; i++) {
+                quicklistEntry entry;
+                quicklistIndex(copy, i, &entry);
+                char *v = genstr("hello mixed", i);
+                if (entry.sz != strlen(v) || memcmp(entry.value, v, entry.sz))
+                    ERR("Wrong value at index %d", i);
+            }
+            quicklistRelease(copy);
+        }
+
+        TEST_DESC("append nodes encoded with codec %d", enc) {
+            quicklistSetCodec(enc);
+            quicklist *ql = quicklistNew(32, 1);
+            for (int i = 0; i < 1000; i++) {
+                char *v = genstr("hello append", i);
+                quicklistPushTail(ql, v, strlen(v));
+            }
+            quicklistSetCodec(QUICKLIST_NODE_ENCODING_LZF);
+
+            for (int depth = 0; depth < 20; depth++) {
+                quicklist *copy = quicklistNew(32, depth);
+                for (quicklistNode *node = ql->head; node; node = node->next) {
+                    size_t len = quicklistNodeIsCompressed(node) ?
+                        sizeof(quicklistLZF) + ((quicklistLZF *)node->zl)->sz :
+                        node->sz;
+                    unsigned char *data = zmalloc(len);
+                    memcpy(data, node->zl, len);
+                    quicklistAppendEncoded(copy, data, node->encoding,
+                                           node->sz, node->count);
+                }
+                quicklistFixCompression(copy);
+                ql_verify(copy, 32, 1000, 32, 8);
+                for (int i = 0; i < 1000; i++) {
+                    quicklistEntry entry;
+                    quicklistIndex(copy, i, &entry);
+                    char *v = genstr("hello append", i);
+                    if (entry.sz != strlen(v) ||
+                        memcmp(entry.value, v, entry.sz))
+                        ERR("Wrong value at index %d at compress %d", i,
+                            depth);
+                }
+                quicklistRelease(copy);
+            }
+            quicklistRelease(ql);
+        }
+    }
+
+    TEST("append LZF compressed listpacks without decompressing them") {
+        for (int entries = 1; entries < 500; entries += 37) {
+            unsigned char *lp = lpNew();
+            for (int i = 0; i < entries; i++) {
+                char *v = genstr("hello lzf", i);
+                lp = lpAppend(lp, (unsigned char *)v, strlen(v));
+            }
+            size_t sz = lpBytes(lp);
+            quicklistLZF *lzf = zmalloc(sizeof(*lzf) + sz);
+            lzf->sz = lzf_compress(lp, sz, lzf->compressed, sz);
+            if (lzf->sz == 0) {
+                zfree(lzf);
+                lpFree(lp);
+                continue;
+            }
+
+            quicklist *ql = quicklistNew(-2, 1);
+            if (quicklistAppendLzf(ql, lzf, sz - 1))
+                ERR("Accepted LZF listpack with wrong size at %d", entries);
+            for (int n = 0; n < 3; n++) {
+                quicklistLZF *dup = zmalloc(sizeof(*lzf) + lzf->sz);
+                memcpy(dup, lzf, sizeof(*lzf) + lzf->sz);
+                if (!quicklistAppendLzf(ql, dup, sz))
+                    ERR("Rejected LZF listpack at %d", entries);
+            }
+            if (ql->len != 3 || ql->count != (unsigned long)entries * 3 ||
+                !quicklistNodeIsCompressed(ql->head->next))
+                ERR("Wrong LZF nodes at %d: %lu nodes, %lu entries", entries,
+                    ql->len, ql->count);
+            quicklistFixCompression(ql);
+            ql_verify(ql, 3, entries * 3, entries, entries);
+            for (int i = 0; i < entries * 3; i++) {
+                quicklistEntry entry;
+                char *v = genstr("hello lzf", i % entries);
+                quicklistIndex(ql, i, &entry);
+                if (entry.sz != strlen(v) || memcmp(entry.value, v, entry.sz))
+                    ERR("Wrong value at index %d", i);
+            }
+            quicklistRelease(ql);
+            zfree(lzf);
+            lpFree(lp);
+        }
+    }
+
+    TEST("refuse corrupt compressed nodes") {
+        quicklist *ql = quicklistNew(32, 1);
+        for (int i = 0; i < 500; i++) {
+            char *v = genstr("hello corrupt", i);
+            quicklistPushTail(ql, v, strlen(v));
+        }
+
+        for (int depth = 0; depth < 3; depth++) {
+            for (int validate = 0; validate < 2; validate++) {
+                quicklist *copy = quicklistNew(32, depth);
+                for (quicklistNode *node = ql->head; node; node = node->next) {
+                    size_t len = quicklistNodeIsCompressed(node) ?
+                        sizeof(quicklistLZF) + ((quicklistLZF *)node->zl)->sz :
+                        node->sz;
+                    unsigned char *data = zmalloc(len);
+                    memcpy(data, node->zl, len);
+                    if (quicklistNodeIsCompressed(node))
+                        /* Keep the size, break the back references. */
+                        memset(((quicklistLZF *)data)->compressed + 8, 0xff,
+                               ((quicklistLZF *)data)->sz - 8);
+                    quicklistAppendEncoded(copy, data, node->encoding,
+                                           node->sz, node->count);
+                }
+                /* Without validation the nodes in the middle stay as they
+                 * are: only the ones within the depth get decompressed. */
+                int ok = validate ? quicklistValidateCompression(copy)
+                                  : quicklistFixCompression(copy);
+                if (ok && (validate || depth == 0))
+                    ERR("Accepted corrupt nodes at compress %d", depth);
+                quicklistRelease(copy);
+            }
+        }
+        quicklistRelease(ql);
+    }
+
     printf("\n");
     for (size_t i = 0; i < option_count; i++)
         printf("Test Loop %02d: %0.2f seconds.\n", options[i],
@@ -522,6 +522,46 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
     }
 }
 
+/* Load a quicklist node saved as an RDB string. A node saved as an LZF
+ * string is returned still compressed, as a quicklistLZF, with '*encoding'
+ * set to QUICKLIST_NODE_ENCODING_LZF. Anything else is returned as a plain
+ * listpack with a RAW '*encoding'. '*lenptr' is set to the listpack size.
+ * On error NULL is returned. */
+static void *rdbLoadQuicklistNode(rio *rdb, int *encoding, size_t *lenptr) {
+    int isencoded;
+    uint64_t len, clen;
+
+    *encoding = QUICKLIST_NODE_ENCODING_RAW;
+    if ((len = rdbLoadLen(rdb,&isencoded)) == RDB_LENERR) return NULL;
+    if (!isencoded || len != RDB_ENC_LZF) {
+        /* Not LZF compressed: load it as rdbGenericLoadStringObject()
+         * does with RDB_LOAD_PLAIN. */
+        if (isencoded)
+            return rdbLoadIntegerObject(rdb,len,RDB_LOAD_PLAIN,lenptr);
+        unsigned char *buf = zmalloc(len);
+        *lenptr = len;
+        if (len && rioRead(rdb,buf,len) == 0) {
+            zfree(buf);
+            return NULL;
+        }
+        return buf;
+    }
+
+    if ((clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+    if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+    if (clen == 0 || len > UINT_MAX)
+        rdbExitReportCorruptRDB("Invalid LZF compressed list node");
+    quicklistLZF *lzf = zmalloc(sizeof(*lzf)+clen);
+    lzf->sz = clen;
+    if (rioRead(rdb,lzf->compressed,clen) == 0) {
+        zfree(lzf);
+        return NULL;
+    }
+    *encoding = QUICKLIST_NODE_ENCODING_LZF;
+    *lenptr = len;
+    return lzf;
+}
+
 robj *rdbLoadStringObject(rio *rdb) {
     return rdbGenericLoadStringObject(rdb,RDB_LOAD_NONE,NULL);
 }
@@ -621,14 +661,46 @@ int rdbLoadBinaryFloatValue(rio *rdb, float *val) {
     return 0;
 }
 
+/* Save a quicklist node in the RDB_TYPE_LIST_QUICKLIST_3 format: the node
+ * encoding, then for raw nodes the listpack as a string, otherwise the
+ * listpack size, the entries count and the compressed blob, written as it
+ * is so that loading can adopt it without compressing it again. */
+static ssize_t rdbSaveQuicklistNode(rio *rdb, quicklistNode *node) {
+    ssize_t n, nwritten = 0;
+
+    if ((n = rdbSaveLen(rdb,node->encoding)) == -1) return -1;
+    nwritten += n;
+    if (!quicklistNodeIsCompressed(node)) {
+        if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
+        return nwritten + n;
+    }
+
+    void *data;
+    size_t compress_len = quicklistGetLzf(node,&data);
+    if ((n = rdbSaveLen(rdb,node->sz)) == -1) return -1;
+    nwritten += n;
+    if ((n = rdbSaveLen(rdb,node->count)) == -1) return -1;
+    nwritten += n;
+    if ((n = rdbSaveLen(rdb,compress_len)) == -1) return -1;
+    nwritten += n;
+    if ((n = rdbWriteRaw(rdb,data,compress_len)) == -1) return -1;
+    return nwritten + n;
+}
+
 /* Save the object type of object "o". */
 int rdbSaveObjectType(rio *rdb, robj *o) {
     switch (o->type) {
     case OBJ_STRING:
-        return rdbSaveType(rdb,RDB_TYPE_STRING);
+        if (o->encoding == OBJ_ENCODING_ROARING)
+            return rdbSaveType(rdb,RDB_TYPE_STRING_ROARING);
+        else
+            return rdbSaveType(rdb,RDB_TYPE_STRING);
     case OBJ_LIST:
-        if (o->encoding == OBJ_ENCODING_QUICKLIST)
-            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST);
+        if (o->encoding == OBJ_ENCODING_QUICKLIST &&
+            quicklistHasNonLzfNodes(o->ptr))
+            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST_3);
+        else if (o->encoding == OBJ_ENCODING_QUICKLIST)
+            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST_2);
         else
             serverPanic("Unknown list encoding");
     case OBJ_SET:
@@ -636,19 +708,24 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
             return rdbSaveType(rdb,RDB_TYPE_SET_INTSET);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_SET);
+        else if (o->encoding == OBJ_ENCODING_ROARING)
+            return rdbSaveType(rdb,RDB_TYPE_SET_ROARING);
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
-        else if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
+        else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                 o->encoding == OBJ_ENCODING_PACKEDTREE ||
+                 o->encoding == OBJ_ENCODING_BTREE)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
-        else if (o->encoding == OBJ_ENCODING_HT)
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
+        else if (o->encoding == OBJ_ENCODING_HT ||
+                 o->encoding == OBJ_ENCODING_INTMAP)
             return rdbSaveType(rdb,RDB_TYPE_HASH);
         else
             serverPanic("Unknown hash encoding");
@@ -754,7 +831,22 @@ size_t rdbSaveStreamConsumers(rio *rdb, streamCG *cg) {
 ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
     ssize_t n = 0, nwritten = 0;
 
-    if (o->type == OBJ_STRING) {
+    if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_ROARING) {
+        /* Save a sparse bitmap as its length and the roaring bitmap of the
+         * offsets of the bits set. */
+        sparseBitmap *sb = o->ptr;
+        size_t l = roaringBlobLen(sb->bits);
+        unsigned char *blob;
+
+        if ((n = rdbSaveLen(rdb,sb->len)) == -1) return -1;
+        nwritten += n;
+        blob = zmalloc(l);
+        roaringSerialize(sb->bits,blob);
+        n = rdbSaveRawString(rdb,blob,l);
+        zfree(blob);
+        if (n == -1) return -1;
+        nwritten += n;
+    } else if (o->type == OBJ_STRING) {
         /* Save a string value */
         if ((n = rdbSaveStringObject(rdb,o)) == -1) return -1;
         nwritten += n;
@@ -763,12 +855,18 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         if (o->encoding == OBJ_ENCODING_QUICKLIST) {
             quicklist *ql = o->ptr;
             quicklistNode *node = ql->head;
+            int v3 = quicklistHasNonLzfNodes(ql);
 
             if ((n = rdbSaveLen(rdb,ql->len)) == -1) return -1;
             nwritten += n;
 
             while(node) {
-                if (quicklistNodeIsCompressed(node)) {
+                if (v3) {
+                    /* Nodes are saved with the codec they were compressed
+                     * with, which LZF strings can't express. */
+                    if ((n = rdbSaveQuicklistNode(rdb,node)) == -1) return -1;
+                    nwritten += n;
+                } else if (quicklistNodeIsCompressed(node)) {
                     void *data;
                     size_t compress_len = quicklistGetLzf(node, &data);
                     if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
@@ -811,13 +909,22 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            size_t l = roaringBlobLen(o->ptr);
+            unsigned char *blob = zmalloc(l);
+
+            roaringSerialize(o->ptr,blob);
+            n = rdbSaveRawString(rdb,blob,l);
+            zfree(blob);
+            if (n == -1) return -1;
+            nwritten += n;
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -847,17 +954,85 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                 nwritten += n;
                 zn = zn->backward;
             }
+        } else if (o->encoding == OBJ_ENCODING_PACKEDTREE) {
+            zptree *zpt = o->ptr;
+            zptNode *leaf = zpt->tail;
+            unsigned char *eptr, *sptr;
+            unsigned char *vstr;
+            unsigned int vlen;
+            long long vlong;
+
+            if ((n = rdbSaveLen(rdb,zptLength(zpt))) == -1) return -1;
+            nwritten += n;
+
+            /* Same format and order of the skiplist encoding. */
+            sptr = lpLast(leaf->lp);
+            eptr = sptr ? lpPrev(leaf->lp,sptr) : NULL;
+            while (eptr != NULL) {
+                vstr = lpGetValue(eptr,&vlen,&vlong);
+                if (vstr != NULL)
+                    n = rdbSaveRawString(rdb,vstr,vlen);
+                else
+                    n = rdbSaveLongLongAsStringObject(rdb,vlong);
+                if (n == -1) return -1;
+                nwritten += n;
+                if ((n = rdbSaveBinaryDoubleValue(rdb,zzlGetScore(sptr))) == -1)
+                    return -1;
+                nwritten += n;
+                zptPrev(&leaf,&eptr,&sptr);
+            }
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            zbtree *zbt = ((zset*)o->ptr)->zbt;
+            zbtNode *zn = zbt->length ? zbt->tail : NULL;
+            int pos = zbt->tail->num-1;
+
+            if ((n = rdbSaveLen(rdb,zbt->length)) == -1) return -1;
+            nwritten += n;
+
+            /* Same order of the skiplist encoding. */
+            while (zn != NULL) {
+                if ((n = rdbSaveRawString(rdb,
+                    (unsigned char*)zn->ele[pos],sdslen(zn->ele[pos]))) == -1)
+                {
+                    return -1;
+                }
+                nwritten += n;
+                if ((n = rdbSaveBinaryDoubleValue(rdb,zn->score[pos])) == -1)
+                    return -1;
+                nwritten += n;
+                zbtPrev(&zn,&pos);
+            }
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
 
+        } else if (o->encoding == OBJ_ENCODING_INTMAP) {
+            /* Intmaps are saved as plain field / value pairs: the loading
+             * side will pick the right encoding. */
+            intmap *im = o->ptr;
+            uint32_t pos, len = intmapLen(im);
+
+            if ((n = rdbSaveLen(rdb,len)) == -1) return -1;
+            nwritten += n;
+
+            for (pos = 0; pos < len; pos++) {
+                unsigned char *field;
+                uint32_t flen;
+
+                intmapGetField(im,pos,&field,&flen);
+                if ((n = rdbSaveRawString(rdb,field,flen)) == -1) return -1;
+                nwritten += n;
+                if ((n = rdbSaveLongLongAsStringObject(rdb,
+                        intmapGetValue(im,pos))) == -1) return -1;
+                nwritten += n;
+            }
         } else if (o->encoding == OBJ_ENCODING_HT) {
             dictIterator *di = dictGetIterator(o->ptr);
             dictEntry *de;
@@ -1171,7 +1346,7 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
          * these sizes are just hints to resize the hash tables. */
         uint64_t db_size, expires_size;
         db_size = dictSize(db->dict);
-        expires_size = dictSize(db->expires);
+        expires_size = dbVolatileKeysCount(db);
         if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
@@ -1425,6 +1600,29 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
     return createStringObject("module-dummy-value",18);
 }
 
+/* Convert a ziplist, as found in RDB files saved by older versions, into a
+ * listpack with the same entries. The ziplist is freed. */
+unsigned char *rdbConvertZiplistToListpack(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+    char buf[LONG_STR_SIZE];
+
+    while (p != NULL) {
+        ziplistGet(p,&vstr,&vlen,&vll);
+        if (vstr == NULL) {
+            vlen = ll2string(buf,sizeof(buf),vll);
+            vstr = (unsigned char*)buf;
+        }
+        lp = lpAppend(lp,vstr,vlen);
+        p = ziplistNext(zl,p);
+    }
+    zfree(zl);
+    return lp;
+}
+
 /* Load a Redis object of the specified type from the specified file.
  * On success a newly allocated object is returned, otherwise NULL. */
 robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
@@ -1457,8 +1655,15 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         /* Read Set value */
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
 
-        /* Use a regular set when there are too many entries. */
-        if (len > server.set_max_intset_entries) {
+        /* Use a roaring bitmap or a regular set when there are too many
+         * entries. A roaring bitmap is converted like an intset as soon as
+         * a non integer element is found. */
+        if (len > server.set_max_intset_entries &&
+            server.set_roaring_encoding)
+        {
+            o = createObject(OBJ_SET,roaringNew());
+            o->encoding = OBJ_ENCODING_ROARING;
+        } else if (len > server.set_max_intset_entries) {
             o = createSetObject();
             /* It's faster to expand the dict to the right size asap in order
              * to avoid rehashing */
@@ -1476,10 +1681,15 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             if ((sdsele = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
 
-            if (o->encoding == OBJ_ENCODING_INTSET) {
+            if (o->encoding == OBJ_ENCODING_INTSET ||
+                o->encoding == OBJ_ENCODING_ROARING)
+            {
                 /* Fetch integer value from element. */
                 if (isSdsRepresentableAsLongLong(sdsele,&llval) == C_OK) {
-                    o->ptr = intsetAdd(o->ptr,llval,NULL);
+                    if (o->encoding == OBJ_ENCODING_INTSET)
+                        o->ptr = intsetAdd(o->ptr,llval,NULL);
+                    else
+                        roaringAdd(o->ptr,llval);
                 } else {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                     dictExpand(o->ptr,len);
@@ -1501,7 +1711,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         zset *zs;
 
         if ((zsetlen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
-        o = createZsetObject();
+        o = server.zset_btree_encoding ? createZsetBtreeObject() :
+                                         createZsetObject();
         zs = o->ptr;
 
         if (zsetlen > DICT_HT_INITIAL_SIZE)
@@ -1511,7 +1722,6 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         while(zsetlen--) {
             sds sdsele;
             double score;
-            zskiplistNode *znode;
 
             if ((sdsele = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
@@ -1525,14 +1735,11 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             /* Don't care about integer-encoded strings. */
             if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
 
-            znode = zslInsert(zs->zsl,score,sdsele);
-            dictAdd(zs->dict,sdsele,&znode->score);
+            zsetLargeInsert(zs,score,sdsele);
         }
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
-        if (zsetLength(o) <= server.zset_max_ziplist_entries &&
-            maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+        zsetConvertToListpackIfNeeded(o,maxelelen);
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
         int ret;
@@ -1547,8 +1754,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         if (len > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
@@ -1556,11 +1763,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             if ((value = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)field,
-                    sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)value,
-                    sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, (unsigned char*)field, sdslen(field));
+            o->ptr = lpAppend(o->ptr, (unsigned char*)value, sdslen(value));
 
             /* Convert to hash table if size threshold is exceeded */
             if (sdslen(field) > server.hash_max_ziplist_value ||
@@ -1596,23 +1801,130 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
 
         /* All pairs should be read by now */
         serverAssert(len == 0);
-    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
+        hashTypeTryIntmapEncoding(o);
+    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST ||
+               rdbtype == RDB_TYPE_LIST_QUICKLIST_2) {
+        /* When the list is going to be compressed anyway, LZF compressed
+         * listpacks are adopted as they are instead of being decompressed
+         * and compressed again: they get decompressed on first access, or
+         * if they fall within the compress depth. This only happens when
+         * loading an RDB file: RESTORE payloads can't be trusted, and
+         * redis-check-rdb decompresses everything to validate it. */
+        int adopt = rdbtype == RDB_TYPE_LIST_QUICKLIST_2 &&
+                    server.list_compress_depth != 0 && server.loading &&
+                    !rdbCheckMode;
+
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
         o = createQuicklistObject();
         quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
                             server.list_compress_depth);
 
         while (len--) {
+            if (adopt) {
+                int encoding;
+                size_t lpsize;
+                void *data = rdbLoadQuicklistNode(rdb,&encoding,&lpsize);
+                if (data == NULL) {
+                    decrRefCount(o);
+                    return NULL;
+                }
+                if (encoding == QUICKLIST_NODE_ENCODING_RAW) {
+                    quicklistAppendEncoded(o->ptr,data,encoding,lpsize,
+                                           lpLength(data));
+                } else if (!quicklistAppendLzf(o->ptr,data,lpsize)) {
+                    rdbExitReportCorruptRDB("Invalid LZF compressed list node");
+                }
+                continue;
+            }
+
             unsigned char *zl =
                 rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
             if (zl == NULL) return NULL;
-            quicklistAppendZiplist(o->ptr, zl);
+            /* Nodes saved by older versions are ziplists. */
+            if (rdbtype == RDB_TYPE_LIST_QUICKLIST)
+                zl = rdbConvertZiplistToListpack(zl);
+            quicklistAppendListpack(o->ptr, zl);
+        }
+        if (adopt && !quicklistFixCompression(o->ptr))
+            rdbExitReportCorruptRDB("Invalid LZF compressed list node");
+    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST_3) {
+        /* Compressed nodes are adopted as for RDB_TYPE_LIST_QUICKLIST_2,
+         * otherwise they are all decompressed and validated. */
+        int adopt = server.list_compress_depth != 0 && server.loading &&
+                    !rdbCheckMode;
+
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        o = createQuicklistObject();
+        quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
+                            server.list_compress_depth);
+
+        while (len--) {
+            uint64_t encoding, sz, count, clen;
+            unsigned char *data;
+
+            if ((encoding = rdbLoadLen(rdb,NULL)) == RDB_LENERR) {
+                decrRefCount(o);
+                return NULL;
+            }
+            if (encoding == QUICKLIST_NODE_ENCODING_RAW) {
+                size_t lpsize;
+                data = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&lpsize);
+                if (data == NULL) {
+                    decrRefCount(o);
+                    return NULL;
+                }
+                quicklistAppendEncoded(o->ptr,data,QUICKLIST_NODE_ENCODING_RAW,
+                                       lpsize,lpLength(data));
+                continue;
+            }
+            /* A payload from a build with more codecs may reach us with
+             * RESTORE or MIGRATE: just refuse it, the caller reports the
+             * error. */
+            if (encoding > UINT8_MAX || !quicklistCodecIsAvailable(encoding)) {
+                serverLog(LL_WARNING,"List node compressed with codec %llu "
+                    "not supported by this build",
+                    (unsigned long long)encoding);
+                decrRefCount(o);
+                return NULL;
+            }
+            if ((sz = rdbLoadLen(rdb,NULL)) == RDB_LENERR ||
+                (count = rdbLoadLen(rdb,NULL)) == RDB_LENERR ||
+                (clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
+            {
+                decrRefCount(o);
+                return NULL;
+            }
+            if (sz == 0 || sz > UINT_MAX || count == 0 || count > UINT16_MAX ||
+                clen == 0 || clen >= sz)
+            {
+                serverLog(LL_WARNING,"Invalid compressed list node");
+                decrRefCount(o);
+                return NULL;
+            }
+
+            quicklistLZF *lzf = zmalloc(sizeof(*lzf)+clen);
+            lzf->sz = clen;
+            if (rioRead(rdb,lzf->compressed,clen) == 0) {
+                zfree(lzf);
+                decrRefCount(o);
+                return NULL;
+            }
+            quicklistAppendEncoded(o->ptr,(unsigned char*)lzf,encoding,sz,count);
+        }
+        if (!(adopt ? quicklistFixCompression(o->ptr) :
+                      quicklistValidateCompression(o->ptr)))
+        {
+            serverLog(LL_WARNING,"Invalid compressed list node");
+            decrRefCount(o);
+            return NULL;
         }
     } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  ||
                rdbtype == RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == RDB_TYPE_SET_INTSET   ||
                rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == RDB_TYPE_HASH_LISTPACK)
     {
         unsigned char *encoded =
             rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
@@ -1627,10 +1939,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
          * converted. */
         switch(rdbtype) {
             case RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *zl = lpNew();
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1639,14 +1951,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        zl = lpAppend(zl, fstr, flen);
+                        zl = lpAppend(zl, vstr, vlen);
                     }
 
                     zfree(o->ptr);
                     o->ptr = zl;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
                     if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
                         maxlen > server.hash_max_ziplist_value)
@@ -1664,24 +1976,89 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                 o->type = OBJ_SET;
                 o->encoding = OBJ_ENCODING_INTSET;
                 if (intsetLen(o->ptr) > server.set_max_intset_entries)
-                    setTypeConvert(o,OBJ_ENCODING_HT);
+                    setTypeConvert(o,server.set_roaring_encoding ?
+                        OBJ_ENCODING_ROARING : OBJ_ENCODING_HT);
                 break;
             case RDB_TYPE_ZSET_ZIPLIST:
+            case RDB_TYPE_ZSET_LISTPACK:
+                /* Sorted sets saved by older versions are converted to the
+                 * listpack encoding used in memory. */
+                if (rdbtype == RDB_TYPE_ZSET_ZIPLIST)
+                    o->ptr = rdbConvertZiplistToListpack(o->ptr);
                 o->type = OBJ_ZSET;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (zsetLength(o) > server.zset_max_ziplist_entries)
-                    zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                    zsetConvert(o,zsetOverflowEncoding(zsetLength(o)));
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
+            case RDB_TYPE_HASH_LISTPACK:
+                if (rdbtype == RDB_TYPE_HASH_ZIPLIST)
+                    o->ptr = rdbConvertZiplistToListpack(o->ptr);
                 o->type = OBJ_HASH;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (hashTypeLength(o) > server.hash_max_ziplist_entries)
                     hashTypeConvert(o, OBJ_ENCODING_HT);
+                else
+                    hashTypeTryIntmapEncoding(o);
                 break;
             default:
                 rdbExitReportCorruptRDB("Unknown RDB encoding type %d",rdbtype);
                 break;
         }
+    } else if (rdbtype == RDB_TYPE_SET_ROARING) {
+        size_t bloblen;
+        unsigned char *blob =
+            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&bloblen);
+        if (blob == NULL) return NULL;
+        roaring *r = roaringDeserialize(blob,bloblen);
+        zfree(blob);
+        if (r == NULL)
+            rdbExitReportCorruptRDB("Invalid roaring bitmap encoded set");
+
+        /* Use the encoding the current configuration would select. */
+        o = createObject(OBJ_SET,r);
+        o->encoding = OBJ_ENCODING_ROARING;
+        if (roaringCard(r) <= server.set_max_intset_entries)
+            setTypeConvert(o,OBJ_ENCODING_INTSET);
+        else if (!server.set_roaring_encoding)
+            setTypeConvert(o,OBJ_ENCODING_HT);
+    } else if (rdbtype == RDB_TYPE_STRING_ROARING) {
+        uint64_t len;
+        size_t bloblen;
+        unsigned char *blob;
+        roaringIterator ri;
+        int64_t bit;
+
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        blob = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&bloblen);
+        if (blob == NULL) return NULL;
+        roaring *r = roaringDeserialize(blob,bloblen);
+        zfree(blob);
+        if (r == NULL)
+            rdbExitReportCorruptRDB("Invalid roaring bitmap encoded string");
+
+        /* All the bits set must be inside the string. */
+        roaringInitIterator(r,&ri);
+        if (len == 0 || len > SIZE_MAX/8 ||
+            (roaringNext(&ri,&bit) && bit < 0))
+            rdbExitReportCorruptRDB("Invalid sparse bitmap length");
+        roaringSeek(&ri,(int64_t)len*8);
+        if (roaringNext(&ri,&bit))
+            rdbExitReportCorruptRDB("Sparse bitmap bit out of range");
+
+        /* Use the encoding the current configuration would select. */
+        sparseBitmap *sb = zmalloc(sizeof(*sb));
+        sb->len = len;
+        sb->bits = r;
+        o = createObject(OBJ_STRING,sb);
+        o->encoding = OBJ_ENCODING_ROARING;
+        if (!server.bitmap_sparse_min_bytes ||
+            (long long)len < server.bitmap_sparse_min_bytes)
+        {
+            robj *dec = getDecodedObject(o);
+            decrRefCount(o);
+            o = dec;
+        }
     } else if (rdbtype == RDB_TYPE_STREAM_LISTPACKS) {
         o = createStreamObject();
         stream *s = o->ptr;
@@ -1975,7 +2352,8 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
             if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
             dictExpand(db->dict,db_size);
-            dictExpand(db->expires,expires_size);
+            if (!server.expire_in_keyspace)
+                dictExpand(db->expires,expires_size);
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_AUX) {
             /* AUX: generic string-string fields. Use to add state to RDB
@@ -85,7 +85,13 @@ char *rdb_type_string[] = {
     "zset-ziplist",
     "hash-ziplist",
     "quicklist",
-    "stream"
+    "stream",
+    "hash-listpack",
+    "zset-listpack",
+    "quicklist-v2",
+    "set-roaring",
+    "string-roaring",
+    "quicklist-v3"
 };
 
 /* Show a few stats collected into 'rdbstate' */
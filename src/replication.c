@@ -2226,6 +2226,7 @@ void replicationCacheMaster(client *c) {
     listEmpty(c->reply);
     c->sentlen = 0;
     c->reply_bytes = 0;
+    c->reply_refs = 0;
     c->bufpos = 0;
     resetClient(c);
 
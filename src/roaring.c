@@ -0,0 +1,797 @@
+/*
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* A roaring bitmap is a compressed set of 64 bit integers, used to encode
+ * big sets of integers. Elements are split by their high 48 bits in
+ * containers (see roaring.h), kept in a sorted array, so a lookup is a binary
+ * search among the containers followed by either a binary search in a
+ * sorted array of 16 bit integers, or a bit test. Dense ranges of integers
+ * take 1 bit per element, sparse ones 16 bits, plus the container header.
+ *
+ * Signed integers are mapped to unsigned ones flipping the sign bit, so that
+ * the containers, and the elements inside them, are in the same order of
+ * the signed values.
+ *
+ * The serialized format, used for RDB persistence, is little endian:
+ *
+ * <len:32> [<key:64> <card:32> <card 16 bit values or 1024 64 bit words>]...
+ *
+ * A container is serialized as a bitmap when its cardinality is greater than
+ * ROARING_ARRAY_MAX, exactly as it is stored in memory. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "roaring.h"
+#include "zmalloc.h"
+#include "endianconv.h"
+
+#define ROARING_ARRAY_MAX 4096      /* Max elements of an array container. */
+#define ROARING_BITMAP_WORDS 1024   /* 65536 bits. */
+#define ROARING_BITMAP_BYTES (ROARING_BITMAP_WORDS*sizeof(uint64_t))
+#define ROARING_ARRAY_INIT_CAP 4
+
+#define roaringIsBitmap(c) ((c)->card > ROARING_ARRAY_MAX)
+
+/* Map a signed value to an unsigned one with the same order, and back. */
+static inline uint64_t roaringToUnsigned(int64_t v) {
+    return (uint64_t)v ^ (1ULL<<63);
+}
+
+static inline int64_t roaringToSigned(uint64_t key, uint16_t low) {
+    return (int64_t)(((key << 16) | low) ^ (1ULL<<63));
+}
+
+/* Create an empty roaring bitmap. */
+roaring *roaringNew(void) {
+    roaring *r = zmalloc(sizeof(*r));
+    r->card = 0;
+    r->len = r->cap = 0;
+    r->containers = NULL;
+    return r;
+}
+
+void roaringFree(roaring *r) {
+    for (uint32_t j = 0; j < r->len; j++) zfree(r->containers[j].data);
+    zfree(r->containers);
+    zfree(r);
+}
+
+uint64_t roaringCard(const roaring *r) {
+    return r->card;
+}
+
+/* ------------------------------- Containers ------------------------------- */
+
+/* Search the container with the given key. Return 1 if found, otherwise 0,
+ * and in both cases set '*idx' to the position where it is or should be. */
+static int roaringFindContainer(const roaring *r, uint64_t key, uint32_t *idx) {
+    uint32_t lo = 0, hi = r->len;
+
+    /* Elements are often added in order: check the last container first. */
+    if (r->len && r->containers[r->len-1].key <= key) {
+        *idx = r->len - (r->containers[r->len-1].key == key);
+        return r->containers[r->len-1].key == key;
+    }
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (r->containers[mid].key < key) lo = mid+1; else hi = mid;
+    }
+    *idx = lo;
+    return lo < r->len && r->containers[lo].key == key;
+}
+
+/* Insert an empty container at position 'idx', returning it. */
+static roaringContainer *roaringInsertContainer(roaring *r, uint32_t idx, uint64_t key) {
+    roaringContainer *c;
+
+    if (r->len == r->cap) {
+        r->cap = r->cap ? r->cap*2 : 1;
+        r->containers = zrealloc(r->containers,sizeof(*c)*r->cap);
+    }
+    memmove(r->containers+idx+1,r->containers+idx,sizeof(*c)*(r->len-idx));
+    r->len++;
+    c = r->containers+idx;
+    c->key = key;
+    c->card = 0;
+    c->cap = ROARING_ARRAY_INIT_CAP;
+    c->data = zmalloc(sizeof(uint16_t)*c->cap);
+    return c;
+}
+
+static void roaringRemoveContainer(roaring *r, uint32_t idx) {
+    zfree(r->containers[idx].data);
+    memmove(r->containers+idx,r->containers+idx+1,
+        sizeof(roaringContainer)*(r->len-idx-1));
+    r->len--;
+    if (r->len == 0) {
+        zfree(r->containers);
+        r->containers = NULL;
+        r->cap = 0;
+    } else if (r->len*4 < r->cap) {
+        r->cap /= 2;
+        r->containers = zrealloc(r->containers,sizeof(roaringContainer)*r->cap);
+    }
+}
+
+/* Search 'low' in a sorted array of 'card' elements. Return 1 if found,
+ * otherwise 0, and in both cases set '*pos' to the position where the
+ * element is or should be. */
+static int roaringArraySearch(const uint16_t *a, uint32_t card, uint16_t low, uint32_t *pos) {
+    uint32_t lo = 0, hi = card;
+
+    if (card && a[card-1] < low) {
+        *pos = card;
+        return 0;
+    }
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (a[mid] < low) lo = mid+1; else hi = mid;
+    }
+    *pos = lo;
+    return lo < card && a[lo] == low;
+}
+
+static inline int roaringBitmapTest(const uint64_t *bm, uint16_t low) {
+    return (bm[low>>6] >> (low&63)) & 1;
+}
+
+/* Turn a full array container into a bitmap container and vice versa. The
+ * caller adjusts the cardinality after the conversion. */
+static void roaringArrayToBitmap(roaringContainer *c) {
+    uint16_t *a = c->data;
+    uint64_t *bm = zcalloc(ROARING_BITMAP_BYTES);
+
+    for (uint32_t j = 0; j < c->card; j++)
+        bm[a[j]>>6] |= 1ULL << (a[j]&63);
+    zfree(a);
+    c->data = bm;
+    c->cap = 0;
+}
+
+static void roaringBitmapToArray(roaringContainer *c, uint32_t card) {
+    uint64_t *bm = c->data;
+    uint16_t *a = zmalloc(sizeof(uint16_t)*card);
+    uint32_t n = 0;
+
+    for (uint32_t w = 0; w < ROARING_BITMAP_WORDS; w++) {
+        uint64_t word = bm[w];
+        while (word) {
+            a[n++] = w*64+__builtin_ctzll(word);
+            word &= word-1;
+        }
+    }
+    zfree(bm);
+    c->data = a;
+    c->cap = card;
+}
+
+/* ------------------------------ Elements ---------------------------------- */
+
+/* Add 'value' to the set. Return 1 if it was added, 0 if already present. */
+int roaringAdd(roaring *r, int64_t value) {
+    uint64_t u = roaringToUnsigned(value), key = u >> 16;
+    uint16_t low = u & 0xffff;
+    roaringContainer *c;
+    uint32_t idx, pos;
+
+    if (roaringFindContainer(r,key,&idx))
+        c = r->containers+idx;
+    else
+        c = roaringInsertContainer(r,idx,key);
+
+    if (roaringIsBitmap(c)) {
+        uint64_t *bm = c->data;
+        if (roaringBitmapTest(bm,low)) return 0;
+        bm[low>>6] |= 1ULL << (low&63);
+    } else {
+        uint16_t *a = c->data;
+        if (roaringArraySearch(a,c->card,low,&pos)) return 0;
+        if (c->card == ROARING_ARRAY_MAX) {
+            roaringArrayToBitmap(c);
+            ((uint64_t*)c->data)[low>>6] |= 1ULL << (low&63);
+        } else {
+            if (c->card == c->cap) {
+                c->cap *= 2;
+                if (c->cap > ROARING_ARRAY_MAX) c->cap = ROARING_ARRAY_MAX;
+                c->data = a = zrealloc(a,sizeof(uint16_t)*c->cap);
+            }
+            memmove(a+pos+1,a+pos,sizeof(uint16_t)*(c->card-pos));
+            a[pos] = low;
+        }
+    }
+    c->card++;
+    r->card++;
+    return 1;
+}
+
+/* Remove 'value' from the set. Return 1 if it was removed, 0 if missing. */
+int roaringRemove(roaring *r, int64_t value) {
+    uint64_t u = roaringToUnsigned(value), key = u >> 16;
+    uint16_t low = u & 0xffff;
+    roaringContainer *c;
+    uint32_t idx, pos;
+
+    if (!roaringFindContainer(r,key,&idx)) return 0;
+    c = r->containers+idx;
+
+    if (roaringIsBitmap(c)) {
+        uint64_t *bm = c->data;
+        if (!roaringBitmapTest(bm,low)) return 0;
+        bm[low>>6] &= ~(1ULL << (low&63));
+        if (c->card-1 == ROARING_ARRAY_MAX)
+            roaringBitmapToArray(c,ROARING_ARRAY_MAX);
+    } else {
+        uint16_t *a = c->data;
+        if (!roaringArraySearch(a,c->card,low,&pos)) return 0;
+        memmove(a+pos,a+pos+1,sizeof(uint16_t)*(c->card-pos-1));
+        if (c->card-1 > ROARING_ARRAY_INIT_CAP && (c->card-1)*4 < c->cap) {
+            c->cap /= 2;
+            c->data = zrealloc(a,sizeof(uint16_t)*c->cap);
+        }
+    }
+    c->card--;
+    r->card--;
+    if (c->card == 0) roaringRemoveContainer(r,idx);
+    return 1;
+}
+
+/* Return 1 if 'value' is in the set, 0 otherwise. */
+int roaringContains(roaring *r, int64_t value) {
+    uint64_t u = roaringToUnsigned(value), key = u >> 16;
+    uint16_t low = u & 0xffff;
+    roaringContainer *c;
+    uint32_t idx, pos;
+
+    if (!roaringFindContainer(r,key,&idx)) return 0;
+    c = r->containers+idx;
+    if (roaringIsBitmap(c))
+        return roaringBitmapTest(c->data,low);
+    return roaringArraySearch(c->data,c->card,low,&pos);
+}
+
+/* Return a random element of a non empty set, every element having the same
+ * probability to be returned. */
+int64_t roaringRandom(roaring *r) {
+    uint64_t rank = (((uint64_t)rand() << 31) ^ rand()) % r->card;
+    roaringContainer *c = r->containers;
+
+    while (rank >= c->card) rank -= (c++)->card;
+    if (!roaringIsBitmap(c))
+        return roaringToSigned(c->key,((uint16_t*)c->data)[rank]);
+
+    uint64_t *bm = c->data;
+    uint32_t w = 0, count;
+    while (rank >= (count = __builtin_popcountll(bm[w]))) {
+        rank -= count;
+        w++;
+    }
+    uint64_t word = bm[w];
+    while (rank--) word &= word-1;
+    return roaringToSigned(c->key,w*64+__builtin_ctzll(word));
+}
+
+/* ------------------------------- Iteration -------------------------------- */
+
+/* Initialize an iterator returning the elements of 'r' in ascending order.
+ * The set must not be modified while it is iterated. */
+void roaringInitIterator(roaring *r, roaringIterator *it) {
+    it->r = r;
+    it->ci = 0;
+    it->pos = 0;
+}
+
+/* Move the iterator to the first element not smaller than 'value'. */
+void roaringSeek(roaringIterator *it, int64_t value) {
+    uint64_t u = roaringToUnsigned(value), key = u >> 16;
+    uint16_t low = u & 0xffff;
+    roaringContainer *c;
+
+    it->pos = 0;
+    if (!roaringFindContainer(it->r,key,&it->ci)) return;
+    c = it->r->containers+it->ci;
+    if (roaringIsBitmap(c))
+        it->pos = low;
+    else
+        roaringArraySearch(c->data,c->card,low,&it->pos);
+}
+
+/* Store the next element in '*value' and return 1, or return 0 when there
+ * are no more elements. */
+int roaringNext(roaringIterator *it, int64_t *value) {
+    roaring *r = it->r;
+
+    while (it->ci < r->len) {
+        roaringContainer *c = r->containers+it->ci;
+
+        if (roaringIsBitmap(c)) {
+            uint64_t *bm = c->data;
+            uint32_t w = it->pos >> 6;
+
+            if (w < ROARING_BITMAP_WORDS) {
+                uint64_t word = bm[w] & (~0ULL << (it->pos & 63));
+                while (!word && ++w < ROARING_BITMAP_WORDS) word = bm[w];
+                if (word) {
+                    uint32_t bit = w*64+__builtin_ctzll(word);
+                    *value = roaringToSigned(c->key,bit);
+                    it->pos = bit+1;
+                    return 1;
+                }
+            }
+        } else if (it->pos < c->card) {
+            *value = roaringToSigned(c->key,((uint16_t*)c->data)[it->pos++]);
+            return 1;
+        }
+        it->ci++;
+        it->pos = 0;
+    }
+    return 0;
+}
+
+/* ----------------------------- Set operations ----------------------------- */
+
+/* Append a container with the given key and content, that must have a
+ * greater key than all the other containers. */
+static void roaringAppendContainer(roaring *r, uint64_t key, uint32_t card, uint32_t cap, void *data) {
+    roaringContainer *c;
+
+    if (r->len == r->cap) {
+        r->cap = r->cap ? r->cap*2 : 1;
+        r->containers = zrealloc(r->containers,sizeof(*c)*r->cap);
+    }
+    c = r->containers+r->len++;
+    c->key = key;
+    c->card = card;
+    c->cap = cap;
+    c->data = data;
+    r->card += card;
+}
+
+/* Intersect two containers with the same key, appending the result to 'dst'
+ * when not empty. */
+static void roaringIntersectContainers(roaring *dst, roaringContainer *a, roaringContainer *b) {
+    uint32_t n = 0;
+
+    if (roaringIsBitmap(a) && roaringIsBitmap(b)) {
+        uint64_t *bma = a->data, *bmb = b->data;
+        uint64_t *bm = zmalloc(ROARING_BITMAP_BYTES);
+
+        for (uint32_t w = 0; w < ROARING_BITMAP_WORDS; w++) {
+            bm[w] = bma[w] & bmb[w];
+            n += __builtin_popcountll(bm[w]);
+        }
+        if (n == 0) {
+            zfree(bm);
+            return;
+        }
+        roaringAppendContainer(dst,a->key,n,0,bm);
+        if (n <= ROARING_ARRAY_MAX)
+            roaringBitmapToArray(dst->containers+dst->len-1,n);
+        return;
+    }
+
+    /* At least one is an array: the result can't be bigger than it. */
+    if (roaringIsBitmap(a)) {
+        roaringContainer *tmp = a; a = b; b = tmp;
+    }
+    uint16_t *aa = a->data;
+    uint16_t *res = zmalloc(sizeof(uint16_t)*a->card);
+
+    if (roaringIsBitmap(b)) {
+        for (uint32_t i = 0; i < a->card; i++)
+            if (roaringBitmapTest(b->data,aa[i])) res[n++] = aa[i];
+    } else {
+        uint16_t *ab = b->data;
+        uint32_t i = 0, j = 0;
+        while (i < a->card && j < b->card) {
+            if (aa[i] < ab[j]) i++;
+            else if (aa[i] > ab[j]) j++;
+            else { res[n++] = aa[i]; i++; j++; }
+        }
+    }
+    if (n == 0) {
+        zfree(res);
+        return;
+    }
+    roaringAppendContainer(dst,a->key,n,n,zrealloc(res,sizeof(uint16_t)*n));
+}
+
+/* Return a new roaring bitmap with the elements both in 'a' and 'b'. Only
+ * the containers with the same key in both sets are intersected. */
+roaring *roaringIntersect(roaring *a, roaring *b) {
+    roaring *dst = roaringNew();
+    uint32_t i = 0, j = 0;
+
+    while (i < a->len && j < b->len) {
+        roaringContainer *ca = a->containers+i, *cb = b->containers+j;
+        if (ca->key < cb->key) {
+            i++;
+        } else if (ca->key > cb->key) {
+            j++;
+        } else {
+            roaringIntersectContainers(dst,ca,cb);
+            i++;
+            j++;
+        }
+    }
+    return dst;
+}
+
+/* ---------------------------- Serialization ------------------------------- */
+
+/* Return the memory used by the set. */
+size_t roaringAllocSize(roaring *r) {
+    size_t size = sizeof(*r)+sizeof(roaringContainer)*r->cap;
+
+    for (uint32_t j = 0; j < r->len; j++) {
+        roaringContainer *c = r->containers+j;
+        size += roaringIsBitmap(c) ? ROARING_BITMAP_BYTES :
+                                     sizeof(uint16_t)*c->cap;
+    }
+    return size;
+}
+
+/* Return the size of the serialized set. */
+size_t roaringBlobLen(roaring *r) {
+    size_t len = sizeof(uint32_t);
+
+    for (uint32_t j = 0; j < r->len; j++) {
+        roaringContainer *c = r->containers+j;
+        len += sizeof(uint64_t)+sizeof(uint32_t);
+        len += roaringIsBitmap(c) ? ROARING_BITMAP_BYTES :
+                                    sizeof(uint16_t)*c->card;
+    }
+    return len;
+}
+
+/* Serialize the set into 'buf', that must be roaringBlobLen() bytes. */
+void roaringSerialize(roaring *r, unsigned char *buf) {
+    uint32_t len = r->len;
+
+    memcpy(buf,&len,sizeof(len));
+    memrev32ifbe(buf);
+    buf += sizeof(len);
+    for (uint32_t j = 0; j < r->len; j++) {
+        roaringContainer *c = r->containers+j;
+        size_t bytes = roaringIsBitmap(c) ? ROARING_BITMAP_BYTES :
+                                            sizeof(uint16_t)*c->card;
+
+        memcpy(buf,&c->key,sizeof(c->key));
+        memrev64ifbe(buf);
+        buf += sizeof(c->key);
+        memcpy(buf,&c->card,sizeof(c->card));
+        memrev32ifbe(buf);
+        buf += sizeof(c->card);
+        memcpy(buf,c->data,bytes);
+#if (BYTE_ORDER == BIG_ENDIAN)
+        if (roaringIsBitmap(c)) {
+            for (uint32_t w = 0; w < ROARING_BITMAP_WORDS; w++)
+                memrev64(buf+w*sizeof(uint64_t));
+        } else {
+            for (uint32_t i = 0; i < c->card; i++)
+                memrev16(buf+i*sizeof(uint16_t));
+        }
+#endif
+        buf += bytes;
+    }
+}
+
+/* Create a set from a buffer produced by roaringSerialize(). The content is
+ * validated: NULL is returned if the buffer is not a valid serialized set. */
+roaring *roaringDeserialize(const unsigned char *buf, size_t len) {
+    const unsigned char *end = buf+len;
+    roaring *r = roaringNew();
+    uint32_t count;
+
+    if (len < sizeof(count)) goto err;
+    memcpy(&count,buf,sizeof(count));
+    memrev32ifbe(&count);
+    buf += sizeof(count);
+
+    for (uint32_t j = 0; j < count; j++) {
+        uint64_t key;
+        uint32_t card, n = 0;
+        size_t bytes;
+        void *data;
+
+        if ((size_t)(end-buf) < sizeof(key)+sizeof(card)) goto err;
+        memcpy(&key,buf,sizeof(key));
+        memrev64ifbe(&key);
+        buf += sizeof(key);
+        memcpy(&card,buf,sizeof(card));
+        memrev32ifbe(&card);
+        buf += sizeof(card);
+
+        /* Keys have 48 bits and must be strictly ascending. */
+        if (key >> 48 || card == 0 || card > 65536) goto err;
+        if (r->len && r->containers[r->len-1].key >= key) goto err;
+        bytes = card > ROARING_ARRAY_MAX ? ROARING_BITMAP_BYTES :
+                                           sizeof(uint16_t)*card;
+        if ((size_t)(end-buf) < bytes) goto err;
+
+        data = zmalloc(bytes);
+        memcpy(data,buf,bytes);
+        buf += bytes;
+        if (card > ROARING_ARRAY_MAX) {
+            uint64_t *bm = data;
+            for (uint32_t w = 0; w < ROARING_BITMAP_WORDS; w++) {
+                memrev64ifbe(bm+w);
+                n += __builtin_popcountll(bm[w]);
+            }
+            roaringAppendContainer(r,key,card,0,data);
+        } else {
+            uint16_t *a = data;
+            for (uint32_t i = 0; i < card; i++) {
+                memrev16ifbe(a+i);
+                if (i == 0 || a[i-1] < a[i]) n++;
+            }
+            roaringAppendContainer(r,key,card,card,data);
+        }
+        if (n != card) goto err;
+    }
+    if (buf != end) goto err;
+    return r;
+
+err:
+    roaringFree(r);
+    return NULL;
+}
+
+#ifdef REDIS_TEST
+#include <time.h>
+#include <sys/time.h>
+#include "intset.h"
+
+static void ok(void) {
+    printf("OK\n");
+}
+
+#define assert(_e) ((_e)?(void)0:(_assert(#_e,__FILE__,__LINE__),exit(1)))
+static void _assert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+/* Check the invariants of the containers, and that the set has exactly the
+ * elements of 'ref', a boolean array indexed by value-base. */
+#define REF_SIZE 400000
+static void checkAgainstRef(roaring *r, char *ref, int64_t base) {
+    roaringIterator it;
+    int64_t v, prev = 0;
+    uint64_t card = 0, count = 0;
+
+    for (uint32_t j = 0; j < r->len; j++) {
+        roaringContainer *c = r->containers+j;
+        assert(c->card > 0);
+        if (j) assert(r->containers[j-1].key < c->key);
+        if (!roaringIsBitmap(c)) assert(c->card <= c->cap);
+        card += c->card;
+    }
+    assert(card == r->card);
+
+    roaringInitIterator(r,&it);
+    while (roaringNext(&it,&v)) {
+        if (count) assert(prev < v);
+        assert(v >= base && v < base+REF_SIZE && ref[v-base]);
+        prev = v;
+        count++;
+    }
+    assert(count == r->card);
+}
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+#define UNUSED(x) (void)(x)
+int roaringTest(int argc, char **argv) {
+    roaring *r;
+    srand(time(NULL));
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    printf("Basic add, remove and contains: "); {
+        r = roaringNew();
+        assert(roaringAdd(r,5) == 1);
+        assert(roaringAdd(r,5) == 0);
+        assert(roaringAdd(r,-1) == 1);
+        assert(roaringAdd(r,INT64_MIN) == 1);
+        assert(roaringAdd(r,INT64_MAX) == 1);
+        assert(roaringCard(r) == 4);
+        assert(roaringContains(r,5) && roaringContains(r,-1));
+        assert(roaringContains(r,INT64_MIN) && roaringContains(r,INT64_MAX));
+        assert(!roaringContains(r,0) && !roaringContains(r,65541));
+        assert(roaringRemove(r,5) == 1);
+        assert(roaringRemove(r,5) == 0);
+        assert(roaringCard(r) == 3 && r->len == 3);
+        assert(roaringRemove(r,-1) && roaringRemove(r,INT64_MIN) &&
+               roaringRemove(r,INT64_MAX));
+        assert(roaringCard(r) == 0 && r->len == 0);
+        assert(roaringAdd(r,7) == 1 && roaringContains(r,7));
+        roaringFree(r);
+        ok();
+    }
+
+    printf("Ordered iteration of signed values: "); {
+        int64_t values[] = {INT64_MIN, -70000, -65536, -1, 0, 1, 65535, 65536,
+                            INT64_MAX};
+        int64_t v;
+        roaringIterator it;
+        int n = sizeof(values)/sizeof(values[0]);
+
+        r = roaringNew();
+        for (int j = n-1; j >= 0; j--) roaringAdd(r,values[j]);
+        roaringInitIterator(r,&it);
+        for (int j = 0; j < n; j++) {
+            assert(roaringNext(&it,&v));
+            assert(v == values[j]);
+        }
+        assert(!roaringNext(&it,&v));
+
+        roaringSeek(&it,-2);
+        assert(roaringNext(&it,&v) && v == -1);
+        roaringSeek(&it,2);
+        assert(roaringNext(&it,&v) && v == 65535);
+        roaringSeek(&it,INT64_MAX);
+        assert(roaringNext(&it,&v) && v == INT64_MAX);
+        assert(!roaringNext(&it,&v));
+        roaringFree(r);
+        ok();
+    }
+
+    printf("Array to bitmap conversion and back: "); {
+        r = roaringNew();
+        for (int j = 0; j < 8192; j += 2) roaringAdd(r,j);
+        assert(r->len == 1 && !roaringIsBitmap(r->containers));
+        roaringAdd(r,1);
+        assert(roaringIsBitmap(r->containers));
+        for (int j = 0; j < 8192; j++)
+            assert(roaringContains(r,j) == (j % 2 == 0 || j == 1));
+        roaringRemove(r,0);
+        assert(!roaringIsBitmap(r->containers));
+        for (int j = 0; j < 8192; j++)
+            assert(roaringContains(r,j) == ((j % 2 == 0 && j) || j == 1));
+        roaringFree(r);
+        ok();
+    }
+
+    printf("Stress add+remove: "); {
+        char *ref = zcalloc(REF_SIZE);
+        int64_t base = -REF_SIZE/2;
+
+        r = roaringNew();
+        for (int i = 0; i < 1000000; i++) {
+            /* Alternate dense and sparse regions to get both containers. */
+            int64_t v = (rand() % 4) ? rand() % 100000 : rand() % REF_SIZE;
+            v += base;
+            if (rand() % 3) {
+                assert(roaringAdd(r,v) == !ref[v-base]);
+                ref[v-base] = 1;
+            } else {
+                assert(roaringRemove(r,v) == ref[v-base]);
+                ref[v-base] = 0;
+            }
+        }
+        checkAgainstRef(r,ref,base);
+        for (int j = 0; j < REF_SIZE; j++)
+            assert(roaringContains(r,base+j) == ref[j]);
+        for (int j = 0; j < 1000; j++) {
+            int64_t v = roaringRandom(r);
+            assert(ref[v-base]);
+        }
+        roaringFree(r);
+        zfree(ref);
+        ok();
+    }
+
+    printf("Intersection: "); {
+        char *ref = zcalloc(REF_SIZE);
+        roaring *a = roaringNew(), *b = roaringNew(), *i;
+
+        for (int j = 0; j < 200000; j++) {
+            int64_t v = rand() % REF_SIZE;
+            roaringAdd(a,v);
+            /* Dense in the first half, sparse in the second one. */
+            v = (rand() % 4) ? rand() % (REF_SIZE/2) : rand() % REF_SIZE;
+            roaringAdd(b,v);
+        }
+        for (int j = 0; j < REF_SIZE; j++)
+            ref[j] = roaringContains(a,j) && roaringContains(b,j);
+        i = roaringIntersect(a,b);
+        checkAgainstRef(i,ref,0);
+        roaringFree(i);
+        roaringFree(a);
+        roaringFree(b);
+        zfree(ref);
+        ok();
+    }
+
+    printf("Serialization round trip and corruption: "); {
+        size_t len;
+        unsigned char *buf;
+        roaring *copy;
+
+        r = roaringNew();
+        for (int j = 0; j < 100000; j++) roaringAdd(r,rand() % 300000 - 1000);
+        len = roaringBlobLen(r);
+        buf = zmalloc(len);
+        roaringSerialize(r,buf);
+        copy = roaringDeserialize(buf,len);
+        assert(copy != NULL && roaringCard(copy) == roaringCard(r));
+        assert(roaringBlobLen(copy) == len);
+        for (int j = -1000; j < 300000; j++)
+            assert(roaringContains(r,j) == roaringContains(copy,j));
+        roaringFree(copy);
+
+        assert(roaringDeserialize(buf,len-1) == NULL);
+        assert(roaringDeserialize(buf,3) == NULL);
+        /* Corrupt the cardinality of the first container. */
+        buf[12] ^= 1;
+        assert(roaringDeserialize(buf,len) == NULL);
+        buf[12] ^= 1;
+        copy = roaringDeserialize(buf,len);
+        assert(copy != NULL);
+        roaringFree(copy);
+        zfree(buf);
+        roaringFree(r);
+        ok();
+    }
+
+    printf("Memory compared to intset: "); {
+        intset *is = intsetNew();
+        long long start;
+        long n = 1000000;
+
+        r = roaringNew();
+        for (long j = 0; j < n; j++) {
+            int64_t v = rand() % (n*4);
+            roaringAdd(r,v);
+            is = intsetAdd(is,v,NULL);
+        }
+        printf("%llu elements, roaring %zu bytes, intset %zu bytes\n",
+            (unsigned long long)roaringCard(r),roaringAllocSize(r),
+            intsetBlobLen(is));
+
+        start = usec();
+        for (long j = 0; j < n; j++) roaringContains(r,rand() % (n*4));
+        printf("  %ld lookups: roaring %lldusec, ",n,usec()-start);
+        start = usec();
+        for (long j = 0; j < n; j++) intsetFind(is,rand() % (n*4));
+        printf("intset %lldusec\n",usec()-start);
+        roaringFree(r);
+        zfree(is);
+    }
+
+    return 0;
+}
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+#include <stdint.h>
+#include <stddef.h>
+
+/* A container holds the elements of a roaring bitmap sharing the same high
+ * 48 bits, as a sorted array of the low 16 bits when there are at most
+ * ROARING_ARRAY_MAX of them, as a bitmap of 65536 bits otherwise. */
+typedef struct roaringContainer {
+    uint64_t key;           /* High 48 bits of the elements. */
+    uint32_t card;          /* Number of elements. */
+    uint32_t cap;           /* Allocated elements of an array container. */
+    void *data;             /* uint16_t array or uint64_t bitmap words. */
+} roaringContainer;
+
+typedef struct roaring {
+    uint64_t card;          /* Number of elements. */
+    uint32_t len;           /* Number of containers. */
+    uint32_t cap;           /* Allocated containers. */
+    roaringContainer *containers;   /* Sorted by key. */
+} roaring;
+
+typedef struct roaringIterator {
+    roaring *r;
+    uint32_t ci;            /* Current container. */
+    uint32_t pos;           /* Next array index or bit in the container. */
+} roaringIterator;
+
+roaring *roaringNew(void);
+void roaringFree(roaring *r);
+int roaringAdd(roaring *r, int64_t value);
+int roaringRemove(roaring *r, int64_t value);
+int roaringContains(roaring *r, int64_t value);
+uint64_t roaringCard(const roaring *r);
+int64_t roaringRandom(roaring *r);
+roaring *roaringIntersect(roaring *a, roaring *b);
+void roaringInitIterator(roaring *r, roaringIterator *it);
+void roaringSeek(roaringIterator *it, int64_t value);
+int roaringNext(roaringIterator *it, int64_t *value);
+size_t roaringAllocSize(roaring *r);
+size_t roaringBlobLen(roaring *r);
+void roaringSerialize(roaring *r, unsigned char *buf);
+roaring *roaringDeserialize(const unsigned char *buf, size_t len);
+
+#ifdef REDIS_TEST
+int roaringTest(int argc, char *argv[]);
+#endif
+
+#endif // __ROARING_H
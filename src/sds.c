@@ -80,42 +80,11 @@ static inline char sdsReqType(size_t string_size) {
 #endif
 }
 
-/* Create a new sds string with the content specified by the 'init' pointer
- * and 'initlen'.
- * If NULL is used for 'init' the string is initialized with zero bytes.
- * If SDS_NOINIT is used, the buffer is left uninitialized;
- *
- * The string is always null-termined (all the sds strings are, always) so
- * even if you create an sds string with:
- *
- * mystring = sdsnewlen("abc",3);
- *
- * You can print the string with printf() as there is an implicit \0 at the
- * end of the string. However the string is binary safe and can contain
- * \0 characters in the middle, as the length is stored in the sds header. */
-sds sdsnewlen(const void *init, size_t initlen) {
-    void *sh;
-    sds s; // sds = char *
-    char type = sdsReqType(initlen);// 根据字符串的长度获取适合的hdr
-    /* Empty strings are usually created in order to append. Use type 8
-     * since type 5 is not good at this. */
-    if (type == SDS_TYPE_5 && initlen == 0) {
-        type = SDS_TYPE_8;
-    }
-    int hdrlen = sdsHdrSize(type); 
+/* Initialize the header of type 'type' that precedes 's', for a string
+ * of 'initlen' bytes with no free space. */
+static inline void sdsSetHdr(sds s, char type, size_t initlen) {
     unsigned char *fp; /* flags pointer. */
 
-    sh = s_malloc(hdrlen+initlen+1); // +1 是为了存'\0'
-    if (init==SDS_NOINIT) { // 直接==比较字符串要保证不是malloc出来的
-        init = NULL;
-    } else if (!init) {
-        // 初始化内存空间为0，init==null时不必初始化浪费时间，最后直接
-        memset(sh, 0, hdrlen+initlen+1); 
-    }
-    if (sh == NULL) { // 这个判断不必要s_malloc分配失败会调用abort?
-        return NULL;
-    }
-    s = (char*)sh+hdrlen;// 指向数据字符串
     fp = ((unsigned char*)s)-1; // 后退一位指向flags
     switch(type) {
         case SDS_TYPE_5: {
@@ -152,6 +121,44 @@ sds sdsnewlen(const void *init, size_t initlen) {
             break;
         }
     }
+}
+
+/* Create a new sds string with the content specified by the 'init' pointer
+ * and 'initlen'.
+ * If NULL is used for 'init' the string is initialized with zero bytes.
+ * If SDS_NOINIT is used, the buffer is left uninitialized;
+ *
+ * The string is always null-termined (all the sds strings are, always) so
+ * even if you create an sds string with:
+ *
+ * mystring = sdsnewlen("abc",3);
+ *
+ * You can print the string with printf() as there is an implicit \0 at the
+ * end of the string. However the string is binary safe and can contain
+ * \0 characters in the middle, as the length is stored in the sds header. */
+sds sdsnewlen(const void *init, size_t initlen) {
+    void *sh;
+    sds s; // sds = char *
+    char type = sdsReqType(initlen);// 根据字符串的长度获取适合的hdr
+    /* Empty strings are usually created in order to append. Use type 8
+     * since type 5 is not good at this. */
+    if (type == SDS_TYPE_5 && initlen == 0) {
+        type = SDS_TYPE_8;
+    }
+    int hdrlen = sdsHdrSize(type); 
+
+    sh = s_malloc(hdrlen+initlen+1); // +1 是为了存'\0'
+    if (init==SDS_NOINIT) { // 直接==比较字符串要保证不是malloc出来的
+        init = NULL;
+    } else if (!init) {
+        // 初始化内存空间为0，init==null时不必初始化浪费时间，最后直接
+        memset(sh, 0, hdrlen+initlen+1); 
+    }
+    if (sh == NULL) { // 这个判断不必要s_malloc分配失败会调用abort?
+        return NULL;
+    }
+    s = (char*)sh+hdrlen;// 指向数据字符串
+    sdsSetHdr(s, type, initlen);
     if (initlen && init) {
         memcpy(s, init, initlen);
     }
@@ -176,6 +183,26 @@ sds sdsdup(const sds s) {
     return sdsnewlen(s, sdslen(s));
 }
 
+/* Return the number of bytes sdsembed() needs to store a copy of 's'. */
+size_t sdsEmbedSize(const sds s) {
+    return sdsHdrSize(sdsReqType(sdslen(s)))+sdslen(s)+1;
+}
+
+/* Write a copy of 's' with no free space into 'buf', that must be at least
+ * sdsEmbedSize(s) bytes, and return it. This is useful to store a string
+ * inside some other allocation: the returned string can be used as any other
+ * sds string as long as it is not freed or resized. */
+sds sdsembed(void *buf, const sds s) {
+    size_t len = sdslen(s);
+    char type = sdsReqType(len);
+    sds e = (char*)buf+sdsHdrSize(type);
+
+    sdsSetHdr(e, type, len);
+    memcpy(e, s, len);
+    e[len] = '\0';
+    return e;
+}
+
 /* Free an sds string. No operation is performed if 's' is NULL. */
 void sdsfree(sds s) {
     if (s == NULL) return;
@@ -1321,6 +1348,26 @@ int sdsTest(void) {
 
             sdsfree(x);
         }
+
+        {
+            char buf[512];
+            size_t lens[] = {0, 31, 32, 300};
+            int i;
+
+            for (i = 0; i < 4; i++) {
+                x = sdsnewlen(NULL,lens[i]);
+                memset(x,'a'+i,lens[i]);
+                size_t size = sdsEmbedSize(x);
+                memset(buf,0xff,sizeof(buf));
+                y = sdsembed(buf,x);
+                test_cond("sdsembed() fits sdsEmbedSize()",
+                    y+sdslen(y)+1 == buf+size && y[sdslen(y)] == '\0');
+                test_cond("sdsembed() content",
+                    sdslen(y) == lens[i] && sdsavail(y) == 0 &&
+                    memcmp(x,y,lens[i]) == 0);
+                sdsfree(x);
+            }
+        }
     }
     test_report()
     return 0;
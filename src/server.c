@@ -505,6 +505,26 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+size_t dictSdsEmbedSize(const void *key) {
+    return sdsEmbedSize((sds)key);
+}
+
+void *dictSdsEmbed(void *buf, const void *key) {
+    return sdsembed(buf,(sds)key);
+}
+
+size_t dictSdsEmbedSizeWithMeta(const void *key) {
+    return sizeof(keyMeta)+sdsEmbedSize((sds)key);
+}
+
+void *dictSdsEmbedWithMeta(void *buf, const void *key) {
+    keyMeta *meta = buf;
+
+    meta->expire = -1;
+    meta->vpos = 0;
+    return sdsembed(meta+1,(sds)key);
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -608,14 +628,32 @@ dictType zsetDictType = {
     NULL                       /* val destructor */
 };
 
-/* Db->dict, keys are sds strings, vals are Redis objects. */
+/* Db->dict, keys are sds strings embedded in the dict entries, vals are
+ * Redis objects. */
 dictType dbDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor   /* val destructor */
+    NULL,                       /* key destructor */
+    dictObjectDestructor,       /* val destructor */
+    dictSdsEmbedSize,           /* key embed size */
+    dictSdsEmbed,               /* key embed */
+    1                           /* open addressing */
+};
+
+/* Db->dict when expire-in-keyspace is enabled: like dbDictType, but every
+ * entry has a keyMeta header, holding the expire time, before the key. */
+dictType dbDictWithExpireType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    dictObjectDestructor,       /* val destructor */
+    dictSdsEmbedSizeWithMeta,   /* key embed size */
+    dictSdsEmbedWithMeta,       /* key embed */
+    1                           /* open addressing */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -635,7 +673,10 @@ dictType keyptrDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     NULL,                       /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    NULL,                       /* key embed size */
+    NULL,                       /* key embed */
+    1                           /* open addressing */
 };
 
 /* Command table. sds string -> command struct pointer. */
@@ -745,6 +786,60 @@ void tryResizeHashTables(int dbid) {
         dictResize(server.db[dbid].expires);
 }
 
+/* Growing a huge dict means allocating and initializing its new table,
+ * which may take a long time: the pages of tables allocated with mmap() are
+ * zeroed lazily, but the page faults then just slow down the rehashing. So
+ * when the main dict of a database is about to grow to a table of at least
+ * rehash-bg-alloc-min-slots slots, the table is allocated and faulted in by
+ * a bio thread, and installed here at a later call, once ready, starting
+ * the incremental rehashing. If the dict filled up before
+ * that, it just grew synchronously, and the table is discarded. */
+void preallocateHashTables(int dbid) {
+    redisDb *db = server.db+dbid;
+    dictTableAlloc *req = db->table_alloc;
+    unsigned long size;
+
+    if (req) {
+        int done;
+        atomicGetWithSync(req->done,done);
+        if (!done) return;
+
+        /* The dict may have been replaced (FLUSHALL ASYNC, SWAPDB) or
+         * resized in the meantime: only use the table if it is still
+         * the one the dict needs. */
+        if (req->d != db->dict ||
+            dictGrowSizeHint(db->dict) != req->size ||
+            dictExpandWithTable(db->dict,req->size,req->table) == DICT_ERR)
+        {
+            dictFreeTable(req->table,req->size);
+        } else {
+            server.stat_rehash_bg_allocs++;
+        }
+        zfree(req);
+        db->table_alloc = NULL;
+        return;
+    }
+
+    if (server.rehash_bg_alloc_min_slots == 0) return;
+    size = dictGrowSizeHint(db->dict);
+    if (size == 0 || size < server.rehash_bg_alloc_min_slots) return;
+
+    req = zmalloc(sizeof(*req));
+    req->d = db->dict;
+    req->size = size;
+    req->table = NULL;
+    req->done = 0;
+    db->table_alloc = req;
+    bioCreateBackgroundJob(BIO_DICT_ALLOC,req,NULL,NULL);
+}
+
+/* Called in the BIO_DICT_ALLOC thread: allocate the table, faulting in its
+ * pages, so that the main thread only has to install it. */
+void dictTableAllocFromBioThread(dictTableAlloc *req) {
+    req->table = dictAllocTable(req->size);
+    atomicSetWithSync(req->done,1);
+}
+
 /* Our hash table implementation performs rehashing incrementally while
  * we write/read from the hash table. Still if the server is idle, the hash
  * table will use two tables for a long time. So we try to use 1 millisecond
@@ -781,6 +876,18 @@ void updateDictResizePolicy(void) {
     }
 }
 
+/* Tell dict.c what kind of pages to use for the huge tables it allocates
+ * with mmap(), according to the hashtable-huge-pages option. */
+void updateDictHugePages(void) {
+    int flags = 0;
+
+    if (server.hashtable_huge_pages == HASHTABLE_HUGE_PAGES_THP)
+        flags = ZMMAP_THP;
+    else if (server.hashtable_huge_pages == HASHTABLE_HUGE_PAGES_HUGETLB)
+        flags = ZMMAP_HUGETLB;
+    dictSetTableHugePages(flags);
+}
+
 int hasActiveChildProcess() {
     return server.rdb_child_pid != -1 ||
            server.aof_child_pid != -1;
@@ -1037,6 +1144,7 @@ void databasesCron(void) {
         /* Resize */
         for (j = 0; j < dbs_per_call; j++) {
             tryResizeHashTables(resize_db % server.dbnum);
+            preallocateHashTables(resize_db % server.dbnum);
             resize_db++;
         }
 
@@ -1209,7 +1317,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
             size = dictSlots(server.db[j].dict);
             used = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            vkeys = dbVolatileKeysCount(server.db+j);
             if (used || vkeys) {
                 serverLog(LL_VERBOSE,"DB %d: %lld keys (%lld volatile) in %lld slots HT.",j,used,vkeys,size);
                 /* dictPrintStats(server.dict); */
@@ -1391,6 +1499,11 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 void beforeSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
 
+    /* Read and parse the queries of the clients that had their read
+     * postponed during this event loop iteration, using the I/O threads
+     * if enabled, and execute the resulting commands. */
+    handleClientsWithPendingReadsUsingThreads();
+
     /* Call the Redis Cluster before sleep function. Note that this function
      * may change the state of Redis Cluster (from ok to fail or vice versa),
      * so it's a good idea to call it before serving the unblocked clients
@@ -1439,7 +1552,11 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     flushAppendOnlyFile(0);
 
     /* Handle writes with pending output buffers. */
-    handleClientsWithPendingWrites();
+    handleClientsWithPendingWritesUsingThreads();
+
+    /* Release the clients the I/O threads found to be closed, or that had
+     * to be closed after the reply was sent. */
+    freeClientsInAsyncFreeQueue();
 
     /* Before we are going to sleep, let the threads access the dataset by
      * releasing the GIL. Redis main thread will not touch anything at this
@@ -1562,6 +1679,8 @@ void initServerConfig(void) {
     pthread_mutex_init(&server.next_client_id_mutex,NULL);
     pthread_mutex_init(&server.lruclock_mutex,NULL);
     pthread_mutex_init(&server.unixtime_mutex,NULL);
+    pthread_mutex_init(&server.stat_net_input_bytes_mutex,NULL);
+    pthread_mutex_init(&server.stat_net_output_bytes_mutex,NULL);
 
     updateCachedTime(1);
     getRandomHexChars(server.runid,CONFIG_RUN_ID_SIZE);
@@ -1586,6 +1705,8 @@ void initServerConfig(void) {
     server.verbosity = CONFIG_DEFAULT_VERBOSITY;
     server.maxidletime = CONFIG_DEFAULT_CLIENT_TIMEOUT;
     server.tcpkeepalive = CONFIG_DEFAULT_TCP_KEEPALIVE;
+    server.io_threads_num = CONFIG_DEFAULT_IO_THREADS_NUM;
+    server.io_threads_active = 0;
     server.active_expire_enabled = 1;
     server.active_defrag_enabled = CONFIG_DEFAULT_ACTIVE_DEFRAG;
     server.active_defrag_ignore_bytes = CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES;
@@ -1595,6 +1716,8 @@ void initServerConfig(void) {
     server.active_defrag_cycle_max = CONFIG_DEFAULT_DEFRAG_CYCLE_MAX;
     server.active_defrag_max_scan_fields = CONFIG_DEFAULT_DEFRAG_MAX_SCAN_FIELDS;
     server.proto_max_bulk_len = CONFIG_DEFAULT_PROTO_MAX_BULK_LEN;
+    server.bitop_incremental_min_bytes = CONFIG_DEFAULT_BITOP_INCREMENTAL_MIN_BYTES;
+    server.bitmap_sparse_min_bytes = CONFIG_DEFAULT_BITMAP_SPARSE_MIN_BYTES;
     server.client_max_querybuf_len = PROTO_MAX_QUERYBUF_LEN;
     server.saveparams = NULL;
     server.loading = 0;
@@ -1632,6 +1755,8 @@ void initServerConfig(void) {
     server.rdb_checksum = CONFIG_DEFAULT_RDB_CHECKSUM;
     server.stop_writes_on_bgsave_err = CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR;
     server.activerehashing = CONFIG_DEFAULT_ACTIVE_REHASHING;
+    server.rehash_bg_alloc_min_slots = CONFIG_DEFAULT_REHASH_BG_ALLOC_MIN_SLOTS;
+    server.hashtable_huge_pages = CONFIG_DEFAULT_HASHTABLE_HUGE_PAGES;
     server.active_defrag_running = 0;
     server.notify_keyspace_events = 0;
     server.maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
@@ -1645,11 +1770,16 @@ void initServerConfig(void) {
     server.lfu_decay_time = CONFIG_DEFAULT_LFU_DECAY_TIME;
     server.hash_max_ziplist_entries = OBJ_HASH_MAX_ZIPLIST_ENTRIES;
     server.hash_max_ziplist_value = OBJ_HASH_MAX_ZIPLIST_VALUE;
+    server.hash_intmap_encoding = OBJ_HASH_INTMAP_ENCODING;
     server.list_max_ziplist_size = OBJ_LIST_MAX_ZIPLIST_SIZE;
     server.list_compress_depth = OBJ_LIST_COMPRESS_DEPTH;
+    server.list_compress_algorithm = OBJ_LIST_COMPRESS_ALGORITHM;
     server.set_max_intset_entries = OBJ_SET_MAX_INTSET_ENTRIES;
+    server.set_roaring_encoding = OBJ_SET_ROARING_ENCODING;
     server.zset_max_ziplist_entries = OBJ_ZSET_MAX_ZIPLIST_ENTRIES;
     server.zset_max_ziplist_value = OBJ_ZSET_MAX_ZIPLIST_VALUE;
+    server.zset_max_packedtree_entries = OBJ_ZSET_MAX_PACKEDTREE_ENTRIES;
+    server.zset_btree_encoding = OBJ_ZSET_BTREE_ENCODING;
     server.hll_sparse_max_bytes = CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES;
     server.stream_node_max_bytes = OBJ_STREAM_NODE_MAX_BYTES;
     server.stream_node_max_entries = OBJ_STREAM_NODE_MAX_ENTRIES;
@@ -1671,6 +1801,8 @@ void initServerConfig(void) {
     server.lazyfree_lazy_eviction = CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION;
     server.lazyfree_lazy_expire = CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE;
     server.lazyfree_lazy_server_del = CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL;
+    server.expire_in_keyspace = CONFIG_DEFAULT_EXPIRE_IN_KEYSPACE;
+    server.active_expire_index = CONFIG_DEFAULT_ACTIVE_EXPIRE_INDEX;
     server.always_show_logo = CONFIG_DEFAULT_ALWAYS_SHOW_LOGO;
     server.lua_time_limit = LUA_SCRIPT_TIME_LIMIT;
 
@@ -2035,6 +2167,7 @@ void resetServerStats(void) {
     server.stat_active_defrag_key_hits = 0;
     server.stat_active_defrag_key_misses = 0;
     server.stat_active_defrag_scanned = 0;
+    server.stat_rehash_bg_allocs = 0;
     server.stat_fork_time = 0;
     server.stat_fork_rate = 0;
     server.stat_rejected_conn = 0;
@@ -2050,12 +2183,16 @@ void resetServerStats(void) {
     }
     server.stat_net_input_bytes = 0;
     server.stat_net_output_bytes = 0;
+    server.stat_io_reads_processed = 0;
+    server.stat_io_writes_processed = 0;
     server.aof_delayed_fsync = 0;
 }
 
 void initServer(void) {
     int j;
 
+    updateDictHugePages();
+
     signal(SIGHUP, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
     setupSignalHandlers();
@@ -2075,6 +2212,7 @@ void initServer(void) {
     server.slaves = listCreate();
     server.monitors = listCreate();
     server.clients_pending_write = listCreate();
+    server.clients_pending_read = listCreate();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
@@ -2120,8 +2258,15 @@ void initServer(void) {
 
     /* Create the Redis databases, and initialize other internal state. */
     for (j = 0; j < server.dbnum; j++) {
-        server.db[j].dict = dictCreate(&dbDictType,NULL);
+        server.db[j].dict = dictCreate(server.expire_in_keyspace ?
+            &dbDictWithExpireType : &dbDictType,NULL);
         server.db[j].expires = dictCreate(&keyptrDictType,NULL);
+        server.db[j].volatile_keys.entries = NULL;
+        server.db[j].volatile_keys.len = 0;
+        server.db[j].volatile_keys.size = 0;
+        server.db[j].expires_index = server.active_expire_index ?
+                                     raxNew() : NULL;
+        server.db[j].table_alloc = NULL;
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
@@ -2235,6 +2380,7 @@ void initServer(void) {
  * see: https://sourceware.org/bugzilla/show_bug.cgi?id=19329 */
 void InitServerLast() {
     bioInit();
+    initThreadedIO();
     server.initial_memory_usage = zmalloc_used_memory();
 }
 
@@ -2910,7 +3056,19 @@ int prepareForShutdown(int flags) {
      * send them pending writes. */
     flushSlavesOutputBuffers();
 
-    /* Close the listening sockets. Apparently this allows faster restarts. */
+    /* Close the listening sockets. Apparently this allows faster restarts.
+     * Unregister them from the event loop first: the io_uring backend
+     * holds a reference to the monitored files, so that a plain close()
+     * would not stop the kernel from accepting new connections. This is
+     * not done in closeListeningSockets() since forked children share the
+     * event loop kernel state with the parent. */
+    for (int j = 0; j < server.ipfd_count; j++)
+        aeDeleteFileEvent(server.el,server.ipfd[j],AE_READABLE);
+    if (server.sofd != -1) aeDeleteFileEvent(server.el,server.sofd,AE_READABLE);
+    if (server.cluster_enabled) {
+        for (int j = 0; j < server.cfd_count; j++)
+            aeDeleteFileEvent(server.el,server.cfd[j],AE_READABLE);
+    }
     closeListeningSockets(1);
     serverLog(LL_WARNING,"%s is now ready to exit, bye bye...",
         server.sentinel_mode ? "Sentinel" : "Redis");
@@ -3486,6 +3644,20 @@ sds genRedisInfoString(char *section) {
 
     /* Stats */
     if (allsections || defsections || !strcasecmp(section,"stats")) {
+        unsigned long rehashing = 0, rehash_moved = 0, rehash_left = 0;
+        int bg_allocs_pending = 0;
+
+        for (j = 0; j < server.dbnum; j++) {
+            dict *dicts[2] = {server.db[j].dict, server.db[j].expires};
+            for (int k = 0; k < 2; k++) {
+                if (!dictIsRehashing(dicts[k])) continue;
+                rehashing++;
+                rehash_moved += dicts[k]->ht[1].used;
+                rehash_left += dicts[k]->ht[0].used;
+            }
+            if (server.db[j].table_alloc) bg_allocs_pending++;
+        }
+
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Stats\r\n"
@@ -3514,7 +3686,14 @@ sds genRedisInfoString(char *section) {
             "active_defrag_hits:%lld\r\n"
             "active_defrag_misses:%lld\r\n"
             "active_defrag_key_hits:%lld\r\n"
-            "active_defrag_key_misses:%lld\r\n",
+            "active_defrag_key_misses:%lld\r\n"
+            "io_threaded_reads_processed:%lld\r\n"
+            "io_threaded_writes_processed:%lld\r\n"
+            "rehashing_dicts:%lu\r\n"
+            "rehashing_keys_moved:%lu\r\n"
+            "rehashing_keys_left:%lu\r\n"
+            "rehash_bg_allocs:%lld\r\n"
+            "rehash_bg_allocs_pending:%d\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -3540,7 +3719,14 @@ sds genRedisInfoString(char *section) {
             server.stat_active_defrag_hits,
             server.stat_active_defrag_misses,
             server.stat_active_defrag_key_hits,
-            server.stat_active_defrag_key_misses);
+            server.stat_active_defrag_key_misses,
+            server.stat_io_reads_processed,
+            server.stat_io_writes_processed,
+            rehashing,
+            rehash_moved,
+            rehash_left,
+            server.stat_rehash_bg_allocs,
+            bg_allocs_pending);
     }
 
     /* Replication */
@@ -3723,7 +3909,7 @@ sds genRedisInfoString(char *section) {
             long long keys, vkeys;
 
             keys = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            vkeys = dbVolatileKeysCount(server.db+j);
             if (keys || vkeys) {
                 info = sdscatprintf(info,
                     "db%d:keys=%lld,expires=%lld,avg_ttl=%lld\r\n",
@@ -4112,6 +4298,14 @@ int main(int argc, char **argv) {
             quicklistTest(argc, argv);
         } else if (!strcasecmp(argv[2], "intset")) {
             return intsetTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "intmap")) {
+            return intmapTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "roaring")) {
+            return roaringTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "bitops")) {
+            return bitopsTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "zset")) {
+            return zsetTest(argc, argv);
         } else if (!strcasecmp(argv[2], "zipmap")) {
             return zipmapTest(argc, argv);
         } else if (!strcasecmp(argv[2], "sha1test")) {
@@ -4124,6 +4318,10 @@ int main(int argc, char **argv) {
             return crc64Test(argc, argv);
         } else if (!strcasecmp(argv[2], "zmalloc")) {
             return zmalloc_test(argc, argv);
+        } else if (!strcasecmp(argv[2], "ae")) {
+            return aeTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "dict")) {
+            return dictTest(argc, argv);
         }
 
         return -1; /* test not found */
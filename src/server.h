@@ -59,7 +59,10 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "listpack.h" /* Compact list of strings, used by small aggregates */
 #include "intset.h"  /* Compact integer set structure */
+#include "intmap.h"  /* Compact field to integer map */
+#include "roaring.h" /* Compressed integer sets */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
 #include "latency.h" /* Latency monitor API */
@@ -145,6 +148,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_AOF_LOAD_TRUNCATED 1
 #define CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE 1
 #define CONFIG_DEFAULT_ACTIVE_REHASHING 1
+#define CONFIG_DEFAULT_REHASH_BG_ALLOC_MIN_SLOTS (1024*1024)
 #define CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define CONFIG_DEFAULT_RDB_SAVE_INCREMENTAL_FSYNC 1
 #define CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE 0
@@ -158,6 +162,8 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
+#define CONFIG_DEFAULT_EXPIRE_IN_KEYSPACE 0
+#define CONFIG_DEFAULT_ACTIVE_EXPIRE_INDEX 0
 #define CONFIG_DEFAULT_ALWAYS_SHOW_LOGO 0
 #define CONFIG_DEFAULT_ACTIVE_DEFRAG 0
 #define CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER 10 /* don't defrag when fragmentation is below 10% */
@@ -167,6 +173,10 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MAX 75 /* 75% CPU max (at upper threshold) */
 #define CONFIG_DEFAULT_DEFRAG_MAX_SCAN_FIELDS 1000 /* keys with more than 1000 fields will be processed separately */
 #define CONFIG_DEFAULT_PROTO_MAX_BULK_LEN (512ll*1024*1024) /* Bulk request max size */
+#define CONFIG_DEFAULT_BITOP_INCREMENTAL_MIN_BYTES (8ll*1024*1024) /* BITOP results computed in slices */
+#define CONFIG_DEFAULT_BITMAP_SPARSE_MIN_BYTES (64ll*1024) /* SETBIT creates sparse bitmaps */
+#define CONFIG_DEFAULT_IO_THREADS_NUM 1 /* Single threaded by default */
+#define IO_THREADS_MAX_NUM 128
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
@@ -187,6 +197,10 @@ typedef long long ustime_t; /* microsecond time type. */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define PROTO_REPLY_REF_MIN_BYTES (1024*16) /* Reference, don't copy, string
+                                               objects of at least this size
+                                               in the reply list. */
+#define NET_MAX_WRITEV_IOVCNT 16 /* Max buffers written by a single writev(2) */
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define REDIS_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
@@ -258,6 +272,13 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CLIENT_LUA_DEBUG_SYNC (1<<26)  /* EVAL debugging without fork() */
 #define CLIENT_MODULE (1<<27) /* Non connected client used by some module. */
 #define CLIENT_PROTECTED (1<<28) /* Client should not be freed for now. */
+#define CLIENT_PENDING_READ (1<<29) /* The client has pending reads and was put
+                                       in the list of clients we can read
+                                       from. */
+#define CLIENT_PENDING_COMMAND (1<<30) /* Used in threaded I/O to signal after
+                                          we return single threaded that the
+                                          client has already pending commands
+                                          to be executed. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -267,7 +288,8 @@ typedef long long ustime_t; /* microsecond time type. */
 #define BLOCKED_MODULE 3  /* Blocked by a loadable module. */
 #define BLOCKED_STREAM 4  /* XREAD. */
 #define BLOCKED_ZSET 5    /* BZPOP et al. */
-#define BLOCKED_NUM 6     /* Number of blocked states. */
+#define BLOCKED_BITOP 6   /* BITOP computed incrementally. */
+#define BLOCKED_NUM 7     /* Number of blocked states. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -356,18 +378,29 @@ typedef long long ustime_t; /* microsecond time type. */
 #define AOF_FSYNC_EVERYSEC 2
 #define CONFIG_DEFAULT_AOF_FSYNC AOF_FSYNC_EVERYSEC
 
+/* Huge pages for hash tables allocated with mmap(), see dictAllocTable(). */
+#define HASHTABLE_HUGE_PAGES_NO 0
+#define HASHTABLE_HUGE_PAGES_THP 1
+#define HASHTABLE_HUGE_PAGES_HUGETLB 2
+#define CONFIG_DEFAULT_HASHTABLE_HUGE_PAGES HASHTABLE_HUGE_PAGES_NO
+
 /* Zipped structures related defaults */
 #define OBJ_HASH_MAX_ZIPLIST_ENTRIES 512
 #define OBJ_HASH_MAX_ZIPLIST_VALUE 64
+#define OBJ_HASH_INTMAP_ENCODING 0
 #define OBJ_SET_MAX_INTSET_ENTRIES 512
+#define OBJ_SET_ROARING_ENCODING 0
 #define OBJ_ZSET_MAX_ZIPLIST_ENTRIES 128
 #define OBJ_ZSET_MAX_ZIPLIST_VALUE 64
+#define OBJ_ZSET_MAX_PACKEDTREE_ENTRIES 8192
+#define OBJ_ZSET_BTREE_ENCODING 0
 #define OBJ_STREAM_NODE_MAX_BYTES 4096
 #define OBJ_STREAM_NODE_MAX_ENTRIES 100
 
 /* List defaults */
 #define OBJ_LIST_MAX_ZIPLIST_SIZE -2
 #define OBJ_LIST_COMPRESS_DEPTH 0
+#define OBJ_LIST_COMPRESS_ALGORITHM QUICKLIST_NODE_ENCODING_LZF
 
 /* HyperLogLog defines */
 #define CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES 3000
@@ -606,6 +639,11 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_INTMAP 11 /* Encoded as sorted fields + int array */
+#define OBJ_ENCODING_LISTPACK 12 /* Encoded as a listpack */
+#define OBJ_ENCODING_PACKEDTREE 13 /* Encoded as a B+tree of listpacks */
+#define OBJ_ENCODING_BTREE 14  /* Encoded as hash table + B+tree */
+#define OBJ_ENCODING_ROARING 15 /* Encoded as roaring bitmap */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -622,6 +660,14 @@ typedef struct redisObject {
     void *ptr;
 } robj;
 
+/* A string with OBJ_ENCODING_ROARING encoding is a bitmap that stores the
+ * offsets of its bits set to one in a roaring bitmap, as all the other bits
+ * are zero. */
+typedef struct sparseBitmap {
+    size_t len;             /* Length of the string in bytes. */
+    roaring *bits;          /* Offsets of the bits set to one. */
+} sparseBitmap;
+
 /* Macro used to initialize a Redis object allocated on the stack.
  * Note that this macro is taken near the structure definition to make sure
  * we'll update it when the structure is changed, to avoid bugs like
@@ -636,18 +682,54 @@ typedef struct redisObject {
 struct evictionPoolEntry; /* Defined in evict.c */
 
 /* This structure is used in order to represent the output buffer of a client,
- * which is actually a linked list of blocks like that, that is: client->reply. */
+ * which is actually a linked list of blocks like that, that is: client->reply.
+ *
+ * When 'obj' is not NULL the block does not own its data: it holds a
+ * reference to a (big) string object, and the object sds is sent to the
+ * client instead of 'buf', that is empty. In this case 'size' and 'used'
+ * are both set to the length of the string. */
 typedef struct clientReplyBlock {
     size_t size, used;
+    robj *obj;
     char buf[];
 } clientReplyBlock;
 
+/* When expire-in-keyspace is enabled, the expire time of every key is stored
+ * in the keyspace entry itself, in this header that precedes the embedded
+ * key name (see dbDictWithExpireType), and db->expires is not used. */
+typedef struct keyMeta {
+    long long expire;           /* Unix time in ms, -1 if the key is persistent. */
+    unsigned long vpos;         /* Position in db->volatile_keys, if volatile. */
+} keyMeta;
+
+#define dictEntryKeyMeta(de) ((keyMeta*)dictGetEmbedBuf(de))
+
+/* The entries of db->dict having an expire set when expire-in-keyspace is
+ * enabled: it replaces db->expires to sample volatile keys for active
+ * expiry and eviction. Removal is O(1) since every key knows its position. */
+typedef struct volatileKeys {
+    dictEntry **entries;
+    unsigned long len, size;
+} volatileKeys;
+
+/* A hash table that a bio thread is allocating for the main dict of a
+ * database that is about to grow, see preallocateHashTables(). */
+typedef struct dictTableAlloc {
+    dict *d;                    /* The dict the table is for. */
+    unsigned long size;         /* Number of slots. */
+    dictEntry **table;          /* Set by the bio thread. */
+    int done;                   /* Set by the bio thread once 'table' is ready. */
+} dictTableAlloc;
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
 typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
     dict *expires;              /* Timeout of keys with a timeout set */
+    volatileKeys volatile_keys; /* Keys with a timeout, if expire-in-keyspace */
+    rax *expires_index;         /* Volatile keys by expire time, or NULL. */
+    struct dictTableAlloc *table_alloc; /* Table of dict being allocated. */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
@@ -701,6 +783,10 @@ typedef struct blockingState {
     void *module_blocked_handle; /* RedisModuleBlockedClient structure.
                                     which is opaque for the Redis core, only
                                     handled in module.c. */
+
+    /* BLOCKED_BITOP */
+    void *bitop_job;        /* BITOP job computing the result, only handled
+                               in bitops.c. */
 } blockingState;
 
 /* The following structure represents a node in the server.ready_keys list,
@@ -741,6 +827,7 @@ typedef struct client {
     long bulklen;           /* Length of bulk argument in multi bulk request. */
     list *reply;            /* List of reply objects to send to the client. */
     unsigned long long reply_bytes; /* Tot bytes of objects in reply list. */
+    unsigned long reply_refs; /* Reply list blocks referencing an object. */
     size_t sentlen;         /* Amount of bytes already sent in the current
                                buffer or object being sent. */
     time_t ctime;           /* Client creation time. */
@@ -827,8 +914,63 @@ typedef struct zskiplist {
 typedef struct zset {
     dict *dict;
     zskiplist *zsl;
+    struct zbtree *zbt;         /* Used instead of 'zsl' by the B-tree encoding. */
 } zset;
 
+/* Element of a batch of new sorted set elements inserted at once, see
+ * zsetBulkInsert(). */
+typedef struct zsetBulkEntry {
+    double score;
+    sds ele;
+    dictEntry *de;              /* Entry of 'ele' in the sorted set dict. */
+    zskiplistNode *node;        /* Set by zslInsertSorted(). */
+} zsetBulkEntry;
+
+/* Medium sized ZSETs use a B+tree of listpacks, see t_zset.c. */
+#define ZPT_LEAF_MAX_ENTRIES 64     /* Max element,score pairs in a leaf. */
+#define ZPT_MAX_CHILDREN 32         /* Max children of an inner node. */
+
+typedef struct zptNode {
+    struct zptNode *parent;
+    unsigned long count;            /* Number of elements below this node. */
+    int leaf;                       /* Leaf or inner node? */
+    int numchildren;                /* Inner nodes: number of children. */
+    unsigned char *lp;              /* Leaves: element,score pairs. */
+    struct zptNode *prev, *next;    /* Leaves: adjacent leaves. */
+    struct zptNode *children[];     /* Inner nodes: children. */
+} zptNode;
+
+typedef struct zptree {
+    zptNode *root;
+    zptNode *head, *tail;           /* First and last leaf. */
+    uint32_t *hashes;               /* Element hashes, 0 for empty slots. */
+    double *scores;                 /* Score of the element in the same slot. */
+    unsigned long size;             /* Slots in the hashes/scores tables. */
+    unsigned long used;             /* Used slots. */
+} zptree;
+
+/* With zset-btree-encoding enabled, large ZSETs are indexed by an order
+ * statistic B+tree instead of a skiplist, see t_zset.c. */
+#define ZBT_NODE_SIZE 16            /* Max keys of a node. */
+
+typedef struct zbtNode {
+    struct zbtNode *parent;
+    int leaf;                       /* Leaf or inner node? */
+    int num;                        /* Number of keys. */
+    double score[ZBT_NODE_SIZE];    /* Leaves: the elements. Inner nodes: */
+    sds ele[ZBT_NODE_SIZE];         /* the first element of every child. */
+    struct zbtNode *prev, *next;    /* Leaves: adjacent leaves. */
+    /* Inner nodes only, leaves are allocated without these fields. */
+    struct zbtNode *children[ZBT_NODE_SIZE];
+    unsigned long counts[ZBT_NODE_SIZE];    /* Elements below every child. */
+} zbtNode;
+
+typedef struct zbtree {
+    zbtNode *root;
+    zbtNode *head, *tail;           /* First and last leaf. */
+    unsigned long length;
+} zbtree;
+
 typedef struct clientBufferLimitsConfig {
     unsigned long long hard_limit_bytes;
     unsigned long long soft_limit_bytes;
@@ -956,6 +1098,8 @@ struct redisServer {
     unsigned int lruclock;      /* Clock for LRU eviction */
     int shutdown_asap;          /* SHUTDOWN needed ASAP */
     int activerehashing;        /* Incremental rehash in serverCron() */
+    unsigned long rehash_bg_alloc_min_slots; /* Allocate bigger tables in bio. */
+    int hashtable_huge_pages;   /* HASHTABLE_HUGE_PAGES_* for huge tables. */
     int active_defrag_running;  /* Active defragmentation running (holds current scan aggressiveness) */
     char *requirepass;          /* Pass for AUTH command, or NULL */
     char *pidfile;              /* PID file path */
@@ -988,6 +1132,7 @@ struct redisServer {
     list *clients;              /* List of active clients */
     list *clients_to_close;     /* Clients to close asynchronously */
     list *clients_pending_write; /* There is to write or install handler. */
+    list *clients_pending_read;  /* Client has pending read socket buffers. */
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     client *current_client;     /* Current client executing the command. */
     long fixed_time_expire;     /* If > 0, expire keys against server.mstime. */
@@ -1025,6 +1170,7 @@ struct redisServer {
     long long stat_active_defrag_key_hits;  /* number of keys with moved allocations */
     long long stat_active_defrag_key_misses;/* number of keys scanned and not moved */
     long long stat_active_defrag_scanned;   /* number of dictEntries scanned */
+    long long stat_rehash_bg_allocs; /* Tables allocated in background. */
     size_t stat_peak_memory;        /* Max used memory record */
     long long stat_fork_time;       /* Time needed to perform latest fork() */
     double stat_fork_rate;          /* Fork rate in GB/sec. */
@@ -1039,6 +1185,10 @@ struct redisServer {
     struct malloc_stats cron_malloc_stats; /* sampled in serverCron(). */
     long long stat_net_input_bytes; /* Bytes read from network. */
     long long stat_net_output_bytes; /* Bytes written to network. */
+    long long stat_io_reads_processed; /* Number of read events processed by
+                                          the I/O threads. */
+    long long stat_io_writes_processed; /* Number of write events processed by
+                                           the I/O threads. */
     size_t stat_rdb_cow_bytes;      /* Copy on write bytes during RDB saving. */
     size_t stat_aof_cow_bytes;      /* Copy on write bytes during AOF rewrite. */
     /* The following two are used to track instantaneous metrics, like
@@ -1053,6 +1203,8 @@ struct redisServer {
     int verbosity;                  /* Loglevel in redis.conf */
     int maxidletime;                /* Client timeout in seconds */
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
+    int io_threads_num;             /* Number of I/O threads to use. */
+    int io_threads_active;          /* Are the threads currently spinning? */
     int active_expire_enabled;      /* Can be disabled for testing purposes. */
     int active_defrag_enabled;
     size_t active_defrag_ignore_bytes; /* minimum amount of fragmentation waste to start active defrag */
@@ -1206,6 +1358,10 @@ struct redisServer {
     int lfu_log_factor;             /* LFU logarithmic counter factor. */
     int lfu_decay_time;             /* LFU counter decay factor. */
     long long proto_max_bulk_len;   /* Protocol bulk length maximum size. */
+    long long bitop_incremental_min_bytes; /* BITOP results of this size or
+                                              larger are computed in slices. */
+    long long bitmap_sparse_min_bytes; /* SETBIT growing a bitmap to this
+                                          size makes it sparse. */
     /* Blocked clients */
     unsigned int blocked_clients;   /* # of clients executing a blocking cmd.*/
     unsigned int blocked_clients_by_type[BLOCKED_NUM];
@@ -1220,15 +1376,20 @@ struct redisServer {
     /* Zip structure config, see redis.conf for more information  */
     size_t hash_max_ziplist_entries;
     size_t hash_max_ziplist_value;
+    int hash_intmap_encoding;
     size_t set_max_intset_entries;
+    int set_roaring_encoding;
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
+    size_t zset_max_packedtree_entries;
+    int zset_btree_encoding;
     size_t hll_sparse_max_bytes;
     size_t stream_node_max_bytes;
     int64_t stream_node_max_entries;
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
+    int list_compress_algorithm; /* QUICKLIST_NODE_ENCODING_* of new nodes. */
     /* time cache */
     time_t unixtime;    /* Unix time sampled every cron cycle. */
     time_t timezone;    /* Cached timezone. As set by tzset(). */
@@ -1281,6 +1442,9 @@ struct redisServer {
     int lazyfree_lazy_eviction;
     int lazyfree_lazy_expire;
     int lazyfree_lazy_server_del;
+    /* Keyspace layout */
+    int expire_in_keyspace;     /* Store expire times in db->dict entries. */
+    int active_expire_index;    /* Active expire using db->expires_index. */
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
@@ -1298,6 +1462,8 @@ struct redisServer {
     pthread_mutex_t lruclock_mutex;
     pthread_mutex_t next_client_id_mutex;
     pthread_mutex_t unixtime_mutex;
+    pthread_mutex_t stat_net_input_bytes_mutex;
+    pthread_mutex_t stat_net_output_bytes_mutex;
 };
 
 typedef struct pubsubPattern {
@@ -1360,6 +1526,7 @@ typedef struct {
     robj *subject;
     int encoding;
     int ii; /* intset iterator */
+    roaringIterator ri;
     dictIterator *di;
 } setTypeIterator;
 
@@ -1373,6 +1540,8 @@ typedef struct {
 
     unsigned char *fptr, *vptr;
 
+    long ii; /* intmap iterator */
+
     dictIterator *di;
     dictEntry *de;
 } hashTypeIterator;
@@ -1395,6 +1564,7 @@ extern dictType zsetDictType;
 extern dictType clusterNodesDictType;
 extern dictType clusterNodesBlackListDictType;
 extern dictType dbDictType;
+extern dictType dbDictWithExpireType;
 extern dictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
@@ -1433,6 +1603,13 @@ void getRandomBytes(unsigned char *p, size_t len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
+void unblockClientFromBitop(client *c);
+void replyToBlockedClientFromBitop(client *c);
+void bitopCompleteJobs(int dbnum);
+void sparseBitmapRead(sparseBitmap *sb, unsigned char *buf, size_t start, size_t count);
+#ifdef REDIS_TEST
+int bitopsTest(int argc, char *argv[]);
+#endif
 void redisSetProcTitle(char *title);
 
 /* networking.c -- Networking and Client related operations */
@@ -1472,6 +1649,7 @@ size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
 void freeClientReplyValue(void *o);
 void *dupClientReplyValue(void *o);
+void copyClientsReplyRefs(void);
 void getClientsMaxBuffers(unsigned long *longest_output_list,
                           unsigned long *biggest_input_buffer);
 char *getClientPeerId(client *client);
@@ -1493,6 +1671,9 @@ void pauseClients(mstime_t duration);
 int clientsArePaused(void);
 int processEventsWhileBlocked(void);
 int handleClientsWithPendingWrites(void);
+int handleClientsWithPendingReadsUsingThreads(void);
+int handleClientsWithPendingWritesUsingThreads(void);
+void initThreadedIO(void);
 int clientHasPendingReplies(client *c);
 void unlinkClient(client *c);
 int writeToClient(int fd, client *c, int handler_installed);
@@ -1565,9 +1746,13 @@ robj *createQuicklistObject(void);
 robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
+robj *createSparseBitmapObject(size_t len);
 robj *createHashObject(void);
+robj *createIntmapHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetListpackObject(void);
+robj *createZsetPackedTreeObject(void);
+robj *createZsetBtreeObject(void);
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -1687,6 +1872,7 @@ typedef struct {
 zskiplist *zslCreate(void);
 void zslFree(zskiplist *zsl);
 zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele);
+void zslInsertSorted(zskiplist *zsl, zsetBulkEntry *entries, unsigned long count);
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score);
 int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node);
 zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range);
@@ -1698,14 +1884,50 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned long zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen);
+zptree *zptCreate(void);
+void zptFree(zptree *zpt);
+unsigned long zptLength(zptree *zpt);
+size_t zptAllocSize(zptree *zpt);
+unsigned char *zptFind(zptree *zpt, sds ele, double *score, zptNode **leaf);
+void zptInsert(zptree *zpt, sds ele, double score);
+void zptDelete(zptree *zpt, zptNode *leaf, unsigned char *eptr);
+unsigned long zptGetRank(zptree *zpt, zptNode *leaf, unsigned char *eptr);
+unsigned char *zptGetElementByRank(zptree *zpt, unsigned long rank, zptNode **leaf);
+void zptNext(zptNode **leaf, unsigned char **eptr, unsigned char **sptr);
+void zptPrev(zptNode **leaf, unsigned char **eptr, unsigned char **sptr);
+unsigned char *zptFirstInRange(zptree *zpt, zrangespec *range, zptNode **leaf);
+unsigned char *zptLastInRange(zptree *zpt, zrangespec *range, zptNode **leaf);
+unsigned char *zptFirstInLexRange(zptree *zpt, zlexrangespec *range, zptNode **leaf);
+unsigned char *zptLastInLexRange(zptree *zpt, zlexrangespec *range, zptNode **leaf);
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *zbt);
+void zbtInsert(zbtree *zbt, double score, sds ele);
+int zbtDelete(zbtree *zbt, double score, sds ele);
+zbtNode *zbtFind(zbtree *zbt, double score, sds ele, int *pos);
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore);
+unsigned long zbtGetRank(zbtNode *n, int pos);
+zbtNode *zbtGetElementByRank(zbtree *zbt, unsigned long rank, int *pos);
+void zbtNext(zbtNode **n, int *pos);
+void zbtPrev(zbtNode **n, int *pos);
+zbtNode *zbtFirstInRange(zbtree *zbt, zrangespec *range, int *pos);
+zbtNode *zbtLastInRange(zbtree *zbt, zrangespec *range, int *pos);
+zbtNode *zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, int *pos);
+zbtNode *zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, int *pos);
+int zsetLargeEncoding(void);
+int zsetOverflowEncoding(size_t length);
+void zsetLargeInsert(zset *zs, double score, sds ele);
+void zsetBulkInsert(zset *zs, zsetBulkEntry *entries, unsigned long count);
+#ifdef REDIS_TEST
+int zsetTest(int argc, char *argv[]);
+#endif
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
@@ -1749,6 +1971,7 @@ void serverLogRaw(int level, const char *msg);
 void serverLogFromHandler(int level, const char *msg);
 void usage(void);
 void updateDictResizePolicy(void);
+void updateDictHugePages(void);
 int htNeedsResize(dict *dict);
 void populateCommandTable(void);
 void resetCommandTableStats(void);
@@ -1789,6 +2012,7 @@ void setTypeConvert(robj *subject, int enc);
 
 void hashTypeConvert(robj *o, int enc);
 void hashTypeTryConversion(robj *subject, robj **argv, int start, int end);
+void hashTypeTryIntmapEncoding(robj *o);
 void hashTypeTryObjectEncoding(robj *subject, robj **o1, robj **o2);
 int hashTypeExists(robj *o, sds key);
 int hashTypeDelete(robj *o, sds key);
@@ -1796,10 +2020,14 @@ unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll);
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll);
+void hashTypeCurrentFromIntmap(hashTypeIterator *hi, int what,
+                               unsigned char **vstr,
+                               unsigned int *vlen,
+                               long long *vll);
 sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what);
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll);
 sds hashTypeCurrentObjectNewSds(hashTypeIterator *hi, int what);
@@ -1832,6 +2060,7 @@ int removeExpire(redisDb *db, robj *key);
 void propagateExpire(redisDb *db, robj *key, int lazy);
 int expireIfNeeded(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
+dictEntry *dbFindExpireEntry(redisDb *db, sds key);
 void setExpire(client *c, redisDb *db, robj *key, long long when);
 robj *lookupKey(redisDb *db, robj *key, int flags);
 robj *lookupKeyRead(redisDb *db, robj *key);
@@ -1927,12 +2156,29 @@ void handleClientsBlockedOnKeys(void);
 void signalKeyAsReady(redisDb *db, robj *key);
 void blockForKeys(client *c, int btype, robj **keys, int numkeys, mstime_t timeout, robj *target, streamID *ids);
 
+/* Number of keys with an expire set in the DB. */
+#define dbVolatileKeysCount(db) (server.expire_in_keyspace ? \
+    (db)->volatile_keys.len : dictSize((db)->expires))
+
+/* Expire time held by an entry of db->expires, or by an entry of db->dict
+ * when expire-in-keyspace is enabled. */
+#define expireEntryGetTime(de) (server.expire_in_keyspace ? \
+    dictEntryKeyMeta(de)->expire : dictGetSignedIntegerVal(de))
+
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
 void expireSlaveKeys(void);
 void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList(void);
 size_t getSlaveKeyWithExpireCount(void);
+void expireIndexAdd(redisDb *db, robj *key, long long when);
+void expireIndexRemove(redisDb *db, robj *key);
+void expireIndexEmpty(redisDb *db);
+void volatileKeysAdd(redisDb *db, dictEntry *de);
+void volatileKeysDelete(redisDb *db, dictEntry *de);
+void volatileKeysEmpty(redisDb *db);
+dictEntry *volatileKeysRandom(redisDb *db);
+unsigned int volatileKeysGetSome(redisDb *db, dictEntry **des, unsigned int count);
 
 /* evict.c -- maxmemory handling and LRU eviction. */
 void evictionPoolAlloc(void);
@@ -1945,6 +2191,10 @@ unsigned long LFUDecrAndReturn(robj *o);
 uint64_t dictSdsHash(const void *key);
 int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
 void dictSdsDestructor(void *privdata, void *val);
+size_t dictSdsEmbedSize(const void *key);
+void *dictSdsEmbed(void *buf, const void *key);
+size_t dictSdsEmbedSizeWithMeta(const void *key);
+void *dictSdsEmbedWithMeta(void *buf, const void *key);
 
 /* Git SHA1 */
 char *redisGitSHA1(void);
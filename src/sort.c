@@ -301,8 +301,9 @@ void sortCommand(client *c) {
         sortby = NULL;
     }
 
-    /* Destructively convert encoded sorted sets for SORT. */
-    if (sortval->type == OBJ_ZSET)
+    /* Destructively convert encoded sorted sets for SORT. The B-tree encoding
+     * already has the hash table and the ordered index SORT needs. */
+    if (sortval->type == OBJ_ZSET && sortval->encoding != OBJ_ENCODING_BTREE)
         zsetConvert(sortval, OBJ_ENCODING_SKIPLIST);
 
     /* Objtain the length of the object to sort. */
@@ -388,6 +389,29 @@ void sortCommand(client *c) {
             j++;
         }
         setTypeReleaseIterator(si);
+    } else if (sortval->type == OBJ_ZSET && dontsort &&
+               sortval->encoding == OBJ_ENCODING_BTREE) {
+        /* Same as below for the B-tree encoding. */
+        zbtree *zbt = ((zset*)sortval->ptr)->zbt;
+        zbtNode *n;
+        int pos, rangelen = vectorlen;
+
+        n = zbtGetElementByRank(zbt,desc ? zbt->length-start :
+                                          (unsigned long)start+1,&pos);
+        while(rangelen--) {
+            serverAssertWithInfo(c,sortval,n != NULL);
+            vector[j].obj = createStringObject(n->ele[pos],sdslen(n->ele[pos]));
+            vector[j].u.score = 0;
+            vector[j].u.cmpobj = NULL;
+            j++;
+            if (desc)
+                zbtPrev(&n,&pos);
+            else
+                zbtNext(&n,&pos);
+        }
+        /* Fix start/end: output code is not aware of this optimization. */
+        end -= start;
+        start = 0;
     } else if (sortval->type == OBJ_ZSET && dontsort) {
         /* Special handling for a sorted set, if 'dontsort' is true.
          * This makes sure we return elements in the sorted set original
@@ -476,6 +500,9 @@ void sortCommand(client *c) {
                      * integer-encoded (the only encoding supported) so
                      * far. We can just cast it */
                     vector[j].u.score = (long)byval->ptr;
+                } else if (byval->encoding == OBJ_ENCODING_ROARING) {
+                    if (getDoubleFromObject(byval,&vector[j].u.score) != C_OK)
+                        int_conversion_error = 1;
                 } else {
                     serverAssertWithInfo(c,sortval,1 != 1);
                 }
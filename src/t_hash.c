@@ -35,12 +35,13 @@
  *----------------------------------------------------------------------------*/
 
 /* Check the length of a number of objects to see if we need to convert a
- * ziplist to a real hash. Note that we only check string encoded objects
- * as their string length can be queried in constant time. */
+ * listpack or an intmap to a real hash. Note that we only check string
+ * encoded objects as their string length can be queried in constant time. */
 void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     int i;
 
-    if (o->encoding != OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding != OBJ_ENCODING_LISTPACK &&
+        o->encoding != OBJ_ENCODING_INTMAP) {
         return;
     }
 
@@ -54,38 +55,49 @@ void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     }
 }
 
-/* Get the value from a ziplist encoded hash, identified by field.
+/* Get the value from a listpack encoded hash, identified by field.
  * Returns -1 when the field cannot be found. */
-int hashTypeGetFromZiplist(robj *o, sds field,
-                           unsigned char **vstr,
-                           unsigned int *vlen,
-                           long long *vll)
+int hashTypeGetFromListpack(robj *o, sds field,
+                            unsigned char **vstr,
+                            unsigned int *vlen,
+                            long long *vll)
 {
     unsigned char *zl, *fptr = NULL, *vptr = NULL;
-    int ret;
 
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
     zl = o->ptr;
-    fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+    fptr = lpFirst(zl);
     if (fptr != NULL) {
-        fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+        fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
         if (fptr != NULL) {
             /* Grab pointer to the value (fptr points to the field) */
-            vptr = ziplistNext(zl, fptr);
+            vptr = lpNext(zl, fptr);
             serverAssert(vptr != NULL);
         }
     }
 
     if (vptr != NULL) {
-        ret = ziplistGet(vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(vptr, vlen, vll);
         return 0;
     }
 
     return -1;
 }
 
+/* Get the value from an intmap encoded hash, identified by field.
+ * Returns -1 when the field cannot be found. */
+int hashTypeGetFromIntmap(robj *o, sds field, long long *vll) {
+    uint32_t pos;
+
+    serverAssert(o->encoding == OBJ_ENCODING_INTMAP);
+
+    if (!intmapFind(o->ptr, (unsigned char*)field, sdslen(field), &pos))
+        return -1;
+    *vll = intmapGetValue(o->ptr, pos);
+    return 0;
+}
+
 /* Get the value from a hash table encoded hash, identified by field.
  * Returns NULL when the field cannot be found, otherwise the SDS value
  * is returned. */
@@ -109,9 +121,13 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
  * can always check the function return by checking the return value
  * for C_OK and checking if vll (or vstr) is NULL. */
 int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        *vstr = NULL;
+        if (hashTypeGetFromListpack(o, field, vstr, vlen, vll) == 0)
+            return C_OK;
+    } else if (o->encoding == OBJ_ENCODING_INTMAP) {
         *vstr = NULL;
-        if (hashTypeGetFromZiplist(o, field, vstr, vlen, vll) == 0)
+        if (hashTypeGetFromIntmap(o, field, vll) == 0)
             return C_OK;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds value;
@@ -145,13 +161,18 @@ robj *hashTypeGetValueObject(robj *o, sds field) {
  * exist. */
 size_t hashTypeGetValueLength(robj *o, sds field) {
     size_t len = 0;
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0)
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0)
             len = vstr ? vlen : sdigits10(vll);
+    } else if (o->encoding == OBJ_ENCODING_INTMAP) {
+        long long vll;
+
+        if (hashTypeGetFromIntmap(o, field, &vll) == 0)
+            len = sdigits10(vll);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds aux;
 
@@ -166,12 +187,15 @@ size_t hashTypeGetValueLength(robj *o, sds field) {
 /* Test if the specified field exists in the given hash. Returns 1 if the field
  * exists, and 0 when it doesn't. */
 int hashTypeExists(robj *o, sds field) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) return 1;
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0) return 1;
+    } else if (o->encoding == OBJ_ENCODING_INTMAP) {
+        if (intmapFind(o->ptr, (unsigned char*)field, sdslen(field), NULL))
+            return 1;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         if (hashTypeGetFromHashTable(o, field) != NULL) return 1;
     } else {
@@ -203,39 +227,49 @@ int hashTypeExists(robj *o, sds field) {
 #define HASH_SET_COPY 0
 int hashTypeSet(robj *o, sds field, sds value, int flags) {
     int update = 0;
+    long long vll = 0;
+
+    /* Intmaps can only store integers, anything else requires a listpack. */
+    if (o->encoding == OBJ_ENCODING_INTMAP &&
+        !string2ll(value, sdslen(value), &vll))
+    {
+        hashTypeConvert(o, OBJ_ENCODING_LISTPACK);
+    }
+
+    if (o->encoding == OBJ_ENCODING_INTMAP) {
+        o->ptr = intmapSet(o->ptr, (unsigned char*)field, sdslen(field),
+                           vll, &update);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+        /* Check if the intmap needs to be converted to a hash table */
+        if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+            hashTypeConvert(o, OBJ_ENCODING_HT);
+    } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr, *vptr;
 
         zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
                 /* Grab pointer to the value (fptr points to the field) */
-                vptr = ziplistNext(zl, fptr);
+                vptr = lpNext(zl, fptr);
                 serverAssert(vptr != NULL);
                 update = 1;
 
-                /* Delete value */
-                zl = ziplistDelete(zl, &vptr);
-
-                /* Insert new value */
-                zl = ziplistInsert(zl, vptr, (unsigned char*)value,
-                        sdslen(value));
+                /* Replace value */
+                zl = lpInsert(zl, (unsigned char*)value, sdslen(value), vptr,
+                              LP_REPLACE, NULL);
             }
         }
 
         if (!update) {
-            /* Push new field/value pair onto the tail of the ziplist */
-            zl = ziplistPush(zl, (unsigned char*)field, sdslen(field),
-                    ZIPLIST_TAIL);
-            zl = ziplistPush(zl, (unsigned char*)value, sdslen(value),
-                    ZIPLIST_TAIL);
+            /* Push new field/value pair onto the tail of the listpack */
+            zl = lpAppend(zl, (unsigned char*)field, sdslen(field));
+            zl = lpAppend(zl, (unsigned char*)value, sdslen(value));
         }
         o->ptr = zl;
 
-        /* Check if the ziplist needs to be converted to a hash table */
+        /* Check if the listpack needs to be converted to a hash table */
         if (hashTypeLength(o) > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
     } else if (o->encoding == OBJ_ENCODING_HT) {
@@ -281,20 +315,23 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
 int hashTypeDelete(robj *o, sds field) {
     int deleted = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr;
 
         zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(zl, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
-                zl = ziplistDelete(zl,&fptr); /* Delete the key. */
-                zl = ziplistDelete(zl,&fptr); /* Delete the value. */
+                zl = lpDelete(zl,fptr,&fptr); /* Delete the key. */
+                zl = lpDelete(zl,fptr,NULL); /* Delete the value. */
                 o->ptr = zl;
                 deleted = 1;
             }
         }
+    } else if (o->encoding == OBJ_ENCODING_INTMAP) {
+        o->ptr = intmapDelete(o->ptr, (unsigned char*)field, sdslen(field),
+                              &deleted);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         if (dictDelete((dict*)o->ptr, field) == C_OK) {
             deleted = 1;
@@ -313,8 +350,10 @@ int hashTypeDelete(robj *o, sds field) {
 unsigned long hashTypeLength(const robj *o) {
     unsigned long length = ULONG_MAX;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        length = ziplistLen(o->ptr) / 2;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        length = lpLength(o->ptr) / 2;
+    } else if (o->encoding == OBJ_ENCODING_INTMAP) {
+        length = intmapLen(o->ptr);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         length = dictSize((const dict*)o->ptr);
     } else {
@@ -328,9 +367,11 @@ hashTypeIterator *hashTypeInitIterator(robj *subject) {
     hi->subject = subject;
     hi->encoding = subject->encoding;
 
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         hi->fptr = NULL;
         hi->vptr = NULL;
+    } else if (hi->encoding == OBJ_ENCODING_INTMAP) {
+        hi->ii = -1;
     } else if (hi->encoding == OBJ_ENCODING_HT) {
         hi->di = dictGetIterator(subject->ptr);
     } else {
@@ -348,7 +389,7 @@ void hashTypeReleaseIterator(hashTypeIterator *hi) {
 /* Move to the next entry in the hash. Return C_OK when the next entry
  * could be found and C_ERR when the iterator reaches the end. */
 int hashTypeNext(hashTypeIterator *hi) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl;
         unsigned char *fptr, *vptr;
 
@@ -359,21 +400,23 @@ int hashTypeNext(hashTypeIterator *hi) {
         if (fptr == NULL) {
             /* Initialize cursor */
             serverAssert(vptr == NULL);
-            fptr = ziplistIndex(zl, 0);
+            fptr = lpFirst(zl);
         } else {
             /* Advance cursor */
             serverAssert(vptr != NULL);
-            fptr = ziplistNext(zl, vptr);
+            fptr = lpNext(zl, vptr);
         }
         if (fptr == NULL) return C_ERR;
 
         /* Grab pointer to the value (fptr points to the field) */
-        vptr = ziplistNext(zl, fptr);
+        vptr = lpNext(zl, fptr);
         serverAssert(vptr != NULL);
 
         /* fptr, vptr now point to the first or next pair */
         hi->fptr = fptr;
         hi->vptr = vptr;
+    } else if (hi->encoding == OBJ_ENCODING_INTMAP) {
+        if (++hi->ii >= (long)intmapLen(hi->subject->ptr)) return C_ERR;
     } else if (hi->encoding == OBJ_ENCODING_HT) {
         if ((hi->de = dictNext(hi->di)) == NULL) return C_ERR;
     } else {
@@ -383,22 +426,39 @@ int hashTypeNext(hashTypeIterator *hi) {
 }
 
 /* Get the field or value at iterator cursor, for an iterator on a hash value
- * encoded as a ziplist. Prototype is similar to `hashTypeGetFromZiplist`. */
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll)
+ * encoded as a listpack. Prototype is similar to `hashTypeGetFromListpack`. */
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll)
 {
-    int ret;
+    serverAssert(hi->encoding == OBJ_ENCODING_LISTPACK);
 
-    serverAssert(hi->encoding == OBJ_ENCODING_ZIPLIST);
+    if (what & OBJ_HASH_KEY) {
+        *vstr = lpGetValue(hi->fptr, vlen, vll);
+    } else {
+        *vstr = lpGetValue(hi->vptr, vlen, vll);
+    }
+}
+
+/* Get the field or value at iterator cursor, for an iterator on a hash value
+ * encoded as an intmap. Values are always returned as numbers. Prototype is
+ * similar to `hashTypeCurrentFromListpack`. */
+void hashTypeCurrentFromIntmap(hashTypeIterator *hi, int what,
+                               unsigned char **vstr,
+                               unsigned int *vlen,
+                               long long *vll)
+{
+    serverAssert(hi->encoding == OBJ_ENCODING_INTMAP);
 
     if (what & OBJ_HASH_KEY) {
-        ret = ziplistGet(hi->fptr, vstr, vlen, vll);
-        serverAssert(ret);
+        uint32_t flen;
+
+        intmapGetField(hi->subject->ptr, hi->ii, vstr, &flen);
+        *vlen = flen;
     } else {
-        ret = ziplistGet(hi->vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = NULL;
+        *vll = intmapGetValue(hi->subject->ptr, hi->ii);
     }
 }
 
@@ -426,9 +486,11 @@ sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what) {
  * can always check the function return by checking the return value
  * type checking if vstr == NULL. */
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        hashTypeCurrentFromZiplist(hi, what, vstr, vlen, vll);
+        hashTypeCurrentFromListpack(hi, what, vstr, vlen, vll);
+    } else if (hi->encoding == OBJ_ENCODING_INTMAP) {
+        hashTypeCurrentFromIntmap(hi, what, vstr, vlen, vll);
     } else if (hi->encoding == OBJ_ENCODING_HT) {
         sds ele = hashTypeCurrentFromHashTable(hi, what);
         *vstr = (unsigned char*) ele;
@@ -453,7 +515,8 @@ sds hashTypeCurrentObjectNewSds(hashTypeIterator *hi, int what) {
 robj *hashTypeLookupWriteOrCreate(client *c, robj *key) {
     robj *o = lookupKeyWrite(c->db,key);
     if (o == NULL) {
-        o = createHashObject();
+        o = server.hash_intmap_encoding ? createIntmapHashObject() :
+                                          createHashObject();
         dbAdd(c->db,key,o);
     } else {
         if (o->type != OBJ_HASH) {
@@ -464,10 +527,10 @@ robj *hashTypeLookupWriteOrCreate(client *c, robj *key) {
     return o;
 }
 
-void hashTypeConvertZiplist(robj *o, int enc) {
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+void hashTypeConvertListpack(robj *o, int enc) {
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    if (enc == OBJ_ENCODING_ZIPLIST) {
+    if (enc == OBJ_ENCODING_LISTPACK) {
         /* Nothing to do... */
 
     } else if (enc == OBJ_ENCODING_HT) {
@@ -485,9 +548,9 @@ void hashTypeConvertZiplist(robj *o, int enc) {
             value = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE);
             ret = dictAdd(dict, key, value);
             if (ret != DICT_OK) {
-                serverLogHexDump(LL_WARNING,"ziplist with dup elements dump",
-                    o->ptr,ziplistBlobLen(o->ptr));
-                serverPanic("Ziplist corruption detected");
+                serverLogHexDump(LL_WARNING,"listpack with dup elements dump",
+                    o->ptr,lpBytes(o->ptr));
+                serverPanic("Listpack corruption detected");
             }
         }
         hashTypeReleaseIterator(hi);
@@ -499,9 +562,55 @@ void hashTypeConvertZiplist(robj *o, int enc) {
     }
 }
 
+void hashTypeConvertIntmap(robj *o, int enc) {
+    intmap *im = o->ptr;
+    uint32_t pos, len = intmapLen(im);
+    unsigned char *field;
+    uint32_t flen;
+    long long value;
+
+    serverAssert(o->encoding == OBJ_ENCODING_INTMAP);
+
+    if (enc == OBJ_ENCODING_INTMAP) {
+        /* Nothing to do... */
+
+    } else if (enc == OBJ_ENCODING_LISTPACK) {
+        unsigned char *zl = lpNew();
+        char buf[LONG_STR_SIZE];
+        int vlen;
+
+        for (pos = 0; pos < len; pos++) {
+            intmapGetField(im, pos, &field, &flen);
+            value = intmapGetValue(im, pos);
+            vlen = ll2string(buf, sizeof(buf), value);
+            zl = lpAppend(zl, field, flen);
+            zl = lpAppend(zl, (unsigned char*)buf, vlen);
+        }
+        zfree(im);
+        o->encoding = OBJ_ENCODING_LISTPACK;
+        o->ptr = zl;
+    } else if (enc == OBJ_ENCODING_HT) {
+        dict *dict = dictCreate(&hashDictType, NULL);
+
+        if (len > DICT_HT_INITIAL_SIZE) dictExpand(dict, len);
+        for (pos = 0; pos < len; pos++) {
+            intmapGetField(im, pos, &field, &flen);
+            value = intmapGetValue(im, pos);
+            dictAdd(dict, sdsnewlen(field, flen), sdsfromlonglong(value));
+        }
+        zfree(im);
+        o->encoding = OBJ_ENCODING_HT;
+        o->ptr = dict;
+    } else {
+        serverPanic("Unknown hash encoding");
+    }
+}
+
 void hashTypeConvert(robj *o, int enc) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        hashTypeConvertZiplist(o, enc);
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        hashTypeConvertListpack(o, enc);
+    } else if (o->encoding == OBJ_ENCODING_INTMAP) {
+        hashTypeConvertIntmap(o, enc);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         serverPanic("Not implemented");
     } else {
@@ -509,6 +618,50 @@ void hashTypeConvert(robj *o, int enc) {
     }
 }
 
+/* Convert a listpack encoded hash to an intmap if hash-intmap-encoding is
+ * enabled and all its values are integers. This is used when loading hashes,
+ * since while they are serialized the encoding is lost. */
+void hashTypeTryIntmapEncoding(robj *o) {
+    unsigned char *zl, *fptr, *vptr;
+    unsigned char *fstr, *vstr;
+    unsigned int flen, vlen;
+    long long fll, vll;
+    char buf[LONG_STR_SIZE];
+    intmap *im;
+
+    if (!server.hash_intmap_encoding || o->encoding != OBJ_ENCODING_LISTPACK)
+        return;
+
+    /* Check the values first, so that we don't build the intmap just to
+     * throw it away. */
+    zl = o->ptr;
+    fptr = lpFirst(zl);
+    while (fptr != NULL) {
+        vptr = lpNext(zl, fptr);
+        serverAssert(vptr != NULL);
+        vstr = lpGetValue(vptr, &vlen, &vll);
+        if (vstr) return;
+        fptr = lpNext(zl, vptr);
+    }
+
+    im = intmapNew();
+    fptr = lpFirst(zl);
+    while (fptr != NULL) {
+        vptr = lpNext(zl, fptr);
+        fstr = lpGetValue(fptr, &flen, &fll);
+        vstr = lpGetValue(vptr, &vlen, &vll);
+        if (fstr == NULL) {
+            flen = ll2string(buf, sizeof(buf), fll);
+            fstr = (unsigned char*)buf;
+        }
+        im = intmapSet(im, fstr, flen, vll, NULL);
+        fptr = lpNext(zl, vptr);
+    }
+    lpFree(zl);
+    o->encoding = OBJ_ENCODING_INTMAP;
+    o->ptr = im;
+}
+
 /*-----------------------------------------------------------------------------
  * Hash type commands
  *----------------------------------------------------------------------------*/
@@ -564,13 +717,26 @@ void hsetCommand(client *c) {
 void hincrbyCommand(client *c) {
     long long value, incr, oldvalue;
     robj *o;
-    sds new;
+    sds new, field = c->argv[2]->ptr;
     unsigned char *vstr;
     unsigned int vlen;
+    uint32_t pos;
+    int found = 0;
 
     if (getLongLongFromObjectOrReply(c,c->argv[3],&incr,NULL) != C_OK) return;
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
-    if (hashTypeGetValue(o,c->argv[2]->ptr,&vstr,&vlen,&value) == C_OK) {
+    if (o->encoding == OBJ_ENCODING_INTMAP &&
+        sdslen(field) > server.hash_max_ziplist_value)
+    {
+        hashTypeConvert(o, OBJ_ENCODING_HT);
+    }
+
+    if (o->encoding == OBJ_ENCODING_INTMAP) {
+        /* Remember the position of the field, so that an existing counter
+         * is updated in place without any further lookup. */
+        found = intmapFind(o->ptr,(unsigned char*)field,sdslen(field),&pos);
+        value = found ? intmapGetValue(o->ptr,pos) : 0;
+    } else if (hashTypeGetValue(o,field,&vstr,&vlen,&value) == C_OK) {
         if (vstr) {
             if (string2ll((char*)vstr,vlen,&value) == 0) {
                 addReplyError(c,"hash value is not an integer");
@@ -588,8 +754,12 @@ void hincrbyCommand(client *c) {
         return;
     }
     value += incr;
-    new = sdsfromlonglong(value);
-    hashTypeSet(o,c->argv[2]->ptr,new,HASH_SET_TAKE_VALUE);
+    if (found) {
+        o->ptr = intmapSetValue(o->ptr,pos,value);
+    } else {
+        new = sdsfromlonglong(value);
+        hashTypeSet(o,field,new,HASH_SET_TAKE_VALUE);
+    }
     addReplyLongLong(c,value);
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_HASH,"hincrby",c->argv[1],c->db->id);
@@ -654,12 +824,12 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
         return;
     }
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        ret = hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll);
+        ret = hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll);
         if (ret < 0) {
             addReply(c, shared.nullbulk);
         } else {
@@ -670,6 +840,13 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
             }
         }
 
+    } else if (o->encoding == OBJ_ENCODING_INTMAP) {
+        long long vll;
+
+        if (hashTypeGetFromIntmap(o, field, &vll) < 0)
+            addReply(c, shared.nullbulk);
+        else
+            addReplyBulkLongLong(c, vll);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds value = hashTypeGetFromHashTable(o, field);
         if (value == NULL)
@@ -754,12 +931,22 @@ void hstrlenCommand(client *c) {
 }
 
 static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *vstr = NULL;
+        unsigned int vlen = UINT_MAX;
+        long long vll = LLONG_MAX;
+
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
+        if (vstr)
+            addReplyBulkCBuffer(c, vstr, vlen);
+        else
+            addReplyBulkLongLong(c, vll);
+    } else if (hi->encoding == OBJ_ENCODING_INTMAP) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromIntmap(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             addReplyBulkCBuffer(c, vstr, vlen);
         else
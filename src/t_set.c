@@ -64,10 +64,11 @@ int setTypeAdd(robj *subject, sds value) {
             uint8_t success = 0;
             subject->ptr = intsetAdd(subject->ptr,llval,&success);
             if (success) {
-                /* Convert to regular set when the intset contains
-                 * too many entries. */
+                /* Convert to a roaring bitmap or a regular set when the
+                 * intset contains too many entries. */
                 if (intsetLen(subject->ptr) > server.set_max_intset_entries)
-                    setTypeConvert(subject,OBJ_ENCODING_HT);
+                    setTypeConvert(subject,server.set_roaring_encoding ?
+                        OBJ_ENCODING_ROARING : OBJ_ENCODING_HT);
                 return 1;
             }
         } else {
@@ -79,6 +80,15 @@ int setTypeAdd(robj *subject, sds value) {
             serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
             return 1;
         }
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
+            return roaringAdd(subject->ptr,llval);
+        } else {
+            /* Like for intsets, a non integer value converts the set. */
+            setTypeConvert(subject,OBJ_ENCODING_HT);
+            serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
+            return 1;
+        }
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -98,6 +108,9 @@ int setTypeRemove(robj *setobj, sds value) {
             setobj->ptr = intsetRemove(setobj->ptr,llval,&success);
             if (success) return 1;
         }
+    } else if (setobj->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK)
+            return roaringRemove(setobj->ptr,llval);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -112,6 +125,9 @@ int setTypeIsMember(robj *subject, sds value) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             return intsetFind((intset*)subject->ptr,llval);
         }
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK)
+            return roaringContains(subject->ptr,llval);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -126,6 +142,8 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
         si->di = dictGetIterator(subject->ptr);
     } else if (si->encoding == OBJ_ENCODING_INTSET) {
         si->ii = 0;
+    } else if (si->encoding == OBJ_ENCODING_ROARING) {
+        roaringInitIterator(subject->ptr,&si->ri);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -144,7 +162,8 @@ void setTypeReleaseIterator(setTypeIterator *si) {
  * Since set elements can be internally be stored as SDS strings or
  * simple arrays of integers, setTypeNext returns the encoding of the
  * set object you are iterating, and will populate the appropriate pointer
- * (sdsele) or (llele) accordingly.
+ * (sdsele) or (llele) accordingly: only the OBJ_ENCODING_HT encoding
+ * populates (sdsele), the intset and roaring ones populate (llele).
  *
  * Note that both the sdsele and llele pointers should be passed and cannot
  * be NULL since the function will try to defensively populate the non
@@ -161,6 +180,9 @@ int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele) {
         if (!intsetGet(si->subject->ptr,si->ii++,llele))
             return -1;
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (si->encoding == OBJ_ENCODING_ROARING) {
+        if (!roaringNext(&si->ri,llele)) return -1;
+        *sdsele = NULL; /* Not needed. Defensive. */
     } else {
         serverPanic("Wrong set encoding in setTypeNext");
     }
@@ -183,6 +205,7 @@ sds setTypeNextObject(setTypeIterator *si) {
     switch(encoding) {
         case -1:    return NULL;
         case OBJ_ENCODING_INTSET:
+        case OBJ_ENCODING_ROARING:
             return sdsfromlonglong(intele);
         case OBJ_ENCODING_HT:
             return sdsdup(sdsele);
@@ -213,6 +236,9 @@ int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         *llele = intsetRandom(setobj->ptr);
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (setobj->encoding == OBJ_ENCODING_ROARING) {
+        *llele = roaringRandom(setobj->ptr);
+        *sdsele = NULL; /* Not needed. Defensive. */
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -224,6 +250,8 @@ unsigned long setTypeSize(const robj *subject) {
         return dictSize((const dict*)subject->ptr);
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         return intsetLen((const intset*)subject->ptr);
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        return roaringCard((const roaring*)subject->ptr);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -231,19 +259,22 @@ unsigned long setTypeSize(const robj *subject) {
 
 /* Convert the set to specified encoding. The resulting dict (when converting
  * to a hash table) is presized to hold the number of elements in the original
- * set. */
+ * set. An intset can be converted to a hash table or a roaring bitmap, and a
+ * roaring bitmap to a hash table or, when small enough, back to an intset. */
 void setTypeConvert(robj *setobj, int enc) {
     setTypeIterator *si;
+    int64_t intele;
+    sds element;
+    void *ptr;
     serverAssertWithInfo(NULL,setobj,setobj->type == OBJ_SET &&
-                             setobj->encoding == OBJ_ENCODING_INTSET);
+                             (setobj->encoding == OBJ_ENCODING_INTSET ||
+                              setobj->encoding == OBJ_ENCODING_ROARING));
 
     if (enc == OBJ_ENCODING_HT) {
-        int64_t intele;
         dict *d = dictCreate(&setDictType,NULL);
-        sds element;
 
         /* Presize the dict to avoid rehashing */
-        dictExpand(d,intsetLen(setobj->ptr));
+        dictExpand(d,setTypeSize(setobj));
 
         /* To add the elements we extract integers and create redis objects */
         si = setTypeInitIterator(setobj);
@@ -252,13 +283,44 @@ void setTypeConvert(robj *setobj, int enc) {
             serverAssert(dictAdd(d,element,NULL) == DICT_OK);
         }
         setTypeReleaseIterator(si);
-
-        setobj->encoding = OBJ_ENCODING_HT;
-        zfree(setobj->ptr);
-        setobj->ptr = d;
+        ptr = d;
+    } else if (enc == OBJ_ENCODING_ROARING &&
+               setobj->encoding == OBJ_ENCODING_INTSET)
+    {
+        roaring *r = roaringNew();
+        si = setTypeInitIterator(setobj);
+        while (setTypeNext(si,&element,&intele) != -1)
+            roaringAdd(r,intele);
+        setTypeReleaseIterator(si);
+        ptr = r;
+    } else if (enc == OBJ_ENCODING_INTSET &&
+               setobj->encoding == OBJ_ENCODING_ROARING)
+    {
+        intset *is = intsetNew();
+        si = setTypeInitIterator(setobj);
+        while (setTypeNext(si,&element,&intele) != -1)
+            is = intsetAdd(is,intele,NULL);
+        setTypeReleaseIterator(si);
+        ptr = is;
     } else {
         serverPanic("Unsupported set conversion");
     }
+
+    if (setobj->encoding == OBJ_ENCODING_ROARING)
+        roaringFree(setobj->ptr);
+    else
+        zfree(setobj->ptr);
+    setobj->encoding = enc;
+    setobj->ptr = ptr;
+}
+
+/* Remove an integer returned by setTypeRandomElement() or setTypeNext() from
+ * an intset or roaring encoded set. */
+static void setTypeRemoveInteger(robj *setobj, int64_t llele) {
+    if (setobj->encoding == OBJ_ENCODING_INTSET)
+        setobj->ptr = intsetRemove(setobj->ptr,llele,NULL);
+    else
+        roaringRemove(setobj->ptr,llele);
 }
 
 void saddCommand(client *c) {
@@ -475,10 +537,10 @@ void spopWithCountCommand(client *c) {
         while(count--) {
             /* Emit and remove. */
             encoding = setTypeRandomElement(set,&sdsele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
-                set->ptr = intsetRemove(set->ptr,llele,NULL);
+                setTypeRemoveInteger(set,llele);
             } else {
                 addReplyBulkCBuffer(c,sdsele,sdslen(sdsele));
                 objele = createStringObject(sdsele,sdslen(sdsele));
@@ -505,7 +567,7 @@ void spopWithCountCommand(client *c) {
         /* Create a new set with just the remaining elements. */
         while(remaining--) {
             encoding = setTypeRandomElement(set,&sdsele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 sdsele = sdsfromlonglong(llele);
             } else {
                 sdsele = sdsdup(sdsele);
@@ -520,7 +582,7 @@ void spopWithCountCommand(client *c) {
         setTypeIterator *si;
         si = setTypeInitIterator(set);
         while((encoding = setTypeNext(si,&sdsele,&llele)) != -1) {
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
             } else {
@@ -573,9 +635,9 @@ void spopCommand(client *c) {
     encoding = setTypeRandomElement(set,&sdsele,&llele);
 
     /* Remove the element from the set */
-    if (encoding == OBJ_ENCODING_INTSET) {
+    if (encoding != OBJ_ENCODING_HT) {
         ele = createStringObjectFromLongLong(llele);
-        set->ptr = intsetRemove(set->ptr,llele,NULL);
+        setTypeRemoveInteger(set,llele);
     } else {
         ele = createStringObject(sdsele,sdslen(sdsele));
         setTypeRemove(set,ele->ptr);
@@ -650,7 +712,7 @@ void srandmemberWithCountCommand(client *c) {
         addReplyMultiBulkLen(c,count);
         while(count--) {
             encoding = setTypeRandomElement(set,&ele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 addReplyBulkLongLong(c,llele);
             } else {
                 addReplyBulkCBuffer(c,ele,sdslen(ele));
@@ -687,7 +749,7 @@ void srandmemberWithCountCommand(client *c) {
         while((encoding = setTypeNext(si,&ele,&llele)) != -1) {
             int retval = DICT_ERR;
 
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 retval = dictAdd(d,createStringObjectFromLongLong(llele),NULL);
             } else {
                 retval = dictAdd(d,createStringObject(ele,sdslen(ele)),NULL);
@@ -717,7 +779,7 @@ void srandmemberWithCountCommand(client *c) {
 
         while(added < count) {
             encoding = setTypeRandomElement(set,&ele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 objele = createStringObjectFromLongLong(llele);
             } else {
                 objele = createStringObject(ele,sdslen(ele));
@@ -764,7 +826,7 @@ void srandmemberCommand(client *c) {
         checkType(c,set,OBJ_SET)) return;
 
     encoding = setTypeRandomElement(set,&ele,&llele);
-    if (encoding == OBJ_ENCODING_INTSET) {
+    if (encoding != OBJ_ENCODING_HT) {
         addReplyBulkLongLong(c,llele);
     } else {
         addReplyBulkCBuffer(c,ele,sdslen(ele));
@@ -789,6 +851,45 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
     return 0;
 }
 
+/* Return true if all the 'setnum' sets, skipping the NULL ones, are intset
+ * encoded. In this case SINTER, SUNION and SDIFF work directly on the sorted
+ * arrays of integers with intsetIntersect(), intsetUnion() and
+ * intsetDifference(), instead of looking up every element. */
+static int setsAreAllIntsets(robj **sets, unsigned long setnum) {
+    for (unsigned long j = 0; j < setnum; j++)
+        if (sets[j] && sets[j]->encoding != OBJ_ENCODING_INTSET) return 0;
+    return 1;
+}
+
+/* Create a set object from the result of an intset operation. */
+static robj *createSetObjectFromIntset(intset *is) {
+    robj *o = createObject(OBJ_SET,is);
+    o->encoding = OBJ_ENCODING_INTSET;
+    if (intsetLen(is) > server.set_max_intset_entries)
+        setTypeConvert(o,OBJ_ENCODING_HT);
+    return o;
+}
+
+/* Return true if all the 'setnum' sets are roaring encoded, so that SINTER
+ * can intersect the containers with roaringIntersect(). */
+static int setsAreAllRoaring(robj **sets, unsigned long setnum) {
+    for (unsigned long j = 0; j < setnum; j++)
+        if (sets[j]->encoding != OBJ_ENCODING_ROARING) return 0;
+    return 1;
+}
+
+/* Create a set object from the result of a roaring operation, using an
+ * intset when the result is small. */
+static robj *createSetObjectFromRoaring(roaring *r) {
+    robj *o = createObject(OBJ_SET,r);
+    o->encoding = OBJ_ENCODING_ROARING;
+    if (roaringCard(r) <= server.set_max_intset_entries)
+        setTypeConvert(o,OBJ_ENCODING_INTSET);
+    else if (!server.set_roaring_encoding)
+        setTypeConvert(o,OBJ_ENCODING_HT);
+    return o;
+}
+
 void sinterGenericCommand(client *c, robj **setkeys,
                           unsigned long setnum, robj *dstkey) {
     robj **sets = zmalloc(sizeof(robj*)*setnum);
@@ -840,6 +941,57 @@ void sinterGenericCommand(client *c, robj **setkeys,
         dstset = createIntsetObject();
     }
 
+    if (setsAreAllIntsets(sets,setnum)) {
+        /* Intersect the sorted arrays, from the smallest set. */
+        intset *is = sets[0]->ptr, *tmp;
+        int64_t intele;
+
+        if (setnum == 1) {
+            is = zmalloc(intsetBlobLen(is));
+            memcpy(is,sets[0]->ptr,intsetBlobLen(sets[0]->ptr));
+        }
+        for (j = 1; j < setnum; j++) {
+            tmp = intsetIntersect(is,sets[j]->ptr);
+            if (j > 1) zfree(is);
+            is = tmp;
+            if (intsetLen(is) == 0) break;
+        }
+        if (dstkey) {
+            decrRefCount(dstset);
+            dstset = createSetObjectFromIntset(is);
+        } else {
+            for (j = 0; intsetGet(is,j,&intele); j++)
+                addReplyBulkLongLong(c,intele);
+            cardinality = intsetLen(is);
+            zfree(is);
+        }
+        goto done;
+    }
+
+    if (setnum > 1 && setsAreAllRoaring(sets,setnum)) {
+        /* Intersect the containers, from the smallest set. */
+        roaring *r = roaringIntersect(sets[0]->ptr,sets[1]->ptr), *tmp;
+        roaringIterator ri;
+        int64_t intele;
+
+        for (j = 2; j < setnum && roaringCard(r); j++) {
+            tmp = roaringIntersect(r,sets[j]->ptr);
+            roaringFree(r);
+            r = tmp;
+        }
+        if (dstkey) {
+            decrRefCount(dstset);
+            dstset = createSetObjectFromRoaring(r);
+        } else {
+            roaringInitIterator(r,&ri);
+            while (roaringNext(&ri,&intele))
+                addReplyBulkLongLong(c,intele);
+            cardinality = roaringCard(r);
+            roaringFree(r);
+        }
+        goto done;
+    }
+
     /* Iterate all the elements of the first (smallest) set, and test
      * the element against all the other sets, if at least one set does
      * not include the element it is discarded */
@@ -847,12 +999,17 @@ void sinterGenericCommand(client *c, robj **setkeys,
     while((encoding = setTypeNext(si,&elesds,&intobj)) != -1) {
         for (j = 1; j < setnum; j++) {
             if (sets[j] == sets[0]) continue;
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 /* intset with intset is simple... and fast */
                 if (sets[j]->encoding == OBJ_ENCODING_INTSET &&
                     !intsetFind((intset*)sets[j]->ptr,intobj))
                 {
                     break;
+                /* and so is an integer with a roaring bitmap */
+                } else if (sets[j]->encoding == OBJ_ENCODING_ROARING &&
+                           !roaringContains(sets[j]->ptr,intobj))
+                {
+                    break;
                 /* in order to compare an integer with an object we
                  * have to use the generic function, creating an object
                  * for this */
@@ -880,7 +1037,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
                     addReplyBulkLongLong(c,intobj);
                 cardinality++;
             } else {
-                if (encoding == OBJ_ENCODING_INTSET) {
+                if (encoding != OBJ_ENCODING_HT) {
                     elesds = sdsfromlonglong(intobj);
                     setTypeAdd(dstset,elesds);
                     sdsfree(elesds);
@@ -892,6 +1049,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
     }
     setTypeReleaseIterator(si);
 
+done:
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
          * is not an empty set. */
@@ -990,7 +1148,24 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
      * this set object will be the resulting object to set into the target key*/
     dstset = createIntsetObject();
 
-    if (op == SET_OP_UNION) {
+    if (setsAreAllIntsets(sets,setnum) && (op == SET_OP_UNION || sets[0])) {
+        /* Merge the sorted arrays. Missing keys are empty sets. */
+        intset *is = intsetNew(), *tmp;
+
+        for (j = 0; j < setnum; j++) {
+            if (!sets[j]) continue;
+            if (op == SET_OP_UNION || j == 0)
+                tmp = intsetUnion(is,sets[j]->ptr);
+            else
+                tmp = intsetDifference(is,sets[j]->ptr);
+            zfree(is);
+            is = tmp;
+            if (op == SET_OP_DIFF && intsetLen(is) == 0) break;
+        }
+        cardinality = intsetLen(is);
+        decrRefCount(dstset);
+        dstset = createSetObjectFromIntset(is);
+    } else if (op == SET_OP_UNION) {
         /* Union is trivial, just add every element of every set to the
          * temporary set. */
         for (j = 0; j < setnum; j++) {
@@ -262,6 +262,9 @@ void getrangeCommand(client *c) {
     if (o->encoding == OBJ_ENCODING_INT) {
         str = llbuf;
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        str = NULL; /* Only the requested range is materialized. */
+        strlen = ((sparseBitmap*)o->ptr)->len;
     } else {
         str = o->ptr;
         strlen = sdslen(str);
@@ -282,6 +285,10 @@ void getrangeCommand(client *c) {
      * nothing can be returned is: start > end. */
     if (start > end || strlen == 0) {
         addReply(c,shared.emptybulk);
+    } else if (str == NULL) {
+        sds range = sdsnewlen(NULL,end-start+1);
+        sparseBitmapRead(o->ptr,(unsigned char*)range,start,end-start+1);
+        addReplyBulkSds(c,range);
     } else {
         addReplyBulkCBuffer(c,(char*)str+start,end-start+1);
     }
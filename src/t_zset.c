@@ -186,6 +186,84 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
     return x;
 }
 
+/* Insert 'count' elements, sorted by score and then by element, in a single
+ * pass over the skiplist. This is like calling zslInsert() for every element,
+ * but instead of starting every search from the header, the search of each
+ * level resumes from the last node visited at that level by the previous
+ * insertion, since the new element is always after it. The same assumptions
+ * of zslInsert() apply, and the new nodes are stored in entries[j].node. */
+void zslInsertSorted(zskiplist *zsl, zsetBulkEntry *entries, unsigned long count) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+    unsigned int rank[ZSKIPLIST_MAXLEVEL];
+    unsigned long j;
+    int i, level;
+
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        update[i] = zsl->header;
+        rank[i] = 0;
+    }
+
+    for (j = 0; j < count; j++) {
+        double score = entries[j].score;
+        sds ele = entries[j].ele;
+
+        serverAssert(!isnan(score));
+        for (i = zsl->level-1; i >= 0; i--) {
+            /* Both the node reached at the upper level and the one that
+             * preceded the previous insertion at this level are before the
+             * insert position: start from the furthest of the two. */
+            if (i < zsl->level-1 && rank[i+1] > rank[i]) {
+                update[i] = update[i+1];
+                rank[i] = rank[i+1];
+            }
+            x = update[i];
+            while (x->level[i].forward &&
+                    (x->level[i].forward->score < score ||
+                        (x->level[i].forward->score == score &&
+                        sdscmp(x->level[i].forward->ele,ele) < 0)))
+            {
+                rank[i] += x->level[i].span;
+                x = x->level[i].forward;
+            }
+            update[i] = x;
+        }
+        level = zslRandomLevel();
+        if (level > zsl->level) {
+            for (i = zsl->level; i < level; i++) {
+                rank[i] = 0;
+                update[i] = zsl->header;
+                update[i]->level[i].span = zsl->length;
+            }
+            zsl->level = level;
+        }
+        x = zslCreateNode(level,score,ele);
+        for (i = 0; i < level; i++) {
+            x->level[i].forward = update[i]->level[i].forward;
+            update[i]->level[i].forward = x;
+            x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+            update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+        }
+        for (i = level; i < zsl->level; i++) {
+            update[i]->level[i].span++;
+        }
+
+        x->backward = (update[0] == zsl->header) ? NULL : update[0];
+        if (x->level[0].forward)
+            x->level[0].forward->backward = x;
+        else
+            zsl->tail = x;
+        zsl->length++;
+        entries[j].node = x;
+
+        /* The next element goes after the new node at all its levels. */
+        unsigned int xrank = rank[0]+1;
+        for (i = 0; i < level; i++) {
+            update[i] = x;
+            rank[i] = xrank;
+        }
+    }
+}
+
 /* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
 void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
     int i;
@@ -716,7 +794,7 @@ zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
 }
 
 /*-----------------------------------------------------------------------------
- * Ziplist-backed sorted set API
+ * Listpack-backed sorted set API
  *----------------------------------------------------------------------------*/
 
 double zzlGetScore(unsigned char *sptr) {
@@ -727,7 +805,7 @@ double zzlGetScore(unsigned char *sptr) {
     double score;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(sptr,&vlen,&vlong);
 
     if (vstr) {
         memcpy(buf,vstr,vlen);
@@ -740,14 +818,14 @@ double zzlGetScore(unsigned char *sptr) {
     return score;
 }
 
-/* Return a ziplist element as an SDS string. */
-sds ziplistGetObject(unsigned char *sptr) {
+/* Return a listpack element as an SDS string. */
+sds lpGetObject(unsigned char *sptr) {
     unsigned char *vstr;
     unsigned int vlen;
     long long vlong;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(sptr,&vlen,&vlong);
 
     if (vstr) {
         return sdsnewlen((char*)vstr,vlen);
@@ -764,7 +842,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
     unsigned char vbuf[32];
     int minlen, cmp;
 
-    serverAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(eptr,&vlen,&vlong);
     if (vstr == NULL) {
         /* Store string representation of long long in buf. */
         vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
@@ -778,7 +856,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
 }
 
 unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+    return lpLength(zl)/2;
 }
 
 /* Move to next entry based on the values in eptr and sptr. Both are set to
@@ -787,9 +865,9 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _eptr = ziplistNext(zl,*sptr);
+    _eptr = lpNext(zl,*sptr);
     if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
+        _sptr = lpNext(zl,_eptr);
         serverAssert(_sptr != NULL);
     } else {
         /* No next entry. */
@@ -806,9 +884,9 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _sptr = ziplistPrev(zl,*eptr);
+    _sptr = lpPrev(zl,*eptr);
     if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
+        _eptr = lpPrev(zl,_sptr);
         serverAssert(_eptr != NULL);
     } else {
         /* No previous entry. */
@@ -830,13 +908,13 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-1); /* Last score. */
+    p = lpSeek(zl,-1); /* Last score. */
     if (p == NULL) return 0; /* Empty sorted set */
     score = zzlGetScore(p);
     if (!zslValueGteMin(score,range))
         return 0;
 
-    p = ziplistIndex(zl,1); /* First score. */
+    p = lpSeek(zl,1); /* First score. */
     serverAssert(p != NULL);
     score = zzlGetScore(p);
     if (!zslValueLteMax(score,range))
@@ -848,14 +926,14 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the first element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -867,7 +945,7 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     return NULL;
@@ -876,14 +954,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the last element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -896,9 +974,9 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -907,14 +985,14 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 }
 
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueGteMin(value,spec);
     sdsfree(value);
     return res;
 }
 
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueLteMax(value,spec);
     sdsfree(value);
     return res;
@@ -930,12 +1008,12 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
     if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-2); /* Last element. */
+    p = lpSeek(zl,-2); /* Last element. */
     if (p == NULL) return 0;
     if (!zzlLexValueGteMin(p,range))
         return 0;
 
-    p = ziplistIndex(zl,0); /* First element. */
+    p = lpSeek(zl,0); /* First element. */
     serverAssert(p != NULL);
     if (!zzlLexValueLteMax(p,range))
         return 0;
@@ -946,7 +1024,7 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the first element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -960,9 +1038,9 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
         }
 
         /* Move to next element. */
-        sptr = ziplistNext(zl,eptr); /* This element score. Skip it. */
+        sptr = lpNext(zl,eptr); /* This element score. Skip it. */
         serverAssert(sptr != NULL);
-        eptr = ziplistNext(zl,sptr); /* Next element. */
+        eptr = lpNext(zl,sptr); /* Next element. */
     }
 
     return NULL;
@@ -971,7 +1049,7 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the last element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -986,9 +1064,9 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -997,32 +1075,26 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 }
 
 unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
-
-    while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
-        serverAssert(sptr != NULL);
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
-        if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
-            /* Matching element, pull out score. */
-            if (score != NULL) *score = zzlGetScore(sptr);
-            return eptr;
-        }
+    if (eptr == NULL) return NULL;
+    eptr = lpFind(zl,eptr,(unsigned char*)ele,sdslen(ele),1);
+    if (eptr == NULL) return NULL;
 
-        /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
-    }
-    return NULL;
+    /* Matching element, pull out score. */
+    sptr = lpNext(zl,eptr);
+    serverAssert(sptr != NULL);
+    if (score != NULL) *score = zzlGetScore(sptr);
+    return eptr;
 }
 
-/* Delete (element,score) pair from ziplist. Use local copy of eptr because we
+/* Delete (element,score) pair from listpack. Use local copy of eptr because we
  * don't want to modify the one given as argument. */
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
     unsigned char *p = eptr;
 
-    /* TODO: add function to ziplist API to delete N elements from offset. */
-    zl = ziplistDelete(zl,&p);
-    zl = ziplistDelete(zl,&p);
+    zl = lpDelete(zl,p,&p);
+    zl = lpDelete(zl,p,NULL);
     return zl;
 }
 
@@ -1030,33 +1102,27 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, sds ele, doub
     unsigned char *sptr;
     char scorebuf[128];
     int scorelen;
-    size_t offset;
 
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
-        zl = ziplistPush(zl,(unsigned char*)ele,sdslen(ele),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = lpAppend(zl,(unsigned char*)ele,sdslen(ele));
+        zl = lpAppend(zl,(unsigned char*)scorebuf,scorelen);
     } else {
-        /* Keep offset relative to zl, as it might be re-allocated. */
-        offset = eptr-zl;
-        zl = ziplistInsert(zl,eptr,(unsigned char*)ele,sdslen(ele));
-        eptr = zl+offset;
-
-        /* Insert score after the element. */
-        serverAssert((sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        /* Insert the element before eptr, then the score after it. */
+        zl = lpInsert(zl,(unsigned char*)ele,sdslen(ele),eptr,LP_BEFORE,&sptr);
+        zl = lpInsert(zl,(unsigned char*)scorebuf,scorelen,sptr,LP_AFTER,NULL);
     }
     return zl;
 }
 
-/* Insert (element,score) pair in ziplist. This function assumes the element is
+/* Insert (element,score) pair in listpack. This function assumes the element is
  * not yet present in the list. */
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double s;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
         s = zzlGetScore(sptr);
 
@@ -1075,7 +1141,7 @@ unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     /* Push on tail of list when it was not yet inserted. */
@@ -1094,14 +1160,13 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, eptr will be NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         score = zzlGetScore(sptr);
         if (zslValueLteMax(score,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1122,13 +1187,12 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, eptr will be NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         if (zzlLexValueLteMax(eptr,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1145,229 +1209,1766 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
 unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end, unsigned long *deleted) {
     unsigned int num = (end-start)+1;
     if (deleted) *deleted = num;
-    zl = ziplistDeleteRange(zl,2*(start-1),2*num);
+    zl = lpDeleteRange(zl,2*(start-1),2*num);
     return zl;
 }
 
 /*-----------------------------------------------------------------------------
- * Common sorted set API
+ * Packed tree sorted set API
  *----------------------------------------------------------------------------*/
 
-unsigned long zsetLength(const robj *zobj) {
-    unsigned long length = 0;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
-        length = zzlLength(zobj->ptr);
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        length = ((const zset*)zobj->ptr)->zsl->length;
+/* Medium sized sorted sets, too big for a single listpack but still small
+ * enough that the skiplist + hash table overhead dominates, are stored in a
+ * B+tree whose leaves are listpacks of element,score pairs in the same format
+ * used by the listpack encoding, so the zzl*() functions above work inside a
+ * leaf. Every node counts the elements stored below it, so that rank lookups
+ * and rank seeks are O(log(N)).
+ *
+ * To find the score of an element without scanning the leaves, an open
+ * addressing table maps the 32 bit hash of every element to its score: the
+ * score is all we need to reach the leaf holding the element, where the
+ * element itself is compared. */
+
+#define ZPT_INDEX_MIN_SIZE 16
+
+static zptNode *zptCreateLeaf(unsigned char *lp) {
+    zptNode *n = zmalloc(sizeof(*n));
+    n->parent = NULL;
+    n->count = 0;
+    n->leaf = 1;
+    n->numchildren = 0;
+    n->lp = lp;
+    n->prev = n->next = NULL;
+    return n;
+}
+
+static zptNode *zptCreateInner(void) {
+    zptNode *n = zmalloc(sizeof(*n)+sizeof(zptNode*)*ZPT_MAX_CHILDREN);
+    n->parent = NULL;
+    n->count = 0;
+    n->leaf = 0;
+    n->numchildren = 0;
+    n->lp = NULL;
+    n->prev = n->next = NULL;
+    return n;
+}
+
+zptree *zptCreate(void) {
+    zptree *zpt = zmalloc(sizeof(*zpt));
+    zpt->root = zpt->head = zpt->tail = zptCreateLeaf(lpNew());
+    zpt->hashes = NULL;
+    zpt->scores = NULL;
+    zpt->size = 0;
+    zpt->used = 0;
+    return zpt;
+}
+
+static void zptFreeNode(zptNode *n) {
+    if (n->leaf) {
+        lpFree(n->lp);
     } else {
-        serverPanic("Unknown sorted set encoding");
+        for (int j = 0; j < n->numchildren; j++) zptFreeNode(n->children[j]);
     }
-    return length;
+    zfree(n);
 }
 
-void zsetConvert(robj *zobj, int encoding) {
-    zset *zs;
-    zskiplistNode *node, *next;
-    sds ele;
-    double score;
+void zptFree(zptree *zpt) {
+    zptFreeNode(zpt->root);
+    zfree(zpt->hashes);
+    zfree(zpt->scores);
+    zfree(zpt);
+}
 
-    if (zobj->encoding == encoding) return;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl = zobj->ptr;
-        unsigned char *eptr, *sptr;
-        unsigned char *vstr;
-        unsigned int vlen;
-        long long vlong;
+unsigned long zptLength(zptree *zpt) {
+    return zpt->root->count;
+}
 
-        if (encoding != OBJ_ENCODING_SKIPLIST)
-            serverPanic("Unknown target encoding");
+static size_t zptNodeAllocSize(zptNode *n) {
+    size_t size;
 
-        zs = zmalloc(sizeof(*zs));
-        zs->dict = dictCreate(&zsetDictType,NULL);
-        zs->zsl = zslCreate();
+    if (n->leaf) return sizeof(*n)+lpBytes(n->lp);
+    size = sizeof(*n)+sizeof(zptNode*)*ZPT_MAX_CHILDREN;
+    for (int j = 0; j < n->numchildren; j++)
+        size += zptNodeAllocSize(n->children[j]);
+    return size;
+}
 
-        eptr = ziplistIndex(zl,0);
-        serverAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
-        serverAssertWithInfo(NULL,zobj,sptr != NULL);
+/* Return the number of bytes used by the tree, the leaves and the index. */
+size_t zptAllocSize(zptree *zpt) {
+    return sizeof(*zpt)+zptNodeAllocSize(zpt->root)+
+           zpt->size*(sizeof(uint32_t)+sizeof(double));
+}
 
-        while (eptr != NULL) {
-            score = zzlGetScore(sptr);
-            serverAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
-            if (vstr == NULL)
-                ele = sdsfromlonglong(vlong);
-            else
-                ele = sdsnewlen((char*)vstr,vlen);
+/* ---------------------------- Element index ------------------------------- */
 
-            node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
-            zzlNext(zl,&eptr,&sptr);
+/* Hash of an element as stored in the index. Zero marks empty slots. */
+static uint32_t zptHash(unsigned char *s, size_t len) {
+    uint32_t h = dictGenHashFunction(s,len);
+    return h ? h : 1;
+}
+
+/* Hash of the element stored at 'eptr' in a leaf. */
+static uint32_t zptHashEntry(unsigned char *eptr) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    char buf[LONG_STR_SIZE];
+
+    vstr = lpGetValue(eptr,&vlen,&vlong);
+    if (vstr == NULL) {
+        vlen = ll2string(buf,sizeof(buf),vlong);
+        vstr = (unsigned char*)buf;
+    }
+    return zptHash(vstr,vlen);
+}
+
+static void zptIndexResize(zptree *zpt, unsigned long size) {
+    uint32_t *oldhashes = zpt->hashes;
+    double *oldscores = zpt->scores;
+    unsigned long oldsize = zpt->size, mask = size-1;
+
+    zpt->hashes = zcalloc(sizeof(uint32_t)*size);
+    zpt->scores = zmalloc(sizeof(double)*size);
+    zpt->size = size;
+    for (unsigned long j = 0; j < oldsize; j++) {
+        if (oldhashes[j] == 0) continue;
+        unsigned long i = oldhashes[j] & mask;
+        while (zpt->hashes[i]) i = (i+1) & mask;
+        zpt->hashes[i] = oldhashes[j];
+        zpt->scores[i] = oldscores[j];
+    }
+    zfree(oldhashes);
+    zfree(oldscores);
+}
+
+static void zptIndexAdd(zptree *zpt, uint32_t h, double score) {
+    if ((zpt->used+1)*4 > zpt->size*3)
+        zptIndexResize(zpt,zpt->size ? zpt->size*2 : ZPT_INDEX_MIN_SIZE);
+
+    unsigned long mask = zpt->size-1, i = h & mask;
+    while (zpt->hashes[i]) i = (i+1) & mask;
+    zpt->hashes[i] = h;
+    zpt->scores[i] = score;
+    zpt->used++;
+}
+
+/* Remove one slot with the given hash and score. Slots sharing both are
+ * interchangeable, so it does not matter which one of them goes away. */
+static void zptIndexDel(zptree *zpt, uint32_t h, double score) {
+    unsigned long mask = zpt->size-1, i = h & mask, j;
+
+    while (zpt->hashes[i] != h || zpt->scores[i] != score) {
+        serverAssert(zpt->hashes[i] != 0);
+        i = (i+1) & mask;
+    }
+
+    /* Backward shift deletion: move back every following slot of the same
+     * cluster that can't be found anymore once 'i' becomes empty, that is,
+     * whose home slot is not cyclically in (i,j]. */
+    j = i;
+    while (1) {
+        j = (j+1) & mask;
+        if (zpt->hashes[j] == 0) break;
+        unsigned long k = zpt->hashes[j] & mask;
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            zpt->hashes[i] = zpt->hashes[j];
+            zpt->scores[i] = zpt->scores[j];
+            i = j;
         }
+    }
+    zpt->hashes[i] = 0;
+    zpt->used--;
 
-        zfree(zobj->ptr);
-        zobj->ptr = zs;
-        zobj->encoding = OBJ_ENCODING_SKIPLIST;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+    if (zpt->size > ZPT_INDEX_MIN_SIZE && zpt->used*8 < zpt->size)
+        zptIndexResize(zpt,zpt->size/2);
+}
 
-        if (encoding != OBJ_ENCODING_ZIPLIST)
-            serverPanic("Unknown target encoding");
+/* ----------------------------- Tree structure ----------------------------- */
 
-        /* Approach similar to zslFree(), since we want to free the skiplist at
-         * the same time as creating the ziplist. */
-        zs = zobj->ptr;
-        dictRelease(zs->dict);
-        node = zs->zsl->header->level[0].forward;
-        zfree(zs->zsl->header);
-        zfree(zs->zsl);
+static zptNode *zptFirstLeaf(zptNode *n) {
+    while (!n->leaf) n = n->children[0];
+    return n;
+}
 
-        while (node) {
-            zl = zzlInsertAt(zl,NULL,node->ele,node->score);
-            next = node->level[0].forward;
-            zslFreeNode(node);
-            node = next;
+static zptNode *zptLastLeaf(zptNode *n) {
+    while (!n->leaf) n = n->children[n->numchildren-1];
+    return n;
+}
+
+/* Return the position of 'n' among the children of its parent. */
+static int zptChildIndex(zptNode *n) {
+    zptNode *parent = n->parent;
+
+    for (int j = 0; j < parent->numchildren; j++)
+        if (parent->children[j] == n) return j;
+    serverPanic("Packed tree node not found in its parent");
+    return -1; /* Never reached. */
+}
+
+/* Add 'delta' to the element count of 'n' and all its ancestors. */
+static void zptUpdateCount(zptNode *n, long delta) {
+    while (n) {
+        n->count += delta;
+        n = n->parent;
+    }
+}
+
+static void zptInsertAfter(zptree *zpt, zptNode *n, zptNode *new);
+
+/* Insert 'child' at position 'pos' among the children of the inner node 'n',
+ * splitting 'n' first if it is full. The elements of 'child' are added to the
+ * count of the new parent and its ancestors. */
+static void zptInsertChild(zptree *zpt, zptNode *n, int pos, zptNode *child) {
+    if (n->numchildren == ZPT_MAX_CHILDREN) {
+        zptNode *right = zptCreateInner();
+        int half = n->numchildren/2;
+
+        right->numchildren = n->numchildren-half;
+        memcpy(right->children,n->children+half,
+               sizeof(zptNode*)*right->numchildren);
+        n->numchildren = half;
+        for (int j = 0; j < right->numchildren; j++) {
+            right->children[j]->parent = right;
+            right->count += right->children[j]->count;
         }
+        n->count -= right->count;
+
+        /* The ancestors of 'n' already account for the elements of 'right',
+         * that zptInsertAfter() is going to add again. */
+        if (n->parent) zptUpdateCount(n->parent,-(long)right->count);
+        zptInsertAfter(zpt,n,right);
+        if (pos > half) {
+            n = right;
+            pos -= half;
+        }
+    }
+    memmove(n->children+pos+1,n->children+pos,
+            sizeof(zptNode*)*(n->numchildren-pos));
+    n->children[pos] = child;
+    n->numchildren++;
+    child->parent = n;
+    zptUpdateCount(n,child->count);
+}
 
-        zfree(zs);
-        zobj->ptr = zl;
-        zobj->encoding = OBJ_ENCODING_ZIPLIST;
-    } else {
-        serverPanic("Unknown sorted set encoding");
+/* Insert 'new' as the sibling following 'n', growing the tree by one level
+ * if 'n' is the root. */
+static void zptInsertAfter(zptree *zpt, zptNode *n, zptNode *new) {
+    if (n->parent == NULL) {
+        zptNode *root = zptCreateInner();
+        root->children[0] = n;
+        root->numchildren = 1;
+        root->count = n->count;
+        n->parent = root;
+        zpt->root = root;
     }
+    zptInsertChild(zpt,n->parent,zptChildIndex(n)+1,new);
 }
 
-/* Convert the sorted set object into a ziplist if it is not already a ziplist
- * and if the number of elements and the maximum element size is within the
- * expected ranges. */
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) return;
-    zset *zset = zobj->ptr;
+/* Unlink 'n' from the tree and free it, together with the ancestors that
+ * remain without children. The root can't be removed. */
+static void zptRemoveNode(zptree *zpt, zptNode *n) {
+    zptNode *parent = n->parent;
+    int idx = zptChildIndex(n);
+
+    memmove(parent->children+idx,parent->children+idx+1,
+            sizeof(zptNode*)*(parent->numchildren-idx-1));
+    parent->numchildren--;
+    zptUpdateCount(parent,-(long)n->count);
+
+    if (n->leaf) {
+        if (n->prev) n->prev->next = n->next; else zpt->head = n->next;
+        if (n->next) n->next->prev = n->prev; else zpt->tail = n->prev;
+        lpFree(n->lp);
+    }
+    zfree(n);
+
+    if (parent->numchildren == 0) {
+        zptRemoveNode(zpt,parent);
+        return;
+    }
 
-    if (zset->zsl->length <= server.zset_max_ziplist_entries &&
-        maxelelen <= server.zset_max_ziplist_value)
-            zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
+    /* Shrink the tree when the root is left with a single child. */
+    while (!zpt->root->leaf && zpt->root->numchildren == 1) {
+        zptNode *root = zpt->root;
+        zpt->root = root->children[0];
+        zpt->root->parent = NULL;
+        zfree(root);
+    }
 }
 
-/* Return (by reference) the score of the specified member of the sorted set
- * storing it into *score. If the element does not exist C_ERR is returned
- * otherwise C_OK is returned and *score is correctly populated.
- * If 'zobj' or 'member' is NULL, C_ERR is returned. */
-int zsetScore(robj *zobj, sds member, double *score) {
-    if (!zobj || !member) return C_ERR;
+/* Move the elements of the leaf 'b' at the end of its previous leaf 'a',
+ * that must have the same parent, and remove 'b'. */
+static void zptMergeLeaves(zptree *zpt, zptNode *a, zptNode *b) {
+    unsigned char *lp = lpMerge(&a->lp,&b->lp);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
-        if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        zset *zs = zobj->ptr;
-        dictEntry *de = dictFind(zs->dict, member);
-        if (de == NULL) return C_ERR;
-        *score = *(double*)dictGetVal(de);
-    } else {
-        serverPanic("Unknown sorted set encoding");
+    a->lp = lp;
+    b->lp = NULL;
+    a->count += b->count;
+    b->count = 0;
+    zptRemoveNode(zpt,b);
+}
+
+/* Split a leaf in two halves. */
+static void zptSplitLeaf(zptree *zpt, zptNode *leaf) {
+    unsigned long half = leaf->count/2, moved = leaf->count-half;
+    size_t bytes = lpBytes(leaf->lp);
+    unsigned char *lp = zmalloc(bytes);
+    zptNode *new;
+
+    memcpy(lp,leaf->lp,bytes);
+    new = zptCreateLeaf(lpDeleteRange(lp,0,2*half));
+    leaf->lp = lpDeleteRange(leaf->lp,2*half,2*moved);
+    zptUpdateCount(leaf,-(long)moved);
+    new->count = moved;
+
+    new->prev = leaf;
+    new->next = leaf->next;
+    if (leaf->next) leaf->next->prev = new; else zpt->tail = new;
+    leaf->next = new;
+    zptInsertAfter(zpt,leaf,new);
+}
+
+/* ------------------------------- Lookups ---------------------------------- */
+
+/* Compare the leaf entry at 'eptr' with the element 'ele' having the score
+ * 'score', using the sorted set order. */
+static int zptCompareEntry(unsigned char *lp, unsigned char *eptr, double score, sds ele) {
+    double s = zzlGetScore(lpNext(lp,eptr));
+
+    if (s != score) return (s < score) ? -1 : 1;
+    return zzlCompareElements(eptr,(unsigned char*)ele,sdslen(ele));
+}
+
+/* Return the leaf where the element 'ele' with score 'score' is, or should
+ * be inserted: the first leaf whose last element is not smaller, or the last
+ * leaf when there is no such leaf. */
+static zptNode *zptFindLeaf(zptree *zpt, double score, sds ele) {
+    zptNode *n = zpt->root;
+
+    while (!n->leaf) {
+        int lo = 0, hi = n->numchildren-1;
+
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            zptNode *last = zptLastLeaf(n->children[mid]);
+            if (zptCompareEntry(last->lp,lpSeek(last->lp,-2),score,ele) >= 0)
+                hi = mid;
+            else
+                lo = mid+1;
+        }
+        n = n->children[lo];
     }
-    return C_OK;
+    return n;
 }
 
-/* Add a new element or update the score of an existing element in a sorted
- * set, regardless of its encoding.
- *
- * The set of flags change the command behavior. They are passed with an integer
- * pointer since the function will clear the flags and populate them with
- * other flags to indicate different conditions.
- *
- * The input flags are the following:
- *
- * ZADD_INCR: Increment the current element score by 'score' instead of updating
- *            the current element score. If the element does not exist, we
- *            assume 0 as previous score.
- * ZADD_NX:   Perform the operation only if the element does not exist.
- * ZADD_XX:   Perform the operation only if the element already exist.
- *
- * When ZADD_INCR is used, the new score of the element is stored in
- * '*newscore' if 'newscore' is not NULL.
- *
- * The returned flags are the following:
- *
- * ZADD_NAN:     The resulting score is not a number.
- * ZADD_ADDED:   The element was added (not present before the call).
- * ZADD_UPDATED: The element score was updated.
- * ZADD_NOP:     No operation was performed because of NX or XX.
- *
- * Return value:
- *
- * The function returns 1 on success, and sets the appropriate flags
- * ADDED or UPDATED to signal what happened during the operation (note that
- * none could be set if we re-added an element using the same score it used
- * to have, or in the case a zero increment is used).
- *
- * The function returns 0 on erorr, currently only when the increment
- * produces a NAN condition, or when the 'score' value is NAN since the
- * start.
- *
- * The commad as a side effect of adding a new element may convert the sorted
- * set internal encoding from ziplist to hashtable+skiplist.
- *
- * Memory managemnet of 'ele':
- *
- * The function does not take ownership of the 'ele' SDS string, but copies
- * it if needed. */
-int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
-    /* Turn options into simple to check vars. */
-    int incr = (*flags & ZADD_INCR) != 0;
-    int nx = (*flags & ZADD_NX) != 0;
-    int xx = (*flags & ZADD_XX) != 0;
-    *flags = 0; /* We'll return our response flags. */
-    double curscore;
+/* Find the element 'ele' with the score 'score' in the tree. */
+static unsigned char *zptSeek(zptree *zpt, double score, sds ele, zptNode **leafptr) {
+    zptNode *leaf = zptFindLeaf(zpt,score,ele);
+    unsigned char *eptr = lpFirst(leaf->lp);
 
-    /* NaN as input is an error regardless of all the other parameters. */
-    if (isnan(score)) {
-        *flags = ZADD_NAN;
-        return 0;
+    while (eptr != NULL) {
+        int cmp = zptCompareEntry(leaf->lp,eptr,score,ele);
+        if (cmp == 0) {
+            if (leafptr) *leafptr = leaf;
+            return eptr;
+        }
+        if (cmp > 0) break;
+        eptr = lpNext(leaf->lp,lpNext(leaf->lp,eptr));
     }
+    return NULL;
+}
 
-    /* Update the sorted set according to its encoding. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *eptr;
+/* Find the element 'ele', returning a pointer to it inside its leaf and
+ * populating '*score' and '*leaf' if not NULL. NULL is returned if the
+ * element is not in the set. */
+unsigned char *zptFind(zptree *zpt, sds ele, double *score, zptNode **leaf) {
+    if (zpt->size == 0) return NULL;
 
-        if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
-            /* NX? Return, same element already exists. */
-            if (nx) {
-                *flags |= ZADD_NOP;
-                return 1;
-            }
+    uint32_t h = zptHash((unsigned char*)ele,sdslen(ele));
+    unsigned long mask = zpt->size-1, i = h & mask;
 
-            /* Prepare the score for the increment if needed. */
-            if (incr) {
-                score += curscore;
-                if (isnan(score)) {
-                    *flags |= ZADD_NAN;
-                    return 0;
-                }
-                if (newscore) *newscore = score;
+    while (zpt->hashes[i]) {
+        if (zpt->hashes[i] == h) {
+            unsigned char *eptr = zptSeek(zpt,zpt->scores[i],ele,leaf);
+            if (eptr) {
+                if (score) *score = zpt->scores[i];
+                return eptr;
             }
+        }
+        i = (i+1) & mask;
+    }
+    return NULL;
+}
 
-            /* Remove and re-insert when score changed. */
-            if (score != curscore) {
-                zobj->ptr = zzlDelete(zobj->ptr,eptr);
-                zobj->ptr = zzlInsert(zobj->ptr,ele,score);
-                *flags |= ZADD_UPDATED;
-            }
-            return 1;
-        } else if (!xx) {
-            /* Optimize: check if the element is too large or the list
-             * becomes too long *before* executing zzlInsert. */
-            zobj->ptr = zzlInsert(zobj->ptr,ele,score);
-            if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries ||
-                sdslen(ele) > server.zset_max_ziplist_value)
-                zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
-            if (newscore) *newscore = score;
-            *flags |= ZADD_ADDED;
-            return 1;
-        } else {
-            *flags |= ZADD_NOP;
-            return 1;
+/* Insert the element 'ele' with the score 'score'. The element must not be
+ * already in the set. */
+void zptInsert(zptree *zpt, sds ele, double score) {
+    zptNode *leaf = zpt->tail;
+    unsigned char *last = lpSeek(leaf->lp,-2);
+
+    if (last == NULL || zptCompareEntry(leaf->lp,last,score,ele) < 0) {
+        /* Appending: start a new leaf instead of splitting the last one when
+         * it is full, so that sorted insertions leave the leaves full. */
+        if (leaf->count >= ZPT_LEAF_MAX_ENTRIES) {
+            zptNode *new = zptCreateLeaf(lpNew());
+            new->prev = leaf;
+            leaf->next = new;
+            zpt->tail = new;
+            zptInsertAfter(zpt,leaf,new);
+            leaf = new;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        leaf->lp = zzlInsertAt(leaf->lp,NULL,ele,score);
+    } else {
+        leaf = zptFindLeaf(zpt,score,ele);
+        leaf->lp = zzlInsert(leaf->lp,ele,score);
+    }
+    zptUpdateCount(leaf,1);
+    if (leaf->count > ZPT_LEAF_MAX_ENTRIES) zptSplitLeaf(zpt,leaf);
+    zptIndexAdd(zpt,zptHash((unsigned char*)ele,sdslen(ele)),score);
+}
+
+/* Delete the element at 'eptr' in the leaf 'leaf'. Both pointers are no
+ * longer valid after the call. */
+void zptDelete(zptree *zpt, zptNode *leaf, unsigned char *eptr) {
+    zptNode *prev = leaf->prev, *next = leaf->next;
+
+    zptIndexDel(zpt,zptHashEntry(eptr),zzlGetScore(lpNext(leaf->lp,eptr)));
+    leaf->lp = zzlDelete(leaf->lp,eptr);
+    zptUpdateCount(leaf,-1);
+
+    if (leaf->count == 0) {
+        if (leaf != zpt->root) zptRemoveNode(zpt,leaf);
+    } else if (next && next->parent == leaf->parent &&
+               leaf->count+next->count <= ZPT_LEAF_MAX_ENTRIES/2) {
+        zptMergeLeaves(zpt,leaf,next);
+    } else if (prev && prev->parent == leaf->parent &&
+               prev->count+leaf->count <= ZPT_LEAF_MAX_ENTRIES/2) {
+        zptMergeLeaves(zpt,prev,leaf);
+    }
+}
+
+/* Return the 1-based rank of the element at 'eptr' in the leaf 'leaf'. */
+unsigned long zptGetRank(zptree *zpt, zptNode *leaf, unsigned char *eptr) {
+    unsigned char *p = lpFirst(leaf->lp);
+    unsigned long rank = 1;
+    zptNode *n;
+
+    UNUSED(zpt);
+    while (p != eptr) {
+        p = lpNext(leaf->lp,lpNext(leaf->lp,p));
+        rank++;
+    }
+    for (n = leaf; n->parent; n = n->parent) {
+        zptNode *parent = n->parent;
+        for (int j = 0; parent->children[j] != n; j++)
+            rank += parent->children[j]->count;
+    }
+    return rank;
+}
+
+/* Return the element with the 1-based rank 'rank', populating '*leaf' with
+ * the leaf holding it, or NULL if the rank is out of range. */
+unsigned char *zptGetElementByRank(zptree *zpt, unsigned long rank, zptNode **leaf) {
+    zptNode *n = zpt->root;
+
+    if (rank == 0 || rank > n->count) return NULL;
+    rank--;
+    while (!n->leaf) {
+        int j = 0;
+        while (rank >= n->children[j]->count) rank -= n->children[j++]->count;
+        n = n->children[j];
+    }
+    *leaf = n;
+    return lpSeek(n->lp,2*rank);
+}
+
+/* Move to the next element, crossing into the next leaf if needed. '*eptr'
+ * is set to NULL after the last element. */
+void zptNext(zptNode **leaf, unsigned char **eptr, unsigned char **sptr) {
+    zzlNext((*leaf)->lp,eptr,sptr);
+    if (*eptr == NULL && (*leaf)->next != NULL) {
+        *leaf = (*leaf)->next;
+        *eptr = lpFirst((*leaf)->lp);
+        *sptr = lpNext((*leaf)->lp,*eptr);
+    }
+}
+
+/* Move to the previous element, crossing into the previous leaf if needed.
+ * '*eptr' is set to NULL before the first element. */
+void zptPrev(zptNode **leaf, unsigned char **eptr, unsigned char **sptr) {
+    zzlPrev((*leaf)->lp,eptr,sptr);
+    if (*eptr == NULL && (*leaf)->prev != NULL) {
+        *leaf = (*leaf)->prev;
+        *sptr = lpLast((*leaf)->lp);
+        *eptr = lpPrev((*leaf)->lp,*sptr);
+    }
+}
+
+/* Find the first element in the specified range. The descent picks the first
+ * child whose last element is not below the range: the leaf reached is the
+ * only one that may start the range. */
+unsigned char *zptFirstInRange(zptree *zpt, zrangespec *range, zptNode **leaf) {
+    zptNode *n = zpt->root;
+    unsigned char *eptr;
+
+    while (!n->leaf) {
+        int lo = 0, hi = n->numchildren-1;
+
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            zptNode *last = zptLastLeaf(n->children[mid]);
+            if (zslValueGteMin(zzlGetScore(lpLast(last->lp)),range))
+                hi = mid;
+            else
+                lo = mid+1;
+        }
+        n = n->children[lo];
+    }
+    eptr = zzlFirstInRange(n->lp,range);
+    if (eptr) *leaf = n;
+    return eptr;
+}
+
+/* Find the last element in the specified range, descending into the last
+ * child whose first element is not above the range. */
+unsigned char *zptLastInRange(zptree *zpt, zrangespec *range, zptNode **leaf) {
+    zptNode *n = zpt->root;
+    unsigned char *eptr;
+
+    while (!n->leaf) {
+        int lo = 0, hi = n->numchildren-1;
+
+        while (lo < hi) {
+            int mid = (lo+hi+1)/2;
+            zptNode *first = zptFirstLeaf(n->children[mid]);
+            if (zslValueLteMax(zzlGetScore(lpSeek(first->lp,1)),range))
+                lo = mid;
+            else
+                hi = mid-1;
+        }
+        n = n->children[lo];
+    }
+    eptr = zzlLastInRange(n->lp,range);
+    if (eptr) *leaf = n;
+    return eptr;
+}
+
+/* Find the first element in the specified lex range. */
+unsigned char *zptFirstInLexRange(zptree *zpt, zlexrangespec *range, zptNode **leaf) {
+    zptNode *n = zpt->root;
+    unsigned char *eptr;
+
+    while (!n->leaf) {
+        int lo = 0, hi = n->numchildren-1;
+
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            zptNode *last = zptLastLeaf(n->children[mid]);
+            if (zzlLexValueGteMin(lpSeek(last->lp,-2),range))
+                hi = mid;
+            else
+                lo = mid+1;
+        }
+        n = n->children[lo];
+    }
+    eptr = zzlFirstInLexRange(n->lp,range);
+    if (eptr) *leaf = n;
+    return eptr;
+}
+
+/* Find the last element in the specified lex range. */
+unsigned char *zptLastInLexRange(zptree *zpt, zlexrangespec *range, zptNode **leaf) {
+    zptNode *n = zpt->root;
+    unsigned char *eptr;
+
+    while (!n->leaf) {
+        int lo = 0, hi = n->numchildren-1;
+
+        while (lo < hi) {
+            int mid = (lo+hi+1)/2;
+            zptNode *first = zptFirstLeaf(n->children[mid]);
+            if (zzlLexValueLteMax(lpFirst(first->lp),range))
+                lo = mid;
+            else
+                hi = mid-1;
+        }
+        n = n->children[lo];
+    }
+    eptr = zzlLastInLexRange(n->lp,range);
+    if (eptr) *leaf = n;
+    return eptr;
+}
+
+/* Move '*eptr' 'offset' elements forward, or backward if 'reverse' is true,
+ * with a single rank lookup. '*eptr' is set to NULL when moving past the
+ * first or last element. A negative offset also results in NULL, like the
+ * element by element traversal of the other encodings. */
+void zptSkip(zptree *zpt, zptNode **leaf, unsigned char **eptr, long offset, int reverse) {
+    unsigned long rank;
+
+    if (offset == 0) return;
+    if (offset < 0) {
+        *eptr = NULL;
+        return;
+    }
+    rank = zptGetRank(zpt,*leaf,*eptr);
+    if (reverse)
+        *eptr = (unsigned long)offset < rank ?
+                zptGetElementByRank(zpt,rank-offset,leaf) : NULL;
+    else
+        *eptr = zptGetElementByRank(zpt,rank+offset,leaf);
+}
+
+unsigned long zptDeleteRangeByScore(zptree *zpt, zrangespec *range) {
+    unsigned long removed = 0;
+    unsigned char *eptr;
+    zptNode *leaf;
+
+    /* Deleting may merge or free leaves, so look up the range again after
+     * every deletion. */
+    while ((eptr = zptFirstInRange(zpt,range,&leaf)) != NULL) {
+        zptDelete(zpt,leaf,eptr);
+        removed++;
+    }
+    return removed;
+}
+
+unsigned long zptDeleteRangeByLex(zptree *zpt, zlexrangespec *range) {
+    unsigned long removed = 0;
+    unsigned char *eptr;
+    zptNode *leaf;
+
+    while ((eptr = zptFirstInLexRange(zpt,range,&leaf)) != NULL) {
+        zptDelete(zpt,leaf,eptr);
+        removed++;
+    }
+    return removed;
+}
+
+/* Delete all the elements with rank between start and end. Start and end
+ * are inclusive and 1-based. */
+unsigned long zptDeleteRangeByRank(zptree *zpt, unsigned int start, unsigned int end) {
+    unsigned long removed;
+    unsigned char *eptr;
+    zptNode *leaf;
+
+    for (removed = 0; removed < (unsigned long)(end-start)+1; removed++) {
+        eptr = zptGetElementByRank(zpt,start,&leaf);
+        serverAssert(eptr != NULL);
+        zptDelete(zpt,leaf,eptr);
+    }
+    return removed;
+}
+
+/*-----------------------------------------------------------------------------
+ * B-tree sorted set API
+ *----------------------------------------------------------------------------*/
+
+/* When zset-btree-encoding is enabled, large sorted sets index their elements
+ * with an order statistic B+tree instead of the skiplist. The hash table
+ * mapping elements to scores is the same used by the skiplist encoding, but
+ * the score is stored inside the dict entry itself.
+ *
+ * Leaves hold up to ZBT_NODE_SIZE element,score pairs in order, with the scores
+ * in their own array so that most comparisons don't need to access the
+ * elements. Inner nodes hold the first element of every child and the number
+ * of elements below it. Lookups, ranks and rank seeks are deterministic
+ * O(log(N)) with a few cache misses per level, instead of the pointer chasing
+ * through the random levels of the skiplist. */
+
+#define ZBT_LEAF_SIZE offsetof(zbtNode,children)
+
+static zbtNode *zbtCreateNode(int leaf) {
+    zbtNode *n = zmalloc(leaf ? ZBT_LEAF_SIZE : sizeof(*n));
+    n->parent = NULL;
+    n->leaf = leaf;
+    n->num = 0;
+    n->prev = n->next = NULL;
+    return n;
+}
+
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+    zbt->root = zbt->head = zbt->tail = zbtCreateNode(1);
+    zbt->length = 0;
+    return zbt;
+}
+
+/* Free a node and the nodes below it. The elements are owned by the leaves,
+ * inner nodes just reference them. */
+static void zbtFreeNode(zbtNode *n) {
+    for (int j = 0; j < n->num; j++) {
+        if (n->leaf)
+            sdsfree(n->ele[j]);
+        else
+            zbtFreeNode(n->children[j]);
+    }
+    zfree(n);
+}
+
+void zbtFree(zbtree *zbt) {
+    zbtFreeNode(zbt->root);
+    zfree(zbt);
+}
+
+/* Compare two element,score pairs using the sorted set order. */
+static inline int zbtCompare(double s1, sds e1, double s2, sds e2) {
+    if (s1 != s2) return (s1 < s2) ? -1 : 1;
+    return sdscmp(e1,e2);
+}
+
+/* ----------------------------- Tree structure ----------------------------- */
+
+/* Return the position of 'n' among the children of its parent. */
+static int zbtChildIndex(zbtNode *n) {
+    zbtNode *parent = n->parent;
+
+    for (int j = 0; j < parent->num; j++)
+        if (parent->children[j] == n) return j;
+    serverPanic("B-tree node not found in its parent");
+    return -1; /* Never reached. */
+}
+
+/* Add 'delta' to the element count every ancestor of 'n' keeps for the
+ * subtree 'n' belongs to. */
+static void zbtUpdateCount(zbtNode *n, long delta) {
+    while (n->parent) {
+        n->parent->counts[zbtChildIndex(n)] += delta;
+        n = n->parent;
+    }
+}
+
+/* Copy the first element of 'n', that must not be empty, into the keys of
+ * the ancestors, after it changed. */
+static void zbtUpdateFirst(zbtNode *n) {
+    while (n->parent) {
+        int idx = zbtChildIndex(n);
+
+        n->parent->score[idx] = n->score[0];
+        n->parent->ele[idx] = n->ele[0];
+        if (idx != 0) break;
+        n = n->parent;
+    }
+}
+
+/* Return the number of elements below 'n'. */
+static unsigned long zbtNodeCount(zbtNode *n) {
+    unsigned long count = 0;
+
+    if (n->leaf) return n->num;
+    for (int j = 0; j < n->num; j++) count += n->counts[j];
+    return count;
+}
+
+static void zbtSplitNode(zbtree *zbt, zbtNode *n);
+
+/* Insert the non empty node 'new', holding 'count' elements, as the sibling
+ * following 'n', or preceding it if 'before' is true, splitting the parent
+ * first if it is full, or growing the tree by one level if 'n' is the root.
+ * The counts of the ancestors of the parent are not updated. */
+static void zbtInsertSibling(zbtree *zbt, zbtNode *n, zbtNode *new, unsigned long count, int before) {
+    zbtNode *parent = n->parent;
+    int pos, tail;
+
+    if (parent == NULL) {
+        parent = zbtCreateNode(0);
+        parent->num = 1;
+        parent->children[0] = n;
+        parent->counts[0] = zbtNodeCount(n);
+        parent->score[0] = n->score[0];
+        parent->ele[0] = n->ele[0];
+        n->parent = parent;
+        zbt->root = parent;
+    } else if (parent->num == ZBT_NODE_SIZE) {
+        zbtSplitNode(zbt,parent);
+        parent = n->parent;
+    }
+
+    pos = zbtChildIndex(n)+(before ? 0 : 1);
+    tail = parent->num-pos;
+    memmove(parent->children+pos+1,parent->children+pos,sizeof(zbtNode*)*tail);
+    memmove(parent->counts+pos+1,parent->counts+pos,sizeof(unsigned long)*tail);
+    memmove(parent->score+pos+1,parent->score+pos,sizeof(double)*tail);
+    memmove(parent->ele+pos+1,parent->ele+pos,sizeof(sds)*tail);
+    parent->children[pos] = new;
+    parent->counts[pos] = count;
+    parent->score[pos] = new->score[0];
+    parent->ele[pos] = new->ele[0];
+    parent->num++;
+    new->parent = parent;
+    if (pos == 0) zbtUpdateFirst(parent);
+}
+
+/* Split the node 'n' in two halves. */
+static void zbtSplitNode(zbtree *zbt, zbtNode *n) {
+    zbtNode *right = zbtCreateNode(n->leaf);
+    int half = n->num/2, hadparent;
+    unsigned long moved;
+
+    right->num = n->num-half;
+    memcpy(right->score,n->score+half,sizeof(double)*right->num);
+    memcpy(right->ele,n->ele+half,sizeof(sds)*right->num);
+    n->num = half;
+    if (n->leaf) {
+        moved = right->num;
+        right->prev = n;
+        right->next = n->next;
+        if (n->next) n->next->prev = right; else zbt->tail = right;
+        n->next = right;
+    } else {
+        memcpy(right->children,n->children+half,sizeof(zbtNode*)*right->num);
+        memcpy(right->counts,n->counts+half,sizeof(unsigned long)*right->num);
+        for (int j = 0; j < right->num; j++) right->children[j]->parent = right;
+        moved = zbtNodeCount(right);
+    }
+
+    /* The count of 'n' is fixed only after inserting 'right': if the parent
+     * is split in the process, the counts of its ancestors must still see the
+     * moved elements under 'n'. A new root computes the right count itself. */
+    hadparent = n->parent != NULL;
+    zbtInsertSibling(zbt,n,right,moved,0);
+    if (hadparent) n->parent->counts[zbtChildIndex(n)] -= moved;
+}
+
+static void zbtRebalance(zbtree *zbt, zbtNode *n);
+
+/* Unlink the node 'n', that must not be the root and must not be accounted
+ * in the counts of its ancestors anymore, and free it. The parent is removed
+ * as well if it remains without children, otherwise it is rebalanced. */
+static void zbtRemoveNode(zbtree *zbt, zbtNode *n) {
+    zbtNode *parent = n->parent;
+    int idx = zbtChildIndex(n);
+    int tail = parent->num-idx-1;
+
+    memmove(parent->children+idx,parent->children+idx+1,sizeof(zbtNode*)*tail);
+    memmove(parent->counts+idx,parent->counts+idx+1,sizeof(unsigned long)*tail);
+    memmove(parent->score+idx,parent->score+idx+1,sizeof(double)*tail);
+    memmove(parent->ele+idx,parent->ele+idx+1,sizeof(sds)*tail);
+    parent->num--;
+
+    if (n->leaf) {
+        if (n->prev) n->prev->next = n->next; else zbt->head = n->next;
+        if (n->next) n->next->prev = n->prev; else zbt->tail = n->prev;
+    }
+    zfree(n);
+
+    if (parent->num == 0) {
+        zbtRemoveNode(zbt,parent);
+        return;
+    }
+    if (idx == 0) zbtUpdateFirst(parent);
+
+    if (parent == zbt->root) {
+        /* Shrink the tree when the root is left with a single child. */
+        while (!zbt->root->leaf && zbt->root->num == 1) {
+            zbtNode *root = zbt->root;
+            zbt->root = root->children[0];
+            zbt->root->parent = NULL;
+            zfree(root);
+        }
+    } else {
+        zbtRebalance(zbt,parent);
+    }
+}
+
+/* Merge the non empty node 'n' with an adjacent sibling when it is less than
+ * a quarter full and the two fit in a single node. 'n' may be freed. */
+static void zbtRebalance(zbtree *zbt, zbtNode *n) {
+    zbtNode *parent = n->parent, *a, *b;
+    int idx;
+
+    if (parent == NULL || n->num >= ZBT_NODE_SIZE/4) return;
+
+    idx = zbtChildIndex(n);
+    if (idx+1 < parent->num &&
+        n->num+parent->children[idx+1]->num <= ZBT_NODE_SIZE)
+    {
+        a = n;
+        b = parent->children[idx+1];
+    } else if (idx > 0 &&
+               parent->children[idx-1]->num+n->num <= ZBT_NODE_SIZE)
+    {
+        a = parent->children[idx-1];
+        b = n;
+        idx--;
+    } else {
+        return;
+    }
+
+    /* Move the keys of 'b' at the end of 'a', then remove 'b'. */
+    memcpy(a->score+a->num,b->score,sizeof(double)*b->num);
+    memcpy(a->ele+a->num,b->ele,sizeof(sds)*b->num);
+    if (!a->leaf) {
+        memcpy(a->children+a->num,b->children,sizeof(zbtNode*)*b->num);
+        memcpy(a->counts+a->num,b->counts,sizeof(unsigned long)*b->num);
+        for (int j = 0; j < b->num; j++) b->children[j]->parent = a;
+    }
+    a->num += b->num;
+    b->num = 0;
+    parent->counts[idx] += parent->counts[idx+1];
+    zbtRemoveNode(zbt,b);
+}
+
+/* Remove 'count' elements starting at position 'pos' of the leaf 'n', without
+ * freeing them. 'n' may be freed. */
+static void zbtDeleteAt(zbtree *zbt, zbtNode *n, int pos, int count) {
+    int tail = n->num-pos-count;
+
+    memmove(n->score+pos,n->score+pos+count,sizeof(double)*tail);
+    memmove(n->ele+pos,n->ele+pos+count,sizeof(sds)*tail);
+    n->num -= count;
+    zbt->length -= count;
+    zbtUpdateCount(n,-count);
+
+    if (n->num == 0) {
+        if (n != zbt->root) zbtRemoveNode(zbt,n);
+    } else {
+        if (pos == 0) zbtUpdateFirst(n);
+        zbtRebalance(zbt,n);
+    }
+}
+
+/* ------------------------------- Lookups ---------------------------------- */
+
+/* Return the position of the first key of 'n' not smaller than the element
+ * 'ele' with score 'score'. */
+static int zbtLowerBound(zbtNode *n, double score, sds ele) {
+    int lo = 0, hi = n->num;
+
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zbtCompare(n->score[mid],n->ele[mid],score,ele) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Return the leaf where the element 'ele' with score 'score' is, or should
+ * be inserted, descending into the last child whose first element is not
+ * greater. */
+static zbtNode *zbtFindLeaf(zbtree *zbt, double score, sds ele) {
+    zbtNode *n = zbt->root;
+
+    while (!n->leaf) {
+        int lo = 1, hi = n->num;
+
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (zbtCompare(n->score[mid],n->ele[mid],score,ele) <= 0)
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+        n = n->children[lo-1];
+    }
+    return n;
+}
+
+/* Find the element 'ele' with score 'score', returning the leaf holding it
+ * and storing its position in '*pos', or NULL if it is not in the tree. */
+zbtNode *zbtFind(zbtree *zbt, double score, sds ele, int *pos) {
+    zbtNode *n = zbtFindLeaf(zbt,score,ele);
+    int i = zbtLowerBound(n,score,ele);
+
+    if (i == n->num || n->score[i] != score || sdscmp(n->ele[i],ele) != 0)
+        return NULL;
+    *pos = i;
+    return n;
+}
+
+/* Insert the element 'ele' with score 'score', taking ownership of the SDS
+ * string. The element must not be already in the tree. */
+void zbtInsert(zbtree *zbt, double score, sds ele) {
+    zbtNode *n = zbt->tail, *head = zbt->head;
+    int append, pos;
+
+    append = n->num == 0 ||
+             zbtCompare(n->score[n->num-1],n->ele[n->num-1],score,ele) < 0;
+    if (append || zbtCompare(head->score[0],head->ele[0],score,ele) > 0) {
+        /* Appending or prepending, as when loading a sorted set: start a new
+         * leaf instead of splitting the first or last one when it is full,
+         * so that sorted insertions leave the leaves full. */
+        if (!append) n = head;
+        if (n->num == ZBT_NODE_SIZE) {
+            zbtNode *new = zbtCreateNode(1);
+            new->score[0] = score;
+            new->ele[0] = ele;
+            new->num = 1;
+            if (append) {
+                new->prev = n;
+                n->next = new;
+                zbt->tail = new;
+            } else {
+                new->next = n;
+                n->prev = new;
+                zbt->head = new;
+            }
+            zbtInsertSibling(zbt,n,new,1,!append);
+            zbtUpdateCount(new->parent,1);
+            zbt->length++;
+            return;
+        }
+        pos = append ? n->num : 0;
+    } else {
+        n = zbtFindLeaf(zbt,score,ele);
+        pos = zbtLowerBound(n,score,ele);
+        if (n->num == ZBT_NODE_SIZE) {
+            zbtSplitNode(zbt,n);
+            if (pos > n->num) {
+                pos -= n->num;
+                n = n->next;
+            }
+        }
+    }
+
+    memmove(n->score+pos+1,n->score+pos,sizeof(double)*(n->num-pos));
+    memmove(n->ele+pos+1,n->ele+pos,sizeof(sds)*(n->num-pos));
+    n->score[pos] = score;
+    n->ele[pos] = ele;
+    n->num++;
+    zbt->length++;
+    zbtUpdateCount(n,1);
+    if (pos == 0) zbtUpdateFirst(n);
+}
+
+/* Delete the element 'ele' with score 'score' and free it. Return 1 if the
+ * element was found and deleted, 0 otherwise. */
+int zbtDelete(zbtree *zbt, double score, sds ele) {
+    zbtNode *n;
+    int pos;
+
+    if ((n = zbtFind(zbt,score,ele,&pos)) == NULL) return 0;
+    ele = n->ele[pos];
+    zbtDeleteAt(zbt,n,pos,1);
+    sdsfree(ele);
+    return 1;
+}
+
+/* Update the score of the element 'ele' from 'curscore' to 'newscore'. The
+ * element must be in the tree. Like zslUpdateScore(), the element is just
+ * updated in place when it does not need to move. */
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore) {
+    zbtNode *n, *prev, *next;
+    int pos, prevpos, nextpos;
+
+    n = zbtFind(zbt,curscore,ele,&pos);
+    serverAssert(n != NULL);
+    ele = n->ele[pos];
+
+    prev = n;
+    prevpos = pos;
+    zbtPrev(&prev,&prevpos);
+    next = n;
+    nextpos = pos;
+    zbtNext(&next,&nextpos);
+    if ((prev == NULL || zbtCompare(prev->score[prevpos],prev->ele[prevpos],
+                                    newscore,ele) < 0) &&
+        (next == NULL || zbtCompare(next->score[nextpos],next->ele[nextpos],
+                                    newscore,ele) > 0))
+    {
+        n->score[pos] = newscore;
+        if (pos == 0) zbtUpdateFirst(n);
+        return;
+    }
+
+    zbtDeleteAt(zbt,n,pos,1);
+    zbtInsert(zbt,newscore,ele);
+}
+
+/* Return the 1-based rank of the element at position 'pos' of the leaf 'n'. */
+unsigned long zbtGetRank(zbtNode *n, int pos) {
+    unsigned long rank = pos+1;
+
+    for (; n->parent; n = n->parent) {
+        zbtNode *parent = n->parent;
+        for (int j = 0; parent->children[j] != n; j++)
+            rank += parent->counts[j];
+    }
+    return rank;
+}
+
+/* Return the leaf holding the element with the 1-based rank 'rank', storing
+ * its position in '*pos', or NULL if the rank is out of range. */
+zbtNode *zbtGetElementByRank(zbtree *zbt, unsigned long rank, int *pos) {
+    zbtNode *n = zbt->root;
+
+    if (rank == 0 || rank > zbt->length) return NULL;
+    rank--;
+    while (!n->leaf) {
+        int j = 0;
+        while (rank >= n->counts[j]) rank -= n->counts[j++];
+        n = n->children[j];
+    }
+    *pos = rank;
+    return n;
+}
+
+/* Move to the next element, crossing into the next leaf if needed. '*n' is
+ * set to NULL after the last element. */
+void zbtNext(zbtNode **n, int *pos) {
+    if (++(*pos) == (*n)->num) {
+        *n = (*n)->next;
+        *pos = 0;
+    }
+}
+
+/* Move to the previous element, crossing into the previous leaf if needed.
+ * '*n' is set to NULL before the first element. */
+void zbtPrev(zbtNode **n, int *pos) {
+    if ((*pos)-- == 0) {
+        *n = (*n)->prev;
+        if (*n) *pos = (*n)->num-1;
+    }
+}
+
+/* Move 'offset' elements forward, or backward if 'reverse' is true, with a
+ * single rank lookup, like zptSkip(). '*n' is set to NULL when moving past
+ * the first or last element, or if the offset is negative. */
+static void zbtSkip(zbtree *zbt, zbtNode **n, int *pos, long offset, int reverse) {
+    unsigned long rank;
+
+    if (offset == 0) return;
+    if (offset < 0) {
+        *n = NULL;
+        return;
+    }
+    rank = zbtGetRank(*n,*pos);
+    if (reverse)
+        *n = (unsigned long)offset < rank ?
+             zbtGetElementByRank(zbt,rank-offset,pos) : NULL;
+    else
+        *n = zbtGetElementByRank(zbt,rank+offset,pos);
+}
+
+/* Returns if there is a part of the tree in range. */
+static int zbtIsInRange(zbtree *zbt, zrangespec *range) {
+    /* Test for ranges that will always be empty. */
+    if (range->min > range->max ||
+            (range->min == range->max && (range->minex || range->maxex)))
+        return 0;
+    if (zbt->length == 0) return 0;
+    if (!zslValueGteMin(zbt->tail->score[zbt->tail->num-1],range)) return 0;
+    if (!zslValueLteMax(zbt->head->score[0],range)) return 0;
+    return 1;
+}
+
+/* Find the first element in the specified range. The descent picks the last
+ * child whose first element is below the range: the range starts inside it,
+ * or at the first element of the following leaf. */
+zbtNode *zbtFirstInRange(zbtree *zbt, zrangespec *range, int *pos) {
+    zbtNode *n = zbt->root;
+    int lo, hi;
+
+    if (!zbtIsInRange(zbt,range)) return NULL;
+
+    while (!n->leaf) {
+        lo = 1, hi = n->num;
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (zslValueGteMin(n->score[mid],range)) hi = mid; else lo = mid+1;
+        }
+        n = n->children[lo-1];
+    }
+    lo = 0, hi = n->num;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zslValueGteMin(n->score[mid],range)) hi = mid; else lo = mid+1;
+    }
+    if (lo == n->num) {
+        n = n->next;
+        lo = 0;
+    }
+
+    /* Check if score <= max. */
+    if (!zslValueLteMax(n->score[lo],range)) return NULL;
+    *pos = lo;
+    return n;
+}
+
+/* Find the last element in the specified range, descending into the last
+ * child whose first element is not above the range. */
+zbtNode *zbtLastInRange(zbtree *zbt, zrangespec *range, int *pos) {
+    zbtNode *n = zbt->root;
+    int lo, hi;
+
+    if (!zbtIsInRange(zbt,range)) return NULL;
+
+    while (!n->leaf) {
+        lo = 1, hi = n->num;
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (zslValueLteMax(n->score[mid],range)) lo = mid+1; else hi = mid;
+        }
+        n = n->children[lo-1];
+    }
+    lo = 0, hi = n->num;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zslValueLteMax(n->score[mid],range)) lo = mid+1; else hi = mid;
+    }
+
+    /* Check if score >= min. */
+    if (!zslValueGteMin(n->score[lo-1],range)) return NULL;
+    *pos = lo-1;
+    return n;
+}
+
+/* Returns if there is a part of the tree in the lex range. */
+static int zbtIsInLexRange(zbtree *zbt, zlexrangespec *range) {
+    /* Test for ranges that will always be empty. */
+    int cmp = sdscmplex(range->min,range->max);
+    if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
+        return 0;
+    if (zbt->length == 0) return 0;
+    if (!zslLexValueGteMin(zbt->tail->ele[zbt->tail->num-1],range)) return 0;
+    if (!zslLexValueLteMax(zbt->head->ele[0],range)) return 0;
+    return 1;
+}
+
+/* Find the first element in the specified lex range. */
+zbtNode *zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, int *pos) {
+    zbtNode *n = zbt->root;
+    int lo, hi;
+
+    if (!zbtIsInLexRange(zbt,range)) return NULL;
+
+    while (!n->leaf) {
+        lo = 1, hi = n->num;
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (zslLexValueGteMin(n->ele[mid],range)) hi = mid; else lo = mid+1;
+        }
+        n = n->children[lo-1];
+    }
+    lo = 0, hi = n->num;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zslLexValueGteMin(n->ele[mid],range)) hi = mid; else lo = mid+1;
+    }
+    if (lo == n->num) {
+        n = n->next;
+        lo = 0;
+    }
+
+    /* Check if element <= max. */
+    if (!zslLexValueLteMax(n->ele[lo],range)) return NULL;
+    *pos = lo;
+    return n;
+}
+
+/* Find the last element in the specified lex range. */
+zbtNode *zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, int *pos) {
+    zbtNode *n = zbt->root;
+    int lo, hi;
+
+    if (!zbtIsInLexRange(zbt,range)) return NULL;
+
+    while (!n->leaf) {
+        lo = 1, hi = n->num;
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (zslLexValueLteMax(n->ele[mid],range)) lo = mid+1; else hi = mid;
+        }
+        n = n->children[lo-1];
+    }
+    lo = 0, hi = n->num;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zslLexValueLteMax(n->ele[mid],range)) lo = mid+1; else hi = mid;
+    }
+
+    /* Check if element >= min. */
+    if (!zslLexValueGteMin(n->ele[lo-1],range)) return NULL;
+    *pos = lo-1;
+    return n;
+}
+
+/* Delete all the elements with rank between start and end from the tree and
+ * from the hash table, a leaf at a time. Start and end are inclusive and
+ * 1-based. */
+static unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end, dict *dict) {
+    unsigned long removed = 0, toremove = end-start+1;
+
+    while (removed < toremove) {
+        int pos, count;
+        zbtNode *n = zbtGetElementByRank(zbt,start,&pos);
+
+        serverAssert(n != NULL);
+        count = n->num-pos;
+        if ((unsigned long)count > toremove-removed) count = toremove-removed;
+        for (int j = pos; j < pos+count; j++) {
+            dictDelete(dict,n->ele[j]);
+            sdsfree(n->ele[j]);
+        }
+        zbtDeleteAt(zbt,n,pos,count);
+        removed += count;
+    }
+    return removed;
+}
+
+static unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict) {
+    zbtNode *first, *last;
+    int firstpos, lastpos;
+
+    if ((first = zbtFirstInRange(zbt,range,&firstpos)) == NULL) return 0;
+    last = zbtLastInRange(zbt,range,&lastpos);
+    return zbtDeleteRangeByRank(zbt,zbtGetRank(first,firstpos),
+                                zbtGetRank(last,lastpos),dict);
+}
+
+static unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict) {
+    zbtNode *first, *last;
+    int firstpos, lastpos;
+
+    if ((first = zbtFirstInLexRange(zbt,range,&firstpos)) == NULL) return 0;
+    last = zbtLastInLexRange(zbt,range,&lastpos);
+    return zbtDeleteRangeByRank(zbt,zbtGetRank(first,firstpos),
+                                zbtGetRank(last,lastpos),dict);
+}
+
+/*-----------------------------------------------------------------------------
+ * Common sorted set API
+ *----------------------------------------------------------------------------*/
+
+unsigned long zsetLength(const robj *zobj) {
+    unsigned long length = 0;
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+        length = zzlLength(zobj->ptr);
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        length = ((const zset*)zobj->ptr)->zsl->length;
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        length = zptLength(zobj->ptr);
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        length = ((const zset*)zobj->ptr)->zbt->length;
+    } else {
+        serverPanic("Unknown sorted set encoding");
+    }
+    return length;
+}
+
+/* Return the encoding used for sorted sets too big for the listpack and
+ * packed tree encodings. */
+int zsetLargeEncoding(void) {
+    return server.zset_btree_encoding ? OBJ_ENCODING_BTREE :
+                                        OBJ_ENCODING_SKIPLIST;
+}
+
+/* Return the encoding for a sorted set of 'length' elements that is too
+ * long for a listpack: a packed tree within zset-max-packedtree-entries,
+ * where 0 disables packed trees, the large encoding otherwise. */
+int zsetOverflowEncoding(size_t length) {
+    if (server.zset_max_packedtree_entries &&
+        length <= server.zset_max_packedtree_entries)
+        return OBJ_ENCODING_PACKEDTREE;
+    return zsetLargeEncoding();
+}
+
+/* Add a new element to a sorted set using the skiplist or the B-tree
+ * encoding, taking ownership of the 'ele' SDS string. */
+void zsetLargeInsert(zset *zs, double score, sds ele) {
+    if (zs->zbt) {
+        dictEntry *de = dictAddRaw(zs->dict,ele,NULL);
+        serverAssert(de != NULL);
+        dictSetDoubleVal(de,score);
+        zbtInsert(zs->zbt,score,ele);
+    } else {
+        zskiplistNode *node = zslInsert(zs->zsl,score,ele);
+        serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+    }
+}
+
+static int zsetBulkEntryCompare(const void *a, const void *b) {
+    const zsetBulkEntry *ea = a, *eb = b;
+
+    if (ea->score != eb->score) return (ea->score < eb->score) ? -1 : 1;
+    return sdscmp(ea->ele,eb->ele);
+}
+
+/* Add a batch of new elements to a sorted set using the skiplist or the B-tree
+ * encoding, taking ownership of the SDS strings. The caller must have already
+ * added the elements to the dict, storing the entries in entries[j].de, while
+ * this function sets their values. The batch is sorted first, so that the
+ * skiplist can be updated in a single pass and the B-tree is filled in order,
+ * mostly appending to the same leaves. */
+void zsetBulkInsert(zset *zs, zsetBulkEntry *entries, unsigned long count) {
+    unsigned long j;
+
+    qsort(entries,count,sizeof(*entries),zsetBulkEntryCompare);
+    if (zs->zbt) {
+        for (j = 0; j < count; j++) {
+            dictSetDoubleVal(entries[j].de,entries[j].score);
+            zbtInsert(zs->zbt,entries[j].score,entries[j].ele);
+        }
+    } else {
+        zslInsertSorted(zs->zsl,entries,count);
+        for (j = 0; j < count; j++)
+            dictGetVal(entries[j].de) = &entries[j].node->score;
+    }
+}
+
+void zsetConvert(robj *zobj, int encoding) {
+    zset *zs;
+    zskiplistNode *node, *next;
+    sds ele;
+    double score;
+
+    if (zobj->encoding == encoding) return;
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *zl = zobj->ptr;
+        unsigned char *eptr, *sptr;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+
+        if (encoding == OBJ_ENCODING_PACKEDTREE) {
+            zptree *zpt = zptCreate();
+
+            eptr = lpSeek(zl,0);
+            sptr = eptr ? lpNext(zl,eptr) : NULL;
+            while (eptr != NULL) {
+                ele = lpGetObject(eptr);
+                zptInsert(zpt,ele,zzlGetScore(sptr));
+                sdsfree(ele);
+                zzlNext(zl,&eptr,&sptr);
+            }
+
+            zfree(zobj->ptr);
+            zobj->ptr = zpt;
+            zobj->encoding = OBJ_ENCODING_PACKEDTREE;
+            return;
+        }
+
+        if (encoding != OBJ_ENCODING_SKIPLIST && encoding != OBJ_ENCODING_BTREE)
+            serverPanic("Unknown target encoding");
+
+        zs = zmalloc(sizeof(*zs));
+        zs->dict = dictCreate(&zsetDictType,NULL);
+        zs->zsl = encoding == OBJ_ENCODING_SKIPLIST ? zslCreate() : NULL;
+        zs->zbt = encoding == OBJ_ENCODING_BTREE ? zbtCreate() : NULL;
+
+        eptr = lpSeek(zl,0);
+        serverAssertWithInfo(NULL,zobj,eptr != NULL);
+        sptr = lpNext(zl,eptr);
+        serverAssertWithInfo(NULL,zobj,sptr != NULL);
+
+        while (eptr != NULL) {
+            score = zzlGetScore(sptr);
+            vstr = lpGetValue(eptr,&vlen,&vlong);
+            if (vstr == NULL)
+                ele = sdsfromlonglong(vlong);
+            else
+                ele = sdsnewlen((char*)vstr,vlen);
+
+            zsetLargeInsert(zs,score,ele);
+            zzlNext(zl,&eptr,&sptr);
+        }
+
+        zfree(zobj->ptr);
+        zobj->ptr = zs;
+        zobj->encoding = encoding;
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        unsigned char *zl;
+
+        if (encoding == OBJ_ENCODING_BTREE) {
+            zbtree *zbt = zbtCreate();
+
+            /* Move the elements to the tree, storing the scores into the
+             * hash table entries instead of pointing to the skiplist nodes. */
+            zs = zobj->ptr;
+            node = zs->zsl->header->level[0].forward;
+            while (node) {
+                dictEntry *de = dictFind(zs->dict,node->ele);
+                dictSetDoubleVal(de,node->score);
+                zbtInsert(zbt,node->score,node->ele);
+                node->ele = NULL;
+                node = node->level[0].forward;
+            }
+
+            zslFree(zs->zsl);
+            zs->zsl = NULL;
+            zs->zbt = zbt;
+            zobj->encoding = OBJ_ENCODING_BTREE;
+            return;
+        }
+
+        if (encoding == OBJ_ENCODING_PACKEDTREE) {
+            zptree *zpt = zptCreate();
+
+            zs = zobj->ptr;
+            node = zs->zsl->header->level[0].forward;
+            while (node) {
+                zptInsert(zpt,node->ele,node->score);
+                node = node->level[0].forward;
+            }
+
+            dictRelease(zs->dict);
+            zslFree(zs->zsl);
+            zfree(zs);
+            zobj->ptr = zpt;
+            zobj->encoding = OBJ_ENCODING_PACKEDTREE;
+            return;
+        }
+
+        if (encoding != OBJ_ENCODING_LISTPACK)
+            serverPanic("Unknown target encoding");
+        zl = lpNew();
+
+        /* Approach similar to zslFree(), since we want to free the skiplist at
+         * the same time as creating the listpack. */
+        zs = zobj->ptr;
+        dictRelease(zs->dict);
+        node = zs->zsl->header->level[0].forward;
+        zfree(zs->zsl->header);
+        zfree(zs->zsl);
+
+        while (node) {
+            zl = zzlInsertAt(zl,NULL,node->ele,node->score);
+            next = node->level[0].forward;
+            zslFreeNode(node);
+            node = next;
+        }
+
+        zfree(zs);
+        zobj->ptr = zl;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        zptree *zpt = zobj->ptr;
+        zptNode *leaf;
+
+        if (encoding == OBJ_ENCODING_LISTPACK) {
+            unsigned char *zl = NULL;
+
+            /* The leaves already are listpacks in the right format: just
+             * concatenate them. */
+            for (leaf = zpt->head; leaf != NULL; leaf = leaf->next) {
+                zl = zl ? lpMerge(&zl,&leaf->lp) : leaf->lp;
+                leaf->lp = NULL;
+            }
+            zptFree(zpt);
+            zobj->ptr = zl;
+            zobj->encoding = OBJ_ENCODING_LISTPACK;
+        } else if (encoding == OBJ_ENCODING_SKIPLIST ||
+                   encoding == OBJ_ENCODING_BTREE)
+        {
+            unsigned char *eptr, *sptr;
+
+            zs = zmalloc(sizeof(*zs));
+            zs->dict = dictCreate(&zsetDictType,NULL);
+            zs->zsl = encoding == OBJ_ENCODING_SKIPLIST ? zslCreate() : NULL;
+            zs->zbt = encoding == OBJ_ENCODING_BTREE ? zbtCreate() : NULL;
+
+            for (leaf = zpt->head; leaf != NULL; leaf = leaf->next) {
+                eptr = lpSeek(leaf->lp,0);
+                sptr = eptr ? lpNext(leaf->lp,eptr) : NULL;
+                while (eptr != NULL) {
+                    ele = lpGetObject(eptr);
+                    score = zzlGetScore(sptr);
+                    zsetLargeInsert(zs,score,ele);
+                    zzlNext(leaf->lp,&eptr,&sptr);
+                }
+            }
+
+            zptFree(zpt);
+            zobj->ptr = zs;
+            zobj->encoding = encoding;
+        } else {
+            serverPanic("Unknown target encoding");
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zbtNode *n;
+
+        zs = zobj->ptr;
+        if (encoding == OBJ_ENCODING_SKIPLIST) {
+            zs->zsl = zslCreate();
+            for (n = zs->zbt->head; n != NULL; n = n->next) {
+                for (int j = 0; j < n->num; j++) {
+                    dictEntry *de = dictFind(zs->dict,n->ele[j]);
+                    node = zslInsert(zs->zsl,n->score[j],n->ele[j]);
+                    dictSetVal(zs->dict,de,&node->score);
+                }
+                /* The elements now belong to the skiplist. */
+                n->num = 0;
+            }
+            zbtFree(zs->zbt);
+            zs->zbt = NULL;
+            zobj->encoding = OBJ_ENCODING_SKIPLIST;
+        } else if (encoding == OBJ_ENCODING_LISTPACK ||
+                   encoding == OBJ_ENCODING_PACKEDTREE)
+        {
+            unsigned char *zl = NULL;
+            zptree *zpt = NULL;
+
+            if (encoding == OBJ_ENCODING_LISTPACK)
+                zl = lpNew();
+            else
+                zpt = zptCreate();
+            for (n = zs->zbt->head; n != NULL; n = n->next) {
+                for (int j = 0; j < n->num; j++) {
+                    if (zl)
+                        zl = zzlInsertAt(zl,NULL,n->ele[j],n->score[j]);
+                    else
+                        zptInsert(zpt,n->ele[j],n->score[j]);
+                }
+            }
+            dictRelease(zs->dict);
+            zbtFree(zs->zbt);
+            zfree(zs);
+            zobj->ptr = zl ? (void*)zl : (void*)zpt;
+            zobj->encoding = encoding;
+        } else {
+            serverPanic("Unknown target encoding");
+        }
+    } else {
+        serverPanic("Unknown sorted set encoding");
+    }
+}
+
+/* Convert the sorted set object into a listpack if it is not already a listpack
+ * and if the number of elements and the maximum element size is within the
+ * expected ranges. Sets too big for a listpack but within the packed tree
+ * limits are converted into a packed tree instead. */
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) return;
+    unsigned long length = zsetLength(zobj);
+
+    if (maxelelen > server.zset_max_ziplist_value) return;
+    if (length <= server.zset_max_ziplist_entries)
+        zsetConvert(zobj,OBJ_ENCODING_LISTPACK);
+    else if (zsetOverflowEncoding(length) == OBJ_ENCODING_PACKEDTREE)
+        zsetConvert(zobj,OBJ_ENCODING_PACKEDTREE);
+}
+
+/* Return (by reference) the score of the specified member of the sorted set
+ * storing it into *score. If the element does not exist C_ERR is returned
+ * otherwise C_OK is returned and *score is correctly populated.
+ * If 'zobj' or 'member' is NULL, C_ERR is returned. */
+int zsetScore(robj *zobj, sds member, double *score) {
+    if (!zobj || !member) return C_ERR;
+
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+        if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        zset *zs = zobj->ptr;
+        dictEntry *de = dictFind(zs->dict, member);
+        if (de == NULL) return C_ERR;
+        *score = *(double*)dictGetVal(de);
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        if (zptFind(zobj->ptr, member, score, NULL) == NULL) return C_ERR;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        dictEntry *de = dictFind(zs->dict, member);
+        if (de == NULL) return C_ERR;
+        *score = dictGetDoubleVal(de);
+    } else {
+        serverPanic("Unknown sorted set encoding");
+    }
+    return C_OK;
+}
+
+/* Add a new element or update the score of an existing element in a sorted
+ * set, regardless of its encoding.
+ *
+ * The set of flags change the command behavior. They are passed with an integer
+ * pointer since the function will clear the flags and populate them with
+ * other flags to indicate different conditions.
+ *
+ * The input flags are the following:
+ *
+ * ZADD_INCR: Increment the current element score by 'score' instead of updating
+ *            the current element score. If the element does not exist, we
+ *            assume 0 as previous score.
+ * ZADD_NX:   Perform the operation only if the element does not exist.
+ * ZADD_XX:   Perform the operation only if the element already exist.
+ *
+ * When ZADD_INCR is used, the new score of the element is stored in
+ * '*newscore' if 'newscore' is not NULL.
+ *
+ * The returned flags are the following:
+ *
+ * ZADD_NAN:     The resulting score is not a number.
+ * ZADD_ADDED:   The element was added (not present before the call).
+ * ZADD_UPDATED: The element score was updated.
+ * ZADD_NOP:     No operation was performed because of NX or XX.
+ *
+ * Return value:
+ *
+ * The function returns 1 on success, and sets the appropriate flags
+ * ADDED or UPDATED to signal what happened during the operation (note that
+ * none could be set if we re-added an element using the same score it used
+ * to have, or in the case a zero increment is used).
+ *
+ * The function returns 0 on erorr, currently only when the increment
+ * produces a NAN condition, or when the 'score' value is NAN since the
+ * start.
+ *
+ * The commad as a side effect of adding a new element may convert the sorted
+ * set internal encoding from listpack to packed tree or hashtable+skiplist,
+ * and from packed tree to hashtable+skiplist.
+ *
+ * Memory managemnet of 'ele':
+ *
+ * The function does not take ownership of the 'ele' SDS string, but copies
+ * it if needed. */
+int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
+    /* Turn options into simple to check vars. */
+    int incr = (*flags & ZADD_INCR) != 0;
+    int nx = (*flags & ZADD_NX) != 0;
+    int xx = (*flags & ZADD_XX) != 0;
+    *flags = 0; /* We'll return our response flags. */
+    double curscore;
+
+    /* NaN as input is an error regardless of all the other parameters. */
+    if (isnan(score)) {
+        *flags = ZADD_NAN;
+        return 0;
+    }
+
+    /* Update the sorted set according to its encoding. */
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *eptr;
+
+        if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
+            /* NX? Return, same element already exists. */
+            if (nx) {
+                *flags |= ZADD_NOP;
+                return 1;
+            }
+
+            /* Prepare the score for the increment if needed. */
+            if (incr) {
+                score += curscore;
+                if (isnan(score)) {
+                    *flags |= ZADD_NAN;
+                    return 0;
+                }
+                if (newscore) *newscore = score;
+            }
+
+            /* Remove and re-insert when score changed. */
+            if (score != curscore) {
+                zobj->ptr = zzlDelete(zobj->ptr,eptr);
+                zobj->ptr = zzlInsert(zobj->ptr,ele,score);
+                *flags |= ZADD_UPDATED;
+            }
+            return 1;
+        } else if (!xx) {
+            /* Optimize: check if the element is too large or the list
+             * becomes too long *before* executing zzlInsert. */
+            zobj->ptr = zzlInsert(zobj->ptr,ele,score);
+            if (sdslen(ele) > server.zset_max_ziplist_value)
+                zsetConvert(zobj,zsetLargeEncoding());
+            else if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries)
+                zsetConvert(zobj,zsetOverflowEncoding(zzlLength(zobj->ptr)));
+            if (newscore) *newscore = score;
+            *flags |= ZADD_ADDED;
+            return 1;
+        } else {
+            *flags |= ZADD_NOP;
+            return 1;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplistNode *znode;
         dictEntry *de;
@@ -1412,6 +3013,88 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             *flags |= ZADD_NOP;
             return 1;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        zptree *zpt = zobj->ptr;
+        unsigned char *eptr;
+        zptNode *leaf;
+
+        if ((eptr = zptFind(zpt,ele,&curscore,&leaf)) != NULL) {
+            /* NX? Return, same element already exists. */
+            if (nx) {
+                *flags |= ZADD_NOP;
+                return 1;
+            }
+
+            /* Prepare the score for the increment if needed. */
+            if (incr) {
+                score += curscore;
+                if (isnan(score)) {
+                    *flags |= ZADD_NAN;
+                    return 0;
+                }
+                if (newscore) *newscore = score;
+            }
+
+            /* Remove and re-insert when score changed. */
+            if (score != curscore) {
+                zptDelete(zpt,leaf,eptr);
+                zptInsert(zpt,ele,score);
+                *flags |= ZADD_UPDATED;
+            }
+            return 1;
+        } else if (!xx) {
+            zptInsert(zpt,ele,score);
+            if (zsetOverflowEncoding(zptLength(zpt)) !=
+                    OBJ_ENCODING_PACKEDTREE ||
+                sdslen(ele) > server.zset_max_ziplist_value)
+                zsetConvert(zobj,zsetLargeEncoding());
+            if (newscore) *newscore = score;
+            *flags |= ZADD_ADDED;
+            return 1;
+        } else {
+            *flags |= ZADD_NOP;
+            return 1;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        dictEntry *de;
+
+        de = dictFind(zs->dict,ele);
+        if (de != NULL) {
+            /* NX? Return, same element already exists. */
+            if (nx) {
+                *flags |= ZADD_NOP;
+                return 1;
+            }
+            curscore = dictGetDoubleVal(de);
+
+            /* Prepare the score for the increment if needed. */
+            if (incr) {
+                score += curscore;
+                if (isnan(score)) {
+                    *flags |= ZADD_NAN;
+                    return 0;
+                }
+                if (newscore) *newscore = score;
+            }
+
+            /* Move the element when the score changes. The score is stored
+             * in the hash table entry itself. */
+            if (score != curscore) {
+                zbtUpdateScore(zs->zbt,curscore,ele,score);
+                dictSetDoubleVal(de,score);
+                *flags |= ZADD_UPDATED;
+            }
+            return 1;
+        } else if (!xx) {
+            zsetLargeInsert(zs,score,sdsdup(ele));
+            *flags |= ZADD_ADDED;
+            if (newscore) *newscore = score;
+            return 1;
+        } else {
+            *flags |= ZADD_NOP;
+            return 1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1421,7 +3104,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,NULL)) != NULL) {
@@ -1449,6 +3132,32 @@ int zsetDel(robj *zobj, sds ele) {
             int retval = zslDelete(zs->zsl,score,ele,NULL);
             serverAssert(retval);
 
+            if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+            return 1;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        unsigned char *eptr;
+        zptNode *leaf;
+
+        if ((eptr = zptFind(zobj->ptr,ele,NULL,&leaf)) != NULL) {
+            zptDelete(zobj->ptr,leaf,eptr);
+            return 1;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        dictEntry *de;
+        double score;
+
+        de = dictUnlink(zs->dict,ele);
+        if (de != NULL) {
+            /* Like for the skiplist, the tree owns the SDS string shared
+             * with the hash table, so it is the last to release it. */
+            score = dictGetDoubleVal(de);
+            dictFreeUnlinkedEntry(zs->dict,de);
+
+            int retval = zbtDelete(zs->zbt,score,ele);
+            serverAssert(retval);
+
             if (htNeedsResize(zs->dict)) dictResize(zs->dict);
             return 1;
         }
@@ -1475,18 +3184,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
 
     llen = zsetLength(zobj);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         rank = 1;
         while(eptr != NULL) {
-            if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele)))
+            if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele)))
                 break;
             rank++;
             zzlNext(zl,&eptr,&sptr);
@@ -1519,6 +3228,38 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
         } else {
             return -1;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        unsigned char *eptr;
+        zptNode *leaf;
+
+        if ((eptr = zptFind(zobj->ptr,ele,NULL,&leaf)) != NULL) {
+            rank = zptGetRank(zobj->ptr,leaf,eptr);
+            if (reverse)
+                return llen-rank;
+            else
+                return rank-1;
+        } else {
+            return -1;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        dictEntry *de;
+        zbtNode *n;
+        int pos;
+
+        de = dictFind(zs->dict,ele);
+        if (de != NULL) {
+            n = zbtFind(zs->zbt,dictGetDoubleVal(de),ele,&pos);
+            /* Existing elements are always in the tree. */
+            serverAssert(n != NULL);
+            rank = zbtGetRank(n,pos);
+            if (reverse)
+                return llen-rank;
+            else
+                return rank-1;
+        } else {
+            return -1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1528,6 +3269,62 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
  * Sorted set commands
  *----------------------------------------------------------------------------*/
 
+/* Minimum number of score-element pairs of a ZADD to use zaddBulk(). */
+#define ZADD_BULK_MIN_ELEMENTS 16
+
+/* Add many elements at once to a skiplist encoded sorted set, with the same
+ * semantics of calling zsetAdd() for each pair without the INCR option.
+ * The elements that are new are collected and inserted with zsetBulkInsert()
+ * at the end. Until then, their dict entries point to the score stored in
+ * the batch, so that an element repeated in the same ZADD just updates it.
+ * 'eleargv' is the first element argument, with the other ones every two
+ * arguments. */
+static void zaddBulk(robj *zobj, robj **eleargv, double *scores, int elements,
+                     int flags, int *added, int *updated, int *processed)
+{
+    zset *zs = zobj->ptr;
+    zsetBulkEntry *batch = zmalloc(sizeof(*batch)*elements);
+    unsigned long count = 0;
+    int nx = (flags & ZADD_NX) != 0;
+    int xx = (flags & ZADD_XX) != 0;
+
+    for (int j = 0; j < elements; j++) {
+        sds ele = eleargv[j*2]->ptr;
+        double score = scores[j];
+        dictEntry *de = dictFind(zs->dict,ele);
+
+        if (de != NULL) {
+            double *curscore = dictGetVal(de);
+
+            if (nx) continue;
+            if (score != *curscore) {
+                if (count && curscore >= &batch[0].score &&
+                    curscore <= &batch[count-1].score)
+                {
+                    /* Not yet in the skiplist. */
+                    *curscore = score;
+                } else {
+                    zskiplistNode *znode;
+                    znode = zslUpdateScore(zs->zsl,*curscore,ele,score);
+                    dictGetVal(de) = &znode->score; /* Update score ptr. */
+                }
+                (*updated)++;
+            }
+            (*processed)++;
+        } else if (!xx) {
+            zsetBulkEntry *e = batch+count++;
+            e->score = score;
+            e->ele = sdsdup(ele);
+            e->de = dictAddRaw(zs->dict,e->ele,NULL);
+            dictGetVal(e->de) = &e->score;
+            (*added)++;
+            (*processed)++;
+        }
+    }
+    zsetBulkInsert(zs,batch,count);
+    zfree(batch);
+}
+
 /* This generic command implements both ZADD and ZINCRBY. */
 void zaddGenericCommand(client *c, int flags) {
     static char *nanerr = "resulting score is not a number (NaN)";
@@ -1544,6 +3341,7 @@ void zaddGenericCommand(client *c, int flags) {
     int updated = 0;    /* Number of elements with updated score. */
     int processed = 0;  /* Number of elements processed, may remain zero with
                            options like XX. */
+    int created = 0;    /* The command created the key. */
 
     /* Parse options. At the end 'scoreidx' is set to the argument position
      * of the score of the first score-element pair. */
@@ -1599,14 +3397,21 @@ void zaddGenericCommand(client *c, int flags) {
     zobj = lookupKeyWrite(c->db,key);
     if (zobj == NULL) {
         if (xx) goto reply_to_client; /* No key + XX option: nothing to do. */
-        if (server.zset_max_ziplist_entries == 0 ||
-            server.zset_max_ziplist_value < sdslen(c->argv[scoreidx+1]->ptr))
+        int overflow = zsetOverflowEncoding(elements);
+
+        if (server.zset_max_ziplist_value < sdslen(c->argv[scoreidx+1]->ptr) ||
+            ((size_t)elements > server.zset_max_ziplist_entries &&
+             overflow != OBJ_ENCODING_PACKEDTREE))
         {
-            zobj = createZsetObject();
+            zobj = server.zset_btree_encoding ? createZsetBtreeObject() :
+                                                createZsetObject();
+        } else if ((size_t)elements > server.zset_max_ziplist_entries) {
+            zobj = createZsetPackedTreeObject();
         } else {
-            zobj = createZsetZiplistObject();
+            zobj = createZsetListpackObject();
         }
         dbAdd(c->db,key,zobj);
+        created = 1;
     } else {
         if (zobj->type != OBJ_ZSET) {
             addReply(c,shared.wrongtypeerr);
@@ -1614,21 +3419,41 @@ void zaddGenericCommand(client *c, int flags) {
         }
     }
 
-    for (j = 0; j < elements; j++) {
-        double newscore;
-        score = scores[j];
-        int retflags = flags;
-
-        ele = c->argv[scoreidx+1+j*2]->ptr;
-        int retval = zsetAdd(zobj, score, ele, &retflags, &newscore);
-        if (retval == 0) {
-            addReplyError(c,nanerr);
-            goto cleanup;
+    /* Big ZADDs against a skiplist take the bulk insertion path. */
+    if (!incr && elements >= ZADD_BULK_MIN_ELEMENTS &&
+        zobj->encoding == OBJ_ENCODING_SKIPLIST)
+    {
+        zaddBulk(zobj,c->argv+scoreidx+1,scores,elements,flags,
+                 &added,&updated,&processed);
+    } else {
+        for (j = 0; j < elements; j++) {
+            double newscore;
+            score = scores[j];
+            int retflags = flags;
+
+            ele = c->argv[scoreidx+1+j*2]->ptr;
+            int retval = zsetAdd(zobj, score, ele, &retflags, &newscore);
+            if (retval == 0) {
+                addReplyError(c,nanerr);
+                goto cleanup;
+            }
+            if (retflags & ZADD_ADDED) added++;
+            if (retflags & ZADD_UPDATED) updated++;
+            if (!(retflags & ZADD_NOP)) processed++;
+            score = newscore;
+        }
+    }
+
+    /* The encoding of a new key was picked from the number of pairs, but
+     * repeated elements may leave a set small enough for a compact one. */
+    if (created && (size_t)elements > server.zset_max_ziplist_entries) {
+        size_t maxelelen = 0;
+
+        for (j = 0; j < elements; j++) {
+            size_t len = sdslen(c->argv[scoreidx+1+j*2]->ptr);
+            if (len > maxelelen) maxelelen = len;
         }
-        if (retflags & ZADD_ADDED) added++;
-        if (retflags & ZADD_UPDATED) updated++;
-        if (!(retflags & ZADD_NOP)) processed++;
-        score = newscore;
+        zsetConvertToListpackIfNeeded(zobj,maxelelen);
     }
     server.dirty += (added+updated);
 
@@ -1737,7 +3562,7 @@ void zremrangeGenericCommand(client *c, int rangetype) {
     }
 
     /* Step 3: Perform the range deletion operation. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         switch(rangetype) {
         case ZRANGE_RANK:
             zobj->ptr = zzlDeleteRangeByRank(zobj->ptr,start+1,end+1,&deleted);
@@ -1771,6 +3596,40 @@ void zremrangeGenericCommand(client *c, int rangetype) {
             dbDelete(c->db,key);
             keyremoved = 1;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        switch(rangetype) {
+        case ZRANGE_RANK:
+            deleted = zptDeleteRangeByRank(zobj->ptr,start+1,end+1);
+            break;
+        case ZRANGE_SCORE:
+            deleted = zptDeleteRangeByScore(zobj->ptr,&range);
+            break;
+        case ZRANGE_LEX:
+            deleted = zptDeleteRangeByLex(zobj->ptr,&lexrange);
+            break;
+        }
+        if (zptLength(zobj->ptr) == 0) {
+            dbDelete(c->db,key);
+            keyremoved = 1;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        switch(rangetype) {
+        case ZRANGE_RANK:
+            deleted = zbtDeleteRangeByRank(zs->zbt,start+1,end+1,zs->dict);
+            break;
+        case ZRANGE_SCORE:
+            deleted = zbtDeleteRangeByScore(zs->zbt,&range,zs->dict);
+            break;
+        case ZRANGE_LEX:
+            deleted = zbtDeleteRangeByLex(zs->zbt,&lexrange,zs->dict);
+            break;
+        }
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+        if (dictSize(zs->dict) == 0) {
+            dbDelete(c->db,key);
+            keyremoved = 1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1815,6 +3674,7 @@ typedef struct {
                 intset *is;
                 int ii;
             } is;
+            roaringIterator ri;
             struct {
                 dict *dict;
                 dictIterator *di;
@@ -1832,6 +3692,14 @@ typedef struct {
                 zset *zs;
                 zskiplistNode *node;
             } sl;
+            struct {
+                zptNode *leaf;
+                unsigned char *eptr, *sptr;
+            } pt;
+            struct {
+                zbtNode *node;
+                int pos;
+            } bt;
         } zset;
     } iter;
 } zsetopsrc;
@@ -1870,6 +3738,8 @@ void zuiInitIterator(zsetopsrc *op) {
         if (op->encoding == OBJ_ENCODING_INTSET) {
             it->is.is = op->subject->ptr;
             it->is.ii = 0;
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            roaringInitIterator(op->subject->ptr,&it->ri);
         } else if (op->encoding == OBJ_ENCODING_HT) {
             it->ht.dict = op->subject->ptr;
             it->ht.di = dictGetIterator(op->subject->ptr);
@@ -1879,16 +3749,26 @@ void zuiInitIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             it->zl.zl = op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = lpSeek(it->zl.zl,0);
             if (it->zl.eptr != NULL) {
-                it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
+                it->zl.sptr = lpNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             it->sl.zs = op->subject->ptr;
             it->sl.node = it->sl.zs->zsl->header->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_PACKEDTREE) {
+            zptree *zpt = op->subject->ptr;
+            it->pt.leaf = zpt->head;
+            it->pt.eptr = lpSeek(it->pt.leaf->lp,0);
+            if (it->pt.eptr != NULL)
+                it->pt.sptr = lpNext(it->pt.leaf->lp,it->pt.eptr);
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = op->subject->ptr;
+            it->bt.node = zs->zbt->head->num ? zs->zbt->head : NULL;
+            it->bt.pos = 0;
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1905,6 +3785,8 @@ void zuiClearIterator(zsetopsrc *op) {
         iterset *it = &op->iter.set;
         if (op->encoding == OBJ_ENCODING_INTSET) {
             UNUSED(it); /* skip */
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dictReleaseIterator(it->ht.di);
         } else {
@@ -1912,10 +3794,14 @@ void zuiClearIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             UNUSED(it); /* skip */
+        } else if (op->encoding == OBJ_ENCODING_PACKEDTREE) {
+            UNUSED(it); /* skip */
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            UNUSED(it); /* skip */
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1931,6 +3817,8 @@ unsigned long zuiLength(zsetopsrc *op) {
     if (op->type == OBJ_SET) {
         if (op->encoding == OBJ_ENCODING_INTSET) {
             return intsetLen(op->subject->ptr);
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            return roaringCard(op->subject->ptr);
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dict *ht = op->subject->ptr;
             return dictSize(ht);
@@ -1938,11 +3826,16 @@ unsigned long zuiLength(zsetopsrc *op) {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             return zzlLength(op->subject->ptr);
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             zset *zs = op->subject->ptr;
             return zs->zsl->length;
+        } else if (op->encoding == OBJ_ENCODING_PACKEDTREE) {
+            return zptLength(op->subject->ptr);
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = op->subject->ptr;
+            return zs->zbt->length;
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1975,6 +3868,13 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->is.ii++;
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            int64_t ell;
+
+            if (!roaringNext(&it->ri,&ell))
+                return 0;
+            val->ell = ell;
+            val->score = 1.0;
         } else if (op->encoding == OBJ_ENCODING_HT) {
             if (it->ht.de == NULL)
                 return 0;
@@ -1988,11 +3888,11 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             /* No need to check both, but better be explicit. */
             if (it->zl.eptr == NULL || it->zl.sptr == NULL)
                 return 0;
-            serverAssert(ziplistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
+            val->estr = lpGetValue(it->zl.eptr,&val->elen,&val->ell);
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
@@ -2005,6 +3905,22 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->sl.node = it->sl.node->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_PACKEDTREE) {
+            if (it->pt.eptr == NULL)
+                return 0;
+            val->estr = lpGetValue(it->pt.eptr,&val->elen,&val->ell);
+            val->score = zzlGetScore(it->pt.sptr);
+
+            /* Move to next element. */
+            zptNext(&it->pt.leaf,&it->pt.eptr,&it->pt.sptr);
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            if (it->bt.node == NULL)
+                return 0;
+            val->ele = it->bt.node->ele[it->bt.pos];
+            val->score = it->bt.node->score[it->bt.pos];
+
+            /* Move to next element. */
+            zbtNext(&it->bt.node,&it->bt.pos);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2091,6 +4007,15 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            if (zuiLongLongFromValue(val) &&
+                roaringContains(op->subject->ptr,val->ell))
+            {
+                *score = 1.0;
+                return 1;
+            } else {
+                return 0;
+            }
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dict *ht = op->subject->ptr;
             zuiSdsFromValue(val);
@@ -2106,7 +4031,7 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
     } else if (op->type == OBJ_ZSET) {
         zuiSdsFromValue(val);
 
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             if (zzlFind(op->subject->ptr,val->ele,score) != NULL) {
                 /* Score is already set by zzlFind. */
                 return 1;
@@ -2122,6 +4047,22 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
+        } else if (op->encoding == OBJ_ENCODING_PACKEDTREE) {
+            if (zptFind(op->subject->ptr,val->ele,score,NULL) != NULL) {
+                /* Score is already set by zptFind. */
+                return 1;
+            } else {
+                return 0;
+            }
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = op->subject->ptr;
+            dictEntry *de;
+            if ((de = dictFind(zs->dict,val->ele)) != NULL) {
+                *score = dictGetDoubleVal(de);
+                return 1;
+            } else {
+                return 0;
+            }
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2182,7 +4123,8 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     size_t maxelelen = 0;
     robj *dstobj;
     zset *dstzset;
-    zskiplistNode *znode;
+    zsetBulkEntry *batch = NULL;
+    unsigned long count = 0;
     int touched = 0;
 
     /* expect setnum input keys to be given */
@@ -2268,7 +4210,8 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
      * algorithm's performance */
     qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
 
-    dstobj = createZsetObject();
+    dstobj = server.zset_btree_encoding ? createZsetBtreeObject() :
+                                          createZsetObject();
     dstzset = dstobj->ptr;
     memset(&zval, 0, sizeof(zval));
 
@@ -2277,6 +4220,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         if (zuiLength(&src[0]) > 0) {
             /* Precondition: as src[0] is non-empty and the inputs are ordered
              * by size, all src[i > 0] are non-empty too. */
+            batch = zmalloc(sizeof(*batch)*zuiLength(&src[0]));
             zuiInitIterator(&src[0]);
             while (zuiNext(&src[0],&zval)) {
                 double score, value;
@@ -2301,12 +4245,17 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 /* Only continue when present in every input. */
                 if (j == setnum) {
                     tmp = zuiNewSdsFromValue(&zval);
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
+                    batch[count].score = score;
+                    batch[count].ele = tmp;
+                    batch[count].de = dictAddRaw(dstzset->dict,tmp,NULL);
+                    count++;
                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                 }
             }
             zuiClearIterator(&src[0]);
+
+            /* Insert all the elements at once, sorted. */
+            zsetBulkInsert(dstzset,batch,count);
         }
     } else if (op == SET_OP_UNION) {
         dict *accumulator = dictCreate(&setAccumulatorDictType,NULL);
@@ -2337,7 +4286,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 if (!existing) {
                     tmp = zuiNewSdsFromValue(&zval);
                     /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to ziplist
+                     * to understand if it's possible to convert to listpack
                      * at the end. */
                      if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                     /* Update the element with its initial score. */
@@ -2363,23 +4312,30 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
          * let's resize the dictionary embedded inside the sorted set to the
          * right size, in order to save rehashing time. */
         dictExpand(dstzset->dict,dictSize(accumulator));
+        batch = zmalloc(sizeof(*batch)*dictSize(accumulator));
 
         while((de = dictNext(di)) != NULL) {
             sds ele = dictGetKey(de);
-            score = dictGetDoubleVal(de);
-            znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
+            batch[count].score = dictGetDoubleVal(de);
+            batch[count].ele = ele;
+            batch[count].de = dictAddRaw(dstzset->dict,ele,NULL);
+            count++;
         }
         dictReleaseIterator(di);
         dictRelease(accumulator);
+
+        /* Sort the union once and insert it in a single pass, instead of
+         * inserting the elements one by one in the dict random order. */
+        zsetBulkInsert(dstzset,batch,count);
     } else {
         serverPanic("Unknown operator");
     }
+    zfree(batch);
 
     if (dbDelete(c->db,dstkey))
         touched = 1;
-    if (dstzset->zsl->length) {
-        zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
+    if (zsetLength(dstobj)) {
+        zsetConvertToListpackIfNeeded(dstobj,maxelelen);
         dbAdd(c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
         signalModifiedKey(c->db,dstkey);
@@ -2447,7 +4403,7 @@ void zrangeGenericCommand(client *c, int reverse) {
     /* Return the result in form of a multi-bulk reply */
     addReplyMultiBulkLen(c, withscores ? (rangelen*2) : rangelen);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2455,16 +4411,16 @@ void zrangeGenericCommand(client *c, int reverse) {
         long long vlong;
 
         if (reverse)
-            eptr = ziplistIndex(zl,-2-(2*start));
+            eptr = lpSeek(zl,-2-(2*start));
         else
-            eptr = ziplistIndex(zl,2*start);
+            eptr = lpSeek(zl,2*start);
 
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         while (rangelen--) {
             serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
             if (vstr == NULL)
                 addReplyBulkLongLong(c,vlong);
             else
@@ -2496,13 +4452,59 @@ void zrangeGenericCommand(client *c, int reverse) {
                 ln = zslGetElementByRank(zsl,start+1);
         }
 
-        while(rangelen--) {
-            serverAssertWithInfo(c,zobj,ln != NULL);
-            ele = ln->ele;
+        while(rangelen--) {
+            serverAssertWithInfo(c,zobj,ln != NULL);
+            ele = ln->ele;
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            if (withscores)
+                addReplyDouble(c,ln->score);
+            ln = reverse ? ln->backward : ln->level[0].forward;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        zptree *zpt = zobj->ptr;
+        zptNode *leaf;
+        unsigned char *eptr, *sptr;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+
+        eptr = zptGetElementByRank(zpt,reverse ? llen-start : start+1,&leaf);
+        serverAssertWithInfo(c,zobj,eptr != NULL);
+        sptr = lpNext(leaf->lp,eptr);
+
+        while (rangelen--) {
+            serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
+            vstr = lpGetValue(eptr,&vlen,&vlong);
+            if (vstr == NULL)
+                addReplyBulkLongLong(c,vlong);
+            else
+                addReplyBulkCBuffer(c,vstr,vlen);
+
+            if (withscores)
+                addReplyDouble(c,zzlGetScore(sptr));
+
+            if (reverse)
+                zptPrev(&leaf,&eptr,&sptr);
+            else
+                zptNext(&leaf,&eptr,&sptr);
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtNode *n;
+        int pos;
+        sds ele;
+
+        n = zbtGetElementByRank(zs->zbt,reverse ? llen-start : start+1,&pos);
+        while (rangelen--) {
+            serverAssertWithInfo(c,zobj,n != NULL);
+            ele = n->ele[pos];
             addReplyBulkCBuffer(c,ele,sdslen(ele));
             if (withscores)
-                addReplyDouble(c,ln->score);
-            ln = reverse ? ln->backward : ln->level[0].forward;
+                addReplyDouble(c,n->score[pos]);
+            if (reverse)
+                zbtPrev(&n,&pos);
+            else
+                zbtNext(&n,&pos);
         }
     } else {
         serverPanic("Unknown sorted set encoding");
@@ -2572,7 +4574,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
         checkType(c,zobj,OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2595,7 +4597,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2622,8 +4624,8 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 if (!zslValueLteMax(score,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always succeed */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            /* We know the element exists, so lpGetValue should always succeed */
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             rangelen++;
             if (vstr == NULL) {
@@ -2698,6 +4700,117 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        zptree *zpt = zobj->ptr;
+        zptNode *leaf;
+        unsigned char *eptr, *sptr;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+        double score;
+
+        /* If reversed, get the last node in range as starting point. */
+        if (reverse) {
+            eptr = zptLastInRange(zpt,&range,&leaf);
+        } else {
+            eptr = zptFirstInRange(zpt,&range,&leaf);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (eptr == NULL) {
+            addReply(c, shared.emptymultibulk);
+            return;
+        }
+
+        /* We don't know in advance how many matching elements there are in the
+         * list, so we push this object that will represent the multi-bulk
+         * length in the output buffer, and will "fix" it later */
+        replylen = addDeferredMultiBulkLength(c);
+
+        /* The offset is skipped by rank, the score is checked in the next
+         * loop. */
+        zptSkip(zpt,&leaf,&eptr,offset,reverse);
+        sptr = eptr ? lpNext(leaf->lp,eptr) : NULL;
+
+        while (eptr && limit--) {
+            score = zzlGetScore(sptr);
+
+            /* Abort when the node is no longer in range. */
+            if (reverse) {
+                if (!zslValueGteMin(score,&range)) break;
+            } else {
+                if (!zslValueLteMax(score,&range)) break;
+            }
+
+            vstr = lpGetValue(eptr,&vlen,&vlong);
+
+            rangelen++;
+            if (vstr == NULL) {
+                addReplyBulkLongLong(c,vlong);
+            } else {
+                addReplyBulkCBuffer(c,vstr,vlen);
+            }
+
+            if (withscores) {
+                addReplyDouble(c,score);
+            }
+
+            /* Move to next node */
+            if (reverse) {
+                zptPrev(&leaf,&eptr,&sptr);
+            } else {
+                zptNext(&leaf,&eptr,&sptr);
+            }
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtNode *n;
+        int pos;
+
+        /* If reversed, get the last node in range as starting point. */
+        if (reverse) {
+            n = zbtLastInRange(zs->zbt,&range,&pos);
+        } else {
+            n = zbtFirstInRange(zs->zbt,&range,&pos);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (n == NULL) {
+            addReply(c, shared.emptymultibulk);
+            return;
+        }
+
+        /* We don't know in advance how many matching elements there are in the
+         * list, so we push this object that will represent the multi-bulk
+         * length in the output buffer, and will "fix" it later */
+        replylen = addDeferredMultiBulkLength(c);
+
+        /* The offset is skipped by rank, the score is checked in the next
+         * loop. */
+        zbtSkip(zs->zbt,&n,&pos,offset,reverse);
+
+        while (n && limit--) {
+            /* Abort when the node is no longer in range. */
+            if (reverse) {
+                if (!zslValueGteMin(n->score[pos],&range)) break;
+            } else {
+                if (!zslValueLteMax(n->score[pos],&range)) break;
+            }
+
+            rangelen++;
+            addReplyBulkCBuffer(c,n->ele[pos],sdslen(n->ele[pos]));
+
+            if (withscores) {
+                addReplyDouble(c,n->score[pos]);
+            }
+
+            /* Move to next node */
+            if (reverse) {
+                zbtPrev(&n,&pos);
+            } else {
+                zbtNext(&n,&pos);
+            }
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2733,7 +4846,7 @@ void zcountCommand(client *c) {
     if ((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL ||
         checkType(c, zobj, OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         double score;
@@ -2748,7 +4861,7 @@ void zcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         score = zzlGetScore(sptr);
         serverAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
 
@@ -2787,6 +4900,30 @@ void zcountCommand(client *c) {
                 count -= (zsl->length - rank);
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        zptree *zpt = zobj->ptr;
+        unsigned long length = zptLength(zpt);
+        unsigned char *eptr;
+        zptNode *leaf;
+
+        /* Use the ranks of the first and last elements in range, as for the
+         * skiplist. */
+        if ((eptr = zptFirstInRange(zpt,&range,&leaf)) != NULL) {
+            count = length - (zptGetRank(zpt,leaf,eptr) - 1);
+            if ((eptr = zptLastInRange(zpt,&range,&leaf)) != NULL)
+                count -= length - zptGetRank(zpt,leaf,eptr);
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtNode *first, *last;
+        int firstpos, lastpos;
+
+        /* The ranks of the first and last elements in range come straight
+         * from the leaf positions and the counts of their ancestors. */
+        if ((first = zbtFirstInRange(zs->zbt,&range,&firstpos)) != NULL) {
+            last = zbtLastInRange(zs->zbt,&range,&lastpos);
+            count = zbtGetRank(last,lastpos) - zbtGetRank(first,firstpos) + 1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2814,7 +4951,7 @@ void zlexcountCommand(client *c) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
@@ -2829,7 +4966,7 @@ void zlexcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(c,zobj,zzlLexValueLteMax(eptr,&range));
 
         /* Iterate over elements in range */
@@ -2865,6 +5002,26 @@ void zlexcountCommand(client *c) {
                 count -= (zsl->length - rank);
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        zptree *zpt = zobj->ptr;
+        unsigned long length = zptLength(zpt);
+        unsigned char *eptr;
+        zptNode *leaf;
+
+        if ((eptr = zptFirstInLexRange(zpt,&range,&leaf)) != NULL) {
+            count = length - (zptGetRank(zpt,leaf,eptr) - 1);
+            if ((eptr = zptLastInLexRange(zpt,&range,&leaf)) != NULL)
+                count -= length - zptGetRank(zpt,leaf,eptr);
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtNode *first, *last;
+        int firstpos, lastpos;
+
+        if ((first = zbtFirstInLexRange(zs->zbt,&range,&firstpos)) != NULL) {
+            last = zbtLastInLexRange(zs->zbt,&range,&lastpos);
+            count = zbtGetRank(last,lastpos) - zbtGetRank(first,firstpos) + 1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2927,7 +5084,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2950,7 +5107,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2975,9 +5132,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 if (!zzlLexValueLteMax(eptr,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
+            /* We know the element exists, so lpGetValue should always
              * succeed. */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             rangelen++;
             if (vstr == NULL) {
@@ -3045,6 +5202,108 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+        zptree *zpt = zobj->ptr;
+        zptNode *leaf;
+        unsigned char *eptr, *sptr;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+
+        /* If reversed, get the last node in range as starting point. */
+        if (reverse) {
+            eptr = zptLastInLexRange(zpt,&range,&leaf);
+        } else {
+            eptr = zptFirstInLexRange(zpt,&range,&leaf);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (eptr == NULL) {
+            addReply(c, shared.emptymultibulk);
+            zslFreeLexRange(&range);
+            return;
+        }
+
+        /* We don't know in advance how many matching elements there are in the
+         * list, so we push this object that will represent the multi-bulk
+         * length in the output buffer, and will "fix" it later */
+        replylen = addDeferredMultiBulkLength(c);
+
+        /* The offset is skipped by rank, the range is checked in the next
+         * loop. */
+        zptSkip(zpt,&leaf,&eptr,offset,reverse);
+        sptr = eptr ? lpNext(leaf->lp,eptr) : NULL;
+
+        while (eptr && limit--) {
+            /* Abort when the node is no longer in range. */
+            if (reverse) {
+                if (!zzlLexValueGteMin(eptr,&range)) break;
+            } else {
+                if (!zzlLexValueLteMax(eptr,&range)) break;
+            }
+
+            vstr = lpGetValue(eptr,&vlen,&vlong);
+
+            rangelen++;
+            if (vstr == NULL) {
+                addReplyBulkLongLong(c,vlong);
+            } else {
+                addReplyBulkCBuffer(c,vstr,vlen);
+            }
+
+            /* Move to next node */
+            if (reverse) {
+                zptPrev(&leaf,&eptr,&sptr);
+            } else {
+                zptNext(&leaf,&eptr,&sptr);
+            }
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtNode *n;
+        int pos;
+
+        /* If reversed, get the last node in range as starting point. */
+        if (reverse) {
+            n = zbtLastInLexRange(zs->zbt,&range,&pos);
+        } else {
+            n = zbtFirstInLexRange(zs->zbt,&range,&pos);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (n == NULL) {
+            addReply(c, shared.emptymultibulk);
+            zslFreeLexRange(&range);
+            return;
+        }
+
+        /* We don't know in advance how many matching elements there are in the
+         * list, so we push this object that will represent the multi-bulk
+         * length in the output buffer, and will "fix" it later */
+        replylen = addDeferredMultiBulkLength(c);
+
+        /* The offset is skipped by rank, the range is checked in the next
+         * loop. */
+        zbtSkip(zs->zbt,&n,&pos,offset,reverse);
+
+        while (n && limit--) {
+            /* Abort when the node is no longer in range. */
+            if (reverse) {
+                if (!zslLexValueGteMin(n->ele[pos],&range)) break;
+            } else {
+                if (!zslLexValueLteMax(n->ele[pos],&range)) break;
+            }
+
+            rangelen++;
+            addReplyBulkCBuffer(c,n->ele[pos],sdslen(n->ele[pos]));
+
+            /* Move to next node */
+            if (reverse) {
+                zbtPrev(&n,&pos);
+            } else {
+                zbtNext(&n,&pos);
+            }
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -3173,7 +5432,7 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
 
     /* Remove the element. */
     do {
-        if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
             unsigned char *zl = zobj->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -3181,16 +5440,16 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             long long vlong;
 
             /* Get the first or last element in the sorted set. */
-            eptr = ziplistIndex(zl,where == ZSET_MAX ? -2 : 0);
+            eptr = lpSeek(zl,where == ZSET_MAX ? -2 : 0);
             serverAssertWithInfo(c,zobj,eptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen(vstr,vlen);
 
             /* Get the score. */
-            sptr = ziplistNext(zl,eptr);
+            sptr = lpNext(zl,eptr);
             serverAssertWithInfo(c,zobj,sptr != NULL);
             score = zzlGetScore(sptr);
         } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -3206,6 +5465,25 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             serverAssertWithInfo(c,zobj,zln != NULL);
             ele = sdsdup(zln->ele);
             score = zln->score;
+        } else if (zobj->encoding == OBJ_ENCODING_PACKEDTREE) {
+            zptree *zpt = zobj->ptr;
+            zptNode *leaf = (where == ZSET_MAX ? zpt->tail : zpt->head);
+            unsigned char *eptr;
+
+            /* Get the first or last element in the sorted set. */
+            eptr = lpSeek(leaf->lp,where == ZSET_MAX ? -2 : 0);
+            serverAssertWithInfo(c,zobj,eptr != NULL);
+            ele = lpGetObject(eptr);
+            score = zzlGetScore(lpNext(leaf->lp,eptr));
+        } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+            zbtree *zbt = ((zset*)zobj->ptr)->zbt;
+            zbtNode *n = (where == ZSET_MAX ? zbt->tail : zbt->head);
+            int pos = (where == ZSET_MAX ? n->num-1 : 0);
+
+            /* There must be an element in the sorted set. */
+            serverAssertWithInfo(c,zobj,n->num != 0);
+            ele = sdsdup(n->ele[pos]);
+            score = n->score[pos];
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -3304,3 +5582,313 @@ void bzpopminCommand(client *c) {
 void bzpopmaxCommand(client *c) {
     blockingGenericZpopCommand(c,ZSET_MAX);
 }
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+
+static void ok(void) {
+    printf("OK\n");
+}
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+#define assert(_e) ((_e)?(void)0:(_assert(#_e,__FILE__,__LINE__),exit(1)))
+static void _assert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+/* Check the keys, counts and parent pointers of the subtree rooted at 'n',
+ * returning the number of elements below it. */
+static unsigned long zbtCheckNode(zbtNode *n) {
+    unsigned long count = 0;
+
+    assert(n->num > 0 && n->num <= ZBT_NODE_SIZE);
+    for (int j = 0; j < n->num; j++) {
+        if (j > 0)
+            assert(zbtCompare(n->score[j-1],n->ele[j-1],
+                              n->score[j],n->ele[j]) < 0);
+        if (n->leaf) {
+            count++;
+        } else {
+            zbtNode *child = n->children[j];
+            assert(child->parent == n);
+            assert(child->score[0] == n->score[j]);
+            assert(child->ele[0] == n->ele[j]);
+            assert(zbtCheckNode(child) == n->counts[j]);
+            count += n->counts[j];
+        }
+    }
+    return count;
+}
+
+static void zbtCheckConsistency(zbtree *zbt) {
+    zbtNode *n, *prev = NULL;
+    unsigned long count = 0;
+
+    assert(zbt->root->parent == NULL);
+    if (zbt->length == 0) {
+        assert(zbt->root->leaf && zbt->root->num == 0);
+        return;
+    }
+    assert(zbtCheckNode(zbt->root) == zbt->length);
+    for (n = zbt->head; n; prev = n, n = n->next) {
+        assert(n->leaf && n->prev == prev);
+        if (prev)
+            assert(zbtCompare(prev->score[prev->num-1],prev->ele[prev->num-1],
+                              n->score[0],n->ele[0]) < 0);
+        count += n->num;
+    }
+    assert(prev == zbt->tail && count == zbt->length);
+}
+
+/* Check that the tree and the skiplist hold the same elements in the same
+ * order, and that the ranks computed by both agree. */
+static void zbtCheckAgainstSkiplist(zbtree *zbt, zskiplist *zsl) {
+    zskiplistNode *ln = zsl->header->level[0].forward;
+    zbtNode *n = zbt->length ? zbt->head : NULL;
+    unsigned long rank = 1;
+    int pos = 0;
+
+    assert(zbt->length == zsl->length);
+    while (ln) {
+        assert(n != NULL);
+        assert(n->score[pos] == ln->score && sdscmp(n->ele[pos],ln->ele) == 0);
+        assert(zbtGetRank(n,pos) == rank);
+        ln = ln->level[0].forward;
+        zbtNext(&n,&pos);
+        rank++;
+    }
+    assert(n == NULL);
+}
+
+int zsetTest(int argc, char **argv) {
+    zbtree *zbt;
+    zskiplist *zsl;
+    zbtNode *n;
+    int pos;
+    long long start;
+    char buf[32];
+    srand(time(NULL));
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    printf("B-tree sequential insert and delete: "); {
+        zbt = zbtCreate();
+        for (int j = 0; j < 10000; j++)
+            zbtInsert(zbt,j,sdsfromlonglong(j));
+        zbtCheckConsistency(zbt);
+        for (int j = 0; j < 10000; j++) {
+            n = zbtGetElementByRank(zbt,j+1,&pos);
+            assert(n && n->score[pos] == j && zbtGetRank(n,pos) == (unsigned long)j+1);
+        }
+        for (int j = 9999; j >= 0; j -= 2) {
+            sds ele = sdsfromlonglong(j);
+            assert(zbtDelete(zbt,j,ele));
+            assert(!zbtDelete(zbt,j,ele));
+            sdsfree(ele);
+        }
+        zbtCheckConsistency(zbt);
+        for (int j = 0; j < 10000; j += 2) {
+            sds ele = sdsfromlonglong(j);
+            assert(zbtDelete(zbt,j,ele));
+            sdsfree(ele);
+        }
+        zbtCheckConsistency(zbt);
+        assert(zbt->length == 0);
+        zbtFree(zbt);
+        ok();
+    }
+
+    printf("B-tree stress against the skiplist: "); {
+        double scores[5000];
+        int present[5000] = {0};
+
+        zbt = zbtCreate();
+        zsl = zslCreate();
+        for (int i = 0; i < 200000; i++) {
+            int j = rand() % 5000;
+            double score = rand() % 1000;
+            int len = snprintf(buf,sizeof(buf),"ele:%d",j);
+            sds ele = sdsnewlen(buf,len);
+
+            if (!present[j]) {
+                zbtInsert(zbt,score,sdsdup(ele));
+                zslInsert(zsl,score,sdsdup(ele));
+                scores[j] = score;
+                present[j] = 1;
+            } else if (rand() % 2) {
+                zbtUpdateScore(zbt,scores[j],ele,score);
+                zslUpdateScore(zsl,scores[j],ele,score);
+                scores[j] = score;
+            } else {
+                assert(zbtDelete(zbt,scores[j],ele));
+                assert(zslDelete(zsl,scores[j],ele,NULL));
+                present[j] = 0;
+            }
+            sdsfree(ele);
+            if (i % 20000 == 0) {
+                zbtCheckConsistency(zbt);
+                zbtCheckAgainstSkiplist(zbt,zsl);
+            }
+        }
+        zbtCheckConsistency(zbt);
+        zbtCheckAgainstSkiplist(zbt,zsl);
+
+        /* Range lookups must land on the same elements. */
+        for (int i = 0; i < 1000; i++) {
+            zrangespec range;
+            zskiplistNode *ln;
+
+            range.min = rand() % 1000;
+            range.max = range.min + rand() % 50;
+            range.minex = rand() % 2;
+            range.maxex = rand() % 2;
+            n = zbtFirstInRange(zbt,&range,&pos);
+            ln = zslFirstInRange(zsl,&range);
+            assert((n == NULL) == (ln == NULL));
+            if (n) assert(sdscmp(n->ele[pos],ln->ele) == 0);
+            n = zbtLastInRange(zbt,&range,&pos);
+            ln = zslLastInRange(zsl,&range);
+            assert((n == NULL) == (ln == NULL));
+            if (n) assert(sdscmp(n->ele[pos],ln->ele) == 0);
+        }
+        zbtFree(zbt);
+        zslFree(zsl);
+        ok();
+    }
+
+    printf("B-tree range deletion: "); {
+        dict *d = dictCreate(&zsetDictType,NULL);
+        zrangespec range = {100,199,0,0};
+
+        zbt = zbtCreate();
+        for (int j = 0; j < 10000; j++) {
+            sds ele = sdsfromlonglong(j);
+            zbtInsert(zbt,j,ele);
+            dictAdd(d,ele,NULL);
+        }
+        assert(zbtDeleteRangeByScore(zbt,&range,d) == 100);
+        assert(zbtDeleteRangeByRank(zbt,1,50,d) == 50);
+        assert(zbtDeleteRangeByRank(zbt,5000,9850,d) == 4851);
+        zbtCheckConsistency(zbt);
+        assert(zbt->length == 4999 && dictSize(d) == 4999);
+        n = zbtGetElementByRank(zbt,51,&pos);
+        assert(n->score[pos] == 200);
+        zbtFree(zbt);
+        dictRelease(d);
+        ok();
+    }
+
+    printf("Skiplist sorted bulk insertion: "); {
+        zsetBulkEntry batch[2000];
+        int count = 0;
+
+        /* Merge a sorted batch with ties on the score into a skiplist
+         * that already has elements before, between and after them. */
+        zsl = zslCreate();
+        for (int j = 0; j < 3000; j += 3)
+            zslInsert(zsl,j/10,sdsfromlonglong(j));
+        for (int j = 0; j < 3000; j++) {
+            if (j % 3 == 0 || rand() % 3 == 0) continue;
+            batch[count].score = j/10;
+            batch[count].ele = sdsfromlonglong(j);
+            count++;
+        }
+        qsort(batch,count,sizeof(*batch),zsetBulkEntryCompare);
+        zslInsertSorted(zsl,batch,count);
+        assert(zsl->length == 1000+(unsigned long)count);
+
+        /* Walking the list checks the order and the backward links, looking
+         * up each node by rank checks the spans. */
+        zskiplistNode *ln = zsl->header->level[0].forward, *prev = NULL;
+        for (unsigned long rank = 1; ln; rank++) {
+            if (prev) assert(zbtCompare(prev->score,prev->ele,
+                                        ln->score,ln->ele) < 0);
+            assert(ln->backward == prev);
+            assert(zslGetElementByRank(zsl,rank) == ln);
+            assert(zslGetRank(zsl,ln->score,ln->ele) == rank);
+            prev = ln;
+            ln = ln->level[0].forward;
+        }
+        assert(zsl->tail == prev);
+        for (int j = 0; j < count; j++)
+            assert(zslGetElementByRank(zsl,zslGetRank(zsl,batch[j].score,
+                   batch[j].ele)) == batch[j].node);
+        zslFree(zsl);
+        ok();
+    }
+
+    printf("Benchmark B-tree vs skiplist with 1M members:\n"); {
+        int num = 1000000;
+        double *scores = zmalloc(sizeof(double)*num);
+        size_t used;
+
+        for (int j = 0; j < num; j++) scores[j] = rand();
+
+        for (int btree = 0; btree <= 1; btree++) {
+            const char *name = btree ? "btree" : "skiplist";
+            unsigned long ranks = 0;
+
+            used = zmalloc_used_memory();
+            zbt = btree ? zbtCreate() : NULL;
+            zsl = btree ? NULL : zslCreate();
+
+            start = usec();
+            for (int j = 0; j < num; j++) {
+                sds ele = sdsfromlonglong(j);
+                if (btree)
+                    zbtInsert(zbt,scores[j],ele);
+                else
+                    zslInsert(zsl,scores[j],ele);
+            }
+            printf("%8s: %d ZADD: %lld usec, %zu bytes\n",name,num,
+                usec()-start,zmalloc_used_memory()-used);
+
+            start = usec();
+            for (int j = 0; j < num; j++) {
+                int k = rand() % num;
+                sds ele = sdsfromlonglong(k);
+                if (btree) {
+                    n = zbtFind(zbt,scores[k],ele,&pos);
+                    ranks += zbtGetRank(n,pos);
+                } else {
+                    ranks += zslGetRank(zsl,scores[k],ele);
+                }
+                sdsfree(ele);
+            }
+            assert(ranks >= (unsigned long)num);
+            printf("%8s: %d ZRANK: %lld usec\n",name,num,usec()-start);
+
+            start = usec();
+            for (int j = 0; j < num/10; j++) {
+                zrangespec range;
+                range.min = rand();
+                range.max = range.min + RAND_MAX/10000; /* ~100 elements */
+                range.minex = range.maxex = 0;
+                if (btree) {
+                    n = zbtFirstInRange(zbt,&range,&pos);
+                    while (n && zslValueLteMax(n->score[pos],&range))
+                        zbtNext(&n,&pos);
+                } else {
+                    zskiplistNode *ln = zslFirstInRange(zsl,&range);
+                    while (ln && zslValueLteMax(ln->score,&range))
+                        ln = ln->level[0].forward;
+                }
+            }
+            printf("%8s: %d ZRANGEBYSCORE: %lld usec\n",name,num/10,
+                usec()-start);
+
+            if (btree) zbtFree(zbt); else zslFree(zsl);
+        }
+        zfree(scores);
+    }
+
+    return 0;
+}
+#endif
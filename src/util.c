@@ -44,6 +44,10 @@
 #include "util.h"
 #include "sha1.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* Glob-style pattern matching. */
 int stringmatchlen(const char *pattern, int patternLen,
         const char *string, int stringLen, int nocase)
@@ -171,6 +175,126 @@ int stringmatch(const char *pattern, const char *string, int nocase) {
     return stringmatchlen(pattern,strlen(pattern),string,strlen(string),nocase);
 }
 
+/* -----------------------------------------------------------------------------
+ * memfind() kernels.
+ *
+ * The vectorized kernels test 16 (SSE2) or 32 (AVX2) positions at once
+ * comparing the first and the last byte of the needle, and only call
+ * memcmp() where both of them match. The AVX2 kernel is compiled with the
+ * GCC target attribute and selected at runtime, like the ones of bitops.c.
+ * Every kernel starts the search at offset 'i' of 's', and leaves the
+ * positions its vectors can't cover to memfindScalar().
+ * -------------------------------------------------------------------------- */
+
+static unsigned char *memfindScalar(unsigned char *s, size_t slen,
+                                    unsigned char *needle, size_t len,
+                                    size_t i)
+{
+    unsigned char *c;
+    size_t last = slen-len;
+
+    while (i <= last) {
+        if ((c = memchr(s+i,needle[0],last-i+1)) == NULL) return NULL;
+        if (memcmp(c,needle,len) == 0) return c;
+        i = (c-s)+1;
+    }
+    return NULL;
+}
+
+#if defined(__SSE2__)
+static unsigned char *memfindSse2(unsigned char *s, size_t slen,
+                                  unsigned char *needle, size_t len)
+{
+    __m128i first = _mm_set1_epi8((char)needle[0]);
+    __m128i final = _mm_set1_epi8((char)needle[len-1]);
+    size_t i = 0, last = slen-len;
+
+    for (; i+16 <= last+1; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s+i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s+i+len-1));
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a,first),_mm_cmpeq_epi8(b,final)));
+
+        while (mask) {
+            unsigned char *c = s+i+__builtin_ctz(mask);
+            if (memcmp(c,needle,len) == 0) return c;
+            mask &= mask-1;
+        }
+    }
+    return memfindScalar(s,slen,needle,len,i);
+}
+#endif
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 8)
+#define HAVE_MEMFIND_AVX2 1
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static unsigned char *memfindAvx2(unsigned char *s, size_t slen,
+                                  unsigned char *needle, size_t len)
+{
+    __m256i first = _mm256_set1_epi8((char)needle[0]);
+    __m256i final = _mm256_set1_epi8((char)needle[len-1]);
+    size_t i = 0, last = slen-len;
+
+    for (; i+32 <= last+1; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(s+i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s+i+len-1));
+        unsigned int mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a,first),
+                             _mm256_cmpeq_epi8(b,final)));
+
+        while (mask) {
+            unsigned char *c = s+i+__builtin_ctz(mask);
+            if (memcmp(c,needle,len) == 0) return c;
+            mask &= mask-1;
+        }
+    }
+    return memfindScalar(s,slen,needle,len,i);
+}
+#endif
+
+static unsigned char *memfindResolve(unsigned char *s, size_t slen,
+                                     unsigned char *needle, size_t len);
+
+static unsigned char *memfindBaseline(unsigned char *s, size_t slen,
+                                      unsigned char *needle, size_t len)
+{
+    return memfindScalar(s,slen,needle,len,0);
+}
+
+/* The kernel in use. It initially points to a function selecting the best
+ * kernel for this CPU, and then calling it. */
+static unsigned char *(*memfindKernel)(unsigned char *s, size_t slen,
+    unsigned char *needle, size_t len) = memfindResolve;
+
+static void memfindSelectKernel(void) {
+    memfindKernel = memfindBaseline;
+#if defined(__SSE2__)
+    memfindKernel = memfindSse2;
+#endif
+#ifdef HAVE_MEMFIND_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) memfindKernel = memfindAvx2;
+#endif
+}
+
+static unsigned char *memfindResolve(unsigned char *s, size_t slen,
+                                     unsigned char *needle, size_t len)
+{
+    memfindSelectKernel();
+    return memfindKernel(s,slen,needle,len);
+}
+
+/* Return a pointer to the first occurrence of the 'len' bytes at 'needle'
+ * inside the 'slen' bytes at 's', or NULL if there is none. */
+unsigned char *memfind(unsigned char *s, size_t slen, unsigned char *needle,
+                       size_t len)
+{
+    if (len == 0 || len > slen) return NULL;
+    return memfindKernel(s,slen,needle,len);
+}
+
 /* Fuzz stringmatchlen() trying to crash it with bad input. */
 int stringmatchlen_fuzz_test(void) {
     char str[32];
@@ -844,6 +968,60 @@ static void test_ll2string(void) {
 }
 
 #define UNUSED(x) (void)(x)
+/* Check a memfind() kernel against a naive search. Haystacks are made of
+ * listpack-like entries, an encoding byte followed by the string and its
+ * length, and needles are taken from random offsets: many of them cross
+ * the boundary between two entries, and the first and last bytes of the
+ * needle often appear in other positions too. */
+static void test_memfind_kernel(unsigned char *(*kernel)(unsigned char *s,
+    size_t slen, unsigned char *needle, size_t len))
+{
+    unsigned char s[300], needle[64];
+
+    for (int iter = 0; iter < 20000; iter++) {
+        size_t slen = 0;
+        while (slen < sizeof(s)-10) {
+            size_t elen = rand() % 8;
+            s[slen++] = 0x80 | elen;
+            for (size_t j = 0; j < elen; j++) s[slen++] = 'a' + rand() % 3;
+            s[slen++] = elen+1;
+        }
+        slen -= rand() % 100;
+
+        size_t len = 1 + rand() % sizeof(needle);
+        if (len > slen) len = slen;
+        memcpy(needle,s+rand() % (slen-len+1),len);
+        if (rand() % 4 == 0) needle[rand() % len] ^= 0x80;
+
+        unsigned char *expected = NULL;
+        for (size_t j = 0; j+len <= slen; j++) {
+            if (memcmp(s+j,needle,len) == 0) {
+                expected = s+j;
+                break;
+            }
+        }
+        assert(kernel(s,slen,needle,len) == expected);
+    }
+}
+
+static void test_memfind(void) {
+    unsigned char s[] = {0x81,'a',0x02,0x81,'b',0x02};
+    unsigned char needle[] = {0x02,0x81};
+
+    assert(memfind(s,6,needle,2) == s+2);
+    assert(memfind(s,6,needle+1,1) == s);
+    assert(memfind(s,2,needle,2) == NULL);
+    assert(memfind(s,6,needle,0) == NULL);
+
+    test_memfind_kernel(memfindBaseline);
+#if defined(__SSE2__)
+    test_memfind_kernel(memfindSse2);
+#endif
+#ifdef HAVE_MEMFIND_AVX2
+    if (__builtin_cpu_supports("avx2")) test_memfind_kernel(memfindAvx2);
+#endif
+}
+
 int utilTest(int argc, char **argv) {
     UNUSED(argc);
     UNUSED(argv);
@@ -851,6 +1029,7 @@ int utilTest(int argc, char **argv) {
     test_string2ll();
     test_string2l();
     test_ll2string();
+    test_memfind();
     return 0;
 }
 #endif
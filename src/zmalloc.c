@@ -28,6 +28,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -42,6 +43,7 @@ void zlibc_free(void *ptr) {
 
 #include <string.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include "config.h"
 #include "zmalloc.h"
 #include "atomicvar.h"
@@ -207,6 +209,62 @@ void zfree(void *ptr) {
 #endif
 }
 
+/* Mappings are rounded to the size of huge pages, so that a mapping backed
+ * by explicit huge pages can be released without knowing how it was
+ * obtained. The padding is never touched so it only costs address space. */
+#define ZMMAP_ALIGN (2*1024*1024)
+#define zmmap_len(size) (((size)+ZMMAP_ALIGN-1) & ~((size_t)ZMMAP_ALIGN-1))
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Allocate 'size' bytes of zeroed memory with mmap(). The kernel provides
+ * the zeroed pages only when they are first touched, so even a huge
+ * allocation returns immediately, and the cost of page faults is spread
+ * over the accesses. 'flags' can be ZMMAP_THP to advise the use of
+ * transparent huge pages, or ZMMAP_HUGETLB to use explicit huge pages, in
+ * which case normal pages are used if no huge page is available. Where
+ * such flags are not supported they are ignored.
+ *
+ * With ZMMAP_POPULATE the pages are faulted in before returning, writing
+ * a byte in each of them, so that the caller pays for the page faults and
+ * the zeroing instead of the first thread accessing the memory. This is
+ * done after madvise() so that transparent huge pages can be used.
+ *
+ * The memory must be released with zmunmap() passing the same size. */
+void *zmmap(size_t size, int flags) {
+    size_t len = zmmap_len(size);
+    void *ptr = MAP_FAILED;
+#if !defined(MAP_HUGETLB) && !defined(MADV_HUGEPAGE)
+    (void)flags;
+#endif
+
+#ifdef MAP_HUGETLB
+    if (flags & ZMMAP_HUGETLB)
+        ptr = mmap(NULL,len,PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+#endif
+    if (ptr == MAP_FAILED)
+        ptr = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (ptr == MAP_FAILED) zmalloc_oom_handler(size);
+#ifdef MADV_HUGEPAGE
+    if (flags & ZMMAP_THP) madvise(ptr,len,MADV_HUGEPAGE);
+#endif
+    if (flags & ZMMAP_POPULATE) {
+        size_t j;
+        for (j = 0; j < size; j += 4096) ((volatile char*)ptr)[j] = 0;
+    }
+    atomicIncr(used_memory,size);
+    return ptr;
+}
+
+void zmunmap(void *ptr, size_t size) {
+    if (ptr == NULL) return;
+    munmap(ptr,zmmap_len(size));
+    atomicDecr(used_memory,size);
+}
+
 char *zstrdup(const char *s) {
     size_t l = strlen(s)+1;
     char *p = zmalloc(l);
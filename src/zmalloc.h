@@ -77,11 +77,18 @@
 #define HAVE_DEFRAG
 #endif
 
+/* zmmap() flags. */
+#define ZMMAP_THP     (1<<0) /* Advise transparent huge pages. */
+#define ZMMAP_HUGETLB (1<<1) /* Use explicit huge pages if available. */
+#define ZMMAP_POPULATE (1<<2) /* Fault in all the pages before returning. */
+
 void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
 void zfree(void *ptr);
 char *zstrdup(const char *s);
+void *zmmap(size_t size, int flags);
+void zmunmap(void *ptr, size_t size);
 size_t zmalloc_used_memory(void);
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t));
 size_t zmalloc_get_rss(void);
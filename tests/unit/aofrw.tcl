@@ -106,9 +106,10 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
     }
 
     foreach d {string int} {
-        foreach e {intset hashtable} {
+        foreach e {intset roaring hashtable} {
             test "AOF rewrite of set with $e encoding, $d data" {
                 r flushall
+                r config set set-roaring-encoding [expr {$e eq {roaring} ? "yes" : "no"}]
                 if {$e eq {intset}} {set len 10} else {set len 1000}
                 for {set j 0} {$j < $len} {incr j} {
                     if {$d eq {string}} {
@@ -132,12 +133,32 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
             }
         }
     }
+    r config set set-roaring-encoding no
+
+    foreach d {sparse dense} {
+        test "AOF rewrite of sparse bitmap, $d data" {
+            r flushall
+            if {$d eq {sparse}} {set len 100} else {set len 20000}
+            for {set j 0} {$j < $len} {incr j} {
+                r setbit key [randomInt 4000000] 1
+            }
+            assert_equal [r object encoding key] roaring
+            set d1 [r debug digest]
+            r bgrewriteaof
+            waitForBgrewriteaof r
+            r debug loadaof
+            set d2 [r debug digest]
+            if {$d1 ne $d2} {
+                error "assertion:$d1 is not equal to $d2"
+            }
+        }
+    }
 
     foreach d {string int} {
-        foreach e {ziplist hashtable} {
+        foreach e {listpack hashtable} {
             test "AOF rewrite of hash with $e encoding, $d data" {
                 r flushall
-                if {$e eq {ziplist}} {set len 10} else {set len 1000}
+                if {$e eq {listpack}} {set len 10} else {set len 1000}
                 for {set j 0} {$j < $len} {incr j} {
                     if {$d eq {string}} {
                         set data [randstring 0 16 alpha]
@@ -160,10 +181,17 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
     }
 
     foreach d {string int} {
-        foreach e {ziplist skiplist} {
+        foreach e {listpack packedtree skiplist btree} {
             test "AOF rewrite of zset with $e encoding, $d data" {
                 r flushall
-                if {$e eq {ziplist}} {set len 10} else {set len 1000}
+                r config set zset-btree-encoding [expr {$e eq {btree} ? "yes" : "no"}]
+                if {$e eq {listpack}} {
+                    set len 10
+                } elseif {$e eq {packedtree}} {
+                    set len 1000
+                } else {
+                    set len 10000
+                }
                 for {set j 0} {$j < $len} {incr j} {
                     if {$d eq {string}} {
                         set data [randstring 0 16 alpha]
@@ -192,6 +192,215 @@ start_server {tags {"bitops"}} {
         }
     }
 
+    test {BITCOUNT and BITOP on strings spanning many blocks} {
+        r flushall
+        set vec {}
+        for {set j 0} {$j < 3} {incr j} {
+            set str [randstring 9000 10000]
+            lappend vec $str
+            r set vector_$j $str
+            assert_equal [count_bits $str] [r bitcount vector_$j]
+        }
+        foreach op {and or xor} {
+            r bitop $op target vector_0 vector_1 vector_2
+            assert_equal [simulate_bit_op $op {*}$vec] [r get target]
+        }
+        r bitop not target vector_0
+        assert_equal [simulate_bit_op not [lindex $vec 0]] [r get target]
+    }
+
+    test {BITOP computed incrementally matches the synchronous result} {
+        r flushall
+        r config set bitop-incremental-min-bytes 1
+        set vec {}
+        for {set j 0} {$j < 3} {incr j} {
+            set str [randstring 9000 200000]
+            lappend vec $str
+            r set vector_$j $str
+        }
+        foreach op {and or xor} {
+            r bitop $op target vector_0 vector_1 vector_2
+            assert_equal [simulate_bit_op $op {*}$vec] [r get target]
+        }
+        r bitop not target vector_0
+        assert_equal [simulate_bit_op not [lindex $vec 0]] [r get target]
+        r config set bitop-incremental-min-bytes 8mb
+    } {OK}
+
+    test {Incremental BITOP is propagated as BITOP if the sources are unchanged} {
+        r flushall
+        r config set bitop-incremental-min-bytes 1
+        r set a foo
+        r set b bar
+        # Keep the replication PINGs out of the stream we check.
+        r config set repl-ping-replica-period 3600
+        set repl [attach_to_replication_stream]
+        r bitop or target a b
+        assert_replication_stream $repl {
+            {select *}
+            {bitop or target a b}
+        }
+        close_replication_stream $repl
+        r config set repl-ping-replica-period 10
+        r config set bitop-incremental-min-bytes 8mb
+    } {OK}
+
+    test {Other clients are served while a large BITOP is computed} {
+        r flushall
+        r config set bitop-incremental-min-bytes 1mb
+        r setrange a [expr {64*1024*1024-1}] "\x01"
+        set rd [redis_deferring_client]
+        $rd bitop or target a a a a a a a a a a a a a a a a
+        r ping
+        assert_equal 1 [s blocked_clients]
+        assert_equal 0 [r exists target]
+        assert_equal [expr {64*1024*1024}] [$rd read]
+        assert_equal 0 [s blocked_clients]
+        assert_equal 1 [r bitcount target]
+        $rd close
+        r config set bitop-incremental-min-bytes 8mb
+    } {OK}
+
+    test {Large BITOP uses the source values it was called with} {
+        r flushall
+        r config set bitop-incremental-min-bytes 1mb
+        # Attach before creating the large key, so that the replica does not
+        # have to transfer it with the initial SYNC.
+        r config set repl-ping-replica-period 3600
+        set repl [attach_to_replication_stream]
+        r setrange a [expr {64*1024*1024-1}] "\x01"
+        set rd [redis_deferring_client]
+        $rd bitop or target a a a a a a a a a a a a a a a a
+        r ping
+        assert_equal 1 [s blocked_clients]
+        r set a foo
+        assert_equal [expr {64*1024*1024}] [$rd read]
+        assert_equal [expr {64*1024*1024}] [r strlen target]
+        assert_equal 1 [r getbit target [expr {64*1024*1024*8-1}]]
+        assert_equal foo [r get a]
+        # The sources changed, so the result is replicated by value.
+        assert_replication_stream $repl {
+            {select *}
+            {setrange a *}
+            {set a foo}
+            {set target *}
+        }
+        close_replication_stream $repl
+        $rd close
+        r config set repl-ping-replica-period 10
+        r config set bitop-incremental-min-bytes 8mb
+    } {OK}
+
+    test {CLIENT UNBLOCK cancels a large BITOP} {
+        r flushall
+        r config set bitop-incremental-min-bytes 1mb
+        r setrange a [expr {64*1024*1024-1}] "\x01"
+        set rd [redis_deferring_client]
+        $rd client id
+        set id [$rd read]
+        $rd bitop or target a a a a a a a a a a a a a a a a
+        r ping
+        assert_equal 1 [r client unblock $id]
+        catch {$rd read} e
+        assert_match {*UNBLOCKED*} $e
+        assert_equal 0 [s blocked_clients]
+        assert_equal 0 [r exists target]
+        $rd close
+        r config set bitop-incremental-min-bytes 8mb
+    } {OK}
+
+    test {SETBIT at a large offset creates a sparse bitmap} {
+        r del mykey
+        r setbit mykey 4294967295 1
+        assert_encoding roaring mykey
+        assert_equal [expr {512*1024*1024}] [r strlen mykey]
+        assert {[r memory usage mykey] < 1000}
+        assert_equal 1 [r getbit mykey 4294967295]
+        assert_equal 1 [r bitcount mykey]
+        assert_equal 4294967295 [r bitpos mykey 1]
+        assert_equal 0 [r bitpos mykey 0]
+        assert_equal "\x00\x01" [r getrange mykey -2 -1]
+        r setbit mykey 4294967295 0
+    } {1}
+
+    test {Sparse bitmaps reply like strings: fuzzing} {
+        r del sparse dense
+        set ops {}
+        for {set j 0} {$j < 500} {incr j} {
+            lappend ops [randomInt 300000] [randomInt 2]
+        }
+        r config set bitmap-sparse-min-bytes 1
+        foreach {off bit} $ops {r setbit sparse $off $bit}
+        r config set bitmap-sparse-min-bytes 0
+        foreach {off bit} $ops {r setbit dense $off $bit}
+        r config set bitmap-sparse-min-bytes 64kb
+        assert_encoding roaring sparse
+        assert_encoding raw dense
+        assert_equal [r get dense] [r get sparse]
+        assert_equal [r strlen dense] [r strlen sparse]
+        assert_equal [r bitcount dense] [r bitcount sparse]
+        for {set j 0} {$j < 100} {incr j} {
+            set start [expr {[randomInt 80000]-40000}]
+            set end [expr {[randomInt 80000]-40000}]
+            set off [randomInt 320000]
+            assert_equal [r bitcount dense $start $end] [r bitcount sparse $start $end]
+            assert_equal [r bitpos dense 1 $start $end] [r bitpos sparse 1 $start $end]
+            assert_equal [r bitpos dense 0 $start $end] [r bitpos sparse 0 $start $end]
+            assert_equal [r bitpos dense 0 $start] [r bitpos sparse 0 $start]
+            assert_equal [r getrange dense $start $end] [r getrange sparse $start $end]
+            assert_equal [r getbit dense $off] [r getbit sparse $off]
+            assert_equal [r bitfield dense get i13 $off] [r bitfield sparse get i13 $off]
+        }
+        assert_encoding roaring sparse
+    }
+
+    test {BITOP on sparse bitmaps} {
+        r flushall
+        for {set j 0} {$j < 3} {incr j} {
+            set ops {}
+            for {set i 0} {$i < 200} {incr i} {
+                lappend ops [randomInt [expr {600000+$j*100000}]]
+            }
+            r config set bitmap-sparse-min-bytes 1
+            foreach off $ops {r setbit s$j $off 1}
+            r config set bitmap-sparse-min-bytes 0
+            foreach off $ops {r setbit d$j $off 1}
+        }
+        r config set bitmap-sparse-min-bytes 64kb
+        foreach op {and or xor} {
+            assert_equal [r bitop $op dres d0 d1 d2] [r bitop $op sres s0 s1 s2]
+            assert_encoding roaring sres
+            assert_equal [r get dres] [r get sres]
+        }
+        r bitop or dres d0 d1
+        r bitop or mres s0 d1
+        assert_equal [r get dres] [r get mres]
+        r bitop not dres d0
+        r bitop not sres s0
+        assert_equal [r get dres] [r get sres]
+        r bitop and sres s0 nokey
+        list [r bitcount sres] [expr {[r strlen sres] == [r strlen s0]}]
+    } {0 1}
+
+    test {Sparse bitmaps are kept by DEBUG RELOAD} {
+        r flushall
+        r setbit mykey 1000000 1
+        r setbit mykey 5 1
+        set digest [r debug digest]
+        r debug reload
+        assert_encoding roaring mykey
+        assert_equal $digest [r debug digest]
+        r bitcount mykey
+    } {2}
+
+    test {Writing a sparse bitmap as a string converts it to raw} {
+        r del mykey
+        r setbit mykey 1000000 1
+        r append mykey foo
+        assert_encoding raw mykey
+        list [r strlen mykey] [r getbit mykey 1000000] [r getrange mykey -3 -1]
+    } {125004 1 foo}
+
     test {BITOP with integer encoded source objects} {
         r set a 1
         r set b 2
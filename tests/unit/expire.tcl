@@ -220,3 +220,167 @@ start_server {tags {"expire"}} {
         assert {$ttl <= 98 && $ttl > 90}
     }
 }
+
+start_server {tags {"expire"} overrides {expire-in-keyspace yes}} {
+    test {Expire in keyspace - EXPIRE, TTL and PERSIST} {
+        r flushall
+        r set foo bar
+        r set persistent bar
+        assert_equal -1 [r ttl foo]
+        assert_equal 1 [r expire foo 100]
+        set ttl [r ttl foo]
+        assert {$ttl >= 90 && $ttl <= 100}
+        assert_equal 1 [r persist foo]
+        assert_equal 0 [r persist foo]
+        assert_equal -1 [r ttl foo]
+        r expire foo 100
+        r set foo baz
+        assert_equal -1 [r ttl foo]
+        r get foo
+    } {baz}
+
+    test {Expire in keyspace - keys expire on access and actively} {
+        r flushall
+        r psetex lazy 50 v
+        for {set j 0} {$j < 100} {incr j} {
+            r psetex key:$j 50 v
+        }
+        r set stable v
+        after 100
+        assert_equal {} [r get lazy]
+        wait_for_condition 50 100 {
+            [r dbsize] == 1
+        } else {
+            fail "Keys with expire in keyspace not actively expired"
+        }
+        r get stable
+    } {v}
+
+    test {Expire in keyspace - INFO keyspace reports volatile keys} {
+        r flushall
+        for {set j 0} {$j < 50} {incr j} {
+            r set key:$j v
+            if {$j % 2} {r expire key:$j 1000}
+        }
+        r del key:1 key:2
+        r unlink key:3
+        assert_match {*keys=47,expires=23,*} [r info keyspace]
+    }
+
+    test {Expire in keyspace - DEBUG RELOAD preserves expires} {
+        r flushall
+        r set a 1 ex 1000
+        r set b 2
+        r debug reload
+        set ttl [r ttl a]
+        assert {$ttl >= 900 && $ttl <= 1000}
+        assert_equal -1 [r ttl b]
+        assert_match {*keys=2,expires=1,*} [r info keyspace]
+    }
+
+    test {Expire in keyspace - SWAPDB moves volatile keys} {
+        r flushall
+        r select 10
+        r set a 1 ex 1000
+        r swapdb 9 10
+        assert_equal 0 [r dbsize]
+        r select 9
+        set ttl [r ttl a]
+        assert {$ttl >= 900 && $ttl <= 1000}
+        r persist a
+        assert_match {*db9:keys=1,expires=0,*} [r info keyspace]
+    }
+
+    test {Expire in keyspace - RANDOMKEY skips expired keys} {
+        r flushall
+        r psetex a 1 v
+        r set b v
+        after 10
+        set res {}
+        for {set j 0} {$j < 10} {incr j} {
+            lappend res [r randomkey]
+        }
+        lsort -unique $res
+    } {b}
+
+    test {Expire in keyspace - volatile eviction only evicts volatile keys} {
+        r flushall
+        r config set maxmemory 0
+        for {set j 0} {$j < 200} {incr j} {
+            r set persistent:$j [string repeat x 1000]
+            r set volatile:$j [string repeat x 1000] ex 1000
+        }
+        foreach policy {volatile-lru volatile-ttl volatile-random} {
+            set used [s used_memory]
+            r config set maxmemory-policy $policy
+            r config set maxmemory [expr {$used-50000}]
+            r set trigger v
+            r config set maxmemory 0
+            assert_equal 200 [llength [r keys persistent:*]]
+            assert {[llength [r keys volatile:*]] < 200}
+            r del trigger
+        }
+        r config set maxmemory-policy noeviction
+    } {OK}
+}
+
+foreach layout {no yes} {
+    start_server [list tags {"expire"} overrides [list active-expire-index yes expire-in-keyspace $layout]] {
+        test "Expire index - expired keys are actively deleted (expire-in-keyspace $layout)" {
+            r flushall
+            r debug set-active-expire 0
+            # Keys whose TTL was extended or removed should survive.
+            r psetex volatile:0 100000 v
+            r psetex volatile:1 100000 v
+            r persist volatile:1
+            for {set j 2} {$j < 1000} {incr j} {
+                r psetex volatile:$j 100 v
+            }
+            for {set j 0} {$j < 1000} {incr j} {
+                r set persistent:$j v
+            }
+            after 200
+            r debug set-active-expire 1
+            wait_for_condition 50 100 {
+                [r dbsize] == 1002
+            } else {
+                fail "Expired keys were not actively deleted"
+            }
+            assert_equal 1000 [llength [r keys persistent:*]]
+            list [r exists volatile:0] [r exists volatile:1] [r exists volatile:2]
+        } {1 1 0}
+
+        test "Expire index - follows TTL updates and renames (expire-in-keyspace $layout)" {
+            r flushall
+            r set late v px 100000
+            r set soon v px 200
+            r set renamed v px 100000
+            r rename renamed soon2
+            r pexpire soon2 200
+            after 500
+            wait_for_condition 50 100 {
+                [r dbsize] == 1
+            } else {
+                fail "Expired keys were not actively deleted"
+            }
+            r keys *
+        } {late}
+
+        test "Expire index - FLUSHALL ASYNC and SWAPDB (expire-in-keyspace $layout)" {
+            r flushall async
+            r select 10
+            r set a v px 200
+            r set b v px 100000
+            r swapdb 9 10
+            r select 9
+            after 500
+            wait_for_condition 50 100 {
+                [r dbsize] == 1
+            } else {
+                fail "Expired keys were not actively deleted"
+            }
+            r select 9
+            r keys *
+        } {b}
+    }
+}
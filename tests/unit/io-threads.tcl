@@ -0,0 +1,107 @@
+start_server {tags {"io-threads"} overrides {io-threads 4}} {
+    proc format_command {args} {
+        set cmd "*[llength $args]\r\n"
+        foreach a $args {
+            append cmd "$[string length $a]\r\n$a\r\n"
+        }
+        set _ $cmd
+    }
+
+    test {Threaded I/O: pipelined commands from many clients} {
+        r del counter
+        set clients {}
+        for {set j 0} {$j < 20} {incr j} {
+            set rd [redis_deferring_client]
+            for {set i 0} {$i < 100} {incr i} {
+                $rd write [format_command incr counter]
+            }
+            lappend clients $rd
+        }
+        foreach rd $clients {
+            $rd flush
+        }
+        foreach rd $clients {
+            set last 0
+            for {set i 0} {$i < 100} {incr i} {
+                set val [$rd read]
+                assert {$val > $last}
+                set last $val
+            }
+            $rd close
+        }
+        r get counter
+    } {2000}
+
+    test {Threaded I/O: inline and multibulk requests are parsed} {
+        reconnect
+        r write "SET foo bar\r\n"
+        r write [format_command get foo]
+        r write "PING\r\n"
+        r flush
+        list [r read] [r read] [r read]
+    } {OK bar PONG}
+
+    test {Threaded I/O: big arguments split across reads} {
+        reconnect
+        set big [string repeat x 100000]
+        r write [format_command set bigkey $big]
+        r flush
+        assert_equal OK [r read]
+        string length [r get bigkey]
+    } {100000}
+
+    test {Threaded I/O: protocol errors are reported} {
+        reconnect
+        r write "*3\r\n\$3\r\nSET\r\n\$1\r\nx\r\nfooz\r\n"
+        r flush
+        assert_error "*expected '$', got 'f'*" {r read}
+    }
+
+    test {Threaded I/O: CLIENT PAUSE is honored} {
+        reconnect
+        set start [clock milliseconds]
+        r client pause 200
+        set rd [redis_deferring_client]
+        $rd ping
+        assert_equal PONG [$rd read]
+        set elapsed [expr {[clock milliseconds]-$start}]
+        $rd close
+        assert {$elapsed >= 150}
+    }
+
+    test {Threaded I/O: big replies to many clients} {
+        r set bigval [string repeat y 200000]
+        set clients {}
+        for {set j 0} {$j < 20} {incr j} {
+            set rd [redis_deferring_client]
+            for {set i 0} {$i < 5} {incr i} {
+                $rd write [format_command get bigval]
+            }
+            $rd flush
+            lappend clients $rd
+        }
+        set total 0
+        foreach rd $clients {
+            for {set i 0} {$i < 5} {incr i} {
+                incr total [string length [$rd read]]
+            }
+            $rd close
+        }
+        set total
+    } {20000000}
+
+    test {Threaded I/O: connection is closed after QUIT reply} {
+        set clients {}
+        for {set j 0} {$j < 20} {incr j} {
+            set rd [redis_deferring_client]
+            $rd write [format_command quit]
+            $rd flush
+            lappend clients $rd
+        }
+        foreach rd $clients {
+            assert_equal OK [$rd read]
+            assert_error * {$rd read}
+            $rd close
+        }
+    }
+}
@@ -272,4 +272,14 @@ start_server {tags {"keyspace"}} {
         r keys *
         r keys *
     } {dlskeriewrioeuwqoirueioqwrueoqwrueqw}
+
+    test {DEBUG SDSLEN on keys embedded in the keyspace} {
+        r flushdb
+        r set foo bar
+        r set [string repeat k 100] [string repeat v 100]
+        assert_match {key_sds_len:3,*val_sds_len:3,*} [r debug sdslen foo]
+        assert_match {key_sds_len:100,*val_sds_len:100,*} \
+            [r debug sdslen [string repeat k 100]]
+        r ping
+    } {PONG}
 }
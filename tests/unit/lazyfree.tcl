@@ -36,4 +36,41 @@ start_server {tags {"lazyfree"}} {
             fail "Memory is not reclaimed by FLUSHDB ASYNC"
         }
     }
+
+    test "FLUSHALL ASYNC with big values pending in the output buffer" {
+        r flushall
+        for {set j 0} {$j < 10} {incr j} {
+            r set big:$j [string repeat $j 1000000]
+        }
+        # The client doesn't read: most of the values stay referenced by
+        # its output buffer when the keyspace is released.
+        r config resetstat
+        set rd [redis_deferring_client]
+        for {set i 0} {$i < 4} {incr i} {
+            for {set j 0} {$j < 10} {incr j} {
+                $rd get big:$j
+            }
+        }
+        wait_for_condition 50 100 {
+            [string match {*calls=40,*} [r info commandstats]]
+        } else {
+            fail "GET commands not processed"
+        }
+        assert_match {*omem=[1-9]*} [r client list]
+        r flushall async
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0
+        } else {
+            fail "FLUSHALL ASYNC didn't release the keyspace"
+        }
+        for {set j 0} {$j < 10} {incr j} {
+            r set big:$j [string repeat x 1000000]
+        }
+        for {set i 0} {$i < 4} {incr i} {
+            for {set j 0} {$j < 10} {incr j} {
+                assert_equal [string repeat $j 1000000] [$rd read]
+            }
+        }
+        $rd close
+    }
 }
@@ -246,3 +246,42 @@ start_server {tags {"other"}} {
         r save
     } {OK}
 }
+
+start_server {tags {"other"} overrides {rehash-bg-alloc-min-slots 1}} {
+    test {Table of a growing keyspace is allocated in background} {
+        r flushall
+        # 6500 keys fill 3/4 of the 8192 slots table: the next table is
+        # prepared in background and the rehashing starts once ready.
+        r debug populate 6500
+        wait_for_condition 50 100 {
+            [s rehash_bg_allocs] == 1 &&
+            [s rehashing_dicts] == 0 &&
+            [s rehash_bg_allocs_pending] == 0
+        } else {
+            fail "Table not allocated in background"
+        }
+        assert_match {*table size: 16384*} [r debug htstats 9]
+        r set newkey v
+        list [r dbsize] [r get key:0] [r get key:6499]
+    } {6501 value:0 value:6499}
+}
+
+start_server {tags {"other"}} {
+    test {Huge tables are allocated with mmap and can use huge pages} {
+        r flushall
+        assert_error {*Invalid argument*} {r config set hashtable-huge-pages yes}
+        r config set hashtable-huge-pages thp
+        assert_equal {hashtable-huge-pages thp} [r config get hashtable-huge-pages]
+        # 300000 keys need a table of 512k slots, above the mmap threshold.
+        r debug populate 300000
+        assert_match {*table size: 524288*} [r debug htstats 9]
+        for {set j 0} {$j < 300000} {incr j 3} {
+            r del key:$j
+        }
+        r config set hashtable-huge-pages no
+        r flushall
+        r debug populate 300000
+        r set newkey v
+        list [r dbsize] [r get key:0] [r get key:299999] [r get newkey]
+    } {300001 value:0 value:299999 v}
+}
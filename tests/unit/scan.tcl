@@ -53,11 +53,13 @@ start_server {tags {"scan"}} {
         assert_equal 100 [llength $keys]
     }
 
-    foreach enc {intset hashtable} {
+    foreach enc {intset roaring hashtable} {
         test "SSCAN with encoding $enc" {
             # Create the Set
             r del set
-            if {$enc eq {intset}} {
+            r config set set-max-intset-entries [expr {$enc eq {roaring} ? 16 : 512}]
+            r config set set-roaring-encoding [expr {$enc eq {roaring} ? "yes" : "no"}]
+            if {$enc ne {hashtable}} {
                 set prefix ""
             } else {
                 set prefix "ele:"
@@ -87,11 +89,37 @@ start_server {tags {"scan"}} {
         }
     }
 
-    foreach enc {ziplist hashtable} {
+    test "SSCAN of a roaring set converted to a hash table while scanning" {
+        r del set
+        r config set set-max-intset-entries 16
+        r config set set-roaring-encoding yes
+        set elements {}
+        for {set j -500} {$j < 500} {incr j} {
+            lappend elements $j
+        }
+        r sadd set {*}$elements
+        assert_encoding roaring set
+
+        lassign [r sscan set 0 COUNT 500] cur keys
+        assert {$cur != 0 && [string index $cur 0] ne {-}}
+        r sadd set foo
+        assert_encoding hashtable set
+        while {$cur != 0} {
+            lassign [r sscan set $cur COUNT 100] cur k
+            lappend keys {*}$k
+        }
+
+        set keys [lsort -unique $keys]
+        assert_equal 1001 [llength $keys]
+    }
+    r config set set-max-intset-entries 512
+    r config set set-roaring-encoding no
+
+    foreach enc {listpack hashtable} {
         test "HSCAN with encoding $enc" {
             # Create the Hash
             r del hash
-            if {$enc eq {ziplist}} {
+            if {$enc eq {listpack}} {
                 set count 30
             } else {
                 set count 1000
@@ -127,14 +155,17 @@ start_server {tags {"scan"}} {
         }
     }
 
-    foreach enc {ziplist skiplist} {
+    foreach enc {listpack packedtree skiplist btree} {
         test "ZSCAN with encoding $enc" {
             # Create the Sorted Set
             r del zset
-            if {$enc eq {ziplist}} {
+            r config set zset-btree-encoding [expr {$enc eq {btree} ? "yes" : "no"}]
+            if {$enc eq {listpack}} {
                 set count 30
-            } else {
+            } elseif {$enc eq {packedtree}} {
                 set count 1000
+            } else {
+                set count 10000
             }
             set elements {}
             for {set j 0} {$j < $count} {incr j} {
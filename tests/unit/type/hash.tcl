@@ -14,8 +14,8 @@ start_server {tags {"hash"}} {
         list [r hlen smallhash]
     } {8}
 
-    test {Is the small hash encoded with a ziplist?} {
-        assert_encoding ziplist smallhash
+    test {Is the small hash encoded with a listpack?} {
+        assert_encoding listpack smallhash
     }
 
     test {HSET/HLEN - Big hash creation} {
@@ -66,6 +66,18 @@ start_server {tags {"hash"}} {
         set _ $rv
     } {{} {}}
 
+    test {HGET of a small hash finds only whole fields} {
+        # The listpack encoding of the field "B", 0x81 0x42, appears in the
+        # middle of a field, across the end of a field and the integer 66
+        # that follows it, and as a value.
+        r del h
+        r hset h "A\x81B" x "C\x81" 66 k B
+        assert_encoding listpack h
+        set rv [list [r hget h B] [r hexists h B]]
+        r hset h B found
+        lappend rv [r hget h B] [r hget h "C\x81"] [r hget h "A\x81B"]
+    } {{} 0 found 66 x}
+
     test {HSET in update and insert mode} {
         set rv {}
         set k [lindex [array names smallhash *] 0]
@@ -252,7 +264,7 @@ start_server {tags {"hash"}} {
         lappend rv [r hexists bighash nokey]
     } {1 0 1 0}
 
-    test {Is a ziplist encoded Hash promoted on big payload?} {
+    test {Is a listpack encoded Hash promoted on big payload?} {
         r hset smallhash foo [string repeat a 1024]
         r debug object smallhash
     } {*hashtable*}
@@ -438,7 +450,7 @@ start_server {tags {"hash"}} {
         }
     }
 
-    test {Hash ziplist regression test for large keys} {
+    test {Hash listpack regression test for large keys} {
         r hset hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk a
         r hset hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk b
         r hget hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk
@@ -505,7 +517,7 @@ start_server {tags {"hash"}} {
         }
     }
 
-    test {Stress test the hash ziplist -> hashtable encoding conversion} {
+    test {Stress test the hash listpack -> hashtable encoding conversion} {
         r config set hash-max-ziplist-entries 32
         for {set j 0} {$j < 100} {incr j} {
             r del myhash
@@ -516,6 +528,97 @@ start_server {tags {"hash"}} {
         }
     }
 
+    test {Hash intmap encoding is used for integer values} {
+        r config set hash-max-ziplist-entries 32
+        r config set hash-intmap-encoding yes
+        r del myhash
+        r hset myhash b 2 a 1 c -9223372036854775808
+        r hincrby myhash d 100000
+        assert_encoding intmap myhash
+        assert_equal {1 2 -9223372036854775808 100000} \
+            [r hmget myhash a b c d]
+        assert_equal {a 1 b 2 c -9223372036854775808 d 100000} \
+            [lsort -stride 2 [r hgetall myhash]]
+        assert_equal {20} [r hstrlen myhash c]
+        assert_equal {1 0} [list [r hexists myhash a] [r hexists myhash x]]
+        assert_equal {1} [r hdel myhash b]
+        assert_equal {3} [r hlen myhash]
+        lsort -stride 2 [lindex [r hscan myhash 0] 1]
+    } {a 1 c -9223372036854775808 d 100000}
+
+    test {Hash intmap HINCRBY updates counters in place} {
+        r del myhash
+        for {set j 0} {$j < 20} {incr j} {
+            r hincrby myhash counter:[expr {$j % 5}] 1000
+        }
+        r hincrby myhash counter:0 -8589934592
+        assert_encoding intmap myhash
+        r hmget myhash counter:0 counter:4 counter:5
+    } {-8589930592 4000 {}}
+
+    test {Hash intmap is converted to listpack for non integer values} {
+        r del myhash
+        r hset myhash a 1 b 2
+        r hset myhash c foo
+        assert_encoding listpack myhash
+        r del myhash
+        r hset myhash a 1
+        r hincrbyfloat myhash a 1.5
+        assert_encoding listpack myhash
+        r del myhash
+        r hset myhash a 1
+        r hset myhash b " 2"
+        assert_encoding listpack myhash
+        r hgetall myhash
+    } {a 1 b { 2}}
+
+    test {Hash intmap is converted to hashtable when it grows} {
+        r del myhash myhash2
+        for {set j 0} {$j < 33} {incr j} {
+            r hset myhash field:$j $j
+        }
+        assert_encoding hashtable myhash
+        r hset myhash2 a 1
+        r hincrby myhash2 [string repeat x 100] 1
+        assert_encoding hashtable myhash2
+        list [r hget myhash field:32] [r hlen myhash] [r hlen myhash2]
+    } {32 33 2}
+
+    test {Hash intmap encoding survives DEBUG RELOAD} {
+        r del myhash myhash2
+        r hset myhash a 1 b -2 c 3
+        r hset myhash2 a 1 b foo
+        r debug reload
+        assert_encoding intmap myhash
+        assert_encoding listpack myhash2
+        lsort -stride 2 [r hgetall myhash]
+    } {a 1 b -2 c 3}
+
+    test {Stress test the hash intmap encoding} {
+        r del myhash
+        array unset shadow
+        for {set j 0} {$j < 5000} {incr j} {
+            set field [randstring 0 10 alpha]
+            set value [randomSignedInt 4294967296]
+            if {rand() < 0.3} {
+                r hdel myhash $field
+                unset -nocomplain shadow($field)
+            } else {
+                r hset myhash $field $value
+                set shadow($field) $value
+            }
+            if {[r hlen myhash] >= 30} {
+                r del myhash
+                array unset shadow
+            }
+        }
+        assert {[array size shadow] == 0 ||
+                [r object encoding myhash] eq {intmap}}
+        assert_equal [lsort -stride 2 [array get shadow]] \
+                     [lsort -stride 2 [r hgetall myhash]]
+        r config set hash-intmap-encoding no
+    }
+
     # The following test can only be executed if we don't use Valgrind, and if
     # we are using x86_64 architecture, because:
     #
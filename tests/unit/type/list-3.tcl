@@ -120,3 +120,151 @@ start_server {
         }
     }
 }
+
+start_server {
+    tags {list ziplist}
+    overrides {
+        "list-max-ziplist-size" 16
+        "list-compress-depth" 1
+    }
+} {
+    proc available_list_codecs {} {
+        set codecs {}
+        foreach codec {lzf lz4 zstd} {
+            if {[catch {r config set list-compress-algorithm $codec} e]} {
+                assert_match {*DISABLED*} $e
+            } else {
+                lappend codecs $codec
+            }
+        }
+        r config set list-compress-algorithm lzf
+        return $codecs
+    }
+
+    test {list-compress-algorithm CONFIG SET and GET} {
+        assert_equal [lindex [available_list_codecs] 0] lzf
+        catch {r config set list-compress-algorithm snappy} e
+        assert_match {*Invalid argument*} $e
+        r config get list-compress-algorithm
+    } {list-compress-algorithm lzf}
+
+    test {Lists compressed with mixed codecs survive DEBUG RELOAD and RESTORE} {
+        r del l
+        set expected {}
+        foreach codec [available_list_codecs] {
+            r config set list-compress-algorithm $codec
+            for {set i 0} {$i < 200} {incr i} {
+                set v "$codec value number $i"
+                r rpush l $v
+                lappend expected $v
+            }
+        }
+        r config set list-compress-algorithm lzf
+        set digest [r debug digest]
+        set dump [r dump l]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        assert_equal $expected [r lrange l 0 -1]
+        r del l
+        r restore l 0 $dump
+        assert_equal $digest [r debug digest]
+        assert_equal $expected [r lrange l 0 -1]
+    }
+
+    # CRC64 (Jones polynomial, reflected) as used by the DUMP footer.
+    proc crc64 {data} {
+        set crc 0
+        binary scan $data cu* bytes
+        foreach b $bytes {
+            set crc [expr {$crc ^ $b}]
+            for {set j 0} {$j < 8} {incr j} {
+                if {$crc & 1} {
+                    set crc [expr {($crc >> 1) ^ 0x95ac9329ac4bc9b5}]
+                } else {
+                    set crc [expr {$crc >> 1}]
+                }
+            }
+        }
+        if {$crc >= 1<<63} {set crc [expr {$crc - (1<<64)}]}
+        return $crc
+    }
+
+    test {RESTORE refuses list nodes compressed with an unsupported codec} {
+        r set foo bar
+        set dump [r dump foo]
+        assert_equal [string range $dump end-7 end] \
+            [binary format w [crc64 [string range $dump 0 end-8]]]
+        set rdbver [string range $dump end-9 end-8]
+
+        set codecs {7}
+        if {[lsearch [available_list_codecs] lz4] == -1} {lappend codecs 3}
+        if {[lsearch [available_list_codecs] zstd] == -1} {lappend codecs 4}
+        foreach codec $codecs {
+            # A QUICKLIST_3 list of one node: codec, listpack size,
+            # entries count, compressed length and blob.
+            set payload [binary format cccccca5 21 1 $codec 10 1 5 abcde]
+            append payload $rdbver
+            append payload [binary format w [crc64 $payload]]
+            r del l
+            catch {r restore l 0 $payload} e
+            assert_match {*Bad data format*} $e
+            assert_equal 0 [r exists l]
+        }
+        r ping
+    } {PONG}
+
+    test {RESTORE refuses list nodes with a corrupt LZF body} {
+        set rdbver [string range [r dump foo] end-9 end-8]
+        # A listpack with a single entry, and an LZF stream with a valid
+        # listpack header followed by a back reference out of the output.
+        set lp [binary format c* {9 0 0 0 1 0 5 1 255}]
+        set lzf [binary format c* {5 20 0 0 0 1 0 32 255}]
+        foreach depth {1 0} {
+            r config set list-compress-depth $depth
+            # QUICKLIST_2 and QUICKLIST_3 lists of three nodes, the one in
+            # the middle is corrupt.
+            set ql2 [binary format cc 18 3]
+            append ql2 [binary format c 9] $lp
+            append ql2 [binary format ccc 0xc3 9 20] $lzf
+            append ql2 [binary format c 9] $lp
+            set ql3 [binary format cc 21 3]
+            append ql3 [binary format cc 0 9] $lp
+            append ql3 [binary format cccc 1 20 1 9] $lzf
+            append ql3 [binary format cc 0 9] $lp
+            foreach payload [list $ql2 $ql3] {
+                append payload $rdbver
+                append payload [binary format w [crc64 $payload]]
+                r del l
+                catch {r restore l 0 $payload} e
+                assert_match {*Bad data format*} $e
+                assert_equal 0 [r exists l]
+            }
+        }
+        r config set list-compress-depth 1
+        r ping
+    } {PONG}
+
+    foreach depth {1 2 0} {
+        test "Compressed list nodes loaded from RDB at compress depth $depth" {
+            r config set list-compress-depth 1
+            r del l
+            set expected {}
+            for {set i 0} {$i < 2000} {incr i} {
+                set v "value number $i"
+                r rpush l $v
+                lappend expected $v
+            }
+            r config set list-compress-depth $depth
+            set digest [r debug digest]
+            r debug reload
+            assert_equal $digest [r debug digest]
+            assert_equal [lindex $expected 1000] [r lindex l 1000]
+            r linsert l before [lindex $expected 1000] inserted
+            set expected [linsert $expected 1000 inserted]
+            r lset l 500 replaced
+            lset expected 500 replaced
+            assert_equal $expected [r lrange l 0 -1]
+        }
+    }
+    r config set list-compress-depth 1
+}
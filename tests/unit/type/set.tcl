@@ -81,6 +81,121 @@ start_server {
         assert_encoding hashtable myhashset
     }
 
+    test "SADD overflows an intset into a roaring bitmap" {
+        r config set set-roaring-encoding yes
+        r del myset
+        for {set i 0} {$i < 512} {incr i} { r sadd myset $i }
+        assert_encoding intset myset
+        assert_equal 1 [r sadd myset 512]
+        assert_encoding roaring myset
+        assert_equal 513 [r scard myset]
+        assert_equal 1 [r sadd myset a]
+        assert_encoding hashtable myset
+        assert_equal 514 [r scard myset]
+        assert_equal 1 [r sismember myset 512]
+    }
+
+    test "Roaring bitmap SADD, SREM, SISMEMBER and SMEMBERS" {
+        r del myset
+        set expected {}
+        # Dense and sparse ranges, negative and big values.
+        for {set i 0} {$i < 6000} {incr i} { lappend expected [expr {$i*3}] }
+        for {set i 0} {$i < 1000} {incr i} {
+            lappend expected [expr {-$i*100003}]
+            lappend expected [expr {4611686018427387904+$i*7919}]
+        }
+        lappend expected 9223372036854775807 -9223372036854775808
+        set expected [lsort -integer -unique $expected]
+        r sadd myset {*}$expected
+        assert_encoding roaring myset
+        assert_equal [llength $expected] [r scard myset]
+        assert_equal $expected [r smembers myset]
+        assert_equal 1 [r sismember myset 9223372036854775807]
+        assert_equal 1 [r sismember myset -9223372036854775808]
+        assert_equal 0 [r sismember myset 1]
+        assert_equal 0 [r sismember myset foo]
+        assert_equal 0 [r sadd myset 0 3 -100003]
+        assert_equal 2 [r srem myset 3 1 foo -100003]
+        assert_equal [expr {[llength $expected]-2}] [r scard myset]
+        assert_equal 0 [r sismember myset 3]
+        assert_encoding roaring myset
+    }
+
+    test "Roaring bitmap SPOP, SRANDMEMBER and SSCAN" {
+        r del myset
+        set expected {}
+        for {set i 0} {$i < 5000} {incr i} { lappend expected [expr {$i*7-10000}] }
+        r sadd myset {*}$expected
+        assert_encoding roaring myset
+        set popped [r spop myset 100]
+        lappend popped [r spop myset]
+        assert_equal 101 [llength [lsort -unique $popped]]
+        assert_equal 4899 [r scard myset]
+        foreach ele $popped {
+            assert {[lsearch -exact $expected $ele] != -1}
+            assert_equal 0 [r sismember myset $ele]
+        }
+        foreach ele [r srandmember myset 50] {
+            assert_equal 1 [r sismember myset $ele]
+        }
+        foreach ele [r srandmember myset -50] {
+            assert_equal 1 [r sismember myset $ele]
+        }
+        set cur 0
+        set keys {}
+        while 1 {
+            lassign [r sscan myset $cur count 100] cur k
+            assert {[llength $k] <= 100}
+            lappend keys {*}$k
+            if {$cur == 0} break
+        }
+        assert_equal [lsort -integer [r smembers myset]] $keys
+    }
+
+    test "SINTER, SINTERSTORE and SUNION with roaring bitmaps" {
+        r del set1 set2 set3 setres
+        set a {}
+        set b {}
+        for {set i 0} {$i < 20000} {incr i} {
+            lappend a [expr {$i*2}]
+            lappend b [expr {$i*3}]
+        }
+        r sadd set1 {*}$a
+        r sadd set2 {*}$b
+        r sadd set3 {*}[lrange $b 0 299]
+        assert_encoding roaring set1
+        assert_encoding roaring set2
+        assert_encoding intset set3
+        set inter {}
+        for {set i 0} {$i < 40000} {incr i 6} { lappend inter $i }
+        assert_equal $inter [lsort -integer [r sinter set1 set2]]
+        assert_equal [llength $inter] [r sinterstore setres set1 set2]
+        assert_encoding roaring setres
+        assert_equal $inter [r smembers setres]
+        assert_equal [lrange $inter 0 149] [lsort -integer [r sinter set1 set2 set3]]
+        assert_equal 150 [r sinterstore setres set1 set2 set3]
+        assert_encoding intset setres
+        set union [lsort -integer -unique [concat $a $b]]
+        assert_equal [llength $union] [r sunionstore setres set1 set2]
+        assert_encoding roaring setres
+        assert_equal $union [r smembers setres]
+        assert_equal 0 [r sinterstore setres set1 nokey]
+    }
+
+    test "Roaring bitmap encoding after DEBUG RELOAD" {
+        r del myset
+        for {set i 0} {$i < 3000} {incr i} { r sadd myset [expr {$i*$i}] }
+        assert_encoding roaring myset
+        set members [r smembers myset]
+        r debug reload
+        assert_encoding roaring myset
+        assert_equal $members [r smembers myset]
+        r config set set-roaring-encoding no
+        r debug reload
+        assert_encoding hashtable myset
+        assert_equal $members [lsort -integer [r smembers myset]]
+    }
+
     test {SREM basics - regular set} {
         create_set myset {foo bar ciao}
         assert_encoding hashtable myset
@@ -246,6 +361,42 @@ start_server {
         }
     }
 
+    test "SINTER, SUNION and SDIFF fuzzing with intsets" {
+        for {set j 0} {$j < 100} {incr j} {
+            set args {}
+            set num_sets [expr {[randomInt 4]+1}]
+            for {set i 0} {$i < $num_sets} {incr i} {
+                # Mix the int16, int32 and int64 encodings.
+                set range [lindex {100 100000 10000000000} [randomInt 3]]
+                r del set_$i
+                lappend args set_$i
+                for {set k [randomInt 300]} {$k > 0} {incr k -1} {
+                    r sadd set_$i [expr {[randomInt $range]-$range/2}]
+                }
+                if {[r exists set_$i]} {assert_encoding intset set_$i}
+            }
+
+            set inter [lsort -integer [r smembers set_0]]
+            set union $inter
+            set diff $inter
+            foreach key [lrange $args 1 end] {
+                set members [r smembers $key]
+                set inter [lsort -integer [lmap e $inter {
+                    expr {[lsearch -exact $members $e] != -1 ? $e : [continue]}
+                }]]
+                set diff [lsort -integer [lmap e $diff {
+                    expr {[lsearch -exact $members $e] == -1 ? $e : [continue]}
+                }]]
+                set union [lsort -integer -unique [concat $union $members]]
+            }
+            assert_equal $inter [r sinter {*}$args]
+            assert_equal $union [lsort -integer [r sunion {*}$args]]
+            assert_equal $diff [r sdiff {*}$args]
+            r sinterstore dst {*}$args
+            assert_equal $inter [r smembers dst]
+        }
+    }
+
     test "SINTER against non-set should throw error" {
         r set key1 x
         assert_error "WRONGTYPE*" {r sinter key1 noset}
@@ -419,4 +419,20 @@ start_server {tags {"string"}} {
         r set foo bar
         r getrange foo 0 4294967297
     } {bar}
+
+    test {Big values in the output buffer are not affected by later writes} {
+        set big [string repeat x 100000]
+        r set foo $big
+        set rd [redis_deferring_client]
+        $rd get foo
+        $rd setrange foo 0 Y
+        $rd append foo Z
+        $rd get foo
+        $rd del foo
+        set res [list [$rd read] [$rd read] [$rd read] [$rd read] [$rd read]]
+        $rd close
+        assert_equal $big [lindex $res 0]
+        assert_equal {100000 100001 1} [list [lindex $res 1] [lindex $res 2] [lindex $res 4]]
+        assert_equal "Y[string range $big 1 end]Z" [lindex $res 3]
+    }
 }
@@ -7,12 +7,23 @@ start_server {tags {"zset"}} {
     }
 
     proc basics {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             r config set zset-max-ziplist-entries 128
             r config set zset-max-ziplist-value 64
+            r config set zset-max-packedtree-entries 8192
+        } elseif {$encoding == "packedtree"} {
+            r config set zset-max-ziplist-entries 0
+            r config set zset-max-ziplist-value 64
+            r config set zset-max-packedtree-entries 8192
         } elseif {$encoding == "skiplist"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
+            r config set zset-max-packedtree-entries 0
+        } elseif {$encoding == "btree"} {
+            r config set zset-max-ziplist-entries 0
+            r config set zset-max-ziplist-value 0
+            r config set zset-max-packedtree-entries 0
+            r config set zset-btree-encoding yes
         } else {
             puts "Unknown sorted set encoding"
             exit
@@ -35,6 +46,28 @@ start_server {tags {"zset"}} {
             assert_equal {y x z} [r zrange ztmp 0 -1]
         }
 
+        test "Variadic ZADD with repeated elements and options - $encoding" {
+            foreach opts {{} {nx} {xx} {ch} {xx ch}} {
+                r del ztmp zref
+                for {set j 0} {$j < 20} {incr j} {
+                    r zadd ztmp $j m$j
+                    r zadd zref $j m$j
+                }
+                set pairs {}
+                for {set j 0} {$j < 100} {incr j} {
+                    lappend pairs [randomInt 30] m[randomInt 60]
+                }
+                set expected 0
+                foreach {score ele} $pairs {
+                    incr expected [r zadd zref {*}$opts $score $ele]
+                }
+                assert_equal $expected [r zadd ztmp {*}$opts {*}$pairs]
+                assert_equal [r zrange zref 0 -1 withscores] \
+                             [r zrange ztmp 0 -1 withscores]
+                assert_encoding $encoding ztmp
+            }
+        }
+
         test "ZSET element can't be set to NaN with ZADD - $encoding" {
             assert_error "*not*float*" {r zadd myzset nan abc}
         }
@@ -735,8 +768,11 @@ start_server {tags {"zset"}} {
         }
     }
 
-    basics ziplist
+    basics listpack
+    basics packedtree
     basics skiplist
+    basics btree
+    r config set zset-btree-encoding no
 
     test {ZINTERSTORE regression with two sets, intset+hashtable} {
         r del seta setb setc
@@ -751,7 +787,7 @@ start_server {tags {"zset"}} {
         r zrange out 0 -1 withscores
     } {neginf 0}
 
-    test {ZINTERSTORE #516 regression, mixed sets and ziplist zsets} {
+    test {ZINTERSTORE #516 regression, mixed sets and listpack zsets} {
         r sadd one 100 101 102 103
         r sadd two 100 200 201 202
         r zadd three 1 500 1 501 1 502 1 503 1 100
@@ -786,15 +822,30 @@ start_server {tags {"zset"}} {
     }
 
     proc stressers {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             # Little extra to allow proper fuzzing in the sorting stresser
             r config set zset-max-ziplist-entries 256
             r config set zset-max-ziplist-value 64
+            r config set zset-max-packedtree-entries 8192
             set elements 128
+        } elseif {$encoding == "packedtree"} {
+            # Enough elements to split the inner nodes of the tree too
+            r config set zset-max-ziplist-entries 0
+            r config set zset-max-ziplist-value 64
+            r config set zset-max-packedtree-entries 8192
+            set elements 3000
         } elseif {$encoding == "skiplist"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
+            r config set zset-max-packedtree-entries 0
             if {$::accurate} {set elements 1000} else {set elements 100}
+        } elseif {$encoding == "btree"} {
+            # Enough elements to split the inner nodes of the tree too
+            r config set zset-max-ziplist-entries 0
+            r config set zset-max-ziplist-value 0
+            r config set zset-max-packedtree-entries 0
+            r config set zset-btree-encoding yes
+            set elements 1000
         } else {
             puts "Unknown sorted set encoding"
             exit
@@ -1198,8 +1249,58 @@ start_server {tags {"zset"}} {
     }
 
     tags {"slow"} {
-        stressers ziplist
+        stressers listpack
+        stressers packedtree
         stressers skiplist
+        stressers btree
+        r config set zset-btree-encoding no
+    }
+
+    test {zset-max-packedtree-entries 0 keeps small sets in a listpack} {
+        r config set zset-max-ziplist-entries 128
+        r config set zset-max-ziplist-value 64
+        r config set zset-max-packedtree-entries 0
+        r del z
+        r zadd z 1 a
+        assert_encoding listpack z
+        r del z
+        r zadd z 1 a 2 b 3 c
+        assert_encoding listpack z
+        for {set j 0} {$j < 128} {incr j} {r zadd z $j e$j}
+        assert_encoding skiplist z
+        r debug reload
+        assert_encoding skiplist z
+        r del z
+        for {set j 0} {$j < 100} {incr j} {r zadd z $j e$j}
+        r debug reload
+        assert_encoding listpack z
+        r config set zset-max-packedtree-entries 8192
+        r zadd z 200 a 201 b 202 c 203 d 204 e 205 f 206 g 207 h 208 i 209 j \
+                 210 k 211 l 212 m 213 n 214 o 215 p 216 q 217 r 218 s 219 t \
+                 220 u 221 v 222 w 223 x 224 y 225 z 226 aa 227 ab 228 ac
+        assert_encoding packedtree z
+    }
+
+    test {ZADD creating a key with repeated elements picks a compact encoding} {
+        r config set zset-max-ziplist-entries 16
+        r config set zset-max-ziplist-value 64
+        r config set zset-max-packedtree-entries 0
+        set pairs {}
+        for {set j 0} {$j < 100} {incr j} {lappend pairs $j e[expr {$j%5}]}
+        r del z
+        assert_equal 5 [r zadd z {*}$pairs]
+        assert_encoding listpack z
+        assert_equal {e0 95 e1 96 e2 97 e3 98 e4 99} [r zrange z 0 -1 withscores]
+        r config set zset-max-ziplist-entries 0
+        r config set zset-max-packedtree-entries 8192
+        r del z
+        assert_equal 5 [r zadd z {*}$pairs]
+        assert_encoding packedtree z
+        r del z
+        lappend pairs 100 [string repeat x 100]
+        assert_equal 6 [r zadd z {*}$pairs]
+        assert_encoding skiplist z
+        r config set zset-max-ziplist-entries 128
     }
 
     test {ZSET skiplist order consistency when elements are moved} {